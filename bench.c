@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "rbtree_augmented.h"
+#include "rbtree_combining.h"
+#include "rbtree_relaxed.h"
+#include "rbtree_learned.h"
+
+/*
+ * Writer scaling: every thread inserts its share of random keys, then
+ * erases half of them again, through one of the concurrent front ends.
+ * Then lookups: lower bounds of random keys in the tree, in a frozen copy
+ * of it and through a learned index over that.
+ */
+
+#define BENCH_NODES	(1 << 18)
+#define BENCH_MAX_THREADS	64
+#define BENCH_LOOKUPS	(1 << 22)
+#define BENCH_EPSILON	32
+
+struct bench_node {
+	unsigned long long key;
+	size_t count;
+	struct rdx_rb_node node;
+};
+
+static int compare_rb(struct rdx_rb_node *left, struct rdx_rb_node *right)
+{
+	unsigned long long a = rdx_rb_entry(left, struct bench_node, node)->key;
+	unsigned long long b = rdx_rb_entry(right, struct bench_node, node)->key;
+
+	return (a > b) - (a < b);
+}
+
+static size_t compute_count(struct bench_node *data)
+{
+	size_t count = 1;
+
+	if (data->node.rb_left)
+		count += rdx_rb_entry(data->node.rb_left, struct bench_node,
+				      node)->count;
+	if (data->node.rb_right)
+		count += rdx_rb_entry(data->node.rb_right, struct bench_node,
+				      node)->count;
+	return count;
+}
+
+RDX_RB_DECLARE_CALLBACKS(static, count_callbacks, struct bench_node, node,
+			 size_t, count, compute_count, bench_node);
+
+enum { ENGINE_MUTEX, ENGINE_COMBINING, ENGINE_RELAXED, NR_ENGINES };
+
+static const char *engine_names[NR_ENGINES] = {
+	"mutex", "combining", "relaxed"
+};
+
+struct bench {
+	int engine;
+	struct rdx_rb_root root;
+	pthread_mutex_t mutex;
+	struct rdx_rb_fc fc;
+	struct rdx_rb_relaxed relaxed;
+	struct bench_node *nodes;
+	unsigned int nr_threads;
+};
+
+struct bench_thread {
+	struct bench *bench;
+	unsigned int nr;
+	pthread_t thread;
+};
+
+static int bench_insert(struct bench *bench, int slot, struct bench_node *node)
+{
+	int result = false;
+
+	node->count = 1;
+	switch (bench->engine) {
+	case ENGINE_MUTEX:
+		pthread_mutex_lock(&bench->mutex);
+		result = bench_node_insert(node, &bench->root);
+		pthread_mutex_unlock(&bench->mutex);
+		break;
+	case ENGINE_COMBINING:
+		result = rdx_rb_fc_insert(&bench->fc, slot, &node->node);
+		break;
+	case ENGINE_RELAXED:
+		result = rdx_rb_relaxed_insert(&bench->relaxed, slot,
+					       &node->node);
+		break;
+	}
+	return result;
+}
+
+static void bench_erase(struct bench *bench, int slot, struct bench_node *node)
+{
+	switch (bench->engine) {
+	case ENGINE_MUTEX:
+		pthread_mutex_lock(&bench->mutex);
+		bench_node_erase(node, &bench->root);
+		pthread_mutex_unlock(&bench->mutex);
+		break;
+	case ENGINE_COMBINING:
+		rdx_rb_fc_erase(&bench->fc, slot, &node->node);
+		break;
+	case ENGINE_RELAXED:
+		rdx_rb_relaxed_erase(&bench->relaxed, slot, &node->node);
+		break;
+	}
+}
+
+static void *bench_worker(void *arg)
+{
+	struct bench_thread *thread = arg;
+	struct bench *bench = thread->bench;
+	size_t first = (size_t)BENCH_NODES * thread->nr / bench->nr_threads;
+	size_t last = (size_t)BENCH_NODES * (thread->nr + 1) /
+		bench->nr_threads;
+	int slot = 0;
+	size_t i;
+
+	if (bench->engine == ENGINE_COMBINING)
+		slot = rdx_rb_fc_register(&bench->fc);
+	else if (bench->engine == ENGINE_RELAXED)
+		slot = rdx_rb_relaxed_register(&bench->relaxed);
+
+	for (i = first; i < last; i++)
+		bench_insert(bench, slot, &bench->nodes[i]);
+	for (i = first; i < last; i += 2)
+		bench_erase(bench, slot, &bench->nodes[i]);
+
+	if (bench->engine == ENGINE_COMBINING)
+		rdx_rb_fc_unregister(&bench->fc, slot);
+	else if (bench->engine == ENGINE_RELAXED)
+		rdx_rb_relaxed_unregister(&bench->relaxed, slot);
+	return NULL;
+}
+
+static double bench_run(struct bench *bench, int engine,
+			unsigned int nr_threads)
+{
+	struct bench_thread threads[BENCH_MAX_THREADS];
+	struct timespec start, end;
+	unsigned int i;
+
+	bench->engine = engine;
+	bench->nr_threads = nr_threads;
+	bench->root = RDX_RB_ROOT(compare_rb, compare_rb);
+	if (engine == ENGINE_COMBINING)
+		rdx_rb_fc_init(&bench->fc, &bench->root, &count_callbacks,
+			       nr_threads);
+	else if (engine == ENGINE_RELAXED)
+		rdx_rb_relaxed_init(&bench->relaxed, &bench->root,
+				    &count_callbacks, NULL, NULL, nr_threads,
+				    1024);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < nr_threads; i++) {
+		threads[i] = (struct bench_thread){ bench, i };
+		pthread_create(&threads[i].thread, NULL, bench_worker,
+			       &threads[i]);
+	}
+	for (i = 0; i < nr_threads; i++)
+		pthread_join(threads[i].thread, NULL);
+	/* The deferred work is part of the cost */
+	if (engine == ENGINE_RELAXED)
+		rdx_rb_relaxed_destroy(&bench->relaxed);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	if (engine == ENGINE_COMBINING)
+		rdx_rb_fc_destroy(&bench->fc);
+	if (!bench->root.rb_node ||
+	    rdx_rb_entry(bench->root.rb_node, struct bench_node,
+			 node)->count != BENCH_NODES / 2)
+		printf("(wrong result) ");
+
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+static uint64_t bench_key(const struct rdx_rb_node *node, void *arg)
+{
+	return rdx_rb_entry(node, struct bench_node, node)->key;
+}
+
+static const struct rdx_rb_frozen_ops bench_frozen_ops = { 0, 0, bench_key };
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) +
+		(end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+enum { LOOKUP_TREE, LOOKUP_FROZEN, LOOKUP_LEARNED, NR_LOOKUPS };
+
+static const char *lookup_names[NR_LOOKUPS] = {
+	"tree", "frozen", "learned"
+};
+
+/* XOR of every node found, to check them against each other */
+static uintptr_t bench_lookup(struct bench *bench, int kind,
+			      const struct rdx_rb_frozen *frozen,
+			      const struct rdx_rb_learned *learned,
+			      double *seconds)
+{
+	unsigned long long state = 2463534242ull;
+	struct bench_node probe;
+	struct timespec start;
+	struct rdx_rb_node *node;
+	uintptr_t sum = 0;
+	size_t i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < BENCH_LOOKUPS; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		probe.key = state;
+		if (kind == LOOKUP_TREE)
+			node = rdx_rb_leftmost_greater_equiv(&probe.node,
+							     &bench->root);
+		else if (kind == LOOKUP_FROZEN)
+			node = rdx_rb_frozen_node(frozen,
+				rdx_rb_frozen_greater_equiv(frozen, state));
+		else
+			node = rdx_rb_frozen_node(frozen,
+				rdx_rb_learned_greater_equiv(learned, state));
+		sum ^= (uintptr_t)node;
+	}
+	*seconds = seconds_since(&start);
+	return sum;
+}
+
+static void bench_lookups(struct bench *bench)
+{
+	struct rdx_rb_frozen frozen;
+	struct rdx_rb_learned learned;
+	uintptr_t sums[NR_LOOKUPS];
+	double seconds;
+	size_t i;
+	int kind;
+
+	bench->root = RDX_RB_ROOT(compare_rb, compare_rb);
+	for (i = 0; i < BENCH_NODES; i++) {
+		bench->nodes[i].count = 1;
+		bench_node_insert(&bench->nodes[i], &bench->root);
+	}
+	if (!rdx_rb_freeze(&frozen, &bench->root, &bench_frozen_ops, NULL))
+		return;
+	if (!rdx_rb_learned_build(&learned, &frozen, BENCH_EPSILON)) {
+		rdx_rb_frozen_destroy(&frozen);
+		return;
+	}
+
+	printf("\n%8s", "");
+	for (kind = 0; kind < NR_LOOKUPS; kind++)
+		printf(" %12s", lookup_names[kind]);
+	printf("   (million lookups per second)\n%8s", "lookups");
+	for (kind = 0; kind < NR_LOOKUPS; kind++) {
+		sums[kind] = bench_lookup(bench, kind, &frozen, &learned,
+					  &seconds);
+		printf(" %12.2f", BENCH_LOOKUPS / seconds / 1e6);
+		fflush(stdout);
+	}
+	printf("%s\n", sums[LOOKUP_FROZEN] != sums[LOOKUP_TREE] ||
+		       sums[LOOKUP_LEARNED] != sums[LOOKUP_TREE] ?
+		       " (wrong result)" : "");
+
+	rdx_rb_learned_destroy(&learned);
+	rdx_rb_frozen_destroy(&frozen);
+}
+
+int main()
+{
+	struct bench bench;
+	unsigned long long state = 88172645463325252ull;
+	unsigned int nr_threads;
+	size_t i;
+	int engine;
+
+	pthread_mutex_init(&bench.mutex, NULL);
+	bench.nodes = malloc(BENCH_NODES * sizeof(*bench.nodes));
+	if (!bench.nodes)
+		return 1;
+	/* Distinct keys: xorshift never repeats within its period */
+	for (i = 0; i < BENCH_NODES; i++) {
+		state ^= state << 13;
+		state ^= state >> 7;
+		state ^= state << 17;
+		bench.nodes[i].key = state;
+	}
+
+	printf("%8s", "threads");
+	for (engine = 0; engine < NR_ENGINES; engine++)
+		printf(" %12s", engine_names[engine]);
+	printf("   (million operations per second)\n");
+
+	for (nr_threads = 1; nr_threads <= BENCH_MAX_THREADS; nr_threads *= 2) {
+		printf("%8u", nr_threads);
+		for (engine = 0; engine < NR_ENGINES; engine++) {
+			double seconds = bench_run(&bench, engine, nr_threads);
+			printf(" %12.2f", 1.5 * BENCH_NODES / seconds / 1e6);
+			fflush(stdout);
+		}
+		printf("\n");
+	}
+
+	bench_lookups(&bench);
+	free(bench.nodes);
+	return 0;
+}
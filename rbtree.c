@@ -599,6 +599,26 @@ int rdx_rb_insert(struct rdx_rb_node *elem, struct rdx_rb_root *root)
 	return true;
 }
 
+struct rdx_rb_node *
+rdx_rb_find(struct rdx_rb_node *elem, struct rdx_rb_root *root)
+{
+	struct rdx_rb_node *node = root->rb_node;
+
+	if (root->filter && !rdx_rb_filter_may_contain(root->filter, elem))
+		return NULL;
+	while (node) {
+		int result = root->strict_compare(elem, node);
+		if (result < 0) {
+			node = node->rb_left;
+		} else if (result > 0) {
+			node = node->rb_right;
+		} else {
+			return node;
+		}
+	}
+	return NULL;
+}
+
 struct rdx_rb_node *
 rdx_rb_rightmost_less_equiv(struct rdx_rb_node *elem, struct rdx_rb_root *root)
 {
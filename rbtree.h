@@ -38,12 +38,18 @@ struct rdx_rb_node {
 } __attribute__((aligned(sizeof(long))));
     /* The alignment might seem pointless, but allegedly CRIS needs it */
 
+struct rdx_rb_filter;
+struct rdx_rb_feed;
+
 struct rdx_rb_root {
 	struct rdx_rb_node *rb_node;
 	int (*strict_compare)(struct rdx_rb_node *left,
 			      struct rdx_rb_node *right);
 	int (*weak_compare)(struct rdx_rb_node *left,
 			    struct rdx_rb_node *right);
+	/* Optional, see rbtree_filter.h and rbtree_feed.h */
+	struct rdx_rb_filter *filter;
+	struct rdx_rb_feed *feed;
 };
 
 
@@ -54,7 +60,9 @@ struct rdx_rb_root {
 	(struct rdx_rb_root) {				\
 		(struct rdx_rb_node*)NULL,		\
 		rb_strict_compare,			\
-		rb_weak_compare				\
+		rb_weak_compare,			\
+		(struct rdx_rb_filter *)NULL,		\
+		(struct rdx_rb_feed *)NULL		\
 	}
 #define	rdx_rb_entry(ptr, type, member) container_of(ptr, type, member)
 
@@ -118,6 +126,10 @@ rdx_rb_link_node(struct rdx_rb_node * node, struct rdx_rb_node * parent,
 				      typeof(*pos), field); 1; });	\
 	     pos = n)
 
+/*
+ * The node equal to @elem under strict_compare, or NULL. With a filter on
+ * the root, a key the filter has never seen costs no descent.
+ */
 extern struct rdx_rb_node *
 rdx_rb_find(struct rdx_rb_node *elem, struct rdx_rb_root *root);
 
@@ -132,4 +144,106 @@ extern struct rdx_rb_node *
 rdx_rb_leftmost_greater_equiv(struct rdx_rb_node *elem,
 			      struct rdx_rb_root *root);
 
+/*
+ * Bulk operations. Both build a balanced tree from scratch in O(n) instead
+ * of inserting or erasing node by node. An nr_threads above 1 splits the
+ * work by subtree over that many threads, in which case the callbacks must
+ * be safe to call concurrently.
+ */
+
+/* @nodes must be sorted by strict_compare and contain no duplicates */
+extern void
+rdx_rb_build_sorted(struct rdx_rb_node **nodes, size_t count,
+		    struct rdx_rb_root *root, unsigned int nr_threads);
+
+/*
+ * Same for @nodes in any order. @nodes gets sorted in place; of several
+ * nodes comparing equal only the first one goes into the tree and the rest
+ * are reported to @duplicate (if any). Returns false, leaving the tree
+ * untouched, if memory runs out.
+ */
+extern int
+rdx_rb_build(struct rdx_rb_node **nodes, size_t count,
+	     struct rdx_rb_root *root,
+	     void (*duplicate)(struct rdx_rb_node *node, void *arg),
+	     void *arg, unsigned int nr_threads);
+
+/*
+ * Join @left, @pivot and @right, in that key order, into @left, leaving
+ * @right empty. Takes O(log n), whatever the sizes of the two trees.
+ */
+extern void
+rdx_rb_join(struct rdx_rb_root *left, struct rdx_rb_node *pivot,
+	    struct rdx_rb_root *right);
+
+/*
+ * Keep the nodes @pred holds for, hand the rest to @dispose (if any) once
+ * they are out of the tree. Returns false, leaving the tree untouched, if
+ * memory runs out.
+ */
+extern int
+rdx_rb_retain(struct rdx_rb_root *root,
+	      int (*pred)(struct rdx_rb_node *node, void *arg),
+	      void (*dispose)(struct rdx_rb_node *node, void *arg),
+	      void *arg, unsigned int nr_threads);
+
+/*
+ * Make @dst a copy of @src in O(n), with the same shape and colors, and
+ * the comparisons of @src but no filter. @copy returns a copy of the
+ * container of @node, allocated however the caller likes, or NULL when
+ * out of memory; its links are set afterwards. On failure every copy made
+ * so far goes to @dispose (if any), @dst is left empty and false returned.
+ */
+extern int
+rdx_rb_clone(struct rdx_rb_root *dst, struct rdx_rb_root *src,
+	     struct rdx_rb_node *(*copy)(const struct rdx_rb_node *node,
+					 void *arg),
+	     void (*dispose)(struct rdx_rb_node *node, void *arg),
+	     void *arg, unsigned int nr_threads);
+
+/*
+ * Parallel traversal. With nr_threads above 1 the subtrees below the top
+ * few levels are visited concurrently, so @fn and the reducer callbacks must
+ * be safe to call from several threads at once and rdx_rb_for_each() gives
+ * no ordering guarantee. Neither may modify the tree.
+ */
+extern void
+rdx_rb_for_each(struct rdx_rb_root *root,
+		void (*fn)(struct rdx_rb_node *node, void *arg),
+		void *arg, unsigned int nr_threads);
+
+/*
+ * A reduction over accumulators of @size bytes. @init sets one to the
+ * identity, @accumulate folds a node into it and @combine folds @right, which
+ * covers the nodes following those of @acc in key order, into @acc. Partial
+ * results are always combined in key order, so the operation only needs to
+ * be associative, not commutative.
+ */
+struct rdx_rb_reducer {
+	size_t size;
+	void (*init)(void *acc, void *arg);
+	void (*accumulate)(void *acc, struct rdx_rb_node *node, void *arg);
+	void (*combine)(void *acc, const void *right, void *arg);
+};
+
+extern void
+rdx_rb_reduce(struct rdx_rb_root *root,
+	      const struct rdx_rb_reducer *reducer, void *result,
+	      void *arg, unsigned int nr_threads);
+
+/*
+ * Check the whole structure: parent links, a black root, no red node with
+ * a red child, equal black heights, strictly increasing keys and, through
+ * @check (if any), whatever the caller keeps in the nodes. @check sees a
+ * node only after both its subtrees have passed.
+ *
+ * A @sample above 1 turns this into a spot check: the top levels are always
+ * verified, but of the subtrees below them only about one in @sample, picked
+ * at random. Returns true if nothing wrong was found.
+ */
+extern int
+rdx_rb_verify(struct rdx_rb_root *root,
+	      int (*check)(struct rdx_rb_node *node, void *arg),
+	      void *arg, unsigned int nr_threads, unsigned int sample);
+
 #endif	/* _RDX_RBTREE_H */
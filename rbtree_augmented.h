@@ -26,6 +26,8 @@
 // #include <linux/compiler.h>
 #include "compiler.h"
 #include "rbtree.h"
+#include "rbtree_filter.h"
+#include "rbtree_feed.h"
 
 /*
  * Please note - only struct rb_augment_callbacks and the prototypes for
@@ -213,6 +215,133 @@ rdx_rb_erase_augmented(struct rdx_rb_node *node, struct rdx_rb_root *root,
 	}
 }
 
+static inline struct rdx_rb_node *__rdx_rb_leftmost(struct rdx_rb_node *node)
+{
+	while (node->rb_left)
+		node = node->rb_left;
+	return node;
+}
+
+static inline struct rdx_rb_node *__rdx_rb_rightmost(struct rdx_rb_node *node)
+{
+	while (node->rb_right)
+		node = node->rb_right;
+	return node;
+}
+
+/*
+ * Parallel helpers shared by the bulk and traversal code.
+ *
+ * __rdx_rb_split_top() cuts the top @levels levels off the tree below @node.
+ * The subtrees hanging below the cut (some possibly empty) go to @subtrees
+ * and the cut nodes to @separators, so that in key order they read
+ * subtrees[0] separators[0] subtrees[1] ... subtrees[count - 1].
+ * Both arrays need room for 1 << levels entries. Returns the number of
+ * subtrees, @count being how many are in @subtrees already.
+ *
+ * __rdx_rb_split_levels() picks how deep to cut for @nr_threads threads and
+ * __rdx_rb_parallel_run() runs fn(arg, 0) ... fn(arg, nr_tasks - 1) on that
+ * many threads, returning once all of them are done. *
+ * __rdx_rb_calloc_lines() is calloc() starting on a cache line, for the
+ * per-thread structures aligned to keep off each other's lines, which
+ * calloc() alone does not promise. free() releases it.
+ */
+extern size_t
+__rdx_rb_split_top(struct rdx_rb_node *node, int levels,
+		   struct rdx_rb_node **subtrees,
+		   struct rdx_rb_node **separators, size_t count);
+extern int __rdx_rb_split_levels(unsigned int nr_threads);
+extern void
+__rdx_rb_parallel_run(size_t nr_tasks, void (*fn)(void *arg, size_t task),
+		      void *arg, unsigned int nr_threads);
+extern void *__rdx_rb_calloc_lines(size_t count, size_t size);
+
+/*
+ * Augmented versions of the bulk operations from rbtree.h: every payload is
+ * computed once, children first, through augment->propagate(node, parent).
+ */
+extern void
+rdx_rb_build_sorted_augmented(struct rdx_rb_node **nodes, size_t count,
+			      struct rdx_rb_root *root,
+			      unsigned int nr_threads,
+			      const struct rdx_rb_augment_callbacks *augment);
+
+extern int
+rdx_rb_build_augmented(struct rdx_rb_node **nodes, size_t count,
+		       struct rdx_rb_root *root,
+		       void (*duplicate)(struct rdx_rb_node *node, void *arg),
+		       void *arg, unsigned int nr_threads,
+		       const struct rdx_rb_augment_callbacks *augment);
+
+extern void
+rdx_rb_join_augmented(struct rdx_rb_root *left, struct rdx_rb_node *pivot,
+		      struct rdx_rb_root *right,
+		      const struct rdx_rb_augment_callbacks *augment);
+
+extern int
+rdx_rb_retain_augmented(struct rdx_rb_root *root,
+			int (*pred)(struct rdx_rb_node *node, void *arg),
+			void (*dispose)(struct rdx_rb_node *node, void *arg),
+			void *arg, unsigned int nr_threads,
+			const struct rdx_rb_augment_callbacks *augment);
+
+/*
+ * Apply @fn to every node, then bring every payload up to date in a single
+ * postorder pass. @fn may change anything the payload is computed from but
+ * not the key order; a NULL @fn just recomputes all payloads, e.g. after
+ * the aggregation function itself has changed.
+ */
+extern void
+rdx_rb_remap_augmented(struct rdx_rb_root *root,
+		       void (*fn)(struct rdx_rb_node *node, void *arg),
+		       void *arg, unsigned int nr_threads,
+		       const struct rdx_rb_augment_callbacks *augment);
+
+/* As rdx_rb_clone(), with every payload copied through augment->copy() */
+extern int
+rdx_rb_clone_augmented(struct rdx_rb_root *dst, struct rdx_rb_root *src,
+		       struct rdx_rb_node *(*copy)(const struct rdx_rb_node *node,
+						   void *arg),
+		       void (*dispose)(struct rdx_rb_node *node, void *arg),
+		       void *arg, unsigned int nr_threads,
+		       const struct rdx_rb_augment_callbacks *augment);
+
+/*
+ * Batched updates. Between rdx_rb_batch_begin() and rdx_rb_batch_end() no
+ * augmented payload gets updated as the tree is rebalanced; instead, the end
+ * of the batch recomputes every payload it affected exactly once. Insertions
+ * are cheapest in increasing key order. Erased nodes are left cleared (see
+ * RDX_RB_EMPTY_NODE) and must stay allocated until the batch ends. A thread
+ * applies one batch at a time, and @augment may be NULL for a plain tree.
+ * A filter or feed on the root hears of every change, as from _insert and
+ * _erase.
+ */
+struct rdx_rb_batch_record {
+	struct rdx_rb_node *node;
+	size_t depth;
+};
+
+struct rdx_rb_batch {
+	struct rdx_rb_root *root;
+	const struct rdx_rb_augment_callbacks *augment;
+	struct rdx_rb_node *finger;
+	struct rdx_rb_batch_record *records;
+	size_t nr_records, capacity;
+	int overflow;
+};
+
+extern void
+rdx_rb_batch_init(struct rdx_rb_batch *batch, struct rdx_rb_root *root,
+		  const struct rdx_rb_augment_callbacks *augment);
+extern void rdx_rb_batch_destroy(struct rdx_rb_batch *batch);
+
+extern void rdx_rb_batch_begin(struct rdx_rb_batch *batch);
+extern int
+rdx_rb_batch_insert(struct rdx_rb_batch *batch, struct rdx_rb_node *node);
+extern void
+rdx_rb_batch_erase(struct rdx_rb_batch *batch, struct rdx_rb_node *node);
+extern void rdx_rb_batch_end(struct rdx_rb_batch *batch);
+
 #define RDX_RB_DECLARE_CALLBACKS(rbstatic, rbname, rbstruct, rbfield,	\
 				 rbtype, rbaugmented, rbcompute,	\
 				 rbtree_name)				\
@@ -245,24 +374,67 @@ rbname ## _rotate(struct rdx_rb_node *rb_old,				\
 rbstatic const struct rdx_rb_augment_callbacks rbname = {		\
 	rbname ## _propagate, rbname ## _copy, rbname ## _rotate	\
 };									\
-static int								\
+static inline int							\
 rbtree_name ## _insert(rbstruct *elem, struct rdx_rb_root *root)	\
 {									\
 	int result = rdx_rb_insert(&(elem->rbfield), root);		\
 	if (result) {							\
 		rdx_rb_insert_augmented(&(elem->rbfield),		\
 					root, &rbname);			\
+		if (root->filter)					\
+			rdx_rb_filter_add(root, &(elem->rbfield));	\
+		if (root->feed)						\
+			rdx_rb_feed_append(root->feed,			\
+					   RDX_RB_FEED_INSERT,		\
+					   &(elem->rbfield));		\
 		return true;						\
 	} else {							\
 		return false;						\
 	}								\
 }									\
-static void								\
+static inline void							\
 rbtree_name ## _erase(rbstruct *elem, struct rdx_rb_root *root)		\
 {									\
 	rdx_rb_erase_augmented(&(elem->rbfield), root, &rbname);	\
+	if (root->filter)						\
+		rdx_rb_filter_remove(root);				\
+	if (root->feed)							\
+		rdx_rb_feed_append(root->feed, RDX_RB_FEED_ERASE,	\
+				   &(elem->rbfield));			\
+}									\
+static inline rbstruct *						\
+rbtree_name ## _find(rbstruct *elem, struct rdx_rb_root *root)		\
+{									\
+	struct rdx_rb_node *result =					\
+		rdx_rb_find(&(elem->rbfield), root);			\
+	return result ? container_of(result, rbstruct, rbfield) : NULL;	\
+}									\
+/* Put @elem in place of its equal, which is returned, or insert it */	\
+static inline rbstruct *						\
+rbtree_name ## _upsert(rbstruct *elem, struct rdx_rb_root *root)	\
+{									\
+	struct rdx_rb_node *old = rdx_rb_find(&(elem->rbfield), root);	\
+	if (!old) {							\
+		rbtree_name ## _insert(elem, root);			\
+		return NULL;						\
+	}								\
+	rdx_rb_replace_node(old, &(elem->rbfield), root);		\
+	rbname ## _propagate(&(elem->rbfield), NULL);			\
+	if (root->feed)							\
+		rdx_rb_feed_append(root->feed, RDX_RB_FEED_UPDATE,	\
+				   &(elem->rbfield));			\
+	return container_of(old, rbstruct, rbfield);			\
 }									\
-static rbstruct *							\
+/* After changing @elem in place, anything but its key */		\
+static inline void							\
+rbtree_name ## _update(rbstruct *elem, struct rdx_rb_root *root)	\
+{									\
+	rbname ## _propagate(&(elem->rbfield), NULL);			\
+	if (root->feed)							\
+		rdx_rb_feed_append(root->feed, RDX_RB_FEED_UPDATE,	\
+				   &(elem->rbfield));			\
+}									\
+static inline rbstruct *						\
 rbtree_name ## _rightmost_less_equiv(rbstruct *elem,			\
 				     struct rdx_rb_root *root)		\
 {									\
@@ -274,7 +446,7 @@ rbtree_name ## _rightmost_less_equiv(rbstruct *elem,			\
 		return NULL;						\
 	}								\
 }									\
-static rbstruct *							\
+static inline rbstruct *						\
 rbtree_name ## _leftmost_greater_equiv(rbstruct *elem,			\
 				       struct rdx_rb_root *root)	\
 {									\
@@ -285,6 +457,60 @@ rbtree_name ## _leftmost_greater_equiv(rbstruct *elem,			\
 	} else {							\
 		return NULL;						\
 	}								\
+}									\
+static inline void							\
+rbtree_name ## _build_sorted(struct rdx_rb_node **nodes, size_t count,	\
+			     struct rdx_rb_root *root,			\
+			     unsigned int nr_threads)			\
+{									\
+	rdx_rb_build_sorted_augmented(nodes, count, root, nr_threads,	\
+				      &rbname);				\
+}									\
+static inline int							\
+rbtree_name ## _build(struct rdx_rb_node **nodes, size_t count,		\
+		      struct rdx_rb_root *root,				\
+		      void (*duplicate)(struct rdx_rb_node *node,	\
+					void *arg),			\
+		      void *arg, unsigned int nr_threads)		\
+{									\
+	return rdx_rb_build_augmented(nodes, count, root, duplicate,	\
+				      arg, nr_threads, &rbname);	\
+}									\
+static inline void							\
+rbtree_name ## _join(struct rdx_rb_root *left,				\
+		     struct rdx_rb_node *pivot,				\
+		     struct rdx_rb_root *right)				\
+{									\
+	rdx_rb_join_augmented(left, pivot, right, &rbname);		\
+}									\
+static inline int							\
+rbtree_name ## _retain(struct rdx_rb_root *root,			\
+		       int (*pred)(struct rdx_rb_node *node, void *arg),\
+		       void (*dispose)(struct rdx_rb_node *node,	\
+				       void *arg),			\
+		       void *arg, unsigned int nr_threads)		\
+{									\
+	return rdx_rb_retain_augmented(root, pred, dispose, arg,	\
+				       nr_threads, &rbname);		\
+}									\
+static inline void							\
+rbtree_name ## _remap(struct rdx_rb_root *root,				\
+		      void (*fn)(struct rdx_rb_node *node, void *arg),	\
+		      void *arg, unsigned int nr_threads)		\
+{									\
+	rdx_rb_remap_augmented(root, fn, arg, nr_threads, &rbname);	\
+}									\
+static inline int							\
+rbtree_name ## _clone(struct rdx_rb_root *dst, struct rdx_rb_root *src,	\
+		      struct rdx_rb_node *(*copy)(			\
+			      const struct rdx_rb_node *node,		\
+			      void *arg),				\
+		      void (*dispose)(struct rdx_rb_node *node,	\
+				      void *arg),			\
+		      void *arg, unsigned int nr_threads)		\
+{									\
+	return rdx_rb_clone_augmented(dst, src, copy, dispose, arg,	\
+				      nr_threads, &rbname);		\
 }
 
 #endif	/* _RDX_RBTREE_AUGMENTED_H */
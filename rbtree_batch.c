@@ -0,0 +1,287 @@
+/*
+  Red Black Trees - batched updates
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Within a batch, rebalancing does not update any payload but merely
+ * records the nodes whose subtrees changed: at most 5 per insertion (the
+ * node and two rotations) and 9 per erasure (a copy, two propagations and
+ * three rotations). Closing the batch recomputes those and all of their
+ * ancestors, each exactly once.
+ *
+ * Insertions in increasing key order start their descent from the previous
+ * insertion rather than from the root, which costs O(log d) for a distance
+ * of d nodes instead of O(log n).
+ *
+ * Every front end built on batches goes through here, so this is where a
+ * filter or feed on the root hears of the change, as from the generated
+ * _insert and _erase.
+ */
+
+/* The batch being applied by this thread, for the callbacks below */
+static __thread struct rdx_rb_batch *batch_current;
+
+static void batch_record(struct rdx_rb_node *node)
+{
+	struct rdx_rb_batch *batch = batch_current;
+
+	if (!node || batch->overflow)
+		return;
+	if (batch->nr_records == batch->capacity) {
+		size_t capacity = batch->capacity ? batch->capacity * 2 : 64;
+		struct rdx_rb_batch_record *records =
+			realloc(batch->records, capacity * sizeof(*records));
+		if (!records) {
+			/* Fall back to recomputing everything at the end */
+			batch->overflow = true;
+			return;
+		}
+		batch->records = records;
+		batch->capacity = capacity;
+	}
+	batch->records[batch->nr_records++].node = node;
+}
+
+static void batch_propagate(struct rdx_rb_node *node,
+			    struct rdx_rb_node *stop __attribute__((unused)))
+{
+	batch_record(node);
+}
+
+static void batch_copy(struct rdx_rb_node *old __attribute__((unused)),
+		       struct rdx_rb_node *new)
+{
+	batch_record(new);
+}
+
+static void batch_rotate(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	batch_record(old);
+	batch_record(new);
+}
+
+static const struct rdx_rb_augment_callbacks batch_callbacks = {
+	batch_propagate, batch_copy, batch_rotate
+};
+
+void rdx_rb_batch_init(struct rdx_rb_batch *batch, struct rdx_rb_root *root,
+		       const struct rdx_rb_augment_callbacks *augment)
+{
+	batch->root = root;
+	batch->augment = augment;
+	batch->finger = NULL;
+	batch->records = NULL;
+	batch->nr_records = 0;
+	batch->capacity = 0;
+	batch->overflow = false;
+}
+
+void rdx_rb_batch_destroy(struct rdx_rb_batch *batch)
+{
+	free(batch->records);
+}
+
+void rdx_rb_batch_begin(struct rdx_rb_batch *batch)
+{
+	batch->finger = NULL;
+	batch_current = batch;
+}
+
+/*
+ * Insert below @from, a node whose subtree covers the key of @elem, or
+ * from the root if @from is NULL.
+ */
+static int batch_link(struct rdx_rb_root *root, struct rdx_rb_node *from,
+		      struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node **new = from ? &from : &root->rb_node;
+	struct rdx_rb_node *parent = NULL;
+
+	while (*new) {
+		int result = root->strict_compare(elem, *new);
+		parent = *new;
+		if (result < 0)
+			new = &((*new)->rb_left);
+		else if (result > 0)
+			new = &((*new)->rb_right);
+		else
+			return false;
+	}
+	rdx_rb_link_node(elem, parent, new);
+	return true;
+}
+
+/*
+ * Climb from the previous insertion @finger, which sorts before @elem, to
+ * the lowest ancestor whose subtree covers @elem.
+ */
+static struct rdx_rb_node *batch_climb(struct rdx_rb_root *root,
+				       struct rdx_rb_node *finger,
+				       struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node *parent;
+
+	while ((parent = rdx_rb_parent(finger))) {
+		if (finger == parent->rb_left &&
+		    root->strict_compare(elem, parent) < 0)
+			break;
+		finger = parent;
+	}
+	return finger;
+}
+
+int rdx_rb_batch_insert(struct rdx_rb_batch *batch, struct rdx_rb_node *node)
+{
+	struct rdx_rb_root *root = batch->root;
+	struct rdx_rb_node *from = NULL;
+
+	if (batch->finger && root->strict_compare(node, batch->finger) > 0)
+		from = batch_climb(root, batch->finger, node);
+	if (!batch_link(root, from, node))
+		return false;
+
+	if (batch->augment) {
+		__rdx_rb_insert_augmented(node, root, batch_rotate);
+		batch_record(node);
+	} else
+		rdx_rb_insert_color(node, root);
+	batch->finger = node;
+	if (root->filter)
+		rdx_rb_filter_add(root, node);
+	if (root->feed)
+		rdx_rb_feed_append(root->feed, RDX_RB_FEED_INSERT, node);
+	return true;
+}
+
+void rdx_rb_batch_erase(struct rdx_rb_batch *batch, struct rdx_rb_node *node)
+{
+	struct rdx_rb_root *root = batch->root;
+
+	if (batch->augment)
+		rdx_rb_erase_augmented(node, root, &batch_callbacks);
+	else
+		rdx_rb_erase(node, root);
+	if (root->filter)
+		rdx_rb_filter_remove(root);
+	if (root->feed)
+		rdx_rb_feed_append(root->feed, RDX_RB_FEED_ERASE, node);
+	/* Lets the fixup tell nodes that are gone */
+	RDX_RB_CLEAR_NODE(node);
+	if (batch->finger == node)
+		batch->finger = NULL;
+}
+
+/*
+ * The records are kept sorted by decreasing depth. The deepest level gets
+ * recomputed and replaced by its parents, which then merge with the records
+ * one level up, and so on up to the root.
+ */
+static int record_by_node(const void *a, const void *b)
+{
+	uintptr_t left = (uintptr_t)((const struct rdx_rb_batch_record *)a)->node;
+	uintptr_t right = (uintptr_t)((const struct rdx_rb_batch_record *)b)->node;
+
+	return (left > right) - (left < right);
+}
+
+static int record_by_depth(const void *a, const void *b)
+{
+	const struct rdx_rb_batch_record *left = a, *right = b;
+
+	if (left->depth != right->depth)
+		return left->depth < right->depth ? 1 : -1;
+	return record_by_node(a, b);
+}
+
+/* Sort and blank out repeats, which are then skipped */
+static void records_dedup(struct rdx_rb_batch_record *records, size_t count,
+			  int (*compare)(const void *a, const void *b))
+{
+	size_t i;
+
+	if (count <= 1)
+		return;
+	qsort(records, count, sizeof(*records), compare);
+	for (i = count; i > 1; i--)
+		if (records[i - 1].node == records[i - 2].node)
+			records[i - 1].node = NULL;
+}
+
+static void batch_fixup(struct rdx_rb_batch *batch)
+{
+	struct rdx_rb_batch_record *records = batch->records;
+	size_t count = 0, start, end, next, i;
+
+	for (i = 0; i < batch->nr_records; i++) {
+		struct rdx_rb_node *node = records[i].node, *parent;
+		size_t depth = 0;
+
+		if (RDX_RB_EMPTY_NODE(node))
+			continue;
+		for (parent = rdx_rb_parent(node); parent;
+		     parent = rdx_rb_parent(parent))
+			depth++;
+		records[count].node = node;
+		records[count++].depth = depth;
+	}
+	records_dedup(records, count, record_by_depth);
+
+	for (start = 0; start < count; start = next) {
+		size_t depth = records[start].depth;
+
+		for (end = start; end < count && records[end].depth == depth;)
+			end++;
+		/*
+		 * Parents go to the tail of this level's range, right in
+		 * front of the records already sitting one level up.
+		 */
+		next = end;
+		for (i = end; i-- > start;) {
+			struct rdx_rb_node *node = records[i].node, *parent;
+			if (!node)
+				continue;
+			parent = rdx_rb_parent(node);
+			batch->augment->propagate(node, parent);
+			if (parent) {
+				records[--next].node = parent;
+				records[next].depth = depth - 1;
+			}
+		}
+		for (end = next; end < count && records[end].depth == depth - 1;)
+			end++;
+		records_dedup(records + next, end - next, record_by_node);
+	}
+}
+
+void rdx_rb_batch_end(struct rdx_rb_batch *batch)
+{
+	if (batch->augment) {
+		if (batch->overflow)
+			rdx_rb_remap_augmented(batch->root, NULL, NULL, 1,
+					       batch->augment);
+		else
+			batch_fixup(batch);
+	}
+	batch->nr_records = 0;
+	batch->overflow = false;
+	batch->finger = NULL;
+	batch_current = NULL;
+}
@@ -0,0 +1,289 @@
+/*
+  Red Black Trees - per-core insert buffers
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <sched.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rbtree_buffered.h"
+
+/*
+ * Locks are always taken buffer first, tree second. A buffer stays locked
+ * until its nodes are all in the tree, and lookups search the buffers
+ * before the tree, each under its own lock and never both at once. So a
+ * node moving from its buffer to the tree is found in one place or the
+ * other, whichever the lookup gets to first.
+ */
+
+int rdx_rb_buffered_init(struct rdx_rb_buffered *tree, struct rdx_rb_root *root,
+			 const struct rdx_rb_augment_callbacks *augment,
+			 void (*duplicate)(struct rdx_rb_node *node, void *arg),
+			 void *arg, unsigned int nr_buffers, size_t capacity)
+{
+	unsigned int i, ready = 0;
+
+	if (!nr_buffers) {
+		long cpus = sysconf(_SC_NPROCESSORS_CONF);
+		nr_buffers = cpus > 0 ? cpus : 1;
+	}
+	tree->root = root;
+	tree->duplicate = duplicate;
+	tree->arg = arg;
+	tree->nr_buffers = nr_buffers;
+	tree->capacity = capacity ? capacity : 1;
+	tree->buffers = __rdx_rb_calloc_lines(nr_buffers,
+					      sizeof(*tree->buffers));
+	if (!tree->buffers)
+		return false;
+	if (pthread_rwlock_init(&tree->lock, NULL))
+		goto fail;
+	for (; ready < nr_buffers; ready++) {
+		struct rdx_rb_buffer *buffer = &tree->buffers[ready];
+
+		buffer->nodes = malloc(tree->capacity * sizeof(*buffer->nodes));
+		if (!buffer->nodes)
+			break;
+		if (pthread_mutex_init(&buffer->lock, NULL)) {
+			free(buffer->nodes);
+			break;
+		}
+	}
+	if (ready == nr_buffers) {
+		rdx_rb_batch_init(&tree->batch, root, augment);
+		return true;
+	}
+
+	for (i = 0; i < ready; i++) {
+		pthread_mutex_destroy(&tree->buffers[i].lock);
+		free(tree->buffers[i].nodes);
+	}
+	pthread_rwlock_destroy(&tree->lock);
+fail:
+	free(tree->buffers);
+	return false;
+}
+
+void rdx_rb_buffered_destroy(struct rdx_rb_buffered *tree)
+{
+	unsigned int i;
+
+	rdx_rb_buffered_flush(tree);
+	for (i = 0; i < tree->nr_buffers; i++) {
+		pthread_mutex_destroy(&tree->buffers[i].lock);
+		free(tree->buffers[i].nodes);
+	}
+	pthread_rwlock_destroy(&tree->lock);
+	rdx_rb_batch_destroy(&tree->batch);
+	free(tree->buffers);
+}
+
+/*
+ * The first node in @buffer that compares above @elem, or at or above it
+ * if @upper is false.
+ */
+static size_t buffer_search(struct rdx_rb_buffer *buffer,
+			    struct rdx_rb_node *elem,
+			    int (*compare)(struct rdx_rb_node *left,
+					   struct rdx_rb_node *right),
+			    int upper)
+{
+	size_t lo = 0, hi = buffer->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		int result = compare(buffer->nodes[mid], elem);
+		if (result > 0 || (!upper && result == 0))
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* Called with @buffer locked */
+static void buffer_merge(struct rdx_rb_buffered *tree,
+			 struct rdx_rb_buffer *buffer)
+{
+	size_t i;
+
+	for (i = 0; i < buffer->count; i++)
+		if (!rdx_rb_batch_insert(&tree->batch, buffer->nodes[i]) &&
+		    tree->duplicate)
+			tree->duplicate(buffer->nodes[i], tree->arg);
+	buffer->count = 0;
+}
+
+int rdx_rb_buffered_insert(struct rdx_rb_buffered *tree,
+			   struct rdx_rb_node *node)
+{
+	int cpu = sched_getcpu();
+	struct rdx_rb_buffer *buffer =
+		&tree->buffers[(cpu < 0 ? 0 : cpu) % tree->nr_buffers];
+	struct rdx_rb_root *root = tree->root;
+	size_t pos;
+
+	pthread_mutex_lock(&buffer->lock);
+	pos = buffer_search(buffer, node, root->strict_compare, false);
+	if (pos < buffer->count &&
+	    !root->strict_compare(buffer->nodes[pos], node)) {
+		pthread_mutex_unlock(&buffer->lock);
+		return false;
+	}
+	memmove(buffer->nodes + pos + 1, buffer->nodes + pos,
+		(buffer->count - pos) * sizeof(*buffer->nodes));
+	buffer->nodes[pos] = node;
+
+	if (++buffer->count == tree->capacity) {
+		pthread_rwlock_wrlock(&tree->lock);
+		rdx_rb_batch_begin(&tree->batch);
+		buffer_merge(tree, buffer);
+		rdx_rb_batch_end(&tree->batch);
+		pthread_rwlock_unlock(&tree->lock);
+	}
+	pthread_mutex_unlock(&buffer->lock);
+	return true;
+}
+
+void rdx_rb_buffered_write_lock(struct rdx_rb_buffered *tree)
+{
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_buffers; i++)
+		pthread_mutex_lock(&tree->buffers[i].lock);
+	pthread_rwlock_wrlock(&tree->lock);
+	rdx_rb_batch_begin(&tree->batch);
+	for (i = 0; i < tree->nr_buffers; i++)
+		buffer_merge(tree, &tree->buffers[i]);
+	rdx_rb_batch_end(&tree->batch);
+}
+
+void rdx_rb_buffered_write_unlock(struct rdx_rb_buffered *tree)
+{
+	unsigned int i;
+
+	pthread_rwlock_unlock(&tree->lock);
+	for (i = tree->nr_buffers; i-- > 0;)
+		pthread_mutex_unlock(&tree->buffers[i].lock);
+}
+
+void rdx_rb_buffered_flush(struct rdx_rb_buffered *tree)
+{
+	rdx_rb_buffered_write_lock(tree);
+	rdx_rb_buffered_write_unlock(tree);
+}
+
+/*
+ * Lookups
+ */
+
+/* Keep whichever of @best and @node sorts first, or last if @last */
+static struct rdx_rb_node *pick(struct rdx_rb_root *root,
+				struct rdx_rb_node *best,
+				struct rdx_rb_node *node, int last)
+{
+	int result;
+
+	if (!best || !node)
+		return best ? best : node;
+	result = root->strict_compare(node, best);
+	return (last ? result > 0 : result < 0) ? node : best;
+}
+
+struct rdx_rb_node *
+rdx_rb_buffered_find(struct rdx_rb_buffered *tree, struct rdx_rb_node *elem)
+{
+	struct rdx_rb_root *root = tree->root;
+	struct rdx_rb_node *node;
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_buffers; i++) {
+		struct rdx_rb_buffer *buffer = &tree->buffers[i];
+		size_t pos;
+
+		pthread_mutex_lock(&buffer->lock);
+		pos = buffer_search(buffer, elem, root->strict_compare, false);
+		node = pos < buffer->count ? buffer->nodes[pos] : NULL;
+		pthread_mutex_unlock(&buffer->lock);
+		if (node && !root->strict_compare(node, elem))
+			return node;
+	}
+
+	pthread_rwlock_rdlock(&tree->lock);
+	node = root->rb_node;
+	while (node) {
+		int result = root->strict_compare(elem, node);
+		if (!result)
+			break;
+		node = result < 0 ? node->rb_left : node->rb_right;
+	}
+	pthread_rwlock_unlock(&tree->lock);
+	return node;
+}
+
+struct rdx_rb_node *
+rdx_rb_buffered_rightmost_less_equiv(struct rdx_rb_buffered *tree,
+				     struct rdx_rb_node *elem)
+{
+	struct rdx_rb_root *root = tree->root;
+	struct rdx_rb_node *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_buffers; i++) {
+		struct rdx_rb_buffer *buffer = &tree->buffers[i];
+		size_t pos;
+
+		pthread_mutex_lock(&buffer->lock);
+		pos = buffer_search(buffer, elem, root->weak_compare, true);
+		if (pos > 0)
+			best = pick(root, best, buffer->nodes[pos - 1], true);
+		pthread_mutex_unlock(&buffer->lock);
+	}
+
+	pthread_rwlock_rdlock(&tree->lock);
+	best = pick(root, best, rdx_rb_rightmost_less_equiv(elem, root), true);
+	pthread_rwlock_unlock(&tree->lock);
+	return best;
+}
+
+struct rdx_rb_node *
+rdx_rb_buffered_leftmost_greater_equiv(struct rdx_rb_buffered *tree,
+				       struct rdx_rb_node *elem)
+{
+	struct rdx_rb_root *root = tree->root;
+	struct rdx_rb_node *best = NULL;
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_buffers; i++) {
+		struct rdx_rb_buffer *buffer = &tree->buffers[i];
+		size_t pos;
+
+		pthread_mutex_lock(&buffer->lock);
+		pos = buffer_search(buffer, elem, root->weak_compare, false);
+		if (pos < buffer->count)
+			best = pick(root, best, buffer->nodes[pos], false);
+		pthread_mutex_unlock(&buffer->lock);
+	}
+
+	pthread_rwlock_rdlock(&tree->lock);
+	best = pick(root, best, rdx_rb_leftmost_greater_equiv(elem, root),
+		    false);
+	pthread_rwlock_unlock(&tree->lock);
+	return best;
+}
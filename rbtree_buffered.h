@@ -0,0 +1,88 @@
+/*
+  Red Black Trees - per-core insert buffers
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_BUFFERED_H
+#define _RDX_RBTREE_BUFFERED_H
+
+#include <pthread.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Insertions go to a small sorted buffer belonging to the CPU the caller
+ * runs on, under a lock of its own that is hardly ever contended. Once a
+ * buffer fills up it is merged into the tree as one batch, so the tree
+ * lock gets taken once per buffer rather than once per node. Lookups
+ * search the buffers as well as the tree.
+ *
+ * A key that turns out to be in the tree already when its buffer gets
+ * merged is reported to @duplicate (if any) and left out. Anything beyond
+ * inserting and looking up - erasing, iterating, the bulk operations - goes
+ * between rdx_rb_buffered_write_lock() and rdx_rb_buffered_write_unlock(),
+ * which merge all buffers first and then hand out the tree for plain use.
+ */
+
+struct rdx_rb_buffer {
+	pthread_mutex_t lock;
+	size_t count;
+	struct rdx_rb_node **nodes;
+} __attribute__((aligned(64)));
+
+struct rdx_rb_buffered {
+	pthread_rwlock_t lock;
+	struct rdx_rb_root *root;
+	void (*duplicate)(struct rdx_rb_node *node, void *arg);
+	void *arg;
+	unsigned int nr_buffers;
+	size_t capacity;
+	struct rdx_rb_buffer *buffers;
+	/* Merging state, only touched under the exclusive lock */
+	struct rdx_rb_batch batch;
+};
+
+/*
+ * @augment may be NULL for a plain tree. An @nr_buffers of 0 means one per
+ * configured CPU. Returns false if out of memory.
+ */
+extern int
+rdx_rb_buffered_init(struct rdx_rb_buffered *tree, struct rdx_rb_root *root,
+		     const struct rdx_rb_augment_callbacks *augment,
+		     void (*duplicate)(struct rdx_rb_node *node, void *arg),
+		     void *arg, unsigned int nr_buffers, size_t capacity);
+/* Merges what is left, leaving a regular tree behind */
+extern void rdx_rb_buffered_destroy(struct rdx_rb_buffered *tree);
+
+/* Returns false if the key is waiting in the same buffer already */
+extern int
+rdx_rb_buffered_insert(struct rdx_rb_buffered *tree, struct rdx_rb_node *node);
+extern void rdx_rb_buffered_flush(struct rdx_rb_buffered *tree);
+
+extern void rdx_rb_buffered_write_lock(struct rdx_rb_buffered *tree);
+extern void rdx_rb_buffered_write_unlock(struct rdx_rb_buffered *tree);
+
+/* Same as their rbtree.h counterparts, buffered nodes included */
+extern struct rdx_rb_node *
+rdx_rb_buffered_find(struct rdx_rb_buffered *tree, struct rdx_rb_node *elem);
+extern struct rdx_rb_node *
+rdx_rb_buffered_rightmost_less_equiv(struct rdx_rb_buffered *tree,
+				     struct rdx_rb_node *elem);
+extern struct rdx_rb_node *
+rdx_rb_buffered_leftmost_greater_equiv(struct rdx_rb_buffered *tree,
+				       struct rdx_rb_node *elem);
+
+#endif	/* _RDX_RBTREE_BUFFERED_H */
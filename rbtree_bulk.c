@@ -0,0 +1,785 @@
+/*
+  Red Black Trees - bulk operations
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <string.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * A tree built from n sorted nodes by always picking the middle one as the
+ * subtree root has all its levels full except maybe the deepest one. Coloring
+ * that level red and everything above it black satisfies 4) and 5) without
+ * a single rotation, so the whole build is O(n) and every augmented payload
+ * is computed exactly once, children first.
+ *
+ * Parallel variants cut the top few levels off the tree and hand the
+ * subtrees hanging below them to worker threads. The cut nodes are few and
+ * are dealt with by the calling thread.
+ */
+
+/*
+ * Linear time construction
+ */
+
+struct build_task {
+	size_t lo, hi;
+	struct rdx_rb_node *parent;
+	struct rdx_rb_node **link;
+};
+
+struct build_ctx {
+	struct rdx_rb_node **nodes;
+	const struct rdx_rb_augment_callbacks *augment;
+	int red_depth;
+	int split_depth;
+	struct build_task *tasks;
+	size_t nr_tasks;
+};
+
+static struct rdx_rb_node *
+build_subtree(struct build_ctx *ctx, size_t lo, size_t hi, int depth,
+	      struct rdx_rb_node *parent)
+{
+	struct rdx_rb_node *node;
+	size_t mid;
+
+	if (lo == hi)
+		return NULL;
+
+	mid = lo + (hi - lo) / 2;
+	node = ctx->nodes[mid];
+	rdx_rb_set_parent_color(node, parent, depth == ctx->red_depth ?
+				RDX_RB_RED : RDX_RB_BLACK);
+	node->rb_left = build_subtree(ctx, lo, mid, depth + 1, node);
+	node->rb_right = build_subtree(ctx, mid + 1, hi, depth + 1, node);
+	/* Stopping at the parent recomputes this very node only */
+	if (ctx->augment)
+		ctx->augment->propagate(node, parent);
+	return node;
+}
+
+/* Link the top levels, leaving the subtrees below split_depth as tasks */
+static void build_top(struct build_ctx *ctx, size_t lo, size_t hi, int depth,
+		      struct rdx_rb_node *parent, struct rdx_rb_node **link)
+{
+	struct rdx_rb_node *node;
+	size_t mid;
+
+	if (lo == hi) {
+		*link = NULL;
+		return;
+	}
+	if (depth == ctx->split_depth) {
+		struct build_task *task = &ctx->tasks[ctx->nr_tasks++];
+		task->lo = lo;
+		task->hi = hi;
+		task->parent = parent;
+		task->link = link;
+		return;
+	}
+
+	mid = lo + (hi - lo) / 2;
+	node = ctx->nodes[mid];
+	rdx_rb_set_parent_color(node, parent, depth == ctx->red_depth ?
+				RDX_RB_RED : RDX_RB_BLACK);
+	*link = node;
+	build_top(ctx, lo, mid, depth + 1, node, &node->rb_left);
+	build_top(ctx, mid + 1, hi, depth + 1, node, &node->rb_right);
+}
+
+static void augment_top(const struct rdx_rb_augment_callbacks *augment,
+			struct rdx_rb_node *node, int levels)
+{
+	if (!node || levels == 0)
+		return;
+	augment_top(augment, node->rb_left, levels - 1);
+	augment_top(augment, node->rb_right, levels - 1);
+	augment->propagate(node, rdx_rb_parent(node));
+}
+
+static void build_worker(void *arg, size_t i)
+{
+	struct build_ctx *ctx = arg;
+	struct build_task *task = &ctx->tasks[i];
+
+	*task->link = build_subtree(ctx, task->lo, task->hi,
+				    ctx->split_depth, task->parent);
+}
+
+void rdx_rb_build_sorted_augmented(struct rdx_rb_node **nodes, size_t count,
+				   struct rdx_rb_root *root,
+				   unsigned int nr_threads,
+				   const struct rdx_rb_augment_callbacks *augment)
+{
+	struct build_ctx ctx = { nodes, augment, -1, 0, NULL, 0 };
+	int height = 0;
+
+	/* The deepest level is red unless it happens to be full */
+	while (((size_t)2 << height) - 1 < count)
+		height++;
+	if (((size_t)2 << height) - 1 != count)
+		ctx.red_depth = height;
+
+	ctx.split_depth = __rdx_rb_split_levels(nr_threads);
+	if (ctx.split_depth > 0)
+		ctx.tasks = malloc(((size_t)1 << ctx.split_depth) *
+				   sizeof(*ctx.tasks));
+	if (!ctx.tasks) {
+		root->rb_node = build_subtree(&ctx, 0, count, 0, NULL);
+		return;
+	}
+
+	build_top(&ctx, 0, count, 0, NULL, &root->rb_node);
+	__rdx_rb_parallel_run(ctx.nr_tasks, build_worker, &ctx, nr_threads);
+	if (augment)
+		augment_top(augment, root->rb_node, ctx.split_depth);
+	free(ctx.tasks);
+}
+
+void rdx_rb_build_sorted(struct rdx_rb_node **nodes, size_t count,
+			 struct rdx_rb_root *root, unsigned int nr_threads)
+{
+	rdx_rb_build_sorted_augmented(nodes, count, root, nr_threads, NULL);
+}
+
+/*
+ * Construction from unsorted nodes
+ *
+ * A bottom-up merge sort: short runs get insertion sorted, then runs are
+ * merged pairwise, ping-ponging between the caller's array and a scratch
+ * one. Every pass is cut into segments of the output that are merged
+ * independently; where a segment starts in each input run is found by
+ * binary search, so even the last pass, a single pair of runs, keeps all
+ * threads busy. The sort is stable, so of equal nodes the one that came
+ * first in the input survives.
+ */
+
+#define SORT_RUN	32
+
+struct sort_ctx {
+	int (*compare)(struct rdx_rb_node *left, struct rdx_rb_node *right);
+	struct rdx_rb_node **src, **dst;
+	size_t count;
+	size_t width;
+	size_t nr_pairs;
+	size_t nr_parts;
+	size_t nr_tasks;
+};
+
+static void sort_run_worker(void *arg, size_t task)
+{
+	struct sort_ctx *ctx = arg;
+	struct rdx_rb_node **run = ctx->src + task * SORT_RUN;
+	size_t len = ctx->count - task * SORT_RUN, i, j;
+
+	if (len > SORT_RUN)
+		len = SORT_RUN;
+	for (i = 1; i < len; i++) {
+		struct rdx_rb_node *node = run[i];
+		for (j = i; j > 0 && ctx->compare(run[j - 1], node) > 0; j--)
+			run[j] = run[j - 1];
+		run[j] = node;
+	}
+}
+
+/* How many of the first @k merged nodes come from @a */
+static size_t co_rank(struct sort_ctx *ctx, size_t k,
+		      struct rdx_rb_node **a, size_t a_len,
+		      struct rdx_rb_node **b, size_t b_len)
+{
+	size_t lo = k > b_len ? k - b_len : 0;
+	size_t hi = k < a_len ? k : a_len;
+
+	while (lo < hi) {
+		size_t i = lo + (hi - lo) / 2;
+		if (ctx->compare(a[i], b[k - i - 1]) <= 0)
+			lo = i + 1;
+		else
+			hi = i;
+	}
+	return lo;
+}
+
+static void merge_segment(struct sort_ctx *ctx, size_t pair,
+			  size_t part, size_t nr_parts)
+{
+	size_t start = pair * 2 * ctx->width;
+	struct rdx_rb_node **a = ctx->src + start, **b, **out;
+	size_t a_len = ctx->count - start, b_len, len, k0, k1, i, j, i1, j1;
+
+	if (a_len > ctx->width)
+		a_len = ctx->width;
+	b = a + a_len;
+	b_len = ctx->count - start - a_len;
+	if (b_len > ctx->width)
+		b_len = ctx->width;
+	len = a_len + b_len;
+
+	k0 = len * part / nr_parts;
+	k1 = len * (part + 1) / nr_parts;
+	i = co_rank(ctx, k0, a, a_len, b, b_len);
+	j = k0 - i;
+	i1 = co_rank(ctx, k1, a, a_len, b, b_len);
+	j1 = k1 - i1;
+
+	out = ctx->dst + start + k0;
+	while (i < i1 && j < j1) {
+		if (ctx->compare(a[i], b[j]) <= 0)
+			*out++ = a[i++];
+		else
+			*out++ = b[j++];
+	}
+	while (i < i1)
+		*out++ = a[i++];
+	while (j < j1)
+		*out++ = b[j++];
+}
+
+static void merge_worker(void *arg, size_t task)
+{
+	struct sort_ctx *ctx = arg;
+	size_t pair, end;
+
+	if (ctx->nr_parts > 1) {
+		merge_segment(ctx, task / ctx->nr_parts,
+			      task % ctx->nr_parts, ctx->nr_parts);
+		return;
+	}
+	/* More pairs than tasks, each task takes a few whole pairs */
+	end = ctx->nr_pairs * (task + 1) / ctx->nr_tasks;
+	for (pair = ctx->nr_pairs * task / ctx->nr_tasks; pair < end; pair++)
+		merge_segment(ctx, pair, 0, 1);
+}
+
+static int sort_nodes(struct rdx_rb_node **nodes, size_t count,
+		      int (*compare)(struct rdx_rb_node *left,
+				     struct rdx_rb_node *right),
+		      unsigned int nr_threads)
+{
+	struct sort_ctx ctx = { compare, nodes, NULL, count, SORT_RUN };
+	size_t target = nr_threads > 1 ? (size_t)nr_threads * 4 : 1;
+
+	__rdx_rb_parallel_run((count + SORT_RUN - 1) / SORT_RUN,
+			      sort_run_worker, &ctx, nr_threads);
+	if (count <= SORT_RUN)
+		return true;
+
+	ctx.dst = malloc(count * sizeof(*ctx.dst));
+	if (!ctx.dst)
+		return false;
+
+	for (; ctx.width < count; ctx.width *= 2) {
+		struct rdx_rb_node **tmp;
+
+		ctx.nr_pairs = (count + 2 * ctx.width - 1) / (2 * ctx.width);
+		if (ctx.nr_pairs >= target) {
+			ctx.nr_parts = 1;
+			ctx.nr_tasks = target;
+		} else {
+			ctx.nr_parts = (target + ctx.nr_pairs - 1) /
+				       ctx.nr_pairs;
+			ctx.nr_tasks = ctx.nr_pairs * ctx.nr_parts;
+		}
+		__rdx_rb_parallel_run(ctx.nr_tasks, merge_worker, &ctx,
+				      nr_threads);
+		tmp = ctx.src;
+		ctx.src = ctx.dst;
+		ctx.dst = tmp;
+	}
+
+	if (ctx.src != nodes) {
+		memcpy(nodes, ctx.src, count * sizeof(*nodes));
+		ctx.dst = ctx.src;
+	}
+	free(ctx.dst);
+	return true;
+}
+
+int rdx_rb_build_augmented(struct rdx_rb_node **nodes, size_t count,
+			   struct rdx_rb_root *root,
+			   void (*duplicate)(struct rdx_rb_node *node,
+					     void *arg),
+			   void *arg, unsigned int nr_threads,
+			   const struct rdx_rb_augment_callbacks *augment)
+{
+	size_t kept, i;
+
+	if (!sort_nodes(nodes, count, root->strict_compare, nr_threads))
+		return false;
+
+	for (kept = 0, i = 0; i < count; i++) {
+		if (kept && !root->strict_compare(nodes[kept - 1], nodes[i])) {
+			if (duplicate)
+				duplicate(nodes[i], arg);
+			continue;
+		}
+		nodes[kept++] = nodes[i];
+	}
+
+	rdx_rb_build_sorted_augmented(nodes, kept, root, nr_threads, augment);
+	return true;
+}
+
+int rdx_rb_build(struct rdx_rb_node **nodes, size_t count,
+		 struct rdx_rb_root *root,
+		 void (*duplicate)(struct rdx_rb_node *node, void *arg),
+		 void *arg, unsigned int nr_threads)
+{
+	return rdx_rb_build_augmented(nodes, count, root, duplicate, arg,
+				      nr_threads, NULL);
+}
+
+/*
+ * Filtering
+ *
+ * Every subtree below the cut gets a slice of one array big enough for the
+ * whole tree and sorts its own nodes into survivors at the front of the
+ * slice and victims at the back. The cut nodes sit between the slices.
+ * Squeezing the survivors together afterwards yields the sorted input for
+ * the rebuild.
+ */
+
+struct retain_ctx {
+	int (*pred)(struct rdx_rb_node *node, void *arg);
+	void *arg;
+	struct rdx_rb_node **subtrees;
+	struct rdx_rb_node **nodes;
+	size_t *offsets;
+	size_t *sizes;
+	size_t *kept;
+};
+
+static void retain_count_worker(void *arg, size_t i)
+{
+	struct retain_ctx *ctx = arg;
+	struct rdx_rb_node *node = ctx->subtrees[i], *last;
+	size_t size = 0;
+
+	if (node) {
+		last = __rdx_rb_rightmost(node);
+		for (node = __rdx_rb_leftmost(node); ; node = rdx_rb_next(node)) {
+			size++;
+			if (node == last)
+				break;
+		}
+	}
+	ctx->sizes[i] = size;
+}
+
+static void retain_filter_worker(void *arg, size_t i)
+{
+	struct retain_ctx *ctx = arg;
+	struct rdx_rb_node *node = ctx->subtrees[i], *last;
+	struct rdx_rb_node **slice = ctx->nodes + ctx->offsets[i];
+	size_t front = 0, back = ctx->sizes[i];
+
+	if (node) {
+		last = __rdx_rb_rightmost(node);
+		for (node = __rdx_rb_leftmost(node); ; node = rdx_rb_next(node)) {
+			if (ctx->pred(node, ctx->arg))
+				slice[front++] = node;
+			else
+				slice[--back] = node;
+			if (node == last)
+				break;
+		}
+	}
+	ctx->kept[i] = front;
+}
+
+int rdx_rb_retain_augmented(struct rdx_rb_root *root,
+			    int (*pred)(struct rdx_rb_node *node, void *arg),
+			    void (*dispose)(struct rdx_rb_node *node,
+					    void *arg),
+			    void *arg, unsigned int nr_threads,
+			    const struct rdx_rb_augment_callbacks *augment)
+{
+	struct retain_ctx ctx = { pred, arg, NULL, NULL, NULL, NULL, NULL };
+	struct rdx_rb_node **separators;
+	size_t nr_subtrees, total, kept, i, j;
+	int levels = __rdx_rb_split_levels(nr_threads);
+	size_t width = (size_t)1 << levels;
+	int result = false;
+
+	if (RDX_RB_EMPTY_ROOT(root))
+		return true;
+
+	ctx.subtrees = malloc(width * sizeof(*ctx.subtrees));
+	separators = malloc(width * sizeof(*separators));
+	ctx.offsets = malloc(width * sizeof(*ctx.offsets));
+	ctx.sizes = malloc(width * sizeof(*ctx.sizes));
+	ctx.kept = malloc(width * sizeof(*ctx.kept));
+	if (!ctx.subtrees || !separators || !ctx.offsets || !ctx.sizes ||
+	    !ctx.kept)
+		goto out;
+
+	nr_subtrees = __rdx_rb_split_top(root->rb_node, levels,
+					 ctx.subtrees, separators, 0);
+	__rdx_rb_parallel_run(nr_subtrees, retain_count_worker, &ctx,
+			      nr_threads);
+
+	total = 0;
+	for (i = 0; i < nr_subtrees; i++) {
+		ctx.offsets[i] = total;
+		total += ctx.sizes[i] + (i + 1 < nr_subtrees);
+	}
+
+	ctx.nodes = malloc(total * sizeof(*ctx.nodes));
+	if (!ctx.nodes)
+		goto out;
+	__rdx_rb_parallel_run(nr_subtrees, retain_filter_worker, &ctx,
+			      nr_threads);
+
+	/*
+	 * Nobody reads the old links past this point, so victims may be
+	 * disposed of while compacting. Survivors only ever move down, and
+	 * never over victims that have not been disposed of yet.
+	 */
+	kept = 0;
+	for (i = 0; i < nr_subtrees; i++) {
+		struct rdx_rb_node **slice = ctx.nodes + ctx.offsets[i];
+
+		memmove(ctx.nodes + kept, slice, ctx.kept[i] * sizeof(*slice));
+		kept += ctx.kept[i];
+		if (dispose)
+			for (j = ctx.kept[i]; j < ctx.sizes[i]; j++)
+				dispose(slice[j], arg);
+		if (i + 1 < nr_subtrees) {
+			if (pred(separators[i], arg))
+				ctx.nodes[kept++] = separators[i];
+			else if (dispose)
+				dispose(separators[i], arg);
+		}
+	}
+
+	if (kept != total)
+		rdx_rb_build_sorted_augmented(ctx.nodes, kept, root,
+					      nr_threads, augment);
+	result = true;
+out:
+	free(ctx.nodes);
+	free(ctx.kept);
+	free(ctx.sizes);
+	free(ctx.offsets);
+	free(separators);
+	free(ctx.subtrees);
+	return result;
+}
+
+int rdx_rb_retain(struct rdx_rb_root *root,
+		  int (*pred)(struct rdx_rb_node *node, void *arg),
+		  void (*dispose)(struct rdx_rb_node *node, void *arg),
+		  void *arg, unsigned int nr_threads)
+{
+	return rdx_rb_retain_augmented(root, pred, dispose, arg,
+				       nr_threads, NULL);
+}
+
+/*
+ * Whole tree remapping
+ *
+ * Postorder visits both children before their parent, so applying the user
+ * function and recomputing the payload in the same visit leaves every node
+ * consistent as soon as the walk leaves it.
+ */
+
+struct remap_ctx {
+	void (*fn)(struct rdx_rb_node *node, void *arg);
+	void *arg;
+	const struct rdx_rb_augment_callbacks *augment;
+	struct rdx_rb_node **subtrees;
+};
+
+static struct rdx_rb_node *subtree_first_postorder(struct rdx_rb_node *node)
+{
+	for (;;) {
+		if (node->rb_left)
+			node = node->rb_left;
+		else if (node->rb_right)
+			node = node->rb_right;
+		else
+			return node;
+	}
+}
+
+static void remap_node(struct remap_ctx *ctx, struct rdx_rb_node *node)
+{
+	if (ctx->fn)
+		ctx->fn(node, ctx->arg);
+	ctx->augment->propagate(node, rdx_rb_parent(node));
+}
+
+static void remap_worker(void *arg, size_t i)
+{
+	struct remap_ctx *ctx = arg;
+	struct rdx_rb_node *top = ctx->subtrees[i], *node, *next;
+
+	if (!top)
+		return;
+	for (node = subtree_first_postorder(top); ; node = next) {
+		next = rdx_rb_next_postorder(node);
+		remap_node(ctx, node);
+		if (node == top)
+			break;
+	}
+}
+
+static void remap_top(struct remap_ctx *ctx, struct rdx_rb_node *node,
+		      int levels)
+{
+	if (!node || levels == 0)
+		return;
+	remap_top(ctx, node->rb_left, levels - 1);
+	remap_top(ctx, node->rb_right, levels - 1);
+	remap_node(ctx, node);
+}
+
+void rdx_rb_remap_augmented(struct rdx_rb_root *root,
+			    void (*fn)(struct rdx_rb_node *node, void *arg),
+			    void *arg, unsigned int nr_threads,
+			    const struct rdx_rb_augment_callbacks *augment)
+{
+	struct remap_ctx ctx = { fn, arg, augment, NULL };
+	struct rdx_rb_node **separators = NULL;
+	int levels = __rdx_rb_split_levels(nr_threads);
+	size_t width = (size_t)1 << levels;
+	size_t nr_subtrees;
+
+	if (levels > 0) {
+		ctx.subtrees = malloc(width * sizeof(*ctx.subtrees));
+		separators = malloc(width * sizeof(*separators));
+	}
+	if (!ctx.subtrees || !separators) {
+		/* Sequential after all, which needs no memory */
+		struct rdx_rb_node *subtree = root->rb_node;
+
+		free(separators);
+		free(ctx.subtrees);
+		ctx.subtrees = &subtree;
+		remap_worker(&ctx, 0);
+		return;
+	}
+
+	nr_subtrees = __rdx_rb_split_top(root->rb_node, levels,
+					 ctx.subtrees, separators, 0);
+	__rdx_rb_parallel_run(nr_subtrees, remap_worker, &ctx, nr_threads);
+	remap_top(&ctx, root->rb_node, levels);
+	free(separators);
+	free(ctx.subtrees);
+}
+
+/*
+ * Cloning
+ *
+ * A preorder walk copies every node and links it below the copy of its
+ * parent right away, so each link is written once and nothing is left to
+ * fix up afterwards. Parallel clones copy the top levels first, which
+ * gives every subtree below them a parent to hang from.
+ */
+
+struct clone_task {
+	struct rdx_rb_node *node;
+	struct rdx_rb_node *parent;
+	struct rdx_rb_node **link;
+};
+
+struct clone_ctx {
+	struct rdx_rb_node *(*copy)(const struct rdx_rb_node *node, void *arg);
+	void *arg;
+	const struct rdx_rb_augment_callbacks *augment;
+	struct clone_task *tasks;
+	size_t nr_tasks;
+	int failed;
+};
+
+static struct rdx_rb_node *clone_node(struct clone_ctx *ctx,
+				      struct rdx_rb_node *node,
+				      struct rdx_rb_node *parent)
+{
+	struct rdx_rb_node *copy;
+
+	if (__atomic_load_n(&ctx->failed, __ATOMIC_RELAXED))
+		return NULL;
+	copy = ctx->copy(node, ctx->arg);
+	if (!copy) {
+		__atomic_store_n(&ctx->failed, true, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	rdx_rb_set_parent_color(copy, parent, rdx_rb_color(node));
+	copy->rb_left = copy->rb_right = NULL;
+	if (ctx->augment)
+		ctx->augment->copy(node, copy);
+	return copy;
+}
+
+static void clone_subtree(struct clone_ctx *ctx, struct rdx_rb_node *node,
+			  struct rdx_rb_node *parent, struct rdx_rb_node **link)
+{
+	struct rdx_rb_node *copy;
+
+	/* Recurse on the left, loop on the right */
+	for (; node; node = node->rb_right) {
+		copy = clone_node(ctx, node, parent);
+		*link = copy;
+		if (!copy)
+			return;
+		clone_subtree(ctx, node->rb_left, copy, &copy->rb_left);
+		parent = copy;
+		link = &copy->rb_right;
+	}
+}
+
+static void clone_top(struct clone_ctx *ctx, struct rdx_rb_node *node,
+		      struct rdx_rb_node *parent, struct rdx_rb_node **link,
+		      int levels)
+{
+	struct rdx_rb_node *copy;
+
+	if (node && levels == 0) {
+		ctx->tasks[ctx->nr_tasks++] =
+			(struct clone_task){ node, parent, link };
+		return;
+	}
+	if (!node || !(copy = clone_node(ctx, node, parent)))
+		return;
+	*link = copy;
+	clone_top(ctx, node->rb_left, copy, &copy->rb_left, levels - 1);
+	clone_top(ctx, node->rb_right, copy, &copy->rb_right, levels - 1);
+}
+
+static void clone_worker(void *arg, size_t i)
+{
+	struct clone_ctx *ctx = arg;
+	struct clone_task *task = &ctx->tasks[i];
+
+	clone_subtree(ctx, task->node, task->parent, task->link);
+}
+
+int rdx_rb_clone_augmented(struct rdx_rb_root *dst, struct rdx_rb_root *src,
+			   struct rdx_rb_node *(*copy)(
+				   const struct rdx_rb_node *node, void *arg),
+			   void (*dispose)(struct rdx_rb_node *node, void *arg),
+			   void *arg, unsigned int nr_threads,
+			   const struct rdx_rb_augment_callbacks *augment)
+{
+	struct clone_ctx ctx = { copy, arg, augment, NULL, 0, false };
+	int levels = __rdx_rb_split_levels(nr_threads);
+	struct rdx_rb_node *node, *next;
+
+	*dst = RDX_RB_ROOT(src->strict_compare, src->weak_compare);
+	if (levels > 0)
+		ctx.tasks = malloc(((size_t)1 << levels) * sizeof(*ctx.tasks));
+	if (ctx.tasks) {
+		clone_top(&ctx, src->rb_node, NULL, &dst->rb_node, levels);
+		__rdx_rb_parallel_run(ctx.nr_tasks, clone_worker, &ctx,
+				      nr_threads);
+		free(ctx.tasks);
+	} else {
+		clone_subtree(&ctx, src->rb_node, NULL, &dst->rb_node);
+	}
+	if (!ctx.failed)
+		return true;
+
+	/* Whatever was copied is a well formed, if partial, tree */
+	for (node = rdx_rb_first_postorder(dst); node; node = next) {
+		next = rdx_rb_next_postorder(node);
+		if (dispose)
+			dispose(node, arg);
+	}
+	dst->rb_node = NULL;
+	return false;
+}
+
+int rdx_rb_clone(struct rdx_rb_root *dst, struct rdx_rb_root *src,
+		 struct rdx_rb_node *(*copy)(const struct rdx_rb_node *node,
+					     void *arg),
+		 void (*dispose)(struct rdx_rb_node *node, void *arg),
+		 void *arg, unsigned int nr_threads)
+{
+	return rdx_rb_clone_augmented(dst, src, copy, dispose, arg,
+				      nr_threads, NULL);
+}
+
+/*
+ * Joining
+ *
+ * Walk down the inner spine of the taller tree to the first black node of
+ * the same black height as the other tree, and put @pivot in its place,
+ * red, with that node and the other tree as its children. Black heights
+ * still agree everywhere, and the only thing that can be wrong is a red
+ * parent above @pivot, which is exactly what insertion fixes up.
+ */
+
+static int black_height(struct rdx_rb_node *node)
+{
+	int height = 0;
+
+	for (; node; node = node->rb_left)
+		height += rdx_rb_is_black(node);
+	return height;
+}
+
+void rdx_rb_join_augmented(struct rdx_rb_root *left, struct rdx_rb_node *pivot,
+			   struct rdx_rb_root *right,
+			   const struct rdx_rb_augment_callbacks *augment)
+{
+	int lh = black_height(left->rb_node), rh = black_height(right->rb_node);
+	int taller = lh >= rh ? lh : rh, shorter = lh >= rh ? rh : lh;
+	struct rdx_rb_node **link = lh >= rh ? &left->rb_node
+					     : &right->rb_node;
+	struct rdx_rb_node *node = *link, *parent = NULL;
+
+	while (node && !(rdx_rb_is_black(node) && taller == shorter)) {
+		taller -= rdx_rb_is_black(node);
+		parent = node;
+		link = lh >= rh ? &node->rb_right : &node->rb_left;
+		node = *link;
+	}
+
+	if (lh >= rh) {
+		pivot->rb_left = node;
+		pivot->rb_right = right->rb_node;
+	} else {
+		pivot->rb_left = left->rb_node;
+		pivot->rb_right = node;
+	}
+	rdx_rb_set_parent_color(pivot, parent, RDX_RB_RED);
+	*link = pivot;
+	if (lh < rh)
+		left->rb_node = right->rb_node;
+	right->rb_node = NULL;
+	if (pivot->rb_left)
+		rdx_rb_set_parent(pivot->rb_left, pivot);
+	if (pivot->rb_right)
+		rdx_rb_set_parent(pivot->rb_right, pivot);
+
+	if (augment) {
+		/* Rotations recompute from children, which must be right */
+		augment->propagate(pivot, NULL);
+		__rdx_rb_insert_augmented(pivot, left, augment->rotate);
+		augment->propagate(pivot, NULL);
+	} else {
+		rdx_rb_insert_color(pivot, left);
+	}
+}
+
+void rdx_rb_join(struct rdx_rb_root *left, struct rdx_rb_node *pivot,
+		 struct rdx_rb_root *right)
+{
+	rdx_rb_join_augmented(left, pivot, right, NULL);
+}
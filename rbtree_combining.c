@@ -0,0 +1,150 @@
+/*
+  Red Black Trees - flat combining front end
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <sched.h>
+
+#include "rbtree_combining.h"
+
+enum { SLOT_FREE, SLOT_IDLE, SLOT_PENDING, SLOT_DONE };
+enum { OP_INSERT, OP_ERASE };
+
+/* The root being combined into by this thread, for sorting */
+static __thread struct rdx_rb_root *fc_root;
+
+int rdx_rb_fc_init(struct rdx_rb_fc *fc, struct rdx_rb_root *root,
+		   const struct rdx_rb_augment_callbacks *augment,
+		   unsigned int nr_slots)
+{
+	fc->root = root;
+	fc->nr_slots = nr_slots;
+	fc->slots = __rdx_rb_calloc_lines(nr_slots, sizeof(*fc->slots));
+	fc->pending = malloc(nr_slots * sizeof(*fc->pending));
+	if (!fc->slots || !fc->pending ||
+	    pthread_mutex_init(&fc->lock, NULL)) {
+		free(fc->pending);
+		free(fc->slots);
+		return false;
+	}
+	rdx_rb_batch_init(&fc->batch, root, augment);
+	return true;
+}
+
+void rdx_rb_fc_destroy(struct rdx_rb_fc *fc)
+{
+	pthread_mutex_destroy(&fc->lock);
+	rdx_rb_batch_destroy(&fc->batch);
+	free(fc->pending);
+	free(fc->slots);
+}
+
+int rdx_rb_fc_register(struct rdx_rb_fc *fc)
+{
+	unsigned int i;
+
+	for (i = 0; i < fc->nr_slots; i++) {
+		int state = SLOT_FREE;
+		if (__atomic_compare_exchange_n(&fc->slots[i].state, &state,
+						SLOT_IDLE, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return i;
+	}
+	return -1;
+}
+
+void rdx_rb_fc_unregister(struct rdx_rb_fc *fc, int slot)
+{
+	__atomic_store_n(&fc->slots[slot].state, SLOT_FREE, __ATOMIC_RELEASE);
+}
+
+static int slot_by_key(const void *a, const void *b)
+{
+	const struct rdx_rb_fc_slot *left = *(struct rdx_rb_fc_slot **)a;
+	const struct rdx_rb_fc_slot *right = *(struct rdx_rb_fc_slot **)b;
+	int result = fc_root->strict_compare(left->node, right->node);
+
+	if (result)
+		return result;
+	return (left > right) - (left < right);
+}
+
+static void fc_combine(struct rdx_rb_fc *fc)
+{
+	size_t count = 0, i;
+
+	for (i = 0; i < fc->nr_slots; i++)
+		if (__atomic_load_n(&fc->slots[i].state, __ATOMIC_ACQUIRE) ==
+		    SLOT_PENDING)
+			fc->pending[count++] = &fc->slots[i];
+	if (!count)
+		return;
+
+	fc_root = fc->root;
+	qsort(fc->pending, count, sizeof(*fc->pending), slot_by_key);
+
+	rdx_rb_batch_begin(&fc->batch);
+	for (i = 0; i < count; i++) {
+		struct rdx_rb_fc_slot *slot = fc->pending[i];
+
+		if (slot->op == OP_ERASE) {
+			rdx_rb_batch_erase(&fc->batch, slot->node);
+			slot->result = true;
+		} else
+			slot->result = rdx_rb_batch_insert(&fc->batch,
+							   slot->node);
+	}
+	rdx_rb_batch_end(&fc->batch);
+
+	for (i = 0; i < count; i++)
+		__atomic_store_n(&fc->pending[i]->state, SLOT_DONE,
+				 __ATOMIC_RELEASE);
+}
+
+static int fc_submit(struct rdx_rb_fc *fc, int slot_nr, int op,
+		     struct rdx_rb_node *node)
+{
+	struct rdx_rb_fc_slot *slot = &fc->slots[slot_nr];
+	unsigned int spins = 0;
+	int result;
+
+	slot->op = op;
+	slot->node = node;
+	__atomic_store_n(&slot->state, SLOT_PENDING, __ATOMIC_RELEASE);
+
+	while (__atomic_load_n(&slot->state, __ATOMIC_ACQUIRE) != SLOT_DONE) {
+		if (!pthread_mutex_trylock(&fc->lock)) {
+			fc_combine(fc);
+			pthread_mutex_unlock(&fc->lock);
+		} else if (++spins % 64 == 0)
+			sched_yield();
+	}
+
+	result = slot->result;
+	__atomic_store_n(&slot->state, SLOT_IDLE, __ATOMIC_RELAXED);
+	return result;
+}
+
+int rdx_rb_fc_insert(struct rdx_rb_fc *fc, int slot, struct rdx_rb_node *node)
+{
+	return fc_submit(fc, slot, OP_INSERT, node);
+}
+
+void rdx_rb_fc_erase(struct rdx_rb_fc *fc, int slot, struct rdx_rb_node *node)
+{
+	fc_submit(fc, slot, OP_ERASE, node);
+}
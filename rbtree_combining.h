@@ -0,0 +1,82 @@
+/*
+  Red Black Trees - flat combining front end
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_COMBINING_H
+#define _RDX_RBTREE_COMBINING_H
+
+#include <pthread.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Instead of queueing up on the tree lock, every writer publishes its
+ * request in a slot of its own and whoever gets the lock applies all
+ * pending requests at once: sorted by key, so consecutive inserts descend
+ * from where the previous one landed, and with every augmented payload
+ * touched by the batch recomputed once at the end rather than once per
+ * request.
+ *
+ * Each thread registers once for a slot and passes it to every call. Readers
+ * take the lock around their lookups just as they would with a plain mutex.
+ */
+
+struct rdx_rb_fc_slot {
+	int state;
+	int op;
+	struct rdx_rb_node *node;
+	int result;
+} __attribute__((aligned(64)));
+
+struct rdx_rb_fc {
+	pthread_mutex_t lock;
+	struct rdx_rb_root *root;
+	unsigned int nr_slots;
+	struct rdx_rb_fc_slot *slots;
+	/* Combiner state, only touched under the lock */
+	struct rdx_rb_fc_slot **pending;
+	struct rdx_rb_batch batch;
+};
+
+/* @augment may be NULL for a plain tree. Returns false if out of memory. */
+extern int
+rdx_rb_fc_init(struct rdx_rb_fc *fc, struct rdx_rb_root *root,
+	       const struct rdx_rb_augment_callbacks *augment,
+	       unsigned int nr_slots);
+extern void rdx_rb_fc_destroy(struct rdx_rb_fc *fc);
+
+/* Returns a slot for the calling thread, or -1 if all are taken */
+extern int rdx_rb_fc_register(struct rdx_rb_fc *fc);
+extern void rdx_rb_fc_unregister(struct rdx_rb_fc *fc, int slot);
+
+/* Same results as rdx_rb_insert() and rdx_rb_erase() */
+extern int
+rdx_rb_fc_insert(struct rdx_rb_fc *fc, int slot, struct rdx_rb_node *node);
+extern void
+rdx_rb_fc_erase(struct rdx_rb_fc *fc, int slot, struct rdx_rb_node *node);
+
+static inline void rdx_rb_fc_lock(struct rdx_rb_fc *fc)
+{
+	pthread_mutex_lock(&fc->lock);
+}
+
+static inline void rdx_rb_fc_unlock(struct rdx_rb_fc *fc)
+{
+	pthread_mutex_unlock(&fc->lock);
+}
+
+#endif	/* _RDX_RBTREE_COMBINING_H */
@@ -0,0 +1,318 @@
+/*
+  Red Black Trees - change feeds
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include "rbtree_feed.h"
+#include "rbtree_augmented.h"
+
+#include <errno.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static inline struct rdx_rb_feed_record *
+record_at(struct rdx_rb_feed *feed, uint64_t seq)
+{
+	return (struct rdx_rb_feed_record *)
+		(feed->records + seq % feed->capacity * feed->record_size);
+}
+
+void rdx_rb_feed_init(struct rdx_rb_feed *feed, size_t capacity, size_t size,
+		      size_t offset)
+{
+	feed->capacity = capacity;
+	feed->size = size;
+	feed->offset = offset;
+	feed->record_size = RDX_RB_FEED_RECORD_SIZE(size);
+	feed->head = feed->tail_seen = 0;
+	feed->tail = feed->head_seen = 0;
+}
+
+/*
+ * The writer owns @head and the reader @tail, and each only looks at the
+ * other's again when what it saw last runs out.
+ */
+
+void rdx_rb_feed_append(struct rdx_rb_feed *feed, int op,
+			const struct rdx_rb_node *node)
+{
+	uint64_t head = feed->head;
+	struct rdx_rb_feed_record *record;
+
+	while (head - feed->tail_seen >= feed->capacity) {
+		feed->tail_seen = __atomic_load_n(&feed->tail,
+						  __ATOMIC_ACQUIRE);
+		if (head - feed->tail_seen >= feed->capacity)
+			sched_yield();
+	}
+	record = record_at(feed, head);
+	record->seq = head;
+	record->op = op;
+	memcpy(record->data, (const char *)node - feed->offset, feed->size);
+	__atomic_store_n(&feed->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/* How many records from @tail on are there to read */
+static uint64_t available(struct rdx_rb_feed *feed, uint64_t tail)
+{
+	if (feed->head_seen == tail)
+		feed->head_seen = __atomic_load_n(&feed->head,
+						  __ATOMIC_ACQUIRE);
+	return feed->head_seen - tail;
+}
+
+size_t rdx_rb_feed_peek(struct rdx_rb_feed *feed, void *records, size_t max)
+{
+	uint64_t tail = feed->tail, nr = available(feed, tail), i;
+
+	if (nr > max)
+		nr = max;
+	for (i = 0; i < nr; i++)
+		memcpy((unsigned char *)records + i * feed->record_size,
+		       record_at(feed, tail + i), feed->record_size);
+	return nr;
+}
+
+void rdx_rb_feed_consume(struct rdx_rb_feed *feed, size_t nr)
+{
+	__atomic_store_n(&feed->tail, feed->tail + nr, __ATOMIC_RELEASE);
+}
+
+size_t rdx_rb_feed_read(struct rdx_rb_feed *feed, void *records, size_t max)
+{
+	size_t nr = rdx_rb_feed_peek(feed, records, max);
+
+	rdx_rb_feed_consume(feed, nr);
+	return nr;
+}
+
+int rdx_rb_feed_send(struct rdx_rb_feed *feed, int fd)
+{
+	uint64_t tail = feed->tail, nr;
+	ssize_t written;
+	size_t len;
+
+	/* Straight from the ring, up to its end at most at a time */
+	while ((nr = available(feed, tail))) {
+		if (nr > feed->capacity - tail % feed->capacity)
+			nr = feed->capacity - tail % feed->capacity;
+		len = nr * feed->record_size;
+		while (len) {
+			written = write(fd, (char *)record_at(feed, tail) +
+					    nr * feed->record_size - len, len);
+			if (written < 0 && errno == EINTR)
+				continue;
+			if (written <= 0)
+				return false;
+			len -= written;
+		}
+		tail += nr;
+		__atomic_store_n(&feed->tail, tail, __ATOMIC_RELEASE);
+	}
+	return true;
+}
+
+/*
+ * Followers
+ */
+
+int rdx_rb_follower_init(struct rdx_rb_follower *follower,
+			 struct rdx_rb_root *root,
+			 const struct rdx_rb_augment_callbacks *augment,
+			 size_t size, size_t offset, size_t max_batch)
+{
+	follower->root = root;
+	follower->size = size;
+	follower->offset = offset;
+	follower->record_size = RDX_RB_FEED_RECORD_SIZE(size);
+	follower->max_batch = max_batch;
+	follower->next_seq = 0;
+	follower->filled = 0;
+	follower->error = 0;
+	follower->batch = malloc(sizeof(*follower->batch));
+	follower->buffer = malloc(max_batch * follower->record_size);
+	follower->sorted = malloc(max_batch * sizeof(*follower->sorted));
+	follower->fresh = malloc(max_batch * sizeof(*follower->fresh));
+	follower->erased = malloc(max_batch * sizeof(*follower->erased));
+	if (!follower->batch || !follower->buffer || !follower->sorted ||
+	    !follower->fresh || !follower->erased) {
+		free(follower->batch);
+		follower->batch = NULL;
+		rdx_rb_follower_destroy(follower);
+		return false;
+	}
+	rdx_rb_batch_init(follower->batch, root, augment);
+	return true;
+}
+
+void rdx_rb_follower_destroy(struct rdx_rb_follower *follower)
+{
+	if (follower->batch)
+		rdx_rb_batch_destroy(follower->batch);
+	free(follower->batch);
+	free(follower->buffer);
+	free(follower->sorted);
+	free(follower->fresh);
+	free(follower->erased);
+	follower->batch = NULL;
+	follower->buffer = NULL;
+	follower->sorted = NULL;
+	follower->fresh = follower->erased = NULL;
+}
+
+/* The follower sorting records on this thread, for the comparison */
+static __thread struct rdx_rb_follower *follower_current;
+
+static inline struct rdx_rb_node *
+node_of(const struct rdx_rb_follower *follower,
+	const struct rdx_rb_feed_record *record)
+{
+	return (struct rdx_rb_node *)(record->data + follower->offset);
+}
+
+static void free_copy(const struct rdx_rb_follower *follower,
+		      struct rdx_rb_node *node)
+{
+	if (node)
+		free((char *)node - follower->offset);
+}
+
+/* By key, then by sequence number, so the last change to a key is last */
+static int record_order(const void *a, const void *b)
+{
+	const struct rdx_rb_feed_record *left =
+		*(const struct rdx_rb_feed_record **)a;
+	const struct rdx_rb_feed_record *right =
+		*(const struct rdx_rb_feed_record **)b;
+	int result = follower_current->root->strict_compare(
+		node_of(follower_current, left),
+		node_of(follower_current, right));
+
+	return result ? result : (left->seq > right->seq) -
+				 (left->seq < right->seq);
+}
+
+int rdx_rb_follower_apply(struct rdx_rb_follower *follower,
+			  const void *records, size_t nr)
+{
+	struct rdx_rb_root *root = follower->root;
+	const struct rdx_rb_feed_record *record;
+	struct rdx_rb_node *old;
+	size_t i, last = 0, nr_erased = 0;
+	char *copy;
+
+	for (i = 0; i < nr; i++) {
+		record = (const struct rdx_rb_feed_record *)
+			((const unsigned char *)records +
+			 i * follower->record_size);
+		if (record->seq != follower->next_seq + i) {
+			follower->error = EILSEQ;
+			return false;
+		}
+		follower->sorted[i] = record;
+	}
+	follower_current = follower;
+	qsort(follower->sorted, nr, sizeof(*follower->sorted), record_order);
+
+	/* Keep the last of every key, with its copy made up front */
+	for (i = 0; i < nr; i++) {
+		record = follower->sorted[i];
+		if (i + 1 < nr &&
+		    !root->strict_compare(node_of(follower, record),
+					  node_of(follower,
+						  follower->sorted[i + 1])))
+			continue;
+		copy = NULL;
+		if (record->op != RDX_RB_FEED_ERASE) {
+			copy = malloc(follower->size);
+			if (!copy) {
+				while (last--)
+					free_copy(follower,
+						  follower->fresh[last]);
+				follower->error = ENOMEM;
+				return false;
+			}
+			memcpy(copy, record->data, follower->size);
+		}
+		follower->sorted[last] = record;
+		follower->fresh[last++] = copy ? (struct rdx_rb_node *)
+					  (copy + follower->offset) : NULL;
+	}
+
+	rdx_rb_batch_begin(follower->batch);
+	for (i = 0; i < last; i++) {
+		old = rdx_rb_find(node_of(follower, follower->sorted[i]), root);
+		if (old) {
+			rdx_rb_batch_erase(follower->batch, old);
+			follower->erased[nr_erased++] = old;
+		}
+		if (follower->fresh[i])
+			rdx_rb_batch_insert(follower->batch,
+					    follower->fresh[i]);
+	}
+	rdx_rb_batch_end(follower->batch);
+	while (nr_erased--)
+		free_copy(follower, follower->erased[nr_erased]);
+	follower->next_seq += nr;
+	return true;
+}
+
+/* Records leave the ring only once applied, so a failed batch comes again */
+int rdx_rb_follower_poll(struct rdx_rb_follower *follower,
+			 struct rdx_rb_feed *feed)
+{
+	size_t nr = rdx_rb_feed_peek(feed, follower->buffer,
+				     follower->max_batch);
+
+	if (nr && !rdx_rb_follower_apply(follower, follower->buffer, nr))
+		return false;
+	rdx_rb_feed_consume(feed, nr);
+	return true;
+}
+
+int rdx_rb_follower_receive(struct rdx_rb_follower *follower, int fd)
+{
+	size_t size = follower->record_size, nr;
+	ssize_t got;
+
+	/* Whole records left over are a batch that failed, to try again */
+	if (follower->filled < size) {
+		do
+			got = read(fd, follower->buffer + follower->filled,
+				   follower->max_batch * size -
+				   follower->filled);
+		while (got < 0 && errno == EINTR);
+		if (got <= 0) {
+			/* Ending halfway through a record is an error too */
+			follower->error = got < 0 ? errno :
+					  follower->filled ? EPIPE : 0;
+			return false;
+		}
+		follower->filled += got;
+	}
+
+	nr = follower->filled / size;
+	if (nr && !rdx_rb_follower_apply(follower, follower->buffer, nr))
+		return false;
+	follower->filled -= nr * size;
+	memmove(follower->buffer, follower->buffer + nr * size,
+		follower->filled);
+	return true;
+}
@@ -0,0 +1,148 @@
+/*
+  Red Black Trees - change feeds
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_FEED_H
+#define _RDX_RBTREE_FEED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree.h"
+
+/*
+ * A stream of the changes made to a tree, for followers to keep copies of
+ * it up to date with. With a feed on the root, the generated _insert,
+ * _erase, _upsert and _update, and rdx_rb_batch_*() with every front end
+ * on top of it, append a record of every change to a ring of @capacity
+ * records: a sequence number, what happened, and the @size bytes of the
+ * container, which has its rdx_rb_node @offset bytes in. As in
+ * rbtree_replicated.h these are plain bytes, so containers must not point
+ * into themselves.
+ *
+ * The ring takes one writer, the tree's, and one reader, without locks,
+ * and holds no pointers, so it can sit in memory shared between
+ * processes. A writer that finds it full waits for the reader. The reader
+ * takes records straight off the ring, or passes them down a pipe or
+ * socket with rdx_rb_feed_send().
+ *
+ * The follower side applies records to a tree of its own as
+ * rdx_rb_batch_*() batches. Each batch is sorted by key, and only the
+ * last change to each key is applied. Followers own their nodes, which
+ * are malloc()ed copies of the records: free() them. Sequence numbers
+ * must follow on from one batch to the next, and a gap is an error that
+ * only a fresh copy of the tree can fix.
+ */
+
+#define RDX_RB_FEED_INSERT	1
+#define RDX_RB_FEED_ERASE	2
+#define RDX_RB_FEED_UPDATE	3
+
+struct rdx_rb_feed_record {
+	uint64_t seq;
+	uint32_t op, reserved;
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+#define RDX_RB_FEED_RECORD_SIZE(size)					\
+	((sizeof(struct rdx_rb_feed_record) + (size) + 15) & ~(size_t)15)
+
+struct rdx_rb_feed {
+	uint64_t capacity, size, offset, record_size;
+	/* The writer's: the next record to append, and @tail as last seen */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail_seen;
+	/* The reader's: the next record to take, and @head as last seen */
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t head_seen;
+	unsigned char records[] __attribute__((aligned(64)));
+};
+
+/* How much memory a feed takes */
+#define RDX_RB_FEED_BYTES(capacity, size)				\
+	(sizeof(struct rdx_rb_feed) +					\
+	 (capacity) * RDX_RB_FEED_RECORD_SIZE(size))
+
+extern void rdx_rb_feed_init(struct rdx_rb_feed *feed, size_t capacity,
+			     size_t size, size_t offset);
+
+/* For the generated functions */
+extern void rdx_rb_feed_append(struct rdx_rb_feed *feed, int op,
+			       const struct rdx_rb_node *node);
+
+/*
+ * Copy up to @max records into @records, returning how many. Peeking
+ * leaves them on the ring until rdx_rb_feed_consume() takes the first @nr
+ * off; reading does both.
+ */
+extern size_t rdx_rb_feed_peek(struct rdx_rb_feed *feed, void *records,
+			       size_t max);
+extern void rdx_rb_feed_consume(struct rdx_rb_feed *feed, size_t nr);
+extern size_t rdx_rb_feed_read(struct rdx_rb_feed *feed, void *records,
+			       size_t max);
+/* Write every record there is to @fd. False on a write error */
+extern int rdx_rb_feed_send(struct rdx_rb_feed *feed, int fd);
+
+struct rdx_rb_batch;
+struct rdx_rb_augment_callbacks;
+
+struct rdx_rb_follower {
+	struct rdx_rb_root *root;
+	size_t size, offset, record_size, max_batch;
+	/* The sequence number the next record must have */
+	uint64_t next_seq;
+	struct rdx_rb_batch *batch;
+	/* Room for @max_batch records, @filled bytes of them from a pipe */
+	unsigned char *buffer;
+	size_t filled;
+	const struct rdx_rb_feed_record **sorted;
+	struct rdx_rb_node **fresh, **erased;
+	/* Why the last call failed, 0 for the end of the stream */
+	int error;
+};
+
+/* @augment may be NULL for a plain tree. False if out of memory */
+extern int
+rdx_rb_follower_init(struct rdx_rb_follower *follower,
+		     struct rdx_rb_root *root,
+		     const struct rdx_rb_augment_callbacks *augment,
+		     size_t size, size_t offset, size_t max_batch);
+extern void rdx_rb_follower_destroy(struct rdx_rb_follower *follower);
+
+/*
+ * Apply @nr records, at most @max_batch, as one batch. False, with nothing
+ * applied, on a gap in the sequence numbers or out of memory.
+ */
+extern int
+rdx_rb_follower_apply(struct rdx_rb_follower *follower, const void *records,
+		      size_t nr);
+/*
+ * Apply whatever the feed has, up to @max_batch records. Records that fail
+ * to apply stay on the ring, or in the buffer when received, for the next
+ * call to try again.
+ */
+extern int
+rdx_rb_follower_poll(struct rdx_rb_follower *follower,
+		     struct rdx_rb_feed *feed);
+/*
+ * Read once from @fd and apply the records that came, or those that
+ * failed to apply last time without reading. False at the end.
+ */
+extern int
+rdx_rb_follower_receive(struct rdx_rb_follower *follower, int fd);
+
+#endif	/* _RDX_RBTREE_FEED_H */
@@ -0,0 +1,516 @@
+/*
+  Red Black Trees - file-backed trees
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+/* Ahead of <sys/stat.h>, whose <linux/stddef.h> would hide our own */
+#include "rbtree_file.h"
+#include "kernel.h"
+#include "rbtree_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * File layout: the super block in the first page, then the redo log, then
+ * the nodes, each a struct rdx_rb_onode followed by the record and padded
+ * to 8 bytes. Nodes come off a free list threaded through their left
+ * links, or else from the end of the used space; the file doubles when
+ * that runs out.
+ *
+ * A commit writes the log as a header and a list of ranges of the file,
+ * each with its new contents: the super block, then runs of changed nodes.
+ * The header checksum (a CRC32) covers everything after the header, so a
+ * log torn by a crash is told apart and ignored, the nodes themselves
+ * having not been touched yet.
+ */
+
+#define FILE_MAGIC	"RDXRBFL1"
+#define LOG_MAGIC	"RDXRBLG1"
+#define FILE_PAGE	4096
+#define FILE_LOG	(1 << 20)
+#define FILE_INITIAL	(16 * FILE_PAGE)
+/* More nodes than a single change could touch in a tree of 2^64 */
+#define FILE_TOUCHES	512
+
+struct rdx_rb_file_super {
+	char magic[8];
+	uint64_t record_size, log_offset, log_size, data_offset;
+	uint64_t root, free, end, count;
+};
+
+struct log_header {
+	char magic[8];
+	uint64_t nr_ranges, len;
+	uint32_t crc, unused;
+};
+
+struct log_range {
+	uint64_t offset, len;
+};
+
+
+static inline void *record_of(struct rdx_rb_file *file, uint64_t node)
+{
+	return file->base + node + sizeof(struct rdx_rb_onode);
+}
+
+static inline uint64_t node_of(struct rdx_rb_file *file, const void *record)
+{
+	return (const unsigned char *)record - file->base -
+	       sizeof(struct rdx_rb_onode);
+}
+
+static int compare_node(const void *key, const struct rdx_rb_onode *node,
+			void *arg)
+{
+	struct rdx_rb_file *file = arg;
+
+	return file->compare(key, node + 1, file->arg);
+}
+
+/*
+ * Keeping track of changes
+ */
+
+static void mark_dirty(struct rdx_rb_file *file, uint64_t node)
+{
+	if (file->nr_dirty == file->dirty_capacity) {
+		size_t capacity = 2 * file->dirty_capacity + FILE_TOUCHES;
+		uint64_t *dirty = realloc(file->dirty,
+					  capacity * sizeof(*dirty));
+		if (!dirty) {
+			file->error = true;
+			return;
+		}
+		file->dirty = dirty;
+		file->dirty_capacity = capacity;
+	}
+	file->dirty[file->nr_dirty++] = node;
+}
+
+static void file_touch(struct rdx_rb_otree *tree, uint64_t node)
+{
+	mark_dirty(container_of(tree, struct rdx_rb_file, tree), node);
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static void dedup_dirty(struct rdx_rb_file *file)
+{
+	size_t i, n = 0;
+
+	qsort(file->dirty, file->nr_dirty, sizeof(*file->dirty),
+	      compare_offsets);
+	for (i = 0; i < file->nr_dirty; i++)
+		if (!n || file->dirty[i] != file->dirty[n - 1])
+			file->dirty[n++] = file->dirty[i];
+	file->nr_dirty = n;
+}
+
+/* The next run of consecutive dirty nodes, from *@i on */
+static uint64_t next_run(struct rdx_rb_file *file, size_t *i, uint64_t *len)
+{
+	uint64_t start = file->dirty[(*i)++];
+
+	*len = file->node_size;
+	while (*i < file->nr_dirty && file->dirty[*i] == start + *len) {
+		*len += file->node_size;
+		++*i;
+	}
+	return start;
+}
+
+/*
+ * Committing: log, sync, write the ranges in place, sync. The log is only
+ * overwritten by the next commit, after that second sync.
+ */
+
+static int write_log(struct rdx_rb_file *file)
+{
+	struct log_header header = { LOG_MAGIC };
+	size_t len = sizeof(struct log_range) +
+		     ALIGN8(sizeof(*file->super)), i = 0;
+	unsigned char *log, *p;
+	struct log_range *range;
+	int ok;
+
+	len += file->nr_dirty * (sizeof(*range) + file->node_size);
+	log = malloc(len);
+	if (!log)
+		return false;
+
+	range = (struct log_range *)log;
+	range->offset = 0;
+	range->len = sizeof(*file->super);
+	memcpy(range + 1, file->super, sizeof(*file->super));
+	p = (unsigned char *)(range + 1) + ALIGN8(sizeof(*file->super));
+	header.nr_ranges = 1;
+	while (i < file->nr_dirty) {
+		range = (struct log_range *)p;
+		range->offset = next_run(file, &i, &range->len);
+		memcpy(range + 1, file->base + range->offset, range->len);
+		p = (unsigned char *)(range + 1) + range->len;
+		header.nr_ranges++;
+	}
+	header.len = p - log;
+	header.crc = checksum(log, header.len);
+
+	ok = write_all(file->fd, log, header.len,
+		       file->super->log_offset + sizeof(header)) &&
+	     write_all(file->fd, &header, sizeof(header),
+		       file->super->log_offset) &&
+	     !fdatasync(file->fd);
+	free(log);
+	return ok;
+}
+
+/*
+ * Once in place, the changes are in the page cache, so the private copies
+ * of the pages they were made to can go, and with them the memory.
+ */
+static void drop_private(struct rdx_rb_file *file, uint64_t start, uint64_t len)
+{
+	uint64_t end = start + len;
+
+	start &= ~(uint64_t)(FILE_PAGE - 1);
+	end = (end + FILE_PAGE - 1) & ~(uint64_t)(FILE_PAGE - 1);
+	madvise(file->base + start, end - start, MADV_DONTNEED);
+}
+
+static int write_home(struct rdx_rb_file *file)
+{
+	uint64_t start, len;
+	size_t i = 0;
+	int ok = write_all(file->fd, file->super, sizeof(*file->super), 0);
+
+	while (ok && i < file->nr_dirty) {
+		start = next_run(file, &i, &len);
+		ok = write_all(file->fd, file->base + start, len, start);
+	}
+	ok = ok && !fdatasync(file->fd);
+	if (!ok)
+		return false;
+
+	drop_private(file, 0, sizeof(*file->super));
+	for (i = 0; i < file->nr_dirty; ) {
+		start = next_run(file, &i, &len);
+		drop_private(file, start, len);
+	}
+	return true;
+}
+
+int rdx_rb_file_commit(struct rdx_rb_file *file)
+{
+	if (file->error)
+		return false;
+	if (!file->nr_dirty)
+		return true;
+	dedup_dirty(file);
+	if (!write_log(file) || !write_home(file)) {
+		file->error = true;
+		return false;
+	}
+	file->nr_dirty = 0;
+	return true;
+}
+
+/* Make sure the log has room for one more change */
+static int reserve(struct rdx_rb_file *file)
+{
+	if (file->error)
+		return false;
+	if (file->nr_dirty + FILE_TOUCHES <= file->log_capacity)
+		return true;
+	dedup_dirty(file);
+	if (file->nr_dirty + FILE_TOUCHES <= file->log_capacity)
+		return true;
+	return rdx_rb_file_commit(file);
+}
+
+/*
+ * Allocation
+ */
+
+static int grow(struct rdx_rb_file *file)
+{
+	uint64_t size = 2 * file->size;
+	void *base;
+
+	if (ftruncate(file->fd, size))
+		return false;
+	/* Moving keeps the private pages, and so the uncommitted changes */
+	base = mremap(file->base, file->size, size, MREMAP_MAYMOVE);
+	if (base == MAP_FAILED)
+		return false;
+	file->base = base;
+	file->size = size;
+	file->super = base;
+	file->tree.base = base;
+	file->tree.root = &file->super->root;
+	return true;
+}
+
+static uint64_t alloc_node(struct rdx_rb_file *file)
+{
+	struct rdx_rb_file_super *super = file->super;
+	uint64_t node = super->free;
+
+	if (node) {
+		super->free = RDX_RB_ONODE(&file->tree, node)->left;
+		return node;
+	}
+	if (super->end + file->node_size > file->size) {
+		if (!grow(file))
+			return 0;
+		super = file->super;
+	}
+	node = super->end;
+	super->end += file->node_size;
+	return node;
+}
+
+static void free_node(struct rdx_rb_file *file, uint64_t node)
+{
+	mark_dirty(file, node);
+	RDX_RB_ONODE(&file->tree, node)->left = file->super->free;
+	file->super->free = node;
+}
+
+/*
+ * Opening
+ */
+
+static int create(struct rdx_rb_file *file, size_t record_size,
+		  size_t log_size)
+{
+	struct rdx_rb_file_super super = { FILE_MAGIC, record_size };
+
+	super.log_offset = FILE_PAGE;
+	super.log_size = log_size;
+	super.data_offset = FILE_PAGE + ((log_size + FILE_PAGE - 1) &
+					 ~(uint64_t)(FILE_PAGE - 1));
+	super.end = super.data_offset;
+	return !ftruncate(file->fd, super.data_offset + FILE_INITIAL) &&
+	       write_all(file->fd, &super, sizeof(super), 0) &&
+	       !fdatasync(file->fd);
+}
+
+/* Redo the last commit, in case it did not get to the end */
+static int replay(struct rdx_rb_file *file, struct rdx_rb_file_super *super,
+		  uint64_t size)
+{
+	struct log_header header;
+	unsigned char *log, *p;
+	uint64_t i;
+	int ok;
+
+	if (!read_all(file->fd, &header, sizeof(header), super->log_offset))
+		return false;
+	if (memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)))
+		return true;
+	/* Torn, and so never applied: nothing to redo */
+	if (header.len > super->log_size - sizeof(header))
+		return true;
+	log = malloc(header.len + 1);
+	if (!log || !read_all(file->fd, log, header.len,
+			      super->log_offset + sizeof(header))) {
+		free(log);
+		return false;
+	}
+	if (checksum(log, header.len) != header.crc) {
+		free(log);
+		return true;
+	}
+
+	ok = true;
+	for (p = log, i = 0; ok && i < header.nr_ranges; i++) {
+		struct log_range *range = (struct log_range *)p;
+
+		ok = (size_t)(log + header.len - p) >= sizeof(*range) &&
+		     range->len <= (size_t)(log + header.len - p) -
+				   sizeof(*range) &&
+		     range->offset + range->len <= size &&
+		     write_all(file->fd, range + 1, range->len, range->offset);
+		p = (unsigned char *)(range + 1) + ALIGN8(range->len);
+	}
+	free(log);
+	return ok && !fdatasync(file->fd);
+}
+
+int rdx_rb_file_open(struct rdx_rb_file *file, const char *path,
+		     size_t record_size,
+		     int (*compare)(const void *a, const void *b, void *arg),
+		     void *arg, size_t log_size)
+{
+	struct rdx_rb_file_super super;
+	struct stat st;
+
+	memset(file, 0, sizeof(*file));
+	file->record_size = record_size;
+	file->node_size = ALIGN8(sizeof(struct rdx_rb_onode) + record_size);
+	file->compare = compare;
+	file->arg = arg;
+	if (!log_size)
+		log_size = FILE_LOG;
+
+	file->fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (file->fd < 0)
+		return false;
+	if (fstat(file->fd, &st) ||
+	    (!st.st_size && !create(file, record_size, log_size)) ||
+	    fstat(file->fd, &st) ||
+	    !read_all(file->fd, &super, sizeof(super), 0) ||
+	    memcmp(super.magic, FILE_MAGIC, sizeof(super.magic)) ||
+	    super.record_size != record_size ||
+	    super.log_offset < sizeof(super) ||
+	    super.log_size <= sizeof(struct log_header) ||
+	    super.data_offset < super.log_offset + super.log_size ||
+	    !replay(file, &super, st.st_size))
+		goto fail;
+
+	file->size = st.st_size;
+	file->base = mmap(NULL, file->size, PROT_READ | PROT_WRITE,
+			  MAP_PRIVATE, file->fd, 0);
+	if (file->base == MAP_FAILED)
+		goto fail;
+	file->super = (struct rdx_rb_file_super *)file->base;
+	file->tree.base = file->base;
+	file->tree.root = &file->super->root;
+	file->tree.touch = file_touch;
+	/* Every run of nodes may cost a range header, the super block one */
+	file->log_capacity = (file->super->log_size -
+			      sizeof(struct log_header) -
+			      sizeof(struct log_range) -
+			      ALIGN8(sizeof(super))) /
+			     (sizeof(struct log_range) + file->node_size);
+	if (file->log_capacity >= 2 * FILE_TOUCHES &&
+	    file->super->end <= file->size &&
+	    file->super->end >= file->super->data_offset)
+		return true;
+
+	munmap(file->base, file->size);
+fail:
+	close(file->fd);
+	return false;
+}
+
+int rdx_rb_file_close(struct rdx_rb_file *file)
+{
+	int ok = rdx_rb_file_commit(file);
+
+	munmap(file->base, file->size);
+	close(file->fd);
+	free(file->dirty);
+	return ok;
+}
+
+/*
+ * Changes and lookups
+ */
+
+int rdx_rb_file_insert(struct rdx_rb_file *file, const void *record)
+{
+	uint64_t parent, node;
+	int right;
+
+	if (!reserve(file) ||
+	    rdx_rb_olookup(&file->tree, record, compare_node, file, &parent,
+			   &right))
+		return false;
+	/* Might move the mapping, but offsets stay */
+	node = alloc_node(file);
+	if (!node)
+		return false;
+	memcpy(record_of(file, node), record, file->record_size);
+	rdx_rb_oinsert(&file->tree, node, parent, right);
+	file->super->count++;
+	return !file->error;
+}
+
+int rdx_rb_file_erase(struct rdx_rb_file *file, const void *key)
+{
+	uint64_t parent, node;
+	int right;
+
+	if (!reserve(file))
+		return false;
+	node = rdx_rb_olookup(&file->tree, key, compare_node, file, &parent,
+			      &right);
+	if (!node)
+		return false;
+	rdx_rb_oerase(&file->tree, node);
+	free_node(file, node);
+	file->super->count--;
+	return !file->error;
+}
+
+int rdx_rb_file_update(struct rdx_rb_file *file, const void *record)
+{
+	uint64_t parent, node;
+	int right;
+
+	if (!reserve(file))
+		return false;
+	node = rdx_rb_olookup(&file->tree, record, compare_node, file,
+			      &parent, &right);
+	if (!node)
+		return false;
+	mark_dirty(file, node);
+	memcpy(record_of(file, node), record, file->record_size);
+	return !file->error;
+}
+
+const void *rdx_rb_file_find(struct rdx_rb_file *file, const void *key)
+{
+	uint64_t parent;
+	int right;
+	uint64_t node = rdx_rb_olookup(&file->tree, key, compare_node, file,
+				       &parent, &right);
+
+	return node ? record_of(file, node) : NULL;
+}
+
+const void *rdx_rb_file_first(struct rdx_rb_file *file)
+{
+	uint64_t node = rdx_rb_ofirst(&file->tree);
+
+	return node ? record_of(file, node) : NULL;
+}
+
+const void *rdx_rb_file_next(struct rdx_rb_file *file, const void *record)
+{
+	uint64_t node = rdx_rb_onext(&file->tree, node_of(file, record));
+
+	return node ? record_of(file, node) : NULL;
+}
+
+uint64_t rdx_rb_file_count(struct rdx_rb_file *file)
+{
+	return file->super->count;
+}
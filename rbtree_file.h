@@ -0,0 +1,98 @@
+/*
+  Red Black Trees - file-backed trees
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_FILE_H
+#define _RDX_RBTREE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree_offset.h"
+
+/*
+ * A tree of fixed-size records that lives in a file and is changed in
+ * place: nodes are allocated from the file itself, which is mapped, and
+ * link to each other by offset, so opening the file gives the tree back as
+ * it was with nothing to rebuild.
+ *
+ * Changes are made to a private mapping, so none of them reach the file on
+ * their own. rdx_rb_file_commit() gathers every node changed since the
+ * last commit and writes them to a redo log in the file, then, once that is
+ * on disk, to their places; opening the file after a crash replays the log
+ * if it is complete. Either way the file holds the tree as of some commit.
+ * The log has room for a bounded number of nodes, and a run of changes too
+ * long for it gets committed in several parts.
+ *
+ * @compare orders records like memcmp(). Record pointers point into the
+ * mapping, and stay valid until the next insertion, which may move it, or
+ * the erasure of the record. Nothing here locks: one thread at a time.
+ */
+
+struct rdx_rb_file_super;
+
+struct rdx_rb_file {
+	int fd;
+	unsigned char *base;
+	uint64_t size;
+	struct rdx_rb_file_super *super;
+	struct rdx_rb_otree tree;
+	size_t record_size, node_size;
+	int (*compare)(const void *a, const void *b, void *arg);
+	void *arg;
+	/* Nodes changed since the last commit, and how many the log takes */
+	uint64_t *dirty;
+	size_t nr_dirty, dirty_capacity, log_capacity;
+	int error;
+};
+
+/*
+ * Open the tree in @path, creating it if need be with a redo log of
+ * @log_size bytes (0 picks a default). Returns false on I/O errors, running
+ * out of memory, or a file that is not such a tree of @record_size records.
+ */
+extern int
+rdx_rb_file_open(struct rdx_rb_file *file, const char *path,
+		 size_t record_size,
+		 int (*compare)(const void *a, const void *b, void *arg),
+		 void *arg, size_t log_size);
+/* Commits, then closes */
+extern int rdx_rb_file_close(struct rdx_rb_file *file);
+
+/*
+ * Insertion copies @record in, returning false if one with the same key is
+ * there already or on failure. Erasure returns false if there is none such.
+ * Updating overwrites the record with the key of @record, which must not be
+ * reordered by the change, and returns false if there is none.
+ */
+extern int rdx_rb_file_insert(struct rdx_rb_file *file, const void *record);
+extern int rdx_rb_file_erase(struct rdx_rb_file *file, const void *key);
+extern int rdx_rb_file_update(struct rdx_rb_file *file, const void *record);
+extern const void *rdx_rb_file_find(struct rdx_rb_file *file, const void *key);
+
+extern const void *rdx_rb_file_first(struct rdx_rb_file *file);
+extern const void *rdx_rb_file_next(struct rdx_rb_file *file,
+				    const void *record);
+extern uint64_t rdx_rb_file_count(struct rdx_rb_file *file);
+
+/*
+ * Make every change so far durable. Returns false if writing failed, now or
+ * at an earlier commit, or if a change was lost for lack of space.
+ */
+extern int rdx_rb_file_commit(struct rdx_rb_file *file);
+
+#endif	/* _RDX_RBTREE_FILE_H */
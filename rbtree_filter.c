@@ -0,0 +1,121 @@
+/*
+  Red Black Trees - membership filters
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbtree_filter.h"
+
+#define BITS_PER_KEY	16
+#define BLOCK_BITS	256
+#define MIN_CAPACITY	64
+#define CACHE_LINE	64
+
+static void set_bits(struct rdx_rb_filter *filter, struct rdx_rb_node *node)
+{
+	uint64_t hash = rdx_rb_filter_mix(filter->hash(node));
+	uint32_t *block = rdx_rb_filter_block(filter, hash);
+	int i;
+
+	for (i = 0; i < 8; i++)
+		block[i] |= 1U << (((uint32_t)hash * rdx_rb_filter_salt[i]) >> 27);
+}
+
+/* Size the filter for twice @count and fill it from @root */
+static int build(struct rdx_rb_filter *filter, struct rdx_rb_root *root,
+		 size_t count)
+{
+	size_t capacity = count < MIN_CAPACITY / 2 ? MIN_CAPACITY : 2 * count;
+	size_t nr_blocks = capacity * BITS_PER_KEY / BLOCK_BITS;
+	struct rdx_rb_node *node;
+	void *blocks;
+
+	if (posix_memalign(&blocks, CACHE_LINE, nr_blocks * 8 * sizeof(uint32_t)))
+		return false;
+	free(filter->blocks);
+	filter->blocks = blocks;
+	filter->nr_blocks = nr_blocks;
+	filter->capacity = capacity;
+	filter->count = filter->stale = 0;
+	memset(blocks, 0, nr_blocks * 8 * sizeof(uint32_t));
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node)) {
+		set_bits(filter, node);
+		filter->count++;
+	}
+	return true;
+}
+
+int rdx_rb_filter_attach(struct rdx_rb_filter *filter, struct rdx_rb_root *root,
+			 uint64_t (*hash)(const struct rdx_rb_node *node))
+{
+	struct rdx_rb_node *node;
+	size_t count = 0;
+
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node))
+		count++;
+	filter->hash = hash;
+	filter->blocks = NULL;
+	if (!build(filter, root, count))
+		return false;
+	root->filter = filter;
+	return true;
+}
+
+void rdx_rb_filter_detach(struct rdx_rb_root *root)
+{
+	struct rdx_rb_filter *filter = root->filter;
+
+	if (!filter)
+		return;
+	root->filter = NULL;
+	free(filter->blocks);
+	filter->blocks = NULL;
+	filter->nr_blocks = filter->count = filter->stale = 0;
+}
+
+int rdx_rb_filter_rebuild(struct rdx_rb_root *root)
+{
+	struct rdx_rb_node *node;
+	size_t count = 0;
+
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node))
+		count++;
+	return build(root->filter, root, count);
+}
+
+void rdx_rb_filter_add(struct rdx_rb_root *root, struct rdx_rb_node *node)
+{
+	struct rdx_rb_filter *filter = root->filter;
+
+	/* @node is in the tree already, so a rebuild picks it up */
+	if (filter->count + filter->stale >= filter->capacity &&
+	    build(filter, root, filter->count + 1))
+		return;
+	/* Or keep going overloaded: more false positives, never a miss */
+	set_bits(filter, node);
+	filter->count++;
+}
+
+void rdx_rb_filter_remove(struct rdx_rb_root *root)
+{
+	struct rdx_rb_filter *filter = root->filter;
+
+	filter->count--;
+	if (++filter->stale > filter->count && filter->stale >= MIN_CAPACITY)
+		build(filter, root, filter->count);
+}
@@ -0,0 +1,99 @@
+/*
+  Red Black Trees - membership filters
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_FILTER_H
+#define _RDX_RBTREE_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree.h"
+
+/*
+ * A blocked Bloom filter in front of a tree, so that a lookup of a key the
+ * tree does not hold mostly ends before the descent. Every key sets 8 bits
+ * in one 32 byte block, one in each of its words, so a probe touches a
+ * single cache line. At 16 bits a key, about 1 in 500 misses gets through.
+ *
+ * @hash maps a node to a hash of its key, the same for nodes strict_compare
+ * finds equal. Once attached, rdx_rb_find(), the generated _insert,
+ * _erase, _find and _upsert, and rdx_rb_batch_*() with every front end on
+ * top of it keep to it. A Bloom filter cannot forget a key, so an erase
+ * only counts the bits it leaves behind, and the filter is built again
+ * once they outnumber the live keys. Anything else that adds
+ * nodes, rdx_rb_insert() itself, _build, _join and the like, must be
+ * followed by rdx_rb_filter_rebuild().
+ */
+
+struct rdx_rb_filter {
+	uint64_t (*hash)(const struct rdx_rb_node *node);
+	uint32_t *blocks;
+	size_t nr_blocks;
+	/* Keys in the tree, keys it was sized for, erased keys still in it */
+	size_t count, capacity, stale;
+};
+
+/* Build a filter of what @root holds and attach it. False on no memory */
+extern int
+rdx_rb_filter_attach(struct rdx_rb_filter *filter, struct rdx_rb_root *root,
+		     uint64_t (*hash)(const struct rdx_rb_node *node));
+extern void rdx_rb_filter_detach(struct rdx_rb_root *root);
+extern int rdx_rb_filter_rebuild(struct rdx_rb_root *root);
+
+/* For the generated _insert and _erase */
+extern void rdx_rb_filter_add(struct rdx_rb_root *root,
+			      struct rdx_rb_node *node);
+extern void rdx_rb_filter_remove(struct rdx_rb_root *root);
+
+static const uint32_t rdx_rb_filter_salt[8] = {
+	0x47b6137b, 0x44974d91, 0x8824ad5b, 0xa2b7289d,
+	0x705495c7, 0x2df1424b, 0x9efc4947, 0x5c6bfb31
+};
+
+static inline uint64_t rdx_rb_filter_mix(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	return hash ^ (hash >> 33);
+}
+
+/* The high half picks the block, the low half a bit in each word */
+static inline uint32_t *
+rdx_rb_filter_block(const struct rdx_rb_filter *filter, uint64_t hash)
+{
+	return filter->blocks + 8 * (((hash >> 32) * filter->nr_blocks) >> 32);
+}
+
+/* False when @node's key is certainly not in the tree */
+static inline int rdx_rb_filter_may_contain(const struct rdx_rb_filter *filter,
+					    const struct rdx_rb_node *node)
+{
+	uint64_t hash = rdx_rb_filter_mix(filter->hash(node));
+	const uint32_t *block = rdx_rb_filter_block(filter, hash);
+	uint32_t missing = 0;
+	int i;
+
+	for (i = 0; i < 8; i++)
+		missing |= ~block[i] &
+			   (1U << (((uint32_t)hash * rdx_rb_filter_salt[i]) >> 27));
+	return !missing;
+}
+
+#endif	/* _RDX_RBTREE_FILTER_H */
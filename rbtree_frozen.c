@@ -0,0 +1,136 @@
+/*
+  Red Black Trees - frozen copies
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+
+#include "rbtree_augmented.h"
+#include "rbtree_frozen.h"
+
+#define ALIGN16(x)	(((x) + 15) & ~(size_t)15)
+
+static inline void *aggregate_of(struct rdx_rb_frozen *frozen, size_t i)
+{
+	return frozen->aggregates + i * frozen->aggregate_stride;
+}
+
+int rdx_rb_freeze(struct rdx_rb_frozen *frozen, struct rdx_rb_root *root,
+		  const struct rdx_rb_frozen_ops *ops, void *arg)
+{
+	struct rdx_rb_node *node;
+	size_t count = 0, i;
+
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node))
+		count++;
+
+	frozen->ops = ops;
+	frozen->arg = arg;
+	frozen->count = count;
+	frozen->payload_stride = ALIGN16(ops->payload_size);
+	frozen->aggregate_stride = ALIGN16(ops->aggregate_size);
+	frozen->keys = __rdx_rb_calloc_lines(count + 1, sizeof(*frozen->keys));
+	frozen->nodes = malloc((count + 1) * sizeof(*frozen->nodes));
+	frozen->payloads = __rdx_rb_calloc_lines(count + 1,
+						 frozen->payload_stride);
+	frozen->aggregates =
+		__rdx_rb_calloc_lines(count + 1, frozen->aggregate_stride);
+	if (!frozen->keys || !frozen->nodes || !frozen->payloads ||
+	    !frozen->aggregates) {
+		rdx_rb_frozen_destroy(frozen);
+		return false;
+	}
+
+	/* Walk both in order at once */
+	frozen->keys[0] = 0;
+	frozen->nodes[0] = NULL;
+	i = rdx_rb_frozen_first(frozen);
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node)) {
+		frozen->keys[i] = ops->key(node, arg);
+		frozen->nodes[i] = node;
+		if (ops->payload_size)
+			ops->payload(node, frozen->payloads +
+					   i * frozen->payload_stride, arg);
+		i = rdx_rb_frozen_next(frozen, i);
+	}
+
+	/* Children first */
+	if (ops->aggregate_size)
+		for (i = count; i; i--) {
+			void *acc = aggregate_of(frozen, i);
+
+			ops->init(acc, arg);
+			if (2 * i <= count)
+				ops->combine(acc, aggregate_of(frozen, 2 * i),
+					     arg);
+			ops->accumulate(acc, frozen->keys[i],
+					rdx_rb_frozen_payload(frozen, i), arg);
+			if (2 * i + 1 <= count)
+				ops->combine(acc,
+					     aggregate_of(frozen, 2 * i + 1),
+					     arg);
+		}
+	return true;
+}
+
+void rdx_rb_frozen_destroy(struct rdx_rb_frozen *frozen)
+{
+	free(frozen->keys);
+	free(frozen->nodes);
+	free(frozen->payloads);
+	free(frozen->aggregates);
+	frozen->keys = NULL;
+	frozen->nodes = NULL;
+	frozen->payloads = frozen->aggregates = NULL;
+	frozen->count = 0;
+}
+
+/* As in rbtree_mvcc.c, over the implicit tree */
+static void aggregate_range(struct rdx_rb_frozen *frozen, void *acc,
+			    size_t i, uint64_t first, uint64_t last,
+			    int lower, int upper)
+{
+	const struct rdx_rb_frozen_ops *ops = frozen->ops;
+
+	while (i <= frozen->count) {
+		if (!lower && !upper) {
+			ops->combine(acc, aggregate_of(frozen, i), frozen->arg);
+			return;
+		}
+		if (lower && frozen->keys[i] < first) {
+			i = 2 * i + 1;
+		} else if (upper && frozen->keys[i] > last) {
+			i = 2 * i;
+		} else {
+			aggregate_range(frozen, acc, 2 * i, first, last,
+					lower, false);
+			ops->accumulate(acc, frozen->keys[i],
+					rdx_rb_frozen_payload(frozen, i),
+					frozen->arg);
+			lower = false;
+			i = 2 * i + 1;
+		}
+	}
+}
+
+void rdx_rb_frozen_aggregate(struct rdx_rb_frozen *frozen, uint64_t first,
+			     uint64_t last, void *result)
+{
+	if (!frozen->ops->aggregate_size)
+		return;
+	frozen->ops->init(result, frozen->arg);
+	aggregate_range(frozen, result, 1, first, last, true, true);
+}
@@ -0,0 +1,172 @@
+/*
+  Red Black Trees - frozen copies
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_FROZEN_H
+#define _RDX_RBTREE_FROZEN_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree.h"
+
+/*
+ * A read-only copy of a tree for trees built once and searched from then
+ * on. The keys go into an array in Eytzinger order, the order of a
+ * breadth-first walk of a complete tree: entry i has its children at 2i
+ * and 2i + 1, starting from 1. A search then takes no branches but the
+ * loop, touches one cache line per level at most, and fetches the lines
+ * four levels down ahead of time.
+ *
+ * @key maps nodes to keys in the order of the tree, equivalent nodes to
+ * the same key. Next to the keys, in the same order, go the nodes
+ * themselves, a copy of the @payload_size bytes @payload writes for each,
+ * and if @aggregate_size is not 0, the aggregate of every implicit subtree
+ * under @init, @accumulate and @combine, for range aggregates in O(log n).
+ *
+ * Searches give an index, 0 for none, to look up the key, node or payload
+ * at. The copy does not follow changes to the tree.
+ */
+
+struct rdx_rb_frozen_ops {
+	size_t payload_size, aggregate_size;
+	uint64_t (*key)(const struct rdx_rb_node *node, void *arg);
+	void (*payload)(const struct rdx_rb_node *node, void *payload,
+			void *arg);
+	void (*init)(void *acc, void *arg);
+	void (*accumulate)(void *acc, uint64_t key, const void *payload,
+			   void *arg);
+	void (*combine)(void *acc, const void *other, void *arg);
+};
+
+struct rdx_rb_frozen {
+	const struct rdx_rb_frozen_ops *ops;
+	void *arg;
+	size_t count;
+	/* From 1 to count */
+	uint64_t *keys;
+	struct rdx_rb_node **nodes;
+	unsigned char *payloads, *aggregates;
+	size_t payload_stride, aggregate_stride;
+};
+
+/* Returns false when out of memory */
+extern int
+rdx_rb_freeze(struct rdx_rb_frozen *frozen, struct rdx_rb_root *root,
+	      const struct rdx_rb_frozen_ops *ops, void *arg);
+extern void rdx_rb_frozen_destroy(struct rdx_rb_frozen *frozen);
+
+/* Set @result to the aggregate of every key from @first to @last */
+extern void
+rdx_rb_frozen_aggregate(struct rdx_rb_frozen *frozen, uint64_t first,
+			uint64_t last, void *result);
+
+static inline void rdx_rb_frozen_prefetch(const struct rdx_rb_frozen *frozen,
+					  size_t i)
+{
+	__builtin_prefetch(frozen->keys + 16 * i);
+	__builtin_prefetch(frozen->keys + 16 * i + 8);
+}
+
+/*
+ * The first entry at or above @key, as rdx_rb_leftmost_greater_equiv().
+ * The path taken is the bits of i, a 1 for every step right; the answer
+ * is where it last went left, so drop the trailing 1s and one 0 after.
+ */
+static inline size_t
+rdx_rb_frozen_greater_equiv(const struct rdx_rb_frozen *frozen, uint64_t key)
+{
+	size_t i = 1;
+
+	while (i <= frozen->count) {
+		rdx_rb_frozen_prefetch(frozen, i);
+		i = 2 * i + (frozen->keys[i] < key);
+	}
+	return i >> __builtin_ffsll(~(long long)i);
+}
+
+/* The last entry at or below @key, as rdx_rb_rightmost_less_equiv() */
+static inline size_t
+rdx_rb_frozen_less_equiv(const struct rdx_rb_frozen *frozen, uint64_t key)
+{
+	size_t i = 1;
+
+	while (i <= frozen->count) {
+		rdx_rb_frozen_prefetch(frozen, i);
+		i = 2 * i + (frozen->keys[i] <= key);
+	}
+	return i >> __builtin_ffsll(i);
+}
+
+/* In order, 0 past either end */
+static inline size_t rdx_rb_frozen_first(const struct rdx_rb_frozen *frozen)
+{
+	size_t i = frozen->count ? 1 : 0;
+
+	while (i && 2 * i <= frozen->count)
+		i *= 2;
+	return i;
+}
+
+static inline size_t rdx_rb_frozen_last(const struct rdx_rb_frozen *frozen)
+{
+	size_t i = frozen->count ? 1 : 0;
+
+	while (i && 2 * i + 1 <= frozen->count)
+		i = 2 * i + 1;
+	return i;
+}
+
+static inline size_t rdx_rb_frozen_next(const struct rdx_rb_frozen *frozen,
+					size_t i)
+{
+	if (2 * i + 1 > frozen->count)
+		return i >> __builtin_ffsll(~(long long)i);
+	for (i = 2 * i + 1; 2 * i <= frozen->count; i *= 2)
+		;
+	return i;
+}
+
+static inline size_t rdx_rb_frozen_prev(const struct rdx_rb_frozen *frozen,
+					size_t i)
+{
+	if (2 * i > frozen->count)
+		return i >> __builtin_ffsll(i);
+	for (i = 2 * i; 2 * i + 1 <= frozen->count; i = 2 * i + 1)
+		;
+	return i;
+}
+
+static inline uint64_t rdx_rb_frozen_key(const struct rdx_rb_frozen *frozen,
+					 size_t i)
+{
+	return frozen->keys[i];
+}
+
+static inline struct rdx_rb_node *
+rdx_rb_frozen_node(const struct rdx_rb_frozen *frozen, size_t i)
+{
+	return frozen->nodes[i];
+}
+
+static inline const void *
+rdx_rb_frozen_payload(const struct rdx_rb_frozen *frozen, size_t i)
+{
+	return frozen->payloads + i * frozen->payload_stride;
+}
+
+#endif	/* _RDX_RBTREE_FROZEN_H */
@@ -0,0 +1,87 @@
+/*
+  Red Black Trees - file I/O helpers
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_IO_H
+#define _RDX_RBTREE_IO_H
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * Helpers shared by the trees that live in files, not part of the
+ * interface. Include after the public header, whose stddef.h must come
+ * first.
+ */
+
+#define ALIGN8(x)	(((x) + 7) & ~(uint64_t)7)
+
+/* All @len bytes at @offset, going on after short writes and interrupts */
+static inline int write_all(int fd, const void *data, size_t len,
+			    off_t offset)
+{
+	const char *p = data;
+
+	while (len) {
+		ssize_t done = pwrite(fd, p, len, offset);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += done;
+		len -= done;
+		offset += done;
+	}
+	return true;
+}
+
+/* The same for reading, where the end of the file is a failure */
+static inline int read_all(int fd, void *data, size_t len, off_t offset)
+{
+	char *p = data;
+
+	while (len) {
+		ssize_t done = pread(fd, p, len, offset);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return false;
+		p += done;
+		len -= done;
+		offset += done;
+	}
+	return true;
+}
+
+static inline uint32_t checksum(const void *data, size_t len)
+{
+	uint32_t crc = crc32(0, Z_NULL, 0);
+
+	/* zlib takes lengths as unsigned int */
+	while (len) {
+		unsigned int chunk = len > (1u << 30) ? 1u << 30 : len;
+		crc = crc32(crc, data, chunk);
+		data = (const char *)data + chunk;
+		len -= chunk;
+	}
+	return crc;
+}
+
+#endif	/* _RDX_RBTREE_IO_H */
@@ -0,0 +1,898 @@
+/*
+  Red Black Trees - write-ahead journal
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+/* Ahead of <sys/stat.h>, whose <linux/stddef.h> would hide our own */
+#include "rbtree_journal.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+/*
+ * The log is a sequence of records, each a header followed by the encoded
+ * node, numbered by log sequence numbers (LSNs) from 1 on. The checksum
+ * covers everything after itself. A checkpoint records the last LSN it
+ * includes, so that a crash between writing it and emptying the log only
+ * means skipping the records it already covers.
+ */
+
+enum { LOG_INSERT = 1, LOG_ERASE, LOG_UPDATE };
+
+struct log_header {
+	uint32_t crc;
+	uint32_t op;
+	uint64_t lsn;
+};
+
+#define MANIFEST_MAGIC	"RDXRBMF1"
+#define SEGMENT_MAGIC	"RDXRBSG1"
+#define SEGMENT_SIZE	4096
+
+/*
+ * These checksums cover whatever follows the header, then the header
+ * itself with crc zeroed.
+ */
+struct manifest_header {
+	char magic[8];
+	uint64_t record_size, nr_segments, lsn, next_id;
+	uint32_t crc, unused;
+};
+
+struct manifest_entry {
+	uint64_t id, count;
+};
+
+struct segment_header {
+	char magic[8];
+	uint64_t record_size, count, id;
+	uint32_t crc, unused;
+};
+
+/*
+ * CRC32C
+ */
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+	uint32_t i, j, crc;
+
+	for (i = 0; i < 256; i++) {
+		for (crc = i, j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc_table[i] = crc;
+	}
+}
+
+static uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	crc = ~crc;
+	while (len--)
+		crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+/*
+ * Files
+ */
+
+static int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len) {
+		ssize_t done = write(fd, p, len);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += done;
+		len -= done;
+	}
+	return true;
+}
+
+static int read_all(int fd, void *data, size_t len)
+{
+	char *p = data;
+
+	while (len) {
+		ssize_t done = read(fd, p, len);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return false;
+		p += done;
+		len -= done;
+	}
+	return true;
+}
+
+/* Make a rename or a creation in the directory of @path durable */
+static int sync_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir = slash ? strndup(path, slash - path + 1) : strdup(".");
+	int fd, result = false;
+
+	if (!dir)
+		return false;
+	fd = open(dir, O_RDONLY | O_DIRECTORY);
+	if (fd >= 0) {
+		result = !fsync(fd);
+		close(fd);
+	}
+	free(dir);
+	return result;
+}
+
+static char *manifest_path(struct rdx_rb_journal *journal, const char *suffix)
+{
+	char *name;
+
+	return asprintf(&name, "%s.manifest%s", journal->path, suffix) < 0 ?
+	       NULL : name;
+}
+
+static char *segment_path(struct rdx_rb_journal *journal, uint64_t id)
+{
+	char *name;
+
+	return asprintf(&name, "%s.%llu.seg", journal->path,
+			(unsigned long long)id) < 0 ? NULL : name;
+}
+
+/*
+ * Segments
+ *
+ * A segment covers the keys from its first one up to the first one of the
+ * next segment, the first segment also everything below. Changes mark the
+ * segment of their key dirty; those never seen by a checkpoint leave the
+ * first one dirty, which is as good since it is rewritten together with
+ * every dirty segment that follows it directly.
+ */
+
+static struct rdx_rb_journal_segment *
+segment_of(struct rdx_rb_journal *journal, struct rdx_rb_node *node)
+{
+	int (*compare)(struct rdx_rb_node *, struct rdx_rb_node *) =
+		journal->root->strict_compare;
+	size_t lo = 1, hi = journal->nr_segments;
+
+	if (!hi)
+		return NULL;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (compare(journal->segments[mid].first, node) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return &journal->segments[lo - 1];
+}
+
+static void mark_dirty(struct rdx_rb_journal *journal, struct rdx_rb_node *node)
+{
+	struct rdx_rb_journal_segment *segment = segment_of(journal, node);
+
+	if (segment)
+		segment->dirty = true;
+}
+
+static void free_segments(struct rdx_rb_journal *journal,
+			  struct rdx_rb_journal_segment *segments,
+			  size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		if (segments[i].first)
+			journal->ops->dispose(segments[i].first, journal->arg);
+	free(segments);
+}
+
+/*
+ * Recovery
+ */
+
+static struct rdx_rb_node *lookup(struct rdx_rb_root *root,
+				  struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node *node = root->rb_node;
+
+	while (node) {
+		int result = root->strict_compare(elem, node);
+		if (!result)
+			return node;
+		node = result < 0 ? node->rb_left : node->rb_right;
+	}
+	return NULL;
+}
+
+/* Decode the nodes of @segment into @nodes, and its first key once more */
+static int load_segment(struct rdx_rb_journal *journal,
+			struct rdx_rb_journal_segment *segment,
+			struct rdx_rb_node **nodes)
+{
+	const struct rdx_rb_journal_ops *ops = journal->ops;
+	size_t i, decoded = 0, len = segment->count * ops->record_size;
+	char *name = segment_path(journal, segment->id);
+	char *records = malloc(len + 1);
+	struct segment_header header;
+	uint32_t crc, expected;
+	int fd = name ? open(name, O_RDONLY) : -1, result = false;
+
+	free(name);
+	if (fd < 0 || !records || !read_all(fd, &header, sizeof(header)) ||
+	    memcmp(header.magic, SEGMENT_MAGIC, sizeof(header.magic)) ||
+	    header.record_size != ops->record_size ||
+	    header.count != segment->count || header.id != segment->id ||
+	    !segment->count || !read_all(fd, records, len))
+		goto out;
+	crc = crc32c(0, records, len);
+	expected = header.crc;
+	header.crc = 0;
+	if (crc32c(crc, &header, sizeof(header)) != expected)
+		goto out;
+
+	segment->first = ops->decode(records, journal->arg);
+	if (!segment->first)
+		goto out;
+	for (; decoded < segment->count; decoded++) {
+		nodes[decoded] = ops->decode(records + decoded * ops->record_size,
+					     journal->arg);
+		if (!nodes[decoded])
+			goto out;
+	}
+	result = true;
+out:
+	if (!result) {
+		for (i = 0; i < decoded; i++)
+			ops->dispose(nodes[i], journal->arg);
+		if (segment->first)
+			ops->dispose(segment->first, journal->arg);
+		segment->first = NULL;
+	}
+	free(records);
+	if (fd >= 0)
+		close(fd);
+	return result;
+}
+
+/* Load every segment the manifest lists and build the tree out of them */
+static int load_checkpoint(struct rdx_rb_journal *journal, uint64_t *lsn)
+{
+	const struct rdx_rb_journal_ops *ops = journal->ops;
+	struct rdx_rb_journal_segment *segments = NULL;
+	struct manifest_entry *entries = NULL;
+	struct rdx_rb_node **nodes = NULL;
+	struct manifest_header header;
+	char *name = manifest_path(journal, "");
+	size_t i, total = 0, loaded = 0;
+	uint32_t crc, expected;
+	struct stat st;
+	int fd, result = false;
+
+	*lsn = 0;
+	if (!name)
+		return false;
+	fd = open(name, O_RDONLY);
+	free(name);
+	if (fd < 0)
+		return errno == ENOENT;
+
+	if (fstat(fd, &st) || !read_all(fd, &header, sizeof(header)) ||
+	    memcmp(header.magic, MANIFEST_MAGIC, sizeof(header.magic)) ||
+	    header.record_size != ops->record_size ||
+	    (uint64_t)st.st_size != sizeof(header) +
+				     header.nr_segments * sizeof(*entries))
+		goto out;
+	entries = malloc(header.nr_segments * sizeof(*entries) + 1);
+	segments = calloc(header.nr_segments + 1, sizeof(*segments));
+	if (!entries || !segments ||
+	    !read_all(fd, entries, header.nr_segments * sizeof(*entries)))
+		goto out;
+	crc = crc32c(0, entries, header.nr_segments * sizeof(*entries));
+	expected = header.crc;
+	header.crc = 0;
+	if (crc32c(crc, &header, sizeof(header)) != expected)
+		goto out;
+
+	for (i = 0; i < header.nr_segments; i++) {
+		segments[i].id = entries[i].id;
+		segments[i].count = entries[i].count;
+		total += entries[i].count;
+	}
+	nodes = malloc(total * sizeof(*nodes) + 1);
+	if (!nodes)
+		goto out;
+	for (total = 0; loaded < header.nr_segments;
+	     total += segments[loaded++].count)
+		if (!load_segment(journal, &segments[loaded], nodes + total))
+			goto out;
+
+	if (journal->augment)
+		rdx_rb_build_sorted_augmented(nodes, total, journal->root, 1,
+					      journal->augment);
+	else
+		rdx_rb_build_sorted(nodes, total, journal->root, 1);
+	journal->segments = segments;
+	journal->nr_segments = header.nr_segments;
+	journal->next_id = header.next_id;
+	*lsn = header.lsn;
+	result = true;
+out:
+	if (!result) {
+		for (i = 0; i < total; i++)
+			ops->dispose(nodes[i], journal->arg);
+		free_segments(journal, segments, loaded);
+	}
+	free(nodes);
+	free(entries);
+	close(fd);
+	return result;
+}
+
+static int id_compare(const void *left, const void *right)
+{
+	uint64_t l = *(const uint64_t *)left, r = *(const uint64_t *)right;
+
+	return l < r ? -1 : l > r;
+}
+
+/*
+ * Remove the segment files no longer listed in the manifest, which a crash
+ * in the middle of a checkpoint leaves behind.
+ */
+static void remove_orphans(struct rdx_rb_journal *journal)
+{
+	const char *slash = strrchr(journal->path, '/');
+	const char *base = slash ? slash + 1 : journal->path;
+	char *dir = slash ? strndup(journal->path, slash - journal->path + 1)
+			  : strdup(".");
+	uint64_t *ids = malloc(journal->nr_segments * sizeof(*ids) + 1);
+	size_t i, len = strlen(base);
+	struct dirent *entry;
+	DIR *d = dir && ids ? opendir(dir) : NULL;
+
+	for (i = 0; d && i < journal->nr_segments; i++)
+		ids[i] = journal->segments[i].id;
+	if (d)
+		qsort(ids, journal->nr_segments, sizeof(*ids), id_compare);
+	while (d && (entry = readdir(d))) {
+		unsigned long long id;
+		uint64_t key;
+		int end = 0;
+
+		if (strncmp(entry->d_name, base, len) ||
+		    sscanf(entry->d_name + len, ".%llu.seg%n", &id, &end) != 1 ||
+		    !end || entry->d_name[len + end])
+			continue;
+		key = id;
+		if (!bsearch(&key, ids, journal->nr_segments, sizeof(*ids),
+			     id_compare))
+			unlinkat(dirfd(d), entry->d_name, 0);
+	}
+	if (d)
+		closedir(d);
+	free(ids);
+	free(dir);
+}
+
+struct replay_entry {
+	struct rdx_rb_node *node;
+	uint64_t lsn;
+	uint32_t op;
+};
+
+/* The tree being recovered by this thread, for entry_compare() */
+static __thread struct rdx_rb_root *replay_root;
+
+static int entry_compare(const void *left, const void *right)
+{
+	const struct replay_entry *l = left, *r = right;
+	int result = replay_root->strict_compare(l->node, r->node);
+
+	if (result)
+		return result;
+	return l->lsn < r->lsn ? -1 : l->lsn > r->lsn;
+}
+
+/*
+ * Replay @count entries as one batch: sorted by key, and of several
+ * records for the same key only the last one counts.
+ */
+static int replay(struct rdx_rb_journal *journal,
+		  struct replay_entry *entries, size_t count)
+{
+	const struct rdx_rb_journal_ops *ops = journal->ops;
+	struct rdx_rb_root *root = journal->root;
+	struct rdx_rb_node **done = malloc(2 * count * sizeof(*done) + 1);
+	struct rdx_rb_batch batch;
+	size_t i, j, k, nr_erased = 0, nr_replaced = 0;
+
+	if (!done)
+		return false;
+	replay_root = root;
+	qsort(entries, count, sizeof(*entries), entry_compare);
+
+	/* Erased nodes go first in done[], replaced and replacing ones last */
+	rdx_rb_batch_init(&batch, root, journal->augment);
+	rdx_rb_batch_begin(&batch);
+	for (i = 0; i < count; i = j) {
+		struct replay_entry *last;
+		struct rdx_rb_node *old;
+
+		for (j = i + 1; j < count && !root->strict_compare(
+				entries[i].node, entries[j].node); j++)
+			;
+		last = &entries[j - 1];
+		mark_dirty(journal, last->node);
+		for (k = i; k < j - 1; k++)
+			ops->dispose(entries[k].node, journal->arg);
+
+		old = lookup(root, last->node);
+		if (last->op == LOG_ERASE) {
+			ops->dispose(last->node, journal->arg);
+			if (old) {
+				rdx_rb_batch_erase(&batch, old);
+				done[nr_erased++] = old;
+			}
+		} else if (old) {
+			done[2 * count - ++nr_replaced] = old;
+			done[2 * count - ++nr_replaced] = last->node;
+		} else {
+			rdx_rb_batch_insert(&batch, last->node);
+		}
+	}
+	rdx_rb_batch_end(&batch);
+	rdx_rb_batch_destroy(&batch);
+
+	for (i = 0; i < nr_erased; i++)
+		ops->dispose(done[i], journal->arg);
+	for (i = 2 * count; i > 2 * count - nr_replaced; i -= 2) {
+		struct rdx_rb_node *old = done[i - 1], *new = done[i - 2];
+
+		rdx_rb_replace_node(old, new, root);
+		if (journal->augment)
+			journal->augment->propagate(new, NULL);
+		ops->dispose(old, journal->arg);
+	}
+	free(done);
+	return true;
+}
+
+/*
+ * Read the log, replay whatever the checkpoint does not cover, and cut off
+ * everything from the first bad record on.
+ */
+static int recover_log(struct rdx_rb_journal *journal, uint64_t checkpoint)
+{
+	const struct rdx_rb_journal_ops *ops = journal->ops;
+	size_t size = sizeof(struct log_header) + ops->record_size;
+	struct replay_entry *entries = NULL;
+	size_t i, count = 0, valid = 0;
+	uint64_t last = 0;
+	char *data = NULL;
+	struct stat st;
+	int result = false;
+
+	if (fstat(journal->fd, &st))
+		return false;
+	data = malloc(st.st_size + 1);
+	entries = malloc((st.st_size / size + 1) * sizeof(*entries));
+	if (!data || !entries || lseek(journal->fd, 0, SEEK_SET) ||
+	    !read_all(journal->fd, data, st.st_size))
+		goto out;
+
+	for (; valid + size <= (size_t)st.st_size; valid += size) {
+		struct log_header header;
+
+		memcpy(&header, data + valid, sizeof(header));
+		if (header.crc != crc32c(0, data + valid + sizeof(header.crc),
+					 size - sizeof(header.crc)) ||
+		    header.lsn <= last)
+			break;
+		last = header.lsn;
+		if (header.lsn <= checkpoint)
+			continue;
+		entries[count].node = ops->decode(data + valid +
+						  sizeof(header),
+						  journal->arg);
+		if (!entries[count].node)
+			goto out;
+		entries[count].lsn = header.lsn;
+		entries[count++].op = header.op;
+	}
+
+	if (!replay(journal, entries, count))
+		goto out;
+	count = 0;
+	if (valid < (size_t)st.st_size &&
+	    (ftruncate(journal->fd, valid) || fdatasync(journal->fd)))
+		goto out;
+	if (last < checkpoint)
+		last = checkpoint;
+	journal->next_lsn = last + 1;
+	journal->durable_lsn = last;
+	result = true;
+out:
+	for (i = 0; i < count; i++)
+		ops->dispose(entries[i].node, journal->arg);
+	free(entries);
+	free(data);
+	return result;
+}
+
+int rdx_rb_journal_open(struct rdx_rb_journal *journal, const char *path,
+			struct rdx_rb_root *root,
+			const struct rdx_rb_augment_callbacks *augment,
+			const struct rdx_rb_journal_ops *ops, void *arg,
+			size_t segment_size)
+{
+	uint64_t checkpoint;
+
+	pthread_once(&crc_once, crc_init);
+	memset(journal, 0, sizeof(*journal));
+	journal->root = root;
+	journal->augment = augment;
+	journal->ops = ops;
+	journal->arg = arg;
+	journal->segment_size = segment_size ? segment_size : SEGMENT_SIZE;
+	journal->path = strdup(path);
+	if (!journal->path)
+		return false;
+	journal->fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0644);
+	if (journal->fd < 0)
+		goto fail;
+	if (!sync_dir(path) || !load_checkpoint(journal, &checkpoint))
+		goto fail_close;
+	if (!recover_log(journal, checkpoint)) {
+		free_segments(journal, journal->segments, journal->nr_segments);
+		goto fail_close;
+	}
+	remove_orphans(journal);
+	pthread_mutex_init(&journal->lock, NULL);
+	pthread_cond_init(&journal->flushed, NULL);
+	return true;
+
+fail_close:
+	close(journal->fd);
+fail:
+	free(journal->path);
+	return false;
+}
+
+int rdx_rb_journal_close(struct rdx_rb_journal *journal)
+{
+	int result = rdx_rb_journal_commit(journal);
+
+	result = !close(journal->fd) && result;
+	pthread_cond_destroy(&journal->flushed);
+	pthread_mutex_destroy(&journal->lock);
+	free(journal->buffer);
+	free(journal->spare);
+	free_segments(journal, journal->segments, journal->nr_segments);
+	free(journal->path);
+	return result;
+}
+
+/*
+ * Appending and group commit
+ */
+
+static void append(struct rdx_rb_journal *journal, uint32_t op,
+		   struct rdx_rb_node *node)
+{
+	size_t size = sizeof(struct log_header) + journal->ops->record_size;
+	struct log_header header;
+	char *at;
+
+	pthread_mutex_lock(&journal->lock);
+	if (journal->used + size > journal->capacity) {
+		size_t capacity = journal->capacity ? 2 * journal->capacity
+						    : 64 * size;
+		char *buffer = realloc(journal->buffer, capacity);
+
+		if (!buffer) {
+			journal->error = true;
+			pthread_mutex_unlock(&journal->lock);
+			return;
+		}
+		journal->buffer = buffer;
+		journal->capacity = capacity;
+	}
+	mark_dirty(journal, node);
+	at = journal->buffer + journal->used;
+	header.op = op;
+	header.lsn = journal->next_lsn++;
+	memcpy(at, &header, sizeof(header));
+	journal->ops->encode(node, at + sizeof(header), journal->arg);
+	header.crc = crc32c(0, at + sizeof(header.crc),
+			    size - sizeof(header.crc));
+	memcpy(at, &header.crc, sizeof(header.crc));
+	journal->used += size;
+	pthread_mutex_unlock(&journal->lock);
+}
+
+/*
+ * Whoever finds nobody writing becomes the leader: it takes the whole
+ * buffer, leaving the spare one for further appends, and writes it out
+ * with the lock dropped. Everyone else waits for it, and then either finds
+ * its records written or becomes the next leader.
+ */
+int rdx_rb_journal_commit(struct rdx_rb_journal *journal)
+{
+	uint64_t target;
+	int result;
+
+	pthread_mutex_lock(&journal->lock);
+	target = journal->next_lsn - 1;
+	while (journal->durable_lsn < target && !journal->error) {
+		uint64_t upto = journal->next_lsn - 1;
+		size_t len = journal->used, capacity = journal->capacity;
+		char *data = journal->buffer;
+		int ok;
+
+		if (journal->flushing) {
+			pthread_cond_wait(&journal->flushed, &journal->lock);
+			continue;
+		}
+		journal->flushing = true;
+		journal->buffer = journal->spare;
+		journal->capacity = journal->spare_capacity;
+		journal->used = 0;
+		pthread_mutex_unlock(&journal->lock);
+
+		ok = write_all(journal->fd, data, len) &&
+		     !fdatasync(journal->fd);
+
+		pthread_mutex_lock(&journal->lock);
+		journal->spare = data;
+		journal->spare_capacity = capacity;
+		journal->flushing = false;
+		if (ok)
+			journal->durable_lsn = upto;
+		else
+			journal->error = true;
+		pthread_cond_broadcast(&journal->flushed);
+	}
+	result = !journal->error;
+	pthread_mutex_unlock(&journal->lock);
+	return result;
+}
+
+/*
+ * Changes
+ */
+
+int rdx_rb_journal_insert(struct rdx_rb_journal *journal,
+			  struct rdx_rb_node *node)
+{
+	if (!rdx_rb_insert(node, journal->root))
+		return false;
+	if (journal->augment)
+		rdx_rb_insert_augmented(node, journal->root, journal->augment);
+	append(journal, LOG_INSERT, node);
+	return true;
+}
+
+void rdx_rb_journal_erase(struct rdx_rb_journal *journal,
+			  struct rdx_rb_node *node)
+{
+	append(journal, LOG_ERASE, node);
+	if (journal->augment)
+		rdx_rb_erase_augmented(node, journal->root, journal->augment);
+	else
+		rdx_rb_erase(node, journal->root);
+}
+
+void rdx_rb_journal_update(struct rdx_rb_journal *journal,
+			   struct rdx_rb_node *node)
+{
+	if (journal->augment)
+		journal->augment->propagate(node, NULL);
+	append(journal, LOG_UPDATE, node);
+}
+
+/*
+ * Checkpoints
+ *
+ * A checkpoint is a manifest listing segment files in key order, each
+ * holding up to segment_size consecutive nodes. A new checkpoint keeps the
+ * clean segments of the last one and rewrites each run of dirty ones from
+ * what is in the tree now over their keys, into new files, so the old
+ * checkpoint stays intact until the new manifest replaces it.
+ */
+
+static struct rdx_rb_node *first_from(struct rdx_rb_root *root,
+				      struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node *node = root->rb_node, *best = NULL;
+
+	while (node) {
+		if (root->strict_compare(node, elem) >= 0) {
+			best = node;
+			node = node->rb_left;
+		} else {
+			node = node->rb_right;
+		}
+	}
+	return best;
+}
+
+/*
+ * Write the nodes from *@node on, up to @stop (if any) or segment_size of
+ * them, to a new segment file, and advance *@node past them.
+ */
+static int write_segment(struct rdx_rb_journal *journal,
+			 struct rdx_rb_node **node, struct rdx_rb_node *stop,
+			 struct rdx_rb_journal_segment *segment, char *records)
+{
+	const struct rdx_rb_journal_ops *ops = journal->ops;
+	struct segment_header header = { SEGMENT_MAGIC, ops->record_size, 0,
+					 journal->next_id++, 0, 0 };
+	char *name = segment_path(journal, header.id);
+	int fd = name ? open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	uint32_t crc;
+	int ok;
+
+	free(name);
+	segment->id = header.id;
+	segment->first = NULL;
+	segment->dirty = false;
+	for (; *node && header.count < journal->segment_size &&
+	       (!stop || journal->root->strict_compare(*node, stop) < 0);
+	     *node = rdx_rb_next(*node))
+		ops->encode(*node, records + header.count++ * ops->record_size,
+			    journal->arg);
+	segment->count = header.count;
+	if (fd < 0)
+		return false;
+
+	segment->first = ops->decode(records, journal->arg);
+	crc = crc32c(0, records, header.count * ops->record_size);
+	header.crc = crc32c(crc, &header, sizeof(header));
+	ok = segment->first && write_all(fd, &header, sizeof(header)) &&
+	     write_all(fd, records, header.count * ops->record_size) &&
+	     !fsync(fd);
+	return !close(fd) && ok;
+}
+
+static int write_manifest(struct rdx_rb_journal *journal,
+			  struct rdx_rb_journal_segment *segments, size_t count)
+{
+	struct manifest_header header = { MANIFEST_MAGIC,
+					  journal->ops->record_size, count,
+					  journal->next_lsn - 1,
+					  journal->next_id, 0, 0 };
+	struct manifest_entry *entries = malloc(count * sizeof(*entries) + 1);
+	char *name = manifest_path(journal, "");
+	char *tmp = manifest_path(journal, ".tmp");
+	int fd = tmp ? open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	uint32_t crc;
+	size_t i;
+	int ok = fd >= 0 && entries && name;
+
+	for (i = 0; ok && i < count; i++) {
+		entries[i].id = segments[i].id;
+		entries[i].count = segments[i].count;
+	}
+	if (ok) {
+		crc = crc32c(0, entries, count * sizeof(*entries));
+		header.crc = crc32c(crc, &header, sizeof(header));
+		ok = write_all(fd, &header, sizeof(header)) &&
+		     write_all(fd, entries, count * sizeof(*entries)) &&
+		     !fsync(fd);
+	}
+	if (fd >= 0)
+		ok = !close(fd) && ok;
+	ok = ok && !rename(tmp, name) && sync_dir(name);
+	free(entries);
+	free(name);
+	free(tmp);
+	return ok;
+}
+
+static int reserve(struct rdx_rb_journal_segment **segments, size_t count,
+		   size_t *capacity)
+{
+	struct rdx_rb_journal_segment *more;
+
+	if (count < *capacity)
+		return true;
+	more = realloc(*segments, 2 * (*capacity + 8) * sizeof(*more));
+	if (!more)
+		return false;
+	*segments = more;
+	*capacity = 2 * (*capacity + 8);
+	return true;
+}
+
+int rdx_rb_journal_checkpoint(struct rdx_rb_journal *journal)
+{
+	struct rdx_rb_journal_segment *old = journal->segments, *new = NULL;
+	size_t i = 0, j, nr_old = journal->nr_segments, nr_new = 0, capacity = 0;
+	uint64_t first_id = journal->next_id;
+	char *records = malloc(journal->segment_size *
+			       journal->ops->record_size);
+	int ok = records && rdx_rb_journal_commit(journal);
+
+	do {
+		struct rdx_rb_node *node, *stop;
+
+		if (i < nr_old && !old[i].dirty) {
+			ok = ok && reserve(&new, nr_new, &capacity);
+			if (ok)
+				new[nr_new++] = old[i++];
+			continue;
+		}
+		for (j = i; j < nr_old && old[j].dirty; j++)
+			;
+		node = i ? first_from(journal->root, old[i].first)
+			 : rdx_rb_first(journal->root);
+		stop = j < nr_old ? old[j].first : NULL;
+		while (ok && node &&
+		       (!stop || journal->root->strict_compare(node, stop) < 0))
+			ok = reserve(&new, nr_new, &capacity) &&
+			     write_segment(journal, &node, stop, &new[nr_new++],
+					   records);
+		i = j;
+	} while (ok && i < nr_old);
+	ok = ok && write_manifest(journal, new, nr_new);
+
+	/* Whichever set of segment files the manifest does not list goes */
+	for (i = 0; i < (ok ? nr_old : nr_new); i++) {
+		struct rdx_rb_journal_segment *segment = ok ? &old[i] : &new[i];
+		char *name;
+
+		if (ok ? !segment->dirty : segment->id < first_id)
+			continue;
+		name = segment_path(journal, segment->id);
+		if (name)
+			unlink(name);
+		free(name);
+		if (segment->first)
+			journal->ops->dispose(segment->first, journal->arg);
+	}
+	free(ok ? old : new);
+	free(records);
+	if (!ok)
+		return false;
+	journal->segments = new;
+	journal->nr_segments = nr_new;
+
+	/* Only once the checkpoint is in place can the log go */
+	pthread_mutex_lock(&journal->lock);
+	ok = !ftruncate(journal->fd, 0) && !fdatasync(journal->fd);
+	if (!ok)
+		journal->error = true;
+	pthread_mutex_unlock(&journal->lock);
+	return ok;
+}
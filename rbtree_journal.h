@@ -0,0 +1,133 @@
+/*
+  Red Black Trees - write-ahead journal
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_JOURNAL_H
+#define _RDX_RBTREE_JOURNAL_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * A log of every change to a tree, so that it can be brought back after a
+ * crash without going back to wherever its contents came from. The journal
+ * keeps the log itself at @path and, next to it, the latest checkpoint of
+ * the whole tree: a manifest at @path.manifest listing segment files, each
+ * holding a run of consecutive nodes.
+ *
+ * Changes go through the journal, which applies them to the tree and
+ * appends a record to an in-memory buffer; rdx_rb_journal_commit() returns
+ * once everything appended before the call is on disk. Commits arriving
+ * while another one is writing wait for it and then go to disk together,
+ * so concurrent committers share their fsyncs. Every record carries a
+ * CRC32C, and a torn or corrupt tail is cut off on recovery.
+ *
+ * Checkpoints are incremental: every change marks the segment its key
+ * falls in dirty, and the next checkpoint rewrites only the dirty segments,
+ * so its cost follows the number of keys changed, not the size of the tree.
+ *
+ * The journal does no locking of the tree: appending is safe from several
+ * threads at once, the changes to the tree itself are up to the caller.
+ *
+ * Nodes go to disk as records of @record_size bytes written by @encode,
+ * which must cover the key and whatever the payload is computed from, and
+ * come back through @decode, which allocates them. @dispose frees nodes
+ * that recovery decoded but has no use for, or replaced.
+ */
+
+struct rdx_rb_journal_ops {
+	size_t record_size;
+	void (*encode)(const struct rdx_rb_node *node, void *record, void *arg);
+	struct rdx_rb_node *(*decode)(const void *record, void *arg);
+	void (*dispose)(struct rdx_rb_node *node, void *arg);
+};
+
+struct rdx_rb_journal_segment {
+	uint64_t id, count;
+	/* A copy of the first node, to tell which segment a key falls in */
+	struct rdx_rb_node *first;
+	int dirty;
+};
+
+struct rdx_rb_journal {
+	pthread_mutex_t lock;
+	pthread_cond_t flushed;
+	int fd;
+	char *path;
+	struct rdx_rb_root *root;
+	const struct rdx_rb_augment_callbacks *augment;
+	const struct rdx_rb_journal_ops *ops;
+	void *arg;
+	/* Records appended but not written yet, and the leader's spare */
+	char *buffer, *spare;
+	size_t used, capacity, spare_capacity;
+	/* Records below next_lsn exist, those up to durable_lsn are on disk */
+	uint64_t next_lsn, durable_lsn;
+	int flushing;
+	int error;
+	/* The latest checkpoint, in key order */
+	struct rdx_rb_journal_segment *segments;
+	size_t nr_segments, segment_size;
+	uint64_t next_id;
+};
+
+/*
+ * Open the journal at @path, creating it if need be, and recover the tree
+ * into the empty @root: load the checkpoint, then replay the log on top of
+ * it as one sorted batch, each key going straight to its final state.
+ * @augment may be NULL for a plain tree. Checkpoints cut segments of
+ * @segment_size nodes, 0 picking a default. Returns false on I/O errors,
+ * a corrupt checkpoint or running out of memory.
+ */
+extern int
+rdx_rb_journal_open(struct rdx_rb_journal *journal, const char *path,
+		    struct rdx_rb_root *root,
+		    const struct rdx_rb_augment_callbacks *augment,
+		    const struct rdx_rb_journal_ops *ops, void *arg,
+		    size_t segment_size);
+/* Commits, then closes. The tree is left alone */
+extern int rdx_rb_journal_close(struct rdx_rb_journal *journal);
+
+/*
+ * Change the tree and log it. Insertion returns false, logging nothing, if
+ * the key is there already; erasing leaves the node to the caller. After
+ * changing whatever the payload of @node depends on, rdx_rb_journal_update()
+ * brings the payloads up to date and logs the new contents.
+ */
+extern int
+rdx_rb_journal_insert(struct rdx_rb_journal *journal, struct rdx_rb_node *node);
+extern void
+rdx_rb_journal_erase(struct rdx_rb_journal *journal, struct rdx_rb_node *node);
+extern void
+rdx_rb_journal_update(struct rdx_rb_journal *journal, struct rdx_rb_node *node);
+
+/*
+ * Make everything appended so far durable. Returns false if writing failed
+ * or a record could not be appended for lack of memory, since the journal
+ * was opened.
+ */
+extern int rdx_rb_journal_commit(struct rdx_rb_journal *journal);
+
+/*
+ * Write a new checkpoint, rewriting the dirty segments only, and empty the
+ * log. The tree must not change meanwhile.
+ */
+extern int rdx_rb_journal_checkpoint(struct rdx_rb_journal *journal);
+
+#endif	/* _RDX_RBTREE_JOURNAL_H */
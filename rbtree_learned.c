@@ -0,0 +1,179 @@
+/*
+  Red Black Trees - learned indexes
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <math.h>
+#include <stdlib.h>
+
+#include "rbtree_learned.h"
+
+/*
+ * Pieces are fitted to the first position of every distinct key, so that
+ * every piece starts where its first key first appears. A key that falls
+ * in piece s then has its answer somewhere from the start of s to the
+ * start of s + 1, whichever way the prediction is off.
+ */
+
+struct cone {
+	uint64_t key;
+	size_t rank;
+	double lo, hi;
+};
+
+static void close_segment(struct rdx_rb_learned *learned, struct cone *cone)
+{
+	size_t s = learned->nr_segments++;
+
+	learned->segment_keys[s] = cone->key;
+	learned->segments[s].rank = cone->rank;
+	/* A piece of one key has no slope to speak of */
+	learned->segments[s].slope = isinf(cone->hi) ? 0 :
+				     (cone->lo + cone->hi) / 2;
+}
+
+int rdx_rb_learned_build(struct rdx_rb_learned *learned,
+			 const struct rdx_rb_frozen *frozen, size_t epsilon)
+{
+	size_t count = frozen->count, rank, i;
+	struct cone cone = { 0, 0, 0, 0 };
+	double dx, dy, lo, hi;
+
+	learned->frozen = frozen;
+	learned->count = count;
+	learned->epsilon = epsilon;
+	learned->nr_segments = 0;
+	learned->keys = malloc((count + 1) * sizeof(*learned->keys));
+	learned->index = malloc((count + 1) * sizeof(*learned->index));
+	learned->segment_keys =
+		malloc((count + 1) * sizeof(*learned->segment_keys));
+	learned->segments = malloc((count + 1) * sizeof(*learned->segments));
+	if (!learned->keys || !learned->index || !learned->segment_keys ||
+	    !learned->segments) {
+		rdx_rb_learned_destroy(learned);
+		return false;
+	}
+
+	for (i = rdx_rb_frozen_first(frozen), rank = 0; i;
+	     i = rdx_rb_frozen_next(frozen, i), rank++) {
+		learned->keys[rank] = rdx_rb_frozen_key(frozen, i);
+		learned->index[rank] = i;
+	}
+
+	/* Narrow the cone of slopes that fit until a key falls outside */
+	for (rank = 0; rank < count; rank++) {
+		if (rank && learned->keys[rank] == learned->keys[rank - 1])
+			continue;
+		if (rank) {
+			dx = (double)(learned->keys[rank] - cone.key);
+			dy = (double)(rank - cone.rank);
+			lo = (dy - epsilon) / dx;
+			hi = (dy + epsilon) / dx;
+			if (lo <= cone.hi && hi >= cone.lo) {
+				cone.lo = lo > cone.lo ? lo : cone.lo;
+				cone.hi = hi < cone.hi ? hi : cone.hi;
+				continue;
+			}
+			close_segment(learned, &cone);
+		}
+		cone = (struct cone){ learned->keys[rank], rank, 0, INFINITY };
+	}
+	if (count)
+		close_segment(learned, &cone);
+	return true;
+}
+
+void rdx_rb_learned_destroy(struct rdx_rb_learned *learned)
+{
+	free(learned->keys);
+	free(learned->index);
+	free(learned->segment_keys);
+	free(learned->segments);
+	learned->keys = NULL;
+	learned->index = NULL;
+	learned->segment_keys = NULL;
+	learned->segments = NULL;
+	learned->count = learned->nr_segments = 0;
+}
+
+/* The first rank from @lo to @hi with a key above @key, or equal to it */
+static size_t search(const uint64_t *keys, size_t lo, size_t hi,
+		     uint64_t key, int equal)
+{
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (keys[mid] < key || (!equal && keys[mid] == key))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static size_t rank_of(const struct rdx_rb_learned *learned, uint64_t key,
+		      int equal)
+{
+	const uint64_t *keys = learned->keys;
+	size_t base = 0, n = learned->nr_segments, half, start, end, lo, hi, r;
+	double predicted;
+
+	if (!n || key < learned->segment_keys[0])
+		return 0;
+	/* The last piece starting at or below @key, without branching */
+	while (n > 1) {
+		half = n / 2;
+		base = learned->segment_keys[base + half] <= key ?
+		       base + half : base;
+		n -= half;
+	}
+
+	start = learned->segments[base].rank;
+	end = base + 1 < learned->nr_segments ?
+	      learned->segments[base + 1].rank : learned->count;
+	predicted = start + learned->segments[base].slope *
+			    (double)(key - learned->segment_keys[base]);
+	lo = predicted > start + learned->epsilon ?
+	     (size_t)(predicted - learned->epsilon) : start;
+	hi = predicted + learned->epsilon + 1 < end ?
+	     (size_t)(predicted + learned->epsilon + 1) : end;
+	if (lo > hi)
+		lo = hi;
+
+	r = search(keys, lo, hi, key, equal);
+	if (r == lo && lo > start &&
+	    (keys[lo - 1] > key || (equal && keys[lo - 1] == key)))
+		r = search(keys, start, lo, key, equal);
+	else if (r == hi && hi < end)
+		r = search(keys, hi, end, key, equal);
+	return r;
+}
+
+size_t rdx_rb_learned_greater_equiv(const struct rdx_rb_learned *learned,
+				    uint64_t key)
+{
+	size_t r = rank_of(learned, key, true);
+
+	return r < learned->count ? learned->index[r] : 0;
+}
+
+size_t rdx_rb_learned_less_equiv(const struct rdx_rb_learned *learned,
+				 uint64_t key)
+{
+	size_t r = rank_of(learned, key, false);
+
+	return r ? learned->index[r - 1] : 0;
+}
@@ -0,0 +1,74 @@
+/*
+  Red Black Trees - learned indexes
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_LEARNED_H
+#define _RDX_RBTREE_LEARNED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree_frozen.h"
+
+/*
+ * An index over the keys of a frozen copy that learns where keys are
+ * instead of searching for them. The keys are laid out sorted, and their
+ * positions fitted by a piecewise linear function that is never more than
+ * @epsilon off at any key: a lookup finds the piece by a binary search
+ * over the few first keys of the pieces, predicts the position and only
+ * searches the 2 * @epsilon + 1 keys around it. Keys with long runs of
+ * equal ones, and keys between pieces, can fall outside that window, in
+ * which case the search widens to the whole piece, so answers are always
+ * exact.
+ *
+ * The pieces come from a single pass that grows each as long as some
+ * slope keeps every key in it within @epsilon, which gives close to the
+ * fewest pieces possible. Answers are indexes into the frozen copy, which
+ * must stay around as long as this does.
+ */
+
+struct rdx_rb_learned_segment {
+	double slope;
+	size_t rank;
+};
+
+struct rdx_rb_learned {
+	const struct rdx_rb_frozen *frozen;
+	size_t count, epsilon;
+	/* The keys in order, and where each one is in the frozen copy */
+	uint64_t *keys;
+	size_t *index;
+	/* The first key of every piece, apart from the rest of it */
+	size_t nr_segments;
+	uint64_t *segment_keys;
+	struct rdx_rb_learned_segment *segments;
+};
+
+/* Returns false when out of memory */
+extern int
+rdx_rb_learned_build(struct rdx_rb_learned *learned,
+		     const struct rdx_rb_frozen *frozen, size_t epsilon);
+extern void rdx_rb_learned_destroy(struct rdx_rb_learned *learned);
+
+/* As rdx_rb_frozen_greater_equiv() and rdx_rb_frozen_less_equiv() */
+extern size_t
+rdx_rb_learned_greater_equiv(const struct rdx_rb_learned *learned,
+			     uint64_t key);
+extern size_t
+rdx_rb_learned_less_equiv(const struct rdx_rb_learned *learned, uint64_t key);
+
+#endif	/* _RDX_RBTREE_LEARNED_H */
@@ -0,0 +1,1312 @@
+/*
+  Red Black Trees - log-structured merge trees
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+/* Ahead of <sys/stat.h>, whose <linux/stddef.h> would hide our own */
+#include "rbtree_lsm.h"
+#include "kernel.h"
+#include "rbtree_io.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * A run is one file, <id>.run: the header, then the records, each the key,
+ * the flags and the value padded to 8 bytes, in key order; then the
+ * fences, each the first and last key of a block of RDX_RB_LSM_FENCE
+ * records and the aggregate of the live ones; then the Bloom filter. A run
+ * is written whole and synced before the manifest names it, and any file
+ * the manifest does not name is left over from a crash and goes on opening.
+ *
+ * The manifest lists the runs of every level by id, and is replaced by
+ * renaming a new one over it.
+ *
+ * Only the background thread changes the levels, so it reads them without
+ * the lock, and takes it for writing only to swap in the new set. The
+ * frozen memtable does not change until the thread swaps it out either.
+ */
+
+#define RUN_MAGIC	"RDXRBRN1"
+#define MANIFEST_MAGIC	"RDXRBMF1"
+#define LSM_MEMTABLE	(64 * 1024)
+#define RUN_BUFFER	(1 << 20)
+/* About 1% false positives */
+#define BLOOM_BITS	10
+#define BLOOM_HASHES	7
+
+#define TOMBSTONE	1
+#define MAX_RUNS	(RDX_RB_LSM_L0 + RDX_RB_LSM_LEVELS)
+
+struct run_header {
+	char magic[8];
+	uint64_t value_size, aggregate_size, count, nr_fences, bloom_words;
+	uint64_t fences_offset, bloom_offset, size;
+	uint32_t crc, unused;
+};
+
+struct rdx_rb_lsm_run {
+	uint64_t id, count, nr_fences, bloom_words;
+	unsigned char *map;
+	size_t size;
+	const unsigned char *records, *fences;
+	const uint64_t *bloom;
+};
+
+struct manifest {
+	char magic[8];
+	uint64_t next_id, nr_l0;
+	uint64_t l0[RDX_RB_LSM_L0], levels[RDX_RB_LSM_LEVELS];
+	uint32_t crc, unused;
+};
+
+struct lsm_entry {
+	struct rdx_rb_node node;
+	uint64_t key;
+	int tombstone;
+	/* The aggregate of the subtree, then the value */
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+#define ALIGN16(x)	(((x) + 15) & ~(uint64_t)15)
+
+static inline size_t record_size(const struct rdx_rb_lsm_ops *ops)
+{
+	return 2 * sizeof(uint64_t) + ALIGN8(ops->value_size);
+}
+
+static inline size_t fence_size(const struct rdx_rb_lsm_ops *ops)
+{
+	return 2 * sizeof(uint64_t) + ALIGN8(ops->aggregate_size);
+}
+
+static int sync_dir(struct rdx_rb_lsm *lsm)
+{
+	int fd = open(lsm->dir, O_RDONLY | O_DIRECTORY), ok;
+
+	if (fd < 0)
+		return false;
+	ok = !fsync(fd);
+	close(fd);
+	return ok;
+}
+
+static char *run_path(struct rdx_rb_lsm *lsm, uint64_t id)
+{
+	char *path;
+
+	return asprintf(&path, "%s/%llu.run", lsm->dir,
+			(unsigned long long)id) < 0 ? NULL : path;
+}
+
+/*
+ * The memtables
+ */
+
+/* The tree being worked on by this thread, for the callbacks below */
+static __thread struct rdx_rb_lsm *lsm_current;
+
+static struct lsm_entry *entry_of(struct rdx_rb_node *node)
+{
+	return node ? rdx_rb_entry(node, struct lsm_entry, node) : NULL;
+}
+
+static int lsm_compare(struct rdx_rb_node *left, struct rdx_rb_node *right)
+{
+	uint64_t a = entry_of(left)->key, b = entry_of(right)->key;
+
+	return a < b ? -1 : a > b;
+}
+
+static inline void *value_of(struct rdx_rb_lsm *lsm, struct lsm_entry *entry)
+{
+	return entry->data + ALIGN16(lsm->ops->aggregate_size);
+}
+
+static void entry_compute(struct lsm_entry *entry)
+{
+	const struct rdx_rb_lsm_ops *ops = lsm_current->ops;
+	struct lsm_entry *left = entry_of(entry->node.rb_left);
+	struct lsm_entry *right = entry_of(entry->node.rb_right);
+	void *arg = lsm_current->arg;
+
+	if (!ops->aggregate_size)
+		return;
+	ops->init(entry->data, arg);
+	if (left)
+		ops->combine(entry->data, left->data, arg);
+	if (!entry->tombstone)
+		ops->accumulate(entry->data, entry->key,
+				value_of(lsm_current, entry), arg);
+	if (right)
+		ops->combine(entry->data, right->data, arg);
+}
+
+static void lsm_propagate(struct rdx_rb_node *node, struct rdx_rb_node *stop)
+{
+	for (; node != stop; node = rdx_rb_parent(node))
+		entry_compute(entry_of(node));
+}
+
+static void lsm_copy(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	memcpy(entry_of(new)->data, entry_of(old)->data,
+	       lsm_current->ops->aggregate_size);
+}
+
+static void lsm_rotate(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	entry_compute(entry_of(old));
+	entry_compute(entry_of(new));
+}
+
+static const struct rdx_rb_augment_callbacks lsm_callbacks = {
+	lsm_propagate, lsm_copy, lsm_rotate
+};
+
+static struct rdx_rb_node *tree_lower_bound(struct rdx_rb_root *root,
+					    uint64_t key)
+{
+	struct lsm_entry probe = { .key = key };
+
+	return rdx_rb_leftmost_greater_equiv(&probe.node, root);
+}
+
+static struct lsm_entry *tree_find(struct rdx_rb_root *root, uint64_t key)
+{
+	struct lsm_entry *entry = entry_of(tree_lower_bound(root, key));
+
+	return entry && entry->key == key ? entry : NULL;
+}
+
+/* Whether @root has any key from @first to @last */
+static int tree_has_span(struct rdx_rb_root *root, uint64_t first,
+			 uint64_t last)
+{
+	struct rdx_rb_node *node = tree_lower_bound(root, first);
+
+	return node && entry_of(node)->key <= last;
+}
+
+static void free_entries(struct rdx_rb_root *root)
+{
+	struct rdx_rb_node *node, *next;
+
+	for (node = rdx_rb_first_postorder(root); node; node = next) {
+		next = rdx_rb_next_postorder(node);
+		free(entry_of(node));
+	}
+	root->rb_node = NULL;
+}
+
+/* Overwrite or add the entry of @key, a tombstone if @value is NULL */
+static int memtable_write(struct rdx_rb_lsm *lsm, uint64_t key,
+			  const void *value)
+{
+	struct lsm_entry *entry = tree_find(&lsm->memtable, key);
+	int found = entry != NULL;
+
+	if (!found) {
+		entry = malloc(sizeof(*entry) +
+			       ALIGN16(lsm->ops->aggregate_size) +
+			       lsm->ops->value_size);
+		if (!entry)
+			return false;
+		entry->key = key;
+	}
+	entry->tombstone = !value;
+	if (value)
+		memcpy(value_of(lsm, entry), value, lsm->ops->value_size);
+	if (found) {
+		lsm_propagate(&entry->node, NULL);
+		return true;
+	}
+	rdx_rb_insert(&entry->node, &lsm->memtable);
+	rdx_rb_insert_augmented(&entry->node, &lsm->memtable, &lsm_callbacks);
+	lsm->memtable_count++;
+	return true;
+}
+
+/*
+ * Hand the memtable to the background thread, with the lock held for
+ * writing. Returns whether the memtable is empty now, which it is not if
+ * the last one is still being written.
+ */
+static int freeze(struct rdx_rb_lsm *lsm)
+{
+	int empty = RDX_RB_EMPTY_ROOT(&lsm->memtable);
+
+	pthread_mutex_lock(&lsm->work_lock);
+	if (!empty && !lsm->has_frozen) {
+		lsm->frozen.rb_node = lsm->memtable.rb_node;
+		lsm->frozen_count = lsm->memtable_count;
+		lsm->memtable.rb_node = NULL;
+		lsm->memtable_count = 0;
+		lsm->has_frozen = true;
+		pthread_cond_signal(&lsm->work);
+		empty = true;
+	}
+	pthread_mutex_unlock(&lsm->work_lock);
+	return empty;
+}
+
+/* Wait for the frozen memtable to be written out; false if that failed */
+static int wait_frozen(struct rdx_rb_lsm *lsm)
+{
+	int ok;
+
+	pthread_mutex_lock(&lsm->work_lock);
+	while (lsm->has_frozen && !lsm->error)
+		pthread_cond_wait(&lsm->done, &lsm->work_lock);
+	ok = !lsm->error;
+	pthread_mutex_unlock(&lsm->work_lock);
+	return ok;
+}
+
+/*
+ * Runs
+ */
+
+static inline const uint64_t *run_record(struct rdx_rb_lsm *lsm,
+					 const struct rdx_rb_lsm_run *run,
+					 uint64_t index)
+{
+	return (const uint64_t *)(run->records +
+				  index * record_size(lsm->ops));
+}
+
+static inline const uint64_t *run_fence(struct rdx_rb_lsm *lsm,
+					const struct rdx_rb_lsm_run *run,
+					uint64_t index)
+{
+	return (const uint64_t *)(run->fences + index * fence_size(lsm->ops));
+}
+
+static uint64_t mix(uint64_t key)
+{
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	return key ^ (key >> 31);
+}
+
+static void bloom_add(uint64_t *bloom, uint64_t words, uint64_t key)
+{
+	uint64_t hash = mix(key), delta = (hash >> 32) | 1, bit;
+	int i;
+
+	for (i = 0; i < BLOOM_HASHES; i++, hash += delta) {
+		bit = hash % (words * 64);
+		bloom[bit / 64] |= 1ULL << (bit % 64);
+	}
+}
+
+static int bloom_test(const uint64_t *bloom, uint64_t words, uint64_t key)
+{
+	uint64_t hash = mix(key), delta = (hash >> 32) | 1, bit;
+	int i;
+
+	for (i = 0; i < BLOOM_HASHES; i++, hash += delta) {
+		bit = hash % (words * 64);
+		if (!(bloom[bit / 64] & (1ULL << (bit % 64))))
+			return false;
+	}
+	return true;
+}
+
+/* The index of the first record at or after @key, or the count */
+static uint64_t run_lower_bound(struct rdx_rb_lsm *lsm,
+				const struct rdx_rb_lsm_run *run, uint64_t key)
+{
+	uint64_t lo = 0, hi = run->nr_fences, mid;
+
+	/* The first block that ends at or after @key has it */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (run_fence(lsm, run, mid)[1] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo == run->nr_fences)
+		return run->count;
+	lo *= RDX_RB_LSM_FENCE;
+	hi = lo + RDX_RB_LSM_FENCE;
+	if (hi > run->count)
+		hi = run->count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (run_record(lsm, run, mid)[0] < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static const uint64_t *run_find(struct rdx_rb_lsm *lsm,
+				const struct rdx_rb_lsm_run *run, uint64_t key)
+{
+	const uint64_t *record;
+	uint64_t index;
+
+	if (!bloom_test(run->bloom, run->bloom_words, key))
+		return NULL;
+	index = run_lower_bound(lsm, run, key);
+	if (index == run->count)
+		return NULL;
+	record = run_record(lsm, run, index);
+	return record[0] == key ? record : NULL;
+}
+
+static int run_has_span(struct rdx_rb_lsm *lsm,
+			const struct rdx_rb_lsm_run *run, uint64_t first,
+			uint64_t last)
+{
+	uint64_t index = run_lower_bound(lsm, run, first);
+
+	return index < run->count && run_record(lsm, run, index)[0] <= last;
+}
+
+static void free_run(struct rdx_rb_lsm_run *run)
+{
+	munmap(run->map, run->size);
+	free(run);
+}
+
+/* For a run no manifest names any more */
+static void discard_run(struct rdx_rb_lsm *lsm, struct rdx_rb_lsm_run *run)
+{
+	char *path;
+
+	if (!run)
+		return;
+	path = run_path(lsm, run->id);
+	if (path)
+		unlink(path);
+	free(path);
+	free_run(run);
+}
+
+static struct rdx_rb_lsm_run *map_run(struct rdx_rb_lsm *lsm, uint64_t id)
+{
+	const struct rdx_rb_lsm_ops *ops = lsm->ops;
+	struct rdx_rb_lsm_run *run = malloc(sizeof(*run));
+	struct run_header header;
+	char *path = run_path(lsm, id);
+	struct stat st;
+	uint32_t crc;
+	int fd = -1;
+
+	if (!run || !path)
+		goto fail;
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) ||
+	    !read_all(fd, &header, sizeof(header), 0))
+		goto fail;
+	crc = header.crc;
+	header.crc = 0;
+	if (memcmp(header.magic, RUN_MAGIC, sizeof(header.magic)) ||
+	    crc != checksum(&header, sizeof(header)) ||
+	    header.value_size != ops->value_size ||
+	    header.aggregate_size != ops->aggregate_size ||
+	    header.size != (uint64_t)st.st_size ||
+	    header.nr_fences != (header.count + RDX_RB_LSM_FENCE - 1) /
+				RDX_RB_LSM_FENCE ||
+	    header.fences_offset != sizeof(header) +
+				    header.count * record_size(ops) ||
+	    header.bloom_offset != header.fences_offset +
+				   header.nr_fences * fence_size(ops) ||
+	    !header.bloom_words ||
+	    header.size != header.bloom_offset + header.bloom_words * 8)
+		goto fail;
+
+	run->map = mmap(NULL, header.size, PROT_READ, MAP_SHARED, fd, 0);
+	if (run->map == MAP_FAILED)
+		goto fail;
+	close(fd);
+	free(path);
+	run->id = id;
+	run->size = header.size;
+	run->count = header.count;
+	run->nr_fences = header.nr_fences;
+	run->bloom_words = header.bloom_words;
+	run->records = run->map + sizeof(header);
+	run->fences = run->map + header.fences_offset;
+	run->bloom = (const uint64_t *)(run->map + header.bloom_offset);
+	return run;
+
+fail:
+	if (fd >= 0)
+		close(fd);
+	free(path);
+	free(run);
+	return NULL;
+}
+
+struct run_writer {
+	int fd, ok;
+	uint64_t id, count, offset;
+	unsigned char *buffer, *fences;
+	size_t used;
+	uint64_t *bloom, bloom_words;
+};
+
+/* Start run @id of at most @max_count records */
+static int writer_start(struct rdx_rb_lsm *lsm, struct run_writer *writer,
+			uint64_t max_count)
+{
+	uint64_t nr_fences = max_count / RDX_RB_LSM_FENCE + 1;
+	char *path;
+
+	writer->id = lsm->next_id++;
+	writer->count = 0;
+	writer->offset = sizeof(struct run_header);
+	writer->used = 0;
+	writer->bloom_words = (max_count * BLOOM_BITS + 63) / 64 + 1;
+	writer->buffer = malloc(RUN_BUFFER);
+	writer->fences = malloc(nr_fences * fence_size(lsm->ops));
+	writer->bloom = calloc(writer->bloom_words, sizeof(uint64_t));
+	path = run_path(lsm, writer->id);
+	writer->fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : -1;
+	free(path);
+	writer->ok = writer->buffer && writer->fences && writer->bloom &&
+		     writer->fd >= 0;
+	return writer->ok;
+}
+
+static void writer_drain(struct run_writer *writer)
+{
+	writer->ok = writer->ok &&
+		     write_all(writer->fd, writer->buffer, writer->used,
+			       writer->offset);
+	writer->offset += writer->used;
+	writer->used = 0;
+}
+
+static void writer_add(struct rdx_rb_lsm *lsm, struct run_writer *writer,
+		       uint64_t key, uint64_t flags, const void *value)
+{
+	const struct rdx_rb_lsm_ops *ops = lsm->ops;
+	uint64_t *record, *fence;
+
+	if (writer->used + record_size(ops) > RUN_BUFFER)
+		writer_drain(writer);
+	record = (uint64_t *)(writer->buffer + writer->used);
+	record[0] = key;
+	record[1] = flags;
+	memset(record + 2, 0, ALIGN8(ops->value_size));
+	if (!(flags & TOMBSTONE))
+		memcpy(record + 2, value, ops->value_size);
+	writer->used += record_size(ops);
+
+	fence = (uint64_t *)(writer->fences + writer->count /
+			     RDX_RB_LSM_FENCE * fence_size(ops));
+	if (!(writer->count % RDX_RB_LSM_FENCE)) {
+		fence[0] = key;
+		memset(fence + 2, 0, ALIGN8(ops->aggregate_size));
+		if (ops->aggregate_size)
+			ops->init(fence + 2, lsm->arg);
+	}
+	fence[1] = key;
+	if (ops->aggregate_size && !(flags & TOMBSTONE))
+		ops->accumulate(fence + 2, key, value, lsm->arg);
+
+	bloom_add(writer->bloom, writer->bloom_words, key);
+	writer->count++;
+}
+
+/*
+ * Write out the rest and map the run, or for a run left empty by dropping
+ * tombstones, remove it and return NULL in @run.
+ */
+static int writer_finish(struct rdx_rb_lsm *lsm, struct run_writer *writer,
+			 struct rdx_rb_lsm_run **run)
+{
+	struct run_header header;
+	char *path;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RUN_MAGIC, sizeof(header.magic));
+	header.value_size = lsm->ops->value_size;
+	header.aggregate_size = lsm->ops->aggregate_size;
+	header.count = writer->count;
+	header.nr_fences = (writer->count + RDX_RB_LSM_FENCE - 1) /
+			   RDX_RB_LSM_FENCE;
+	header.bloom_words = writer->bloom_words;
+	header.fences_offset = sizeof(header) +
+			       writer->count * record_size(lsm->ops);
+	header.bloom_offset = header.fences_offset +
+			      header.nr_fences * fence_size(lsm->ops);
+	header.size = header.bloom_offset + header.bloom_words * 8;
+	header.crc = checksum(&header, sizeof(header));
+
+	if (writer->fd >= 0) {
+		writer_drain(writer);
+		writer->ok = writer->ok &&
+			     write_all(writer->fd, writer->fences,
+				       header.nr_fences * fence_size(lsm->ops),
+				       header.fences_offset) &&
+			     write_all(writer->fd, writer->bloom,
+				       header.bloom_words * 8,
+				       header.bloom_offset) &&
+			     write_all(writer->fd, &header, sizeof(header), 0) &&
+			     !fdatasync(writer->fd);
+		writer->ok = !close(writer->fd) && writer->ok;
+	}
+	free(writer->buffer);
+	free(writer->fences);
+	free(writer->bloom);
+
+	*run = NULL;
+	if (writer->ok && writer->count) {
+		*run = map_run(lsm, writer->id);
+		writer->ok = *run != NULL;
+	}
+	if (!*run) {
+		path = run_path(lsm, writer->id);
+		if (path)
+			unlink(path);
+		free(path);
+	}
+	return writer->ok;
+}
+
+/*
+ * Merging, newest source first: of several holding the same key, the
+ * first one wins and the rest are skipped.
+ */
+
+struct cursor {
+	/* A memtable node, or a run and an index into it */
+	struct rdx_rb_node *node;
+	const struct rdx_rb_lsm_run *run;
+	uint64_t index;
+	/* Where it is, unless done */
+	uint64_t key, flags;
+	const void *value;
+	int done;
+};
+
+static void cursor_load(struct rdx_rb_lsm *lsm, struct cursor *cursor)
+{
+	const uint64_t *record;
+	struct lsm_entry *entry;
+
+	if (cursor->run) {
+		cursor->done = cursor->index >= cursor->run->count;
+		if (cursor->done)
+			return;
+		record = run_record(lsm, cursor->run, cursor->index);
+		cursor->key = record[0];
+		cursor->flags = record[1];
+		cursor->value = record + 2;
+	} else {
+		cursor->done = !cursor->node;
+		if (cursor->done)
+			return;
+		entry = entry_of(cursor->node);
+		cursor->key = entry->key;
+		cursor->flags = entry->tombstone ? TOMBSTONE : 0;
+		cursor->value = value_of(lsm, entry);
+	}
+}
+
+static void cursor_init(struct rdx_rb_lsm *lsm, struct cursor *cursor,
+			struct rdx_rb_node *node,
+			const struct rdx_rb_lsm_run *run, uint64_t index)
+{
+	cursor->node = node;
+	cursor->run = run;
+	cursor->index = index;
+	cursor_load(lsm, cursor);
+}
+
+static struct cursor *merge_pick(struct cursor *cursors, size_t nr)
+{
+	struct cursor *best = NULL;
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		if (!cursors[i].done && (!best || cursors[i].key < best->key))
+			best = &cursors[i];
+	return best;
+}
+
+static void merge_skip(struct rdx_rb_lsm *lsm, struct cursor *cursors,
+		       size_t nr, uint64_t key)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (cursors[i].done || cursors[i].key != key)
+			continue;
+		if (cursors[i].run)
+			cursors[i].index++;
+		else
+			cursors[i].node = rdx_rb_next(cursors[i].node);
+		cursor_load(lsm, &cursors[i]);
+	}
+}
+
+/* Every run, newest first */
+static size_t runs_of(const struct rdx_rb_lsm_levels *levels,
+		      struct rdx_rb_lsm_run **runs)
+{
+	size_t nr = 0, i;
+
+	for (i = 0; i < levels->nr_l0; i++)
+		runs[nr++] = levels->l0[i];
+	for (i = 0; i < RDX_RB_LSM_LEVELS; i++)
+		if (levels->levels[i])
+			runs[nr++] = levels->levels[i];
+	return nr;
+}
+
+/*
+ * The background thread
+ */
+
+static int save_manifest(struct rdx_rb_lsm *lsm,
+			 const struct rdx_rb_lsm_levels *levels)
+{
+	struct manifest manifest;
+	char *path = NULL, *tmp = NULL;
+	size_t i;
+	int fd, ok = false;
+
+	memset(&manifest, 0, sizeof(manifest));
+	memcpy(manifest.magic, MANIFEST_MAGIC, sizeof(manifest.magic));
+	manifest.next_id = lsm->next_id;
+	manifest.nr_l0 = levels->nr_l0;
+	for (i = 0; i < levels->nr_l0; i++)
+		manifest.l0[i] = levels->l0[i]->id;
+	for (i = 0; i < RDX_RB_LSM_LEVELS; i++)
+		if (levels->levels[i])
+			manifest.levels[i] = levels->levels[i]->id;
+	manifest.crc = checksum(&manifest, sizeof(manifest));
+
+	if (asprintf(&path, "%s/MANIFEST", lsm->dir) < 0 ||
+	    asprintf(&tmp, "%s/MANIFEST.tmp", lsm->dir) < 0)
+		goto out;
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		goto out;
+	ok = write_all(fd, &manifest, sizeof(manifest), 0) && !fdatasync(fd);
+	ok = !close(fd) && ok && !rename(tmp, path) && sync_dir(lsm);
+out:
+	free(path);
+	free(tmp);
+	return ok;
+}
+
+/* Swap in @next, and drop the @nr runs of @old it no longer has */
+static int install(struct rdx_rb_lsm *lsm, struct rdx_rb_lsm_levels *next,
+		   struct rdx_rb_lsm_run *new, struct rdx_rb_lsm_run **old,
+		   size_t nr, int thaw)
+{
+	struct rdx_rb_root garbage = RDX_RB_ROOT(lsm_compare, lsm_compare);
+	size_t i;
+
+	if (!save_manifest(lsm, next)) {
+		discard_run(lsm, new);
+		return false;
+	}
+	pthread_rwlock_wrlock(&lsm->lock);
+	lsm->current = *next;
+	if (thaw) {
+		garbage.rb_node = lsm->frozen.rb_node;
+		lsm->frozen.rb_node = NULL;
+		pthread_mutex_lock(&lsm->work_lock);
+		lsm->has_frozen = false;
+		pthread_mutex_unlock(&lsm->work_lock);
+	}
+	pthread_rwlock_unlock(&lsm->lock);
+
+	free_entries(&garbage);
+	for (i = 0; i < nr; i++)
+		discard_run(lsm, old[i]);
+	return true;
+}
+
+/* Tombstones only matter while something below them has keys */
+static int is_bottom(const struct rdx_rb_lsm_levels *levels, int level)
+{
+	int i;
+
+	for (i = level; i < RDX_RB_LSM_LEVELS; i++)
+		if (levels->levels[i])
+			return false;
+	return true;
+}
+
+static int flush_frozen(struct rdx_rb_lsm *lsm)
+{
+	struct rdx_rb_lsm_levels next = lsm->current;
+	int drop = !next.nr_l0 && is_bottom(&next, 0);
+	struct rdx_rb_lsm_run *run;
+	struct run_writer writer;
+	struct rdx_rb_node *node;
+	struct lsm_entry *entry;
+
+	if (writer_start(lsm, &writer, lsm->frozen_count))
+		for (node = rdx_rb_first(&lsm->frozen); node;
+		     node = rdx_rb_next(node)) {
+			entry = entry_of(node);
+			if (!entry->tombstone)
+				writer_add(lsm, &writer, entry->key, 0,
+					   value_of(lsm, entry));
+			else if (!drop)
+				writer_add(lsm, &writer, entry->key,
+					   TOMBSTONE, NULL);
+		}
+	if (!writer_finish(lsm, &writer, &run))
+		return false;
+	if (run) {
+		memmove(next.l0 + 1, next.l0, next.nr_l0 * sizeof(*next.l0));
+		next.l0[0] = run;
+		next.nr_l0++;
+	}
+	return install(lsm, &next, run, NULL, 0, true);
+}
+
+/* Merge level 0 into level 1, or level @level into the one below */
+static int compact(struct rdx_rb_lsm *lsm, int level)
+{
+	struct rdx_rb_lsm_levels next = lsm->current;
+	struct rdx_rb_lsm_run *inputs[RDX_RB_LSM_L0 + 1], *run;
+	struct cursor cursors[RDX_RB_LSM_L0 + 1], *cursor;
+	struct run_writer writer;
+	uint64_t max_count = 0, key;
+	size_t nr = 0, i;
+	int drop;
+
+	if (!level) {
+		for (i = 0; i < next.nr_l0; i++)
+			inputs[nr++] = next.l0[i];
+		next.nr_l0 = 0;
+	} else {
+		inputs[nr++] = next.levels[level - 1];
+		next.levels[level - 1] = NULL;
+	}
+	if (next.levels[level])
+		inputs[nr++] = next.levels[level];
+	drop = is_bottom(&next, level + 1);
+
+	for (i = 0; i < nr; i++) {
+		cursor_init(lsm, &cursors[i], NULL, inputs[i], 0);
+		max_count += inputs[i]->count;
+	}
+	if (writer_start(lsm, &writer, max_count))
+		while ((cursor = merge_pick(cursors, nr))) {
+			key = cursor->key;
+			if (!drop || !(cursor->flags & TOMBSTONE))
+				writer_add(lsm, &writer, key, cursor->flags,
+					   cursor->value);
+			merge_skip(lsm, cursors, nr, key);
+		}
+	if (!writer_finish(lsm, &writer, &run))
+		return false;
+	next.levels[level] = run;
+	return install(lsm, &next, run, inputs, nr, false);
+}
+
+/* The first level over its size, 0 for a full level 0, or -1 */
+static int compaction_due(struct rdx_rb_lsm *lsm)
+{
+	uint64_t budget = lsm->memtable_limit * RDX_RB_LSM_L0;
+	int i;
+
+	if (lsm->current.nr_l0 == RDX_RB_LSM_L0)
+		return 0;
+	for (i = 0; i + 1 < RDX_RB_LSM_LEVELS; i++, budget *= RDX_RB_LSM_FANOUT)
+		if (lsm->current.levels[i] &&
+		    lsm->current.levels[i]->count > budget)
+			return i + 1;
+	return -1;
+}
+
+/*
+ * Make room in level 0 first, as the frozen memtable goes there; then
+ * flush it, so that writers can go on; then compact the rest.
+ */
+static void *lsm_worker(void *data)
+{
+	struct rdx_rb_lsm *lsm = data;
+	int level, frozen, ok;
+
+	pthread_mutex_lock(&lsm->work_lock);
+	for (;;) {
+		while (!lsm->stop && (lsm->error ||
+		       (!lsm->has_frozen && compaction_due(lsm) < 0)))
+			pthread_cond_wait(&lsm->work, &lsm->work_lock);
+		if (lsm->stop)
+			break;
+		frozen = lsm->has_frozen;
+		pthread_mutex_unlock(&lsm->work_lock);
+
+		level = compaction_due(lsm);
+		if (frozen && level)
+			ok = flush_frozen(lsm);
+		else
+			ok = compact(lsm, level);
+
+		pthread_mutex_lock(&lsm->work_lock);
+		if (!ok)
+			lsm->error = true;
+		pthread_cond_broadcast(&lsm->done);
+	}
+	pthread_mutex_unlock(&lsm->work_lock);
+	return NULL;
+}
+
+/*
+ * Opening and closing
+ */
+
+static void close_runs(struct rdx_rb_lsm_levels *levels)
+{
+	struct rdx_rb_lsm_run *runs[MAX_RUNS];
+	size_t nr = runs_of(levels, runs), i;
+
+	for (i = 0; i < nr; i++)
+		free_run(runs[i]);
+	memset(levels, 0, sizeof(*levels));
+}
+
+static int load_manifest(struct rdx_rb_lsm *lsm)
+{
+	struct rdx_rb_lsm_levels *levels = &lsm->current;
+	struct manifest manifest;
+	char *path;
+	uint32_t crc;
+	size_t i;
+	int fd, ok;
+
+	if (asprintf(&path, "%s/MANIFEST", lsm->dir) < 0)
+		return false;
+	fd = open(path, O_RDONLY);
+	free(path);
+	if (fd < 0)
+		return errno == ENOENT;
+	ok = read_all(fd, &manifest, sizeof(manifest), 0);
+	close(fd);
+	crc = manifest.crc;
+	manifest.crc = 0;
+	if (!ok || memcmp(manifest.magic, MANIFEST_MAGIC,
+			  sizeof(manifest.magic)) ||
+	    crc != checksum(&manifest, sizeof(manifest)) ||
+	    manifest.nr_l0 > RDX_RB_LSM_L0)
+		return false;
+
+	lsm->next_id = manifest.next_id;
+	for (i = 0; i < manifest.nr_l0; i++) {
+		levels->l0[i] = map_run(lsm, manifest.l0[i]);
+		if (!levels->l0[i])
+			goto fail;
+		levels->nr_l0++;
+	}
+	for (i = 0; i < RDX_RB_LSM_LEVELS; i++) {
+		if (!manifest.levels[i])
+			continue;
+		levels->levels[i] = map_run(lsm, manifest.levels[i]);
+		if (!levels->levels[i])
+			goto fail;
+	}
+	return true;
+
+fail:
+	close_runs(levels);
+	return false;
+}
+
+/* Remove runs a crash left behind before the manifest named them */
+static void remove_orphans(struct rdx_rb_lsm *lsm)
+{
+	struct rdx_rb_lsm_run *runs[MAX_RUNS];
+	size_t nr = runs_of(&lsm->current, runs), i;
+	unsigned long long id;
+	struct dirent *dirent;
+	char suffix[8];
+	DIR *dir;
+
+	dir = opendir(lsm->dir);
+	if (!dir)
+		return;
+	while ((dirent = readdir(dir))) {
+		if (sscanf(dirent->d_name, "%llu%7s", &id, suffix) != 2 ||
+		    strcmp(suffix, ".run"))
+			continue;
+		for (i = 0; i < nr && runs[i]->id != id; i++)
+			;
+		if (i == nr)
+			unlinkat(dirfd(dir), dirent->d_name, 0);
+	}
+	closedir(dir);
+}
+
+int rdx_rb_lsm_open(struct rdx_rb_lsm *lsm, const char *dir,
+		    const struct rdx_rb_lsm_ops *ops, void *arg,
+		    size_t memtable_limit)
+{
+	pthread_rwlockattr_t attr;
+	int ok;
+
+	memset(lsm, 0, sizeof(*lsm));
+	lsm->ops = ops;
+	lsm->arg = arg;
+	lsm->memtable_limit = memtable_limit ? memtable_limit : LSM_MEMTABLE;
+	lsm->memtable = RDX_RB_ROOT(lsm_compare, lsm_compare);
+	lsm->frozen = RDX_RB_ROOT(lsm_compare, lsm_compare);
+	lsm->next_id = 1;
+	lsm->dir = strdup(dir);
+	if (!lsm->dir)
+		return false;
+	if ((mkdir(dir, 0755) && errno != EEXIST) || !load_manifest(lsm)) {
+		free(lsm->dir);
+		return false;
+	}
+	remove_orphans(lsm);
+
+	/* Readers come back to back, writers must not starve */
+	ok = !pthread_rwlockattr_init(&attr);
+	ok = ok && !pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) &&
+	     !pthread_rwlock_init(&lsm->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (!ok)
+		goto fail;
+	pthread_mutex_init(&lsm->work_lock, NULL);
+	pthread_cond_init(&lsm->work, NULL);
+	pthread_cond_init(&lsm->done, NULL);
+	if (!pthread_create(&lsm->thread, NULL, lsm_worker, lsm))
+		return true;
+
+	pthread_cond_destroy(&lsm->done);
+	pthread_cond_destroy(&lsm->work);
+	pthread_mutex_destroy(&lsm->work_lock);
+	pthread_rwlock_destroy(&lsm->lock);
+fail:
+	close_runs(&lsm->current);
+	free(lsm->dir);
+	return false;
+}
+
+int rdx_rb_lsm_close(struct rdx_rb_lsm *lsm)
+{
+	int ok = rdx_rb_lsm_flush(lsm);
+
+	pthread_mutex_lock(&lsm->work_lock);
+	lsm->stop = true;
+	pthread_cond_signal(&lsm->work);
+	pthread_mutex_unlock(&lsm->work_lock);
+	pthread_join(lsm->thread, NULL);
+
+	close_runs(&lsm->current);
+	free_entries(&lsm->memtable);
+	free_entries(&lsm->frozen);
+	pthread_cond_destroy(&lsm->done);
+	pthread_cond_destroy(&lsm->work);
+	pthread_mutex_destroy(&lsm->work_lock);
+	pthread_rwlock_destroy(&lsm->lock);
+	free(lsm->dir);
+	return ok;
+}
+
+/*
+ * Changes
+ */
+
+static int lsm_failed(struct rdx_rb_lsm *lsm)
+{
+	int error;
+
+	pthread_mutex_lock(&lsm->work_lock);
+	error = lsm->error;
+	pthread_mutex_unlock(&lsm->work_lock);
+	return error;
+}
+
+/*
+ * Once background work fails nothing more is written out, so changes are
+ * turned away rather than left to pile up in the memtable.
+ */
+static int lsm_write(struct rdx_rb_lsm *lsm, uint64_t key, const void *value)
+{
+	int ok;
+
+	if (lsm_failed(lsm))
+		return false;
+	lsm_current = lsm;
+	pthread_rwlock_wrlock(&lsm->lock);
+	/* Let the memtable run over while the last one is written, not on */
+	while (lsm->memtable_count >= 2 * lsm->memtable_limit &&
+	       !freeze(lsm)) {
+		pthread_rwlock_unlock(&lsm->lock);
+		if (!wait_frozen(lsm))
+			return false;
+		pthread_rwlock_wrlock(&lsm->lock);
+	}
+	ok = memtable_write(lsm, key, value);
+	if (lsm->memtable_count >= lsm->memtable_limit)
+		freeze(lsm);
+	pthread_rwlock_unlock(&lsm->lock);
+	return ok;
+}
+
+int rdx_rb_lsm_put(struct rdx_rb_lsm *lsm, uint64_t key, const void *value)
+{
+	return lsm_write(lsm, key, value);
+}
+
+int rdx_rb_lsm_erase(struct rdx_rb_lsm *lsm, uint64_t key)
+{
+	return lsm_write(lsm, key, NULL);
+}
+
+int rdx_rb_lsm_flush(struct rdx_rb_lsm *lsm)
+{
+	int empty;
+
+	do {
+		if (!wait_frozen(lsm))
+			return false;
+		pthread_rwlock_wrlock(&lsm->lock);
+		empty = freeze(lsm);
+		pthread_rwlock_unlock(&lsm->lock);
+	} while (!empty);
+	return wait_frozen(lsm);
+}
+
+/*
+ * Lookups
+ */
+
+int rdx_rb_lsm_get(struct rdx_rb_lsm *lsm, uint64_t key, void *value)
+{
+	struct rdx_rb_lsm_run *runs[MAX_RUNS];
+	const uint64_t *record = NULL;
+	const void *found = NULL;
+	struct lsm_entry *entry;
+	size_t nr, i;
+
+	pthread_rwlock_rdlock(&lsm->lock);
+	entry = tree_find(&lsm->memtable, key);
+	if (!entry)
+		entry = tree_find(&lsm->frozen, key);
+	if (entry) {
+		if (!entry->tombstone)
+			found = value_of(lsm, entry);
+	} else {
+		nr = runs_of(&lsm->current, runs);
+		for (i = 0; i < nr && !record; i++)
+			record = run_find(lsm, runs[i], key);
+		if (record && !(record[1] & TOMBSTONE))
+			found = record + 2;
+	}
+	if (found)
+		memcpy(value, found, lsm->ops->value_size);
+	pthread_rwlock_unlock(&lsm->lock);
+	return found != NULL;
+}
+
+void rdx_rb_lsm_scan(struct rdx_rb_lsm *lsm, uint64_t first, uint64_t last,
+		     void (*fn)(uint64_t key, const void *value, void *arg),
+		     void *arg)
+{
+	struct rdx_rb_lsm_run *runs[MAX_RUNS];
+	struct cursor cursors[MAX_RUNS + 2], *cursor;
+	size_t nr, i;
+	uint64_t key;
+
+	pthread_rwlock_rdlock(&lsm->lock);
+	cursor_init(lsm, &cursors[0], tree_lower_bound(&lsm->memtable, first),
+		    NULL, 0);
+	cursor_init(lsm, &cursors[1], tree_lower_bound(&lsm->frozen, first),
+		    NULL, 0);
+	nr = runs_of(&lsm->current, runs);
+	for (i = 0; i < nr; i++)
+		cursor_init(lsm, &cursors[i + 2], NULL, runs[i],
+			    run_lower_bound(lsm, runs[i], first));
+	while ((cursor = merge_pick(cursors, nr + 2)) && cursor->key <= last) {
+		key = cursor->key;
+		if (!(cursor->flags & TOMBSTONE))
+			fn(key, cursor->value, arg);
+		merge_skip(lsm, cursors, nr + 2, key);
+	}
+	pthread_rwlock_unlock(&lsm->lock);
+}
+
+/*
+ * Range aggregates. Sources are numbered newest first: the memtable, the
+ * frozen one, then the runs. A key counts from the newest source that has
+ * it, so a subtree or a block counts whole only where no newer source has
+ * any key in its span, and otherwise key by key.
+ */
+
+struct aggregate_ctx {
+	struct rdx_rb_lsm *lsm;
+	uint64_t first, last;
+	struct rdx_rb_lsm_run *runs[MAX_RUNS];
+	size_t nr_runs;
+	void *acc;
+};
+
+static int key_shadowed(struct aggregate_ctx *ctx, size_t source,
+			uint64_t key)
+{
+	size_t i;
+
+	for (i = 0; i < source; i++)
+		if (i == 0 ? tree_find(&ctx->lsm->memtable, key) != NULL :
+		    i == 1 ? tree_find(&ctx->lsm->frozen, key) != NULL :
+		    run_find(ctx->lsm, ctx->runs[i - 2], key) != NULL)
+			return true;
+	return false;
+}
+
+static int span_shadowed(struct aggregate_ctx *ctx, size_t source,
+			 uint64_t first, uint64_t last)
+{
+	size_t i;
+
+	for (i = 0; i < source; i++)
+		if (i == 0 ? tree_has_span(&ctx->lsm->memtable, first, last) :
+		    i == 1 ? tree_has_span(&ctx->lsm->frozen, first, last) :
+		    run_has_span(ctx->lsm, ctx->runs[i - 2], first, last))
+			return true;
+	return false;
+}
+
+static void aggregate_entry(struct aggregate_ctx *ctx, size_t source,
+			    struct lsm_entry *entry)
+{
+	if (!entry->tombstone && !key_shadowed(ctx, source, entry->key))
+		ctx->lsm->ops->accumulate(ctx->acc, entry->key,
+					  value_of(ctx->lsm, entry),
+					  ctx->lsm->arg);
+}
+
+static void aggregate_subtree(struct aggregate_ctx *ctx, size_t source,
+			      struct rdx_rb_node *node)
+{
+	struct rdx_rb_node *first, *last;
+
+	for (; node; node = node->rb_right) {
+		for (first = node; first->rb_left; first = first->rb_left)
+			;
+		for (last = node; last->rb_right; last = last->rb_right)
+			;
+		if (!span_shadowed(ctx, source, entry_of(first)->key,
+				   entry_of(last)->key)) {
+			ctx->lsm->ops->combine(ctx->acc, entry_of(node)->data,
+					       ctx->lsm->arg);
+			return;
+		}
+		aggregate_subtree(ctx, source, node->rb_left);
+		aggregate_entry(ctx, source, entry_of(node));
+	}
+}
+
+/* As in rbtree_mvcc.c */
+static void aggregate_tree(struct aggregate_ctx *ctx, size_t source,
+			   struct rdx_rb_node *node, int lower, int upper)
+{
+	while (node) {
+		struct lsm_entry *entry = entry_of(node);
+
+		if (!lower && !upper) {
+			aggregate_subtree(ctx, source, node);
+			return;
+		}
+		if (lower && entry->key < ctx->first) {
+			node = node->rb_right;
+		} else if (upper && entry->key > ctx->last) {
+			node = node->rb_left;
+		} else {
+			aggregate_tree(ctx, source, node->rb_left, lower,
+				       false);
+			aggregate_entry(ctx, source, entry);
+			lower = false;
+			node = node->rb_right;
+		}
+	}
+}
+
+static void aggregate_run(struct aggregate_ctx *ctx, size_t source)
+{
+	struct rdx_rb_lsm *lsm = ctx->lsm;
+	const struct rdx_rb_lsm_run *run = ctx->runs[source - 2];
+	const uint64_t *fence, *record;
+	uint64_t block, index, end;
+
+	block = run_lower_bound(lsm, run, ctx->first) / RDX_RB_LSM_FENCE;
+	for (; block < run->nr_fences; block++) {
+		fence = run_fence(lsm, run, block);
+		if (fence[0] > ctx->last)
+			break;
+		if (fence[0] >= ctx->first && fence[1] <= ctx->last &&
+		    !span_shadowed(ctx, source, fence[0], fence[1])) {
+			lsm->ops->combine(ctx->acc, fence + 2, lsm->arg);
+			continue;
+		}
+		index = block * RDX_RB_LSM_FENCE;
+		end = index + RDX_RB_LSM_FENCE;
+		if (end > run->count)
+			end = run->count;
+		for (; index < end; index++) {
+			record = run_record(lsm, run, index);
+			if (record[0] < ctx->first)
+				continue;
+			if (record[0] > ctx->last)
+				break;
+			if (!(record[1] & TOMBSTONE) &&
+			    !key_shadowed(ctx, source, record[0]))
+				lsm->ops->accumulate(ctx->acc, record[0],
+						     record + 2, lsm->arg);
+		}
+	}
+}
+
+void rdx_rb_lsm_aggregate(struct rdx_rb_lsm *lsm, uint64_t first,
+			  uint64_t last, void *result)
+{
+	struct aggregate_ctx ctx = {
+		.lsm = lsm, .first = first, .last = last, .acc = result
+	};
+	size_t i;
+
+	if (!lsm->ops->aggregate_size)
+		return;
+	lsm->ops->init(result, lsm->arg);
+	pthread_rwlock_rdlock(&lsm->lock);
+	ctx.nr_runs = runs_of(&lsm->current, ctx.runs);
+	aggregate_tree(&ctx, 0, lsm->memtable.rb_node, true, true);
+	aggregate_tree(&ctx, 1, lsm->frozen.rb_node, true, true);
+	for (i = 0; i < ctx.nr_runs; i++)
+		aggregate_run(&ctx, i + 2);
+	pthread_rwlock_unlock(&lsm->lock);
+}
@@ -0,0 +1,136 @@
+/*
+  Red Black Trees - log-structured merge trees
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_LSM_H
+#define _RDX_RBTREE_LSM_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * A map from 64-bit keys to values of @value_size bytes that takes writes
+ * faster than one tree could hold them. Writes go to the memtable, an
+ * augmented tree; once that is full it is frozen and a background thread
+ * flushes it to an immutable sorted run, a file in @dir mapped into memory.
+ * Runs make up levels: level 0 takes flushed memtables, up to
+ * RDX_RB_LSM_L0 of them, overlapping; from level 1 on every level is a
+ * single run, each RDX_RB_LSM_FANOUT times the size of the one above, and
+ * the same background thread compacts a level into the next once it is
+ * over its size. Erasing writes a tombstone, dropped once compaction takes
+ * it to the deepest level.
+ *
+ * Reads look at the memtable, the frozen one and the runs from newest to
+ * oldest and stop at the first that has the key. Every run has a Bloom
+ * filter to skip it cheaply when it does not, and a fence index, the first
+ * and last key of every RDX_RB_LSM_FENCE records, to find the key when it
+ * does. Scans merge all of them.
+ *
+ * Range aggregates use @init, @accumulate and @combine on accumulators of
+ * @aggregate_size bytes (0 for none), which must be commutative. The
+ * memtables keep the aggregate of every subtree and the fence index that
+ * of every block, so a range takes whole subtrees and whole blocks where
+ * nothing newer overrides any of their keys, and goes key by key only
+ * where something might.
+ *
+ * The memtable is in memory only: whatever rdx_rb_lsm_flush() has not
+ * written out is lost in a crash. Every call takes a reader/writer lock
+ * itself.
+ */
+
+#define RDX_RB_LSM_L0		4
+#define RDX_RB_LSM_LEVELS	8
+#define RDX_RB_LSM_FANOUT	10
+#define RDX_RB_LSM_FENCE	64
+
+struct rdx_rb_lsm_ops {
+	size_t value_size, aggregate_size;
+	void (*init)(void *acc, void *arg);
+	void (*accumulate)(void *acc, uint64_t key, const void *value,
+			   void *arg);
+	void (*combine)(void *acc, const void *other, void *arg);
+};
+
+struct rdx_rb_lsm_run;
+
+struct rdx_rb_lsm_levels {
+	struct rdx_rb_lsm_run *l0[RDX_RB_LSM_L0];
+	size_t nr_l0;
+	/* levels[i] is level i + 1, NULL while empty */
+	struct rdx_rb_lsm_run *levels[RDX_RB_LSM_LEVELS];
+};
+
+struct rdx_rb_lsm {
+	/* Guards both memtables and the levels */
+	pthread_rwlock_t lock;
+	char *dir;
+	const struct rdx_rb_lsm_ops *ops;
+	void *arg;
+	size_t memtable_limit, memtable_count, frozen_count;
+	struct rdx_rb_root memtable, frozen;
+	int has_frozen;
+	struct rdx_rb_lsm_levels current;
+	uint64_t next_id;
+	/* The background thread, and those waiting for it */
+	pthread_t thread;
+	pthread_mutex_t work_lock;
+	pthread_cond_t work, done;
+	int stop, error;
+};
+
+/*
+ * Open the tree in @dir, creating the directory if need be, with a
+ * memtable of @memtable_limit keys (0 picks a default). Returns false on
+ * I/O errors, a corrupt run or manifest, or running out of memory.
+ */
+extern int
+rdx_rb_lsm_open(struct rdx_rb_lsm *lsm, const char *dir,
+		const struct rdx_rb_lsm_ops *ops, void *arg,
+		size_t memtable_limit);
+/* Flushes, then closes */
+extern int rdx_rb_lsm_close(struct rdx_rb_lsm *lsm);
+
+/*
+ * Return false when out of memory, or once background work has failed,
+ * in which case the change is not made.
+ */
+extern int rdx_rb_lsm_put(struct rdx_rb_lsm *lsm, uint64_t key,
+			  const void *value);
+extern int rdx_rb_lsm_erase(struct rdx_rb_lsm *lsm, uint64_t key);
+
+/* Copies the value out, returning false if there is none */
+extern int rdx_rb_lsm_get(struct rdx_rb_lsm *lsm, uint64_t key, void *value);
+
+/* Call @fn on every key from @first to @last in order, holding the lock */
+extern void
+rdx_rb_lsm_scan(struct rdx_rb_lsm *lsm, uint64_t first, uint64_t last,
+		void (*fn)(uint64_t key, const void *value, void *arg),
+		void *arg);
+/* Set @result to the aggregate of every key from @first to @last */
+extern void
+rdx_rb_lsm_aggregate(struct rdx_rb_lsm *lsm, uint64_t first, uint64_t last,
+		     void *result);
+
+/*
+ * Write the memtable out and wait for it to land. Returns false if that,
+ * or any background work since opening, failed.
+ */
+extern int rdx_rb_lsm_flush(struct rdx_rb_lsm *lsm);
+
+#endif	/* _RDX_RBTREE_LSM_H */
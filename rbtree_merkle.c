@@ -0,0 +1,162 @@
+/*
+  Red Black Trees - Merkle hashes
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "rbtree_merkle.h"
+
+static inline uint64_t subtree_hash(const struct rdx_rb_node *node)
+{
+	return node ? rdx_rb_merkle_entry(node)->hash : 0;
+}
+
+static inline uint64_t merkle_compute(struct rdx_rb_merkle_node *node)
+{
+	return node->self + subtree_hash(node->node.rb_left) +
+	       subtree_hash(node->node.rb_right);
+}
+
+RDX_RB_DECLARE_CALLBACKS(, rdx_rb_merkle_callbacks,
+			 struct rdx_rb_merkle_node, node, uint64_t, hash,
+			 merkle_compute, merkle_tree);
+
+int rdx_rb_merkle_insert(struct rdx_rb_merkle_node *node,
+			 struct rdx_rb_root *root)
+{
+	return merkle_tree_insert(node, root);
+}
+
+void rdx_rb_merkle_erase(struct rdx_rb_merkle_node *node,
+			 struct rdx_rb_root *root)
+{
+	merkle_tree_erase(node, root);
+}
+
+void rdx_rb_merkle_update(struct rdx_rb_merkle_node *node, uint64_t hash)
+{
+	rdx_rb_merkle_set(node, hash);
+	rdx_rb_merkle_callbacks_propagate(&node->node, NULL);
+}
+
+/*
+ * As in rbtree_mvcc.c, with bounds that are either inclusive, for
+ * rdx_rb_merkle_range_hash(), or exclusive, for the diff below.
+ */
+static uint64_t range_hash(struct rdx_rb_root *root, struct rdx_rb_node *node,
+			   struct rdx_rb_node *first, struct rdx_rb_node *last,
+			   int exclusive)
+{
+	uint64_t hash = 0;
+
+	while (node) {
+		if (!first && !last)
+			return hash + subtree_hash(node);
+		if (first && root->strict_compare(node, first) < exclusive) {
+			node = node->rb_right;
+		} else if (last && root->strict_compare(node, last) > -exclusive) {
+			node = node->rb_left;
+		} else {
+			hash += range_hash(root, node->rb_left, first, NULL,
+					   exclusive);
+			hash += rdx_rb_merkle_entry(node)->self;
+			first = NULL;
+			node = node->rb_right;
+		}
+	}
+	return hash;
+}
+
+uint64_t rdx_rb_merkle_range_hash(struct rdx_rb_root *root,
+				  struct rdx_rb_node *first,
+				  struct rdx_rb_node *last)
+{
+	return range_hash(root, root->rb_node, first, last, false);
+}
+
+struct diff_ctx {
+	struct rdx_rb_root *a, *b;
+	void (*fn)(struct rdx_rb_node *a, struct rdx_rb_node *b, void *arg);
+	void *arg;
+};
+
+static struct rdx_rb_node *find(struct rdx_rb_root *root,
+				struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node *node = root->rb_node;
+
+	while (node) {
+		int result = root->strict_compare(elem, node);
+		if (result < 0)
+			node = node->rb_left;
+		else if (result > 0)
+			node = node->rb_right;
+		else
+			return node;
+	}
+	return NULL;
+}
+
+/* Every node of @b strictly between @lo and @hi, @a having none there */
+static void diff_missing(struct diff_ctx *ctx, struct rdx_rb_node *lo,
+			 struct rdx_rb_node *hi)
+{
+	struct rdx_rb_root *b = ctx->b;
+	struct rdx_rb_node *node = b->rb_node, *first = NULL;
+
+	while (node) {
+		if (lo && b->strict_compare(node, lo) <= 0) {
+			node = node->rb_right;
+		} else {
+			first = node;
+			node = node->rb_left;
+		}
+	}
+	for (node = first; node && (!hi || b->strict_compare(node, hi) < 0);
+	     node = rdx_rb_next(node))
+		ctx->fn(NULL, node, ctx->arg);
+}
+
+/*
+ * @node is the subtree of @a holding exactly its keys between @lo and @hi,
+ * so its hash is there to compare with that of the same range of @b.
+ */
+static void diff_range(struct diff_ctx *ctx, struct rdx_rb_node *node,
+		       struct rdx_rb_node *lo, struct rdx_rb_node *hi)
+{
+	struct rdx_rb_node *other;
+
+	for (; node; lo = node, node = node->rb_right) {
+		if (subtree_hash(node) ==
+		    range_hash(ctx->b, ctx->b->rb_node, lo, hi, true))
+			return;
+		diff_range(ctx, node->rb_left, lo, node);
+		other = find(ctx->b, node);
+		if (!other || rdx_rb_merkle_entry(other)->self !=
+			      rdx_rb_merkle_entry(node)->self)
+			ctx->fn(node, other, ctx->arg);
+	}
+	diff_missing(ctx, lo, hi);
+}
+
+void rdx_rb_merkle_diff(struct rdx_rb_root *a, struct rdx_rb_root *b,
+			void (*fn)(struct rdx_rb_node *a, struct rdx_rb_node *b,
+				   void *arg),
+			void *arg)
+{
+	struct diff_ctx ctx = { a, b, fn, arg };
+
+	diff_range(&ctx, a->rb_node, NULL, NULL);
+}
@@ -0,0 +1,100 @@
+/*
+  Red Black Trees - Merkle hashes
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_MERKLE_H
+#define _RDX_RBTREE_MERKLE_H
+
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Hashes to tell whether two trees hold the same, and where not. Every
+ * node carries a hash of its own key and value, and the augmentation
+ * keeps the sum of those over its subtree. A sum does not care about
+ * order, so the hash of a set of nodes is the same whatever shape the
+ * tree has, and the hash of any key range comes out of one descent, whole
+ * subtrees at a time. Replicas built in different orders, which have
+ * different shapes, can thus still be compared range by range.
+ *
+ * Embed a struct rdx_rb_merkle_node where the struct rdx_rb_node would
+ * go, set @self with rdx_rb_merkle_set() before inserting, and change it
+ * in the tree with rdx_rb_merkle_update() only. Anything else that takes
+ * augment callbacks takes rdx_rb_merkle_callbacks.
+ */
+
+struct rdx_rb_merkle_node {
+	struct rdx_rb_node node;
+	/* Of this node alone, and of its whole subtree */
+	uint64_t self, hash;
+};
+
+extern const struct rdx_rb_augment_callbacks rdx_rb_merkle_callbacks;
+
+static inline struct rdx_rb_merkle_node *
+rdx_rb_merkle_entry(const struct rdx_rb_node *node)
+{
+	return node ? rdx_rb_entry(node, struct rdx_rb_merkle_node, node) :
+		      NULL;
+}
+
+/* @hash of the key and value, spread out well enough to be summed */
+static inline void rdx_rb_merkle_set(struct rdx_rb_merkle_node *node,
+				     uint64_t hash)
+{
+	/* The mix takes 0 to 0, which would make a node count for nothing */
+	hash += 0x9e3779b97f4a7c15ULL;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	node->self = hash ^ (hash >> 33);
+}
+
+extern int rdx_rb_merkle_insert(struct rdx_rb_merkle_node *node,
+				struct rdx_rb_root *root);
+extern void rdx_rb_merkle_erase(struct rdx_rb_merkle_node *node,
+				struct rdx_rb_root *root);
+extern void rdx_rb_merkle_update(struct rdx_rb_merkle_node *node,
+				 uint64_t hash);
+
+/* Of the whole tree, 0 when empty */
+static inline uint64_t rdx_rb_merkle_root_hash(const struct rdx_rb_root *root)
+{
+	return root->rb_node ? rdx_rb_merkle_entry(root->rb_node)->hash : 0;
+}
+
+/* Of every node from @first to @last by strict_compare, NULL for no bound */
+extern uint64_t
+rdx_rb_merkle_range_hash(struct rdx_rb_root *root, struct rdx_rb_node *first,
+			 struct rdx_rb_node *last);
+
+/*
+ * Call @fn, in key order, for every key where @a and @b differ: with the
+ * node of either side, NULL for the side without the key. Both trees must
+ * order by the same strict_compare. Ranges that hash the same on both
+ * sides are skipped whole, so d differences take O(d log^2 n): the
+ * O(d log n) nodes of @a above them, each with a range hash of @b.
+ */
+extern void
+rdx_rb_merkle_diff(struct rdx_rb_root *a, struct rdx_rb_root *b,
+		   void (*fn)(struct rdx_rb_node *a, struct rdx_rb_node *b,
+			      void *arg),
+		   void *arg);
+
+#endif	/* _RDX_RBTREE_MERKLE_H */
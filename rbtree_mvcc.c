@@ -0,0 +1,442 @@
+/*
+  Red Black Trees - multiversion concurrency control
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include "rbtree_mvcc.h"
+
+/*
+ * Writers change the tree under the lock held exclusively, one operation at
+ * a time, and readers hold it shared for one query at a time. A snapshot
+ * is merely a timestamp: once taken, nothing it can see ever changes.
+ * Snapshots are taken with the lock shared and the garbage collector runs
+ * with it exclusive, so a snapshot either shows up in the collector's scan
+ * or is at least as new as anything the collector prunes.
+ *
+ * The chain of a key is ordered newest first, and every version ends where
+ * the next newer one begins, so once one version is invisible to every
+ * open snapshot, so is everything older.
+ */
+
+struct rdx_rb_mvcc_key {
+	struct rdx_rb_node node;
+	struct rdx_rb_version *head;
+	uint64_t modified, subtree_modified;
+	struct rdx_rb_mvcc_key *next_garbage;
+	int in_garbage;
+	unsigned char aggregate[] __attribute__((aligned(16)));
+};
+
+/* The tree being worked on by this thread, for the callbacks below */
+static __thread struct rdx_rb_mvcc *mvcc_current;
+
+static struct rdx_rb_mvcc_key *key_of(struct rdx_rb_node *node)
+{
+	return node ? rdx_rb_entry(node, struct rdx_rb_mvcc_key, node) : NULL;
+}
+
+static int mvcc_compare(struct rdx_rb_node *left, struct rdx_rb_node *right)
+{
+	return mvcc_current->ops->compare(key_of(left)->head,
+					  key_of(right)->head);
+}
+
+static void key_compute(struct rdx_rb_mvcc_key *key)
+{
+	const struct rdx_rb_mvcc_ops *ops = mvcc_current->ops;
+	struct rdx_rb_mvcc_key *left = key_of(key->node.rb_left);
+	struct rdx_rb_mvcc_key *right = key_of(key->node.rb_right);
+	void *arg = mvcc_current->arg;
+
+	key->subtree_modified = key->modified;
+	ops->init(key->aggregate, arg);
+	if (left) {
+		ops->combine(key->aggregate, left->aggregate, arg);
+		if (left->subtree_modified > key->subtree_modified)
+			key->subtree_modified = left->subtree_modified;
+	}
+	if (key->head->end == RDX_RB_MVCC_INFINITY)
+		ops->accumulate(key->aggregate, key->head, arg);
+	if (right) {
+		ops->combine(key->aggregate, right->aggregate, arg);
+		if (right->subtree_modified > key->subtree_modified)
+			key->subtree_modified = right->subtree_modified;
+	}
+}
+
+static void mvcc_propagate(struct rdx_rb_node *node, struct rdx_rb_node *stop)
+{
+	for (; node != stop; node = rdx_rb_parent(node))
+		key_compute(key_of(node));
+}
+
+static void mvcc_copy(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	struct rdx_rb_mvcc_key *from = key_of(old), *to = key_of(new);
+
+	memcpy(to->aggregate, from->aggregate, mvcc_current->ops->size);
+	to->subtree_modified = from->subtree_modified;
+}
+
+static void mvcc_rotate(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	key_compute(key_of(old));
+	key_compute(key_of(new));
+}
+
+static const struct rdx_rb_augment_callbacks mvcc_callbacks = {
+	mvcc_propagate, mvcc_copy, mvcc_rotate
+};
+
+int rdx_rb_mvcc_init(struct rdx_rb_mvcc *tree, const struct rdx_rb_mvcc_ops *ops,
+		     void *arg, unsigned int nr_snapshots)
+{
+	pthread_rwlockattr_t attr;
+	int ok;
+
+	tree->root = RDX_RB_ROOT(mvcc_compare, mvcc_compare);
+	tree->ops = ops;
+	tree->arg = arg;
+	tree->clock = 0;
+	tree->txn = 0;
+	tree->nr_snapshots = nr_snapshots;
+	tree->garbage = NULL;
+	tree->snapshots = calloc(nr_snapshots, sizeof(*tree->snapshots));
+	if (!tree->snapshots)
+		return false;
+
+	/* Readers come back to back, writers must not starve */
+	if (pthread_rwlockattr_init(&attr))
+		goto fail;
+	pthread_rwlockattr_setkind_np(&attr,
+		PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	ok = !pthread_rwlock_init(&tree->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (!ok)
+		goto fail;
+	if (pthread_mutex_init(&tree->write_lock, NULL)) {
+		pthread_rwlock_destroy(&tree->lock);
+		goto fail;
+	}
+	return true;
+fail:
+	free(tree->snapshots);
+	return false;
+}
+
+static void dispose_chain(struct rdx_rb_mvcc *tree,
+			  struct rdx_rb_version *version)
+{
+	struct rdx_rb_version *older;
+
+	for (; version; version = older) {
+		older = version->older;
+		if (tree->ops->dispose)
+			tree->ops->dispose(version, tree->arg);
+	}
+}
+
+void rdx_rb_mvcc_destroy(struct rdx_rb_mvcc *tree)
+{
+	struct rdx_rb_node *node = rdx_rb_first_postorder(&tree->root), *next;
+
+	for (; node; node = next) {
+		next = rdx_rb_next_postorder(node);
+		dispose_chain(tree, key_of(node)->head);
+		free(key_of(node));
+	}
+	pthread_mutex_destroy(&tree->write_lock);
+	pthread_rwlock_destroy(&tree->lock);
+	free(tree->snapshots);
+}
+
+static struct rdx_rb_mvcc_key *find_key(struct rdx_rb_mvcc *tree,
+					const struct rdx_rb_version *version)
+{
+	struct rdx_rb_node *node = tree->root.rb_node;
+
+	while (node) {
+		int result = tree->ops->compare(version, key_of(node)->head);
+		if (!result)
+			return key_of(node);
+		node = result < 0 ? node->rb_left : node->rb_right;
+	}
+	return NULL;
+}
+
+/*
+ * Writers
+ */
+
+uint64_t rdx_rb_mvcc_begin(struct rdx_rb_mvcc *tree)
+{
+	pthread_mutex_lock(&tree->write_lock);
+	tree->txn = tree->clock + 1;
+	return tree->txn;
+}
+
+void rdx_rb_mvcc_commit(struct rdx_rb_mvcc *tree)
+{
+	__atomic_store_n(&tree->clock, tree->txn, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tree->write_lock);
+}
+
+/* Called with the lock held exclusively, after changing the chain of @key */
+static void key_changed(struct rdx_rb_mvcc *tree, struct rdx_rb_mvcc_key *key)
+{
+	key->modified = tree->txn;
+	mvcc_propagate(&key->node, NULL);
+	if (!key->in_garbage) {
+		key->in_garbage = true;
+		key->next_garbage = tree->garbage;
+		tree->garbage = key;
+	}
+}
+
+int rdx_rb_mvcc_put(struct rdx_rb_mvcc *tree, struct rdx_rb_version *version)
+{
+	struct rdx_rb_mvcc_key *key;
+
+	mvcc_current = tree;
+	pthread_rwlock_wrlock(&tree->lock);
+	version->begin = tree->txn;
+	version->end = RDX_RB_MVCC_INFINITY;
+
+	key = find_key(tree, version);
+	if (key) {
+		if (key->head->end == RDX_RB_MVCC_INFINITY)
+			key->head->end = tree->txn;
+		version->older = key->head;
+		key->head = version;
+		key_changed(tree, key);
+		pthread_rwlock_unlock(&tree->lock);
+		return true;
+	}
+
+	key = malloc(sizeof(*key) + tree->ops->size);
+	if (!key) {
+		pthread_rwlock_unlock(&tree->lock);
+		return false;
+	}
+	version->older = NULL;
+	key->head = version;
+	key->modified = tree->txn;
+	key->in_garbage = false;
+	rdx_rb_insert(&key->node, &tree->root);
+	rdx_rb_insert_augmented(&key->node, &tree->root, &mvcc_callbacks);
+	pthread_rwlock_unlock(&tree->lock);
+	return true;
+}
+
+int rdx_rb_mvcc_erase(struct rdx_rb_mvcc *tree,
+		      const struct rdx_rb_version *version)
+{
+	struct rdx_rb_mvcc_key *key;
+	int result = false;
+
+	mvcc_current = tree;
+	pthread_rwlock_wrlock(&tree->lock);
+	key = find_key(tree, version);
+	if (key && key->head->end == RDX_RB_MVCC_INFINITY) {
+		key->head->end = tree->txn;
+		key_changed(tree, key);
+		result = true;
+	}
+	pthread_rwlock_unlock(&tree->lock);
+	return result;
+}
+
+/*
+ * Readers
+ */
+
+int rdx_rb_mvcc_snapshot(struct rdx_rb_mvcc *tree,
+			 struct rdx_rb_mvcc_snapshot *snapshot)
+{
+	unsigned int i;
+
+	pthread_rwlock_rdlock(&tree->lock);
+	snapshot->ts = __atomic_load_n(&tree->clock, __ATOMIC_ACQUIRE);
+	for (i = 0; i < tree->nr_snapshots; i++) {
+		/* Slots hold the timestamp plus one, zero meaning free */
+		uint64_t free_slot = 0;
+		if (__atomic_compare_exchange_n(&tree->snapshots[i], &free_slot,
+						snapshot->ts + 1, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_RELAXED)) {
+			snapshot->slot = i;
+			pthread_rwlock_unlock(&tree->lock);
+			return true;
+		}
+	}
+	pthread_rwlock_unlock(&tree->lock);
+	return false;
+}
+
+void rdx_rb_mvcc_release(struct rdx_rb_mvcc *tree,
+			 struct rdx_rb_mvcc_snapshot *snapshot)
+{
+	__atomic_store_n(&tree->snapshots[snapshot->slot], 0, __ATOMIC_RELEASE);
+}
+
+static struct rdx_rb_version *visible(struct rdx_rb_mvcc_key *key, uint64_t ts)
+{
+	struct rdx_rb_version *version = key->head;
+
+	while (version && version->begin > ts)
+		version = version->older;
+	return version && ts < version->end ? version : NULL;
+}
+
+struct rdx_rb_version *
+rdx_rb_mvcc_find(struct rdx_rb_mvcc *tree, uint64_t ts,
+		 const struct rdx_rb_version *version)
+{
+	struct rdx_rb_mvcc_key *key;
+
+	pthread_rwlock_rdlock(&tree->lock);
+	key = find_key(tree, version);
+	version = key ? visible(key, ts) : NULL;
+	pthread_rwlock_unlock(&tree->lock);
+	return (struct rdx_rb_version *)version;
+}
+
+struct aggregate_ctx {
+	struct rdx_rb_mvcc *tree;
+	uint64_t ts;
+	void *acc;
+};
+
+static void aggregate_key(struct aggregate_ctx *ctx,
+			  struct rdx_rb_mvcc_key *key)
+{
+	struct rdx_rb_version *version = visible(key, ctx->ts);
+
+	if (version)
+		ctx->tree->ops->accumulate(ctx->acc, version, ctx->tree->arg);
+}
+
+static void aggregate_subtree(struct aggregate_ctx *ctx,
+			      struct rdx_rb_node *node)
+{
+	for (; node; node = node->rb_right) {
+		struct rdx_rb_mvcc_key *key = key_of(node);
+
+		if (key->subtree_modified <= ctx->ts) {
+			ctx->tree->ops->combine(ctx->acc, key->aggregate,
+						ctx->tree->arg);
+			return;
+		}
+		aggregate_subtree(ctx, node->rb_left);
+		aggregate_key(ctx, key);
+	}
+}
+
+/*
+ * Descend to the first key in range, which splits it into a part with
+ * only a lower bound to the left and one with only an upper bound to the
+ * right; those again split at their first key in range, and so on.
+ */
+static void aggregate_range(struct aggregate_ctx *ctx, struct rdx_rb_node *node,
+			    const struct rdx_rb_version *first,
+			    const struct rdx_rb_version *last)
+{
+	const struct rdx_rb_mvcc_ops *ops = ctx->tree->ops;
+
+	while (node) {
+		struct rdx_rb_mvcc_key *key = key_of(node);
+
+		if (!first && !last) {
+			aggregate_subtree(ctx, node);
+			return;
+		}
+		if (first && ops->compare(key->head, first) < 0) {
+			node = node->rb_right;
+		} else if (last && ops->compare(key->head, last) > 0) {
+			node = node->rb_left;
+		} else {
+			aggregate_range(ctx, node->rb_left, first, NULL);
+			aggregate_key(ctx, key);
+			first = NULL;
+			node = node->rb_right;
+		}
+	}
+}
+
+void rdx_rb_mvcc_aggregate(struct rdx_rb_mvcc *tree, uint64_t ts,
+			   const struct rdx_rb_version *first,
+			   const struct rdx_rb_version *last, void *result)
+{
+	struct aggregate_ctx ctx = { tree, ts, result };
+
+	tree->ops->init(result, tree->arg);
+	pthread_rwlock_rdlock(&tree->lock);
+	aggregate_range(&ctx, tree->root.rb_node, first, last);
+	pthread_rwlock_unlock(&tree->lock);
+}
+
+/*
+ * Garbage collection
+ */
+
+void rdx_rb_mvcc_gc(struct rdx_rb_mvcc *tree)
+{
+	struct rdx_rb_mvcc_key **link = &tree->garbage, *key;
+	uint64_t oldest;
+	unsigned int i;
+
+	mvcc_current = tree;
+	pthread_rwlock_wrlock(&tree->lock);
+	oldest = __atomic_load_n(&tree->clock, __ATOMIC_ACQUIRE);
+	for (i = 0; i < tree->nr_snapshots; i++) {
+		uint64_t slot = __atomic_load_n(&tree->snapshots[i],
+						__ATOMIC_ACQUIRE);
+		if (slot && slot - 1 < oldest)
+			oldest = slot - 1;
+	}
+
+	while ((key = *link)) {
+		struct rdx_rb_version **older = &key->head->older;
+
+		/* Erased, and nobody can tell any more */
+		if (key->head->end <= oldest) {
+			*link = key->next_garbage;
+			rdx_rb_erase_augmented(&key->node, &tree->root,
+					       &mvcc_callbacks);
+			dispose_chain(tree, key->head);
+			free(key);
+			continue;
+		}
+
+		while (*older && (*older)->end > oldest)
+			older = &(*older)->older;
+		dispose_chain(tree, *older);
+		*older = NULL;
+
+		if (key->head->end == RDX_RB_MVCC_INFINITY &&
+		    !key->head->older) {
+			*link = key->next_garbage;
+			key->in_garbage = false;
+		} else {
+			link = &key->next_garbage;
+		}
+	}
+	pthread_rwlock_unlock(&tree->lock);
+}
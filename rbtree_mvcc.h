@@ -0,0 +1,133 @@
+/*
+  Red Black Trees - multiversion concurrency control
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_MVCC_H
+#define _RDX_RBTREE_MVCC_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Every key in the tree holds a chain of versions, newest first. A version
+ * is visible at timestamp ts if begin <= ts < end. Writers commit whole
+ * transactions at a time, one after another, each at the next timestamp;
+ * readers take a snapshot of the last committed timestamp and query the
+ * tree as of then, for as long as they like, while writers carry on.
+ *
+ * The tree nodes are keys allocated by the tree itself, which carry the
+ * aggregate over the versions current as of the last write, and the latest
+ * timestamp anything below them changed at. Aggregating as of an older
+ * timestamp uses the stored aggregates of subtrees that did not change
+ * since, and descends into the others, so the cost grows with the number
+ * of changes since the snapshot rather than with the size of the range.
+ *
+ * Superseded versions stay around until rdx_rb_mvcc_gc() finds them
+ * invisible to every snapshot still open, and hands them to @dispose.
+ */
+
+#define RDX_RB_MVCC_INFINITY	UINT64_MAX
+
+/* Embedded in the caller's version structure */
+struct rdx_rb_version {
+	uint64_t begin, end;
+	struct rdx_rb_version *older;
+};
+
+/*
+ * @compare orders versions by key; versions of the same key compare equal.
+ * The aggregate callbacks work just like those of struct rdx_rb_reducer.
+ */
+struct rdx_rb_mvcc_ops {
+	int (*compare)(const struct rdx_rb_version *left,
+		       const struct rdx_rb_version *right);
+	size_t size;
+	void (*init)(void *acc, void *arg);
+	void (*accumulate)(void *acc, const struct rdx_rb_version *version,
+			   void *arg);
+	void (*combine)(void *acc, const void *right, void *arg);
+	void (*dispose)(struct rdx_rb_version *version, void *arg);
+};
+
+struct rdx_rb_mvcc_key;
+
+struct rdx_rb_mvcc {
+	pthread_rwlock_t lock;
+	pthread_mutex_t write_lock;
+	struct rdx_rb_root root;
+	const struct rdx_rb_mvcc_ops *ops;
+	void *arg;
+	uint64_t clock, txn;
+	unsigned int nr_snapshots;
+	uint64_t *snapshots;
+	/* Keys with superseded versions, for the garbage collector */
+	struct rdx_rb_mvcc_key *garbage;
+};
+
+struct rdx_rb_mvcc_snapshot {
+	uint64_t ts;
+	unsigned int slot;
+};
+
+/* Up to @nr_snapshots may be open at once. Returns false if out of memory */
+extern int
+rdx_rb_mvcc_init(struct rdx_rb_mvcc *tree, const struct rdx_rb_mvcc_ops *ops,
+		 void *arg, unsigned int nr_snapshots);
+/* Disposes of every version left */
+extern void rdx_rb_mvcc_destroy(struct rdx_rb_mvcc *tree);
+
+/*
+ * Writing. Everything between begin and commit becomes visible at once,
+ * at the timestamp returned by begin. rdx_rb_mvcc_put() makes @version the
+ * current version of its key, inserting the key if need be, and returns
+ * false only if out of memory. rdx_rb_mvcc_erase() returns false if the key
+ * has no current version.
+ */
+extern uint64_t rdx_rb_mvcc_begin(struct rdx_rb_mvcc *tree);
+extern int
+rdx_rb_mvcc_put(struct rdx_rb_mvcc *tree, struct rdx_rb_version *version);
+extern int
+rdx_rb_mvcc_erase(struct rdx_rb_mvcc *tree, const struct rdx_rb_version *key);
+extern void rdx_rb_mvcc_commit(struct rdx_rb_mvcc *tree);
+
+/* Returns false if @nr_snapshots are open already */
+extern int
+rdx_rb_mvcc_snapshot(struct rdx_rb_mvcc *tree,
+		     struct rdx_rb_mvcc_snapshot *snapshot);
+extern void
+rdx_rb_mvcc_release(struct rdx_rb_mvcc *tree,
+		    struct rdx_rb_mvcc_snapshot *snapshot);
+
+/*
+ * Reading as of @ts, which must not be older than some open snapshot.
+ * The aggregate covers keys from @first to @last inclusive, either of which
+ * may be NULL for no bound.
+ */
+extern struct rdx_rb_version *
+rdx_rb_mvcc_find(struct rdx_rb_mvcc *tree, uint64_t ts,
+		 const struct rdx_rb_version *key);
+extern void
+rdx_rb_mvcc_aggregate(struct rdx_rb_mvcc *tree, uint64_t ts,
+		      const struct rdx_rb_version *first,
+		      const struct rdx_rb_version *last, void *result);
+
+/* Prune whatever no open snapshot can see any more */
+extern void rdx_rb_mvcc_gc(struct rdx_rb_mvcc *tree);
+
+#endif	/* _RDX_RBTREE_MVCC_H */
@@ -0,0 +1,337 @@
+/*
+  Red Black Trees - offset-linked trees
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include "rbtree_offset.h"
+#include "stddef.h"
+
+/*
+ * The same algorithms as rbtree.c, only every link goes through the base of
+ * the region. As there, the color is the low bit of parent_color, which
+ * offsets of aligned nodes leave free.
+ */
+
+#define OFFSET_RED	0
+#define OFFSET_BLACK	1
+
+#define N(offset)	RDX_RB_ONODE(tree, offset)
+
+static inline uint64_t parent_of(const struct rdx_rb_otree *tree,
+				 uint64_t node)
+{
+	return N(node)->parent_color & ~(uint64_t)1;
+}
+
+/* Missing nodes count as black */
+static inline int is_black(const struct rdx_rb_otree *tree, uint64_t node)
+{
+	return !node || (N(node)->parent_color & 1);
+}
+
+static inline void touch(struct rdx_rb_otree *tree, uint64_t node)
+{
+	if (tree->touch && node)
+		tree->touch(tree, node);
+}
+
+static inline void set_parent(struct rdx_rb_otree *tree, uint64_t node,
+			      uint64_t parent)
+{
+	touch(tree, node);
+	N(node)->parent_color = parent | (N(node)->parent_color & 1);
+}
+
+static inline void set_color(struct rdx_rb_otree *tree, uint64_t node,
+			     int color)
+{
+	touch(tree, node);
+	N(node)->parent_color = (N(node)->parent_color & ~(uint64_t)1) | color;
+}
+
+/* Put @new where @old was below @parent */
+static void change_child(struct rdx_rb_otree *tree, uint64_t old, uint64_t new,
+			 uint64_t parent)
+{
+	if (!parent) {
+		*tree->root = new;
+		return;
+	}
+	touch(tree, parent);
+	if (N(parent)->left == old)
+		N(parent)->left = new;
+	else
+		N(parent)->right = new;
+}
+
+/*
+ * Rotate @node down to the left, or to the right if @right: its child on
+ * the other side takes its place.
+ */
+static void rotate(struct rdx_rb_otree *tree, uint64_t node, int right)
+{
+	uint64_t parent = parent_of(tree, node);
+	uint64_t child = right ? N(node)->left : N(node)->right;
+	uint64_t inner = right ? N(child)->right : N(child)->left;
+
+	touch(tree, node);
+	touch(tree, child);
+	if (right) {
+		N(node)->left = inner;
+		N(child)->right = node;
+	} else {
+		N(node)->right = inner;
+		N(child)->left = node;
+	}
+	if (inner)
+		set_parent(tree, inner, node);
+	change_child(tree, node, child, parent);
+	set_parent(tree, child, parent);
+	set_parent(tree, node, child);
+}
+
+uint64_t rdx_rb_olookup(const struct rdx_rb_otree *tree, const void *key,
+			int (*compare)(const void *key,
+				       const struct rdx_rb_onode *node,
+				       void *arg),
+			void *arg, uint64_t *parent, int *right)
+{
+	uint64_t node = *tree->root;
+
+	*parent = 0;
+	*right = false;
+	while (node) {
+		int diff = compare(key, N(node), arg);
+
+		if (!diff)
+			return node;
+		*parent = node;
+		*right = diff > 0;
+		node = *right ? N(node)->right : N(node)->left;
+	}
+	return 0;
+}
+
+void rdx_rb_oinsert(struct rdx_rb_otree *tree, uint64_t node, uint64_t parent,
+		    int right)
+{
+	touch(tree, node);
+	N(node)->parent_color = parent | OFFSET_RED;
+	N(node)->left = N(node)->right = 0;
+	if (!parent) {
+		*tree->root = node;
+	} else {
+		touch(tree, parent);
+		if (right)
+			N(parent)->right = node;
+		else
+			N(parent)->left = node;
+	}
+
+	/* Loop invariant: node is red */
+	while ((parent = parent_of(tree, node)) && !is_black(tree, parent)) {
+		/* A red parent is never the root */
+		uint64_t gparent = parent_of(tree, parent);
+		int left = N(gparent)->left == parent;
+		uint64_t uncle = left ? N(gparent)->right : N(gparent)->left;
+
+		if (!is_black(tree, uncle)) {
+			/* Color flips, then carry on from the grandparent */
+			set_color(tree, parent, OFFSET_BLACK);
+			set_color(tree, uncle, OFFSET_BLACK);
+			set_color(tree, gparent, OFFSET_RED);
+			node = gparent;
+			continue;
+		}
+		if (node == (left ? N(parent)->right : N(parent)->left)) {
+			/* Inner grandchild: rotate it to the outside first */
+			rotate(tree, parent, !left);
+			node = parent;
+			parent = parent_of(tree, node);
+		}
+		set_color(tree, parent, OFFSET_BLACK);
+		set_color(tree, gparent, OFFSET_RED);
+		rotate(tree, gparent, left);
+		break;
+	}
+	set_color(tree, *tree->root, OFFSET_BLACK);
+}
+
+/* @node, a black node or none below @parent, is a black short of the rest */
+static void erase_color(struct rdx_rb_otree *tree, uint64_t node,
+			uint64_t parent)
+{
+	while (node != *tree->root && is_black(tree, node)) {
+		int left = N(parent)->left == node;
+		uint64_t sibling = left ? N(parent)->right : N(parent)->left;
+		uint64_t near, far;
+
+		if (!is_black(tree, sibling)) {
+			/* Make the sibling black, the parent red */
+			set_color(tree, sibling, OFFSET_BLACK);
+			set_color(tree, parent, OFFSET_RED);
+			rotate(tree, parent, !left);
+			sibling = left ? N(parent)->right : N(parent)->left;
+		}
+		near = left ? N(sibling)->left : N(sibling)->right;
+		far = left ? N(sibling)->right : N(sibling)->left;
+		if (is_black(tree, near) && is_black(tree, far)) {
+			/* Take a black off both sides, carry on above */
+			set_color(tree, sibling, OFFSET_RED);
+			node = parent;
+			parent = parent_of(tree, node);
+			continue;
+		}
+		if (is_black(tree, far)) {
+			/* Move the red nephew to the outside */
+			set_color(tree, near, OFFSET_BLACK);
+			set_color(tree, sibling, OFFSET_RED);
+			rotate(tree, sibling, left);
+			sibling = left ? N(parent)->right : N(parent)->left;
+			far = left ? N(sibling)->right : N(sibling)->left;
+		}
+		set_color(tree, sibling, N(parent)->parent_color & 1);
+		set_color(tree, parent, OFFSET_BLACK);
+		set_color(tree, far, OFFSET_BLACK);
+		rotate(tree, parent, !left);
+		return;
+	}
+	if (node)
+		set_color(tree, node, OFFSET_BLACK);
+}
+
+void rdx_rb_oerase(struct rdx_rb_otree *tree, uint64_t node)
+{
+	uint64_t parent = parent_of(tree, node), child, rebalance_parent;
+	int black = is_black(tree, node);
+
+	if (!N(node)->left || !N(node)->right) {
+		/* At most one child, which takes the place of @node */
+		child = N(node)->left ? N(node)->left : N(node)->right;
+		change_child(tree, node, child, parent);
+		if (child)
+			set_parent(tree, child, parent);
+		rebalance_parent = parent;
+	} else {
+		/* The successor takes the place, and the color, of @node */
+		uint64_t successor = N(node)->right;
+
+		while (N(successor)->left)
+			successor = N(successor)->left;
+		black = is_black(tree, successor);
+		child = N(successor)->right;
+		if (parent_of(tree, successor) == node) {
+			rebalance_parent = successor;
+		} else {
+			rebalance_parent = parent_of(tree, successor);
+			change_child(tree, successor, child, rebalance_parent);
+			if (child)
+				set_parent(tree, child, rebalance_parent);
+			touch(tree, successor);
+			N(successor)->right = N(node)->right;
+			set_parent(tree, N(successor)->right, successor);
+		}
+		change_child(tree, node, successor, parent);
+		touch(tree, successor);
+		N(successor)->parent_color = N(node)->parent_color;
+		N(successor)->left = N(node)->left;
+		set_parent(tree, N(successor)->left, successor);
+	}
+	if (black)
+		erase_color(tree, child, rebalance_parent);
+}
+
+uint64_t rdx_rb_ofirst(const struct rdx_rb_otree *tree)
+{
+	uint64_t node = *tree->root;
+
+	while (node && N(node)->left)
+		node = N(node)->left;
+	return node;
+}
+
+uint64_t rdx_rb_olast(const struct rdx_rb_otree *tree)
+{
+	uint64_t node = *tree->root;
+
+	while (node && N(node)->right)
+		node = N(node)->right;
+	return node;
+}
+
+uint64_t rdx_rb_onext(const struct rdx_rb_otree *tree, uint64_t node)
+{
+	uint64_t parent;
+
+	if (N(node)->right) {
+		node = N(node)->right;
+		while (N(node)->left)
+			node = N(node)->left;
+		return node;
+	}
+	while ((parent = parent_of(tree, node)) && node == N(parent)->right)
+		node = parent;
+	return parent;
+}
+
+uint64_t rdx_rb_oprev(const struct rdx_rb_otree *tree, uint64_t node)
+{
+	uint64_t parent;
+
+	if (N(node)->left) {
+		node = N(node)->left;
+		while (N(node)->right)
+			node = N(node)->right;
+		return node;
+	}
+	while ((parent = parent_of(tree, node)) && node == N(parent)->left)
+		node = parent;
+	return parent;
+}
+
+/* Returns the black height of @node, or -1, adding its nodes to *@count */
+static int verify(const struct rdx_rb_otree *tree, uint64_t node,
+		  uint64_t parent, uint64_t size, int depth, long long *count)
+{
+	int left, right;
+
+	if (!node)
+		return 1;
+	/* Deeper than any balanced tree fitting in @size could be */
+	if (node % sizeof(uint64_t) || node > size - sizeof(*N(node)) ||
+	    parent_of(tree, node) != parent || depth > 128)
+		return -1;
+	if (!is_black(tree, node) &&
+	    (!is_black(tree, N(node)->left) || !is_black(tree, N(node)->right)))
+		return -1;
+	left = verify(tree, N(node)->left, node, size, depth + 1, count);
+	right = verify(tree, N(node)->right, node, size, depth + 1, count);
+	if (left < 0 || left != right)
+		return -1;
+	++*count;
+	return left + is_black(tree, node);
+}
+
+long long rdx_rb_overify(const struct rdx_rb_otree *tree, uint64_t size)
+{
+	long long count = 0;
+
+	if (size < sizeof(struct rdx_rb_onode) ||
+	    !is_black(tree, *tree->root) ||
+	    verify(tree, *tree->root, 0, size, 0, &count) < 0)
+		return -1;
+	return count;
+}
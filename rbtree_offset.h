@@ -0,0 +1,81 @@
+/*
+  Red Black Trees - offset-linked trees
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_OFFSET_H
+#define _RDX_RBTREE_OFFSET_H
+
+#include <stdint.h>
+
+/*
+ * Red-black trees whose nodes all live in one region of memory and link to
+ * each other by their byte offsets from its start, so that the region means
+ * the same wherever it gets mapped: in a file, or in memory shared between
+ * processes. Offset 0 stands for no node, so the region has to start with
+ * something else, typically a header holding the root.
+ *
+ * Mirroring rbtree.h, the tree knows nothing of keys: look up the place of a
+ * new node with rdx_rb_olookup(), then rdx_rb_oinsert() it there.
+ *
+ * If @touch is set, it is called with every node whose links or color are
+ * about to change, possibly more than once for the same node, for a caller
+ * that needs to know what a change wrote. *@root, which must be inside the
+ * region as well, is not reported.
+ */
+
+struct rdx_rb_onode {
+	uint64_t parent_color;
+	uint64_t left, right;
+} __attribute__((aligned(sizeof(uint64_t))));
+
+struct rdx_rb_otree {
+	unsigned char *base;
+	uint64_t *root;
+	void (*touch)(struct rdx_rb_otree *tree, uint64_t node);
+};
+
+#define RDX_RB_ONODE(tree, offset) \
+	((struct rdx_rb_onode *)((tree)->base + (offset)))
+
+/*
+ * Find the node matching @key, or return 0 having set *@parent and *@right
+ * to where a node with that key goes. @compare orders @key against @node
+ * like strcmp().
+ */
+extern uint64_t
+rdx_rb_olookup(const struct rdx_rb_otree *tree, const void *key,
+	       int (*compare)(const void *key, const struct rdx_rb_onode *node,
+			      void *arg),
+	       void *arg, uint64_t *parent, int *right);
+
+/* Link @node below @parent, as returned by rdx_rb_olookup(), and rebalance */
+extern void rdx_rb_oinsert(struct rdx_rb_otree *tree, uint64_t node,
+			   uint64_t parent, int right);
+extern void rdx_rb_oerase(struct rdx_rb_otree *tree, uint64_t node);
+
+extern uint64_t rdx_rb_ofirst(const struct rdx_rb_otree *tree);
+extern uint64_t rdx_rb_olast(const struct rdx_rb_otree *tree);
+extern uint64_t rdx_rb_onext(const struct rdx_rb_otree *tree, uint64_t node);
+extern uint64_t rdx_rb_oprev(const struct rdx_rb_otree *tree, uint64_t node);
+
+/*
+ * Check the links and the red-black properties, within a region of @size
+ * bytes. Returns the number of nodes, or -1 if anything is wrong.
+ */
+extern long long rdx_rb_overify(const struct rdx_rb_otree *tree, uint64_t size);
+
+#endif	/* _RDX_RBTREE_OFFSET_H */
@@ -0,0 +1,314 @@
+/*
+  Red Black Trees - parallel traversal
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Everything parallel in here works on the same principle: cut the top few
+ * levels off the tree, turn every subtree hanging below the cut into a task
+ * and deal with the few cut nodes in the calling thread.
+ *
+ * Tasks run on a small work-stealing pool that lives for one call. Each
+ * worker starts with a contiguous run of task numbers, so neighbouring
+ * subtrees stay on one core. A worker takes tasks from the high end of its
+ * own run; once that is empty it steals the low half of somebody else's.
+ * Runs only ever get split, never merged, and no task is added after the
+ * start, so a worker that finds every run empty may simply quit.
+ */
+
+/* A run of task numbers [lo, hi), packed into one word for CAS */
+#define RUN(lo, hi)	(((uint64_t)(hi) << 32) | (uint32_t)(lo))
+#define RUN_LO(run)	((uint32_t)(run))
+#define RUN_HI(run)	((uint32_t)((run) >> 32))
+
+struct pool_worker {
+	uint64_t run;
+	struct pool *pool;
+	pthread_t thread;
+} __attribute__((aligned(64)));
+
+struct pool {
+	void (*fn)(void *arg, size_t task);
+	void *arg;
+	unsigned int nr_workers;
+	struct pool_worker *workers;
+};
+
+static int pool_pop(struct pool_worker *worker, size_t *task)
+{
+	uint64_t run = __atomic_load_n(&worker->run, __ATOMIC_ACQUIRE);
+
+	while (RUN_LO(run) < RUN_HI(run)) {
+		uint64_t rest = RUN(RUN_LO(run), RUN_HI(run) - 1);
+		if (__atomic_compare_exchange_n(&worker->run, &run, rest, false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			*task = RUN_HI(run) - 1;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int pool_steal(struct pool_worker *thief, struct pool_worker *victim,
+		      size_t *task)
+{
+	uint64_t run = __atomic_load_n(&victim->run, __ATOMIC_ACQUIRE);
+
+	while (RUN_LO(run) < RUN_HI(run)) {
+		uint32_t lo = RUN_LO(run), hi = RUN_HI(run);
+		uint32_t mid = lo + (hi - lo + 1) / 2;
+		if (__atomic_compare_exchange_n(&victim->run, &run,
+						RUN(mid, hi), false,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			/* Our own run is empty, nobody else touches it */
+			__atomic_store_n(&thief->run, RUN(lo + 1, mid),
+					 __ATOMIC_RELEASE);
+			*task = lo;
+			return true;
+		}
+	}
+	return false;
+}
+
+static int pool_next(struct pool_worker *worker, size_t *task)
+{
+	struct pool *pool = worker->pool;
+	unsigned int self = worker - pool->workers, i;
+
+	if (pool_pop(worker, task))
+		return true;
+	for (i = 1; i < pool->nr_workers; i++)
+		if (pool_steal(worker,
+			       &pool->workers[(self + i) % pool->nr_workers],
+			       task))
+			return true;
+	return false;
+}
+
+static void *pool_worker(void *data)
+{
+	struct pool_worker *worker = data;
+	size_t task = 0;
+
+	while (pool_next(worker, &task))
+		worker->pool->fn(worker->pool->arg, task);
+	return NULL;
+}
+
+void __rdx_rb_parallel_run(size_t nr_tasks,
+			   void (*fn)(void *arg, size_t task), void *arg,
+			   unsigned int nr_threads)
+{
+	struct pool pool = { fn, arg, 0, NULL };
+	unsigned int i, started = 0;
+	size_t task;
+
+	if (nr_threads > nr_tasks)
+		nr_threads = nr_tasks;
+	if (nr_threads > 1 && nr_tasks <= UINT32_MAX)
+		pool.workers = malloc(nr_threads * sizeof(*pool.workers));
+	if (!pool.workers) {
+		for (task = 0; task < nr_tasks; task++)
+			fn(arg, task);
+		return;
+	}
+
+	pool.nr_workers = nr_threads;
+	for (i = 0; i < nr_threads; i++) {
+		pool.workers[i].run = RUN(nr_tasks * i / nr_threads,
+					  nr_tasks * (i + 1) / nr_threads);
+		pool.workers[i].pool = &pool;
+	}
+	/*
+	 * Failing to start a helper is not an error: its run gets stolen
+	 * by the others, at worst all by the calling thread.
+	 */
+	for (i = 1; i < nr_threads; i++) {
+		if (pthread_create(&pool.workers[i].thread, NULL,
+				   pool_worker, &pool.workers[i]))
+			break;
+		started++;
+	}
+	pool_worker(&pool.workers[0]);
+	for (i = 1; i <= started; i++)
+		pthread_join(pool.workers[i].thread, NULL);
+	free(pool.workers);
+}
+
+void *__rdx_rb_calloc_lines(size_t count, size_t size)
+{
+	size_t bytes = count * size;
+	void *p;
+
+	if (size && bytes / size != count)
+		return NULL;
+	if (posix_memalign(&p, 64, bytes ? bytes : 64))
+		return NULL;
+	return memset(p, 0, bytes);
+}
+
+/* About four subtrees per thread, so that uneven ones even out */
+int __rdx_rb_split_levels(unsigned int nr_threads)
+{
+	int levels = 0;
+
+	if (nr_threads <= 1)
+		return 0;
+	while ((1u << levels) < nr_threads && levels < 16)
+		levels++;
+	return levels + 2;
+}
+
+size_t __rdx_rb_split_top(struct rdx_rb_node *node, int levels,
+			  struct rdx_rb_node **subtrees,
+			  struct rdx_rb_node **separators, size_t count)
+{
+	if (!node || levels == 0) {
+		subtrees[count] = node;
+		return count + 1;
+	}
+	count = __rdx_rb_split_top(node->rb_left, levels - 1,
+				   subtrees, separators, count);
+	separators[count - 1] = node;
+	return __rdx_rb_split_top(node->rb_right, levels - 1,
+				  subtrees, separators, count);
+}
+
+/*
+ * Traversal
+ */
+
+struct traverse_ctx {
+	void (*fn)(struct rdx_rb_node *node, void *arg);
+	const struct rdx_rb_reducer *reducer;
+	void *arg;
+	struct rdx_rb_node **subtrees;
+	char *accs;
+};
+
+static void for_each_worker(void *data, size_t i)
+{
+	struct traverse_ctx *ctx = data;
+	struct rdx_rb_node *node = ctx->subtrees[i], *last;
+
+	if (!node)
+		return;
+	last = __rdx_rb_rightmost(node);
+	for (node = __rdx_rb_leftmost(node); ; node = rdx_rb_next(node)) {
+		ctx->fn(node, ctx->arg);
+		if (node == last)
+			break;
+	}
+}
+
+void rdx_rb_for_each(struct rdx_rb_root *root,
+		     void (*fn)(struct rdx_rb_node *node, void *arg),
+		     void *arg, unsigned int nr_threads)
+{
+	struct traverse_ctx ctx = { fn, NULL, arg, NULL, NULL };
+	struct rdx_rb_node **separators = NULL;
+	int levels = __rdx_rb_split_levels(nr_threads);
+	size_t width = (size_t)1 << levels, nr_subtrees, i;
+
+	if (levels > 0) {
+		ctx.subtrees = malloc(width * sizeof(*ctx.subtrees));
+		separators = malloc(width * sizeof(*separators));
+	}
+	if (!ctx.subtrees || !separators) {
+		struct rdx_rb_node *subtree = root->rb_node;
+
+		free(separators);
+		free(ctx.subtrees);
+		ctx.subtrees = &subtree;
+		for_each_worker(&ctx, 0);
+		return;
+	}
+
+	nr_subtrees = __rdx_rb_split_top(root->rb_node, levels,
+					 ctx.subtrees, separators, 0);
+	__rdx_rb_parallel_run(nr_subtrees, for_each_worker, &ctx, nr_threads);
+	for (i = 0; i + 1 < nr_subtrees; i++)
+		fn(separators[i], arg);
+	free(separators);
+	free(ctx.subtrees);
+}
+
+static void reduce_worker(void *data, size_t i)
+{
+	struct traverse_ctx *ctx = data;
+	const struct rdx_rb_reducer *reducer = ctx->reducer;
+	struct rdx_rb_node *node = ctx->subtrees[i], *last;
+	void *acc = ctx->accs + i * reducer->size;
+
+	reducer->init(acc, ctx->arg);
+	if (!node)
+		return;
+	last = __rdx_rb_rightmost(node);
+	for (node = __rdx_rb_leftmost(node); ; node = rdx_rb_next(node)) {
+		reducer->accumulate(acc, node, ctx->arg);
+		if (node == last)
+			break;
+	}
+}
+
+void rdx_rb_reduce(struct rdx_rb_root *root,
+		   const struct rdx_rb_reducer *reducer, void *result,
+		   void *arg, unsigned int nr_threads)
+{
+	struct traverse_ctx ctx = { NULL, reducer, arg, NULL, NULL };
+	struct rdx_rb_node **separators = NULL;
+	int levels = __rdx_rb_split_levels(nr_threads);
+	size_t width = (size_t)1 << levels, nr_subtrees, i;
+
+	if (levels > 0) {
+		ctx.subtrees = malloc(width * sizeof(*ctx.subtrees));
+		separators = malloc(width * sizeof(*separators));
+		ctx.accs = malloc(width * reducer->size);
+	}
+	if (!ctx.subtrees || !separators || !ctx.accs) {
+		struct rdx_rb_node *subtree = root->rb_node;
+
+		free(ctx.accs);
+		free(separators);
+		free(ctx.subtrees);
+		ctx.subtrees = &subtree;
+		ctx.accs = result;
+		reduce_worker(&ctx, 0);
+		return;
+	}
+
+	nr_subtrees = __rdx_rb_split_top(root->rb_node, levels,
+					 ctx.subtrees, separators, 0);
+	__rdx_rb_parallel_run(nr_subtrees, reduce_worker, &ctx, nr_threads);
+
+	/* Partial results are folded strictly left to right, in key order */
+	memcpy(result, ctx.accs, reducer->size);
+	for (i = 1; i < nr_subtrees; i++) {
+		reducer->accumulate(result, separators[i - 1], arg);
+		reducer->combine(result, ctx.accs + i * reducer->size, arg);
+	}
+	free(ctx.accs);
+	free(separators);
+	free(ctx.subtrees);
+}
@@ -0,0 +1,408 @@
+/*
+  Red Black Trees - relaxed balance with concurrent writers
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include "rbtree_relaxed.h"
+
+/*
+ * Writers and readers share the lock, rebalancing holds it exclusively. So
+ * while the lock is shared, the only changes to the tree are new leaves
+ * showing up in empty child slots and erased marks showing up in the
+ * parent-and-color word - both single word stores that lookups pick up
+ * with atomic loads. The mark is bit 1 of that word, which rdx_rb_parent()
+ * ignores.
+ *
+ * New leaves only ever hang below other new leaves or the tree as of the
+ * last rebalance, so clearing the child slots that hold the logged leaves
+ * restores that tree exactly, payloads and all. They cannot be fixed up in
+ * place instead: the insertion fixup relies on there being a single red
+ * violation in the whole tree, and blackens the neighbours it rotates.
+ * Going back in sorted, each descent starts where the previous one ended.
+ */
+
+#define RELAXED_ERASED	2
+
+static struct rdx_rb_node *relaxed_load(struct rdx_rb_node **slot)
+{
+	return __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+}
+
+static size_t relaxed_parent_color(struct rdx_rb_node *node)
+{
+	return __atomic_load_n(&node->__rb_parent_color, __ATOMIC_ACQUIRE);
+}
+
+static int relaxed_erased(struct rdx_rb_node *node)
+{
+	return relaxed_parent_color(node) & RELAXED_ERASED;
+}
+
+static struct rdx_rb_node *relaxed_parent(struct rdx_rb_node *node)
+{
+	return (struct rdx_rb_node *)(relaxed_parent_color(node) & ~3);
+}
+
+int rdx_rb_relaxed_init(struct rdx_rb_relaxed *tree, struct rdx_rb_root *root,
+			const struct rdx_rb_augment_callbacks *augment,
+			void (*dispose)(struct rdx_rb_node *node, void *arg),
+			void *arg, unsigned int nr_writers, size_t max_pending)
+{
+	pthread_rwlockattr_t attr;
+	unsigned int i;
+	int ok;
+
+	tree->root = root;
+	tree->dispose = dispose;
+	tree->arg = arg;
+	tree->nr_writers = nr_writers;
+	tree->max_pending = max_pending ? max_pending : 1;
+	tree->writers = __rdx_rb_calloc_lines(nr_writers,
+					      sizeof(*tree->writers));
+	tree->sorted = malloc(nr_writers * tree->max_pending *
+			      sizeof(*tree->sorted));
+	ok = tree->writers && tree->sorted;
+	for (i = 0; ok && i < nr_writers; i++) {
+		struct rdx_rb_relaxed_writer *writer = &tree->writers[i];
+
+		writer->pending = malloc(tree->max_pending *
+					 sizeof(*writer->pending));
+		writer->erased = malloc(tree->max_pending *
+					sizeof(*writer->erased));
+		ok = writer->pending && writer->erased;
+	}
+
+	/* Every writer holds the lock shared, rebalancing must not starve */
+	if (ok && !pthread_rwlockattr_init(&attr)) {
+		pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+		ok = !pthread_rwlock_init(&tree->lock, &attr);
+		pthread_rwlockattr_destroy(&attr);
+	} else
+		ok = false;
+
+	if (!ok) {
+		for (i = 0; tree->writers && i < nr_writers; i++) {
+			free(tree->writers[i].erased);
+			free(tree->writers[i].pending);
+		}
+		free(tree->sorted);
+		free(tree->writers);
+		return false;
+	}
+	rdx_rb_batch_init(&tree->batch, root, augment);
+	return true;
+}
+
+void rdx_rb_relaxed_destroy(struct rdx_rb_relaxed *tree)
+{
+	unsigned int i;
+
+	rdx_rb_relaxed_rebalance(tree);
+	pthread_rwlock_destroy(&tree->lock);
+	rdx_rb_batch_destroy(&tree->batch);
+	for (i = 0; i < tree->nr_writers; i++) {
+		free(tree->writers[i].erased);
+		free(tree->writers[i].pending);
+	}
+	free(tree->sorted);
+	free(tree->writers);
+}
+
+int rdx_rb_relaxed_register(struct rdx_rb_relaxed *tree)
+{
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_writers; i++) {
+		int in_use = false;
+		if (__atomic_compare_exchange_n(&tree->writers[i].in_use,
+						&in_use, true, false,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED))
+			return i;
+	}
+	return -1;
+}
+
+void rdx_rb_relaxed_unregister(struct rdx_rb_relaxed *tree, int writer)
+{
+	__atomic_store_n(&tree->writers[writer].in_use, false,
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Rebalancing
+ */
+
+/* The root being rebalanced by this thread, for sorting */
+static __thread struct rdx_rb_root *relaxed_root;
+
+static int node_by_key(const void *a, const void *b)
+{
+	return relaxed_root->strict_compare(*(struct rdx_rb_node **)a,
+					    *(struct rdx_rb_node **)b);
+}
+
+static void relaxed_detach(struct rdx_rb_root *root, struct rdx_rb_node *node)
+{
+	struct rdx_rb_node *parent = rdx_rb_parent(node);
+
+	if (!parent)
+		root->rb_node = NULL;
+	else if (parent->rb_left == node)
+		parent->rb_left = NULL;
+	else
+		parent->rb_right = NULL;
+}
+
+/* Stops the world: callers hold the lock exclusively */
+static void relaxed_rebalance_locked(struct rdx_rb_relaxed *tree)
+{
+	struct rdx_rb_root *root = tree->root;
+	size_t count = 0, i;
+	unsigned int w;
+
+	/* Back to the tree as of the last rebalance */
+	for (w = 0; w < tree->nr_writers; w++) {
+		struct rdx_rb_relaxed_writer *writer = &tree->writers[w];
+
+		for (i = 0; i < writer->nr_pending; i++)
+			relaxed_detach(root, writer->pending[i]);
+	}
+	/* Leaves erased before they ever got balanced are simply gone */
+	for (w = 0; w < tree->nr_writers; w++) {
+		struct rdx_rb_relaxed_writer *writer = &tree->writers[w];
+
+		for (i = 0; i < writer->nr_pending; i++) {
+			struct rdx_rb_node *node = writer->pending[i];
+			if (node->__rb_parent_color & RELAXED_ERASED)
+				RDX_RB_CLEAR_NODE(node);
+			else
+				tree->sorted[count++] = node;
+		}
+	}
+	/* Rotations move the whole word around, marks and all */
+	for (w = 0; w < tree->nr_writers; w++) {
+		struct rdx_rb_relaxed_writer *writer = &tree->writers[w];
+
+		for (i = 0; i < writer->nr_erased; i++)
+			writer->erased[i]->__rb_parent_color &=
+				~RELAXED_ERASED;
+	}
+
+	rdx_rb_batch_begin(&tree->batch);
+	for (w = 0; w < tree->nr_writers; w++) {
+		struct rdx_rb_relaxed_writer *writer = &tree->writers[w];
+
+		for (i = 0; i < writer->nr_erased; i++)
+			if (!RDX_RB_EMPTY_NODE(writer->erased[i]))
+				rdx_rb_batch_erase(&tree->batch,
+						   writer->erased[i]);
+	}
+	relaxed_root = root;
+	qsort(tree->sorted, count, sizeof(*tree->sorted), node_by_key);
+	for (i = 0; i < count; i++)
+		rdx_rb_batch_insert(&tree->batch, tree->sorted[i]);
+	rdx_rb_batch_end(&tree->batch);
+
+	for (w = 0; w < tree->nr_writers; w++) {
+		struct rdx_rb_relaxed_writer *writer = &tree->writers[w];
+
+		if (tree->dispose)
+			for (i = 0; i < writer->nr_erased; i++)
+				tree->dispose(writer->erased[i], tree->arg);
+		writer->nr_pending = 0;
+		writer->nr_erased = 0;
+	}
+}
+
+void rdx_rb_relaxed_rebalance(struct rdx_rb_relaxed *tree)
+{
+	pthread_rwlock_wrlock(&tree->lock);
+	relaxed_rebalance_locked(tree);
+	pthread_rwlock_unlock(&tree->lock);
+}
+
+/* Called with the lock shared, returns with it shared again */
+static void relaxed_make_room(struct rdx_rb_relaxed *tree)
+{
+	pthread_rwlock_unlock(&tree->lock);
+	rdx_rb_relaxed_rebalance(tree);
+	pthread_rwlock_rdlock(&tree->lock);
+}
+
+/*
+ * Writers
+ */
+
+enum { LINK_DONE, LINK_EXISTS, LINK_ERASED };
+
+static int relaxed_link(struct rdx_rb_root *root, struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node **slot = &root->rb_node, *parent = NULL, *node;
+
+	for (;;) {
+		while ((node = relaxed_load(slot))) {
+			int result = root->strict_compare(elem, node);
+			if (!result)
+				return relaxed_erased(node) ? LINK_ERASED :
+							      LINK_EXISTS;
+			parent = node;
+			slot = result < 0 ? &node->rb_left : &node->rb_right;
+		}
+
+		elem->__rb_parent_color = (size_t)parent;
+		elem->rb_left = elem->rb_right = NULL;
+		/* On losing the race, carry on below the winner */
+		if (__atomic_compare_exchange_n(slot, &node, elem, false,
+						__ATOMIC_RELEASE,
+						__ATOMIC_RELAXED))
+			return LINK_DONE;
+	}
+}
+
+int rdx_rb_relaxed_insert(struct rdx_rb_relaxed *tree, int writer_nr,
+			  struct rdx_rb_node *node)
+{
+	struct rdx_rb_relaxed_writer *writer = &tree->writers[writer_nr];
+	int result;
+
+	pthread_rwlock_rdlock(&tree->lock);
+	for (;;) {
+		if (writer->nr_pending == tree->max_pending) {
+			relaxed_make_room(tree);
+			continue;
+		}
+		result = relaxed_link(tree->root, node);
+		/* The erased twin has to go before this one can go in */
+		if (result != LINK_ERASED)
+			break;
+		relaxed_make_room(tree);
+	}
+	if (result == LINK_DONE)
+		writer->pending[writer->nr_pending++] = node;
+	pthread_rwlock_unlock(&tree->lock);
+	return result == LINK_DONE;
+}
+
+int rdx_rb_relaxed_erase(struct rdx_rb_relaxed *tree, int writer_nr,
+			 struct rdx_rb_node *node)
+{
+	struct rdx_rb_relaxed_writer *writer = &tree->writers[writer_nr];
+	size_t old;
+
+	pthread_rwlock_rdlock(&tree->lock);
+	if (writer->nr_erased == tree->max_pending)
+		relaxed_make_room(tree);
+	old = __atomic_fetch_or(&node->__rb_parent_color, RELAXED_ERASED,
+				__ATOMIC_RELEASE);
+	if (!(old & RELAXED_ERASED))
+		writer->erased[writer->nr_erased++] = node;
+	pthread_rwlock_unlock(&tree->lock);
+	return !(old & RELAXED_ERASED);
+}
+
+/*
+ * Readers
+ */
+
+static struct rdx_rb_node *relaxed_next(struct rdx_rb_node *node)
+{
+	struct rdx_rb_node *next = relaxed_load(&node->rb_right), *parent;
+
+	if (next) {
+		while ((node = relaxed_load(&next->rb_left)))
+			next = node;
+		return next;
+	}
+	while ((parent = relaxed_parent(node)) &&
+	       node == relaxed_load(&parent->rb_right))
+		node = parent;
+	return parent;
+}
+
+static struct rdx_rb_node *relaxed_prev(struct rdx_rb_node *node)
+{
+	struct rdx_rb_node *prev = relaxed_load(&node->rb_left), *parent;
+
+	if (prev) {
+		while ((node = relaxed_load(&prev->rb_right)))
+			prev = node;
+		return prev;
+	}
+	while ((parent = relaxed_parent(node)) &&
+	       node == relaxed_load(&parent->rb_left))
+		node = parent;
+	return parent;
+}
+
+struct rdx_rb_node *
+rdx_rb_relaxed_find(struct rdx_rb_relaxed *tree, struct rdx_rb_node *elem)
+{
+	struct rdx_rb_root *root = tree->root;
+	struct rdx_rb_node *node = relaxed_load(&root->rb_node);
+
+	while (node) {
+		int result = root->strict_compare(elem, node);
+		if (!result)
+			return relaxed_erased(node) ? NULL : node;
+		node = relaxed_load(result < 0 ? &node->rb_left :
+						 &node->rb_right);
+	}
+	return NULL;
+}
+
+struct rdx_rb_node *
+rdx_rb_relaxed_rightmost_less_equiv(struct rdx_rb_relaxed *tree,
+				    struct rdx_rb_node *elem)
+{
+	struct rdx_rb_root *root = tree->root;
+	struct rdx_rb_node *node = relaxed_load(&root->rb_node);
+	struct rdx_rb_node *result_node = NULL;
+
+	while (node) {
+		if (root->weak_compare(node, elem) <= 0) {
+			result_node = node;
+			node = relaxed_load(&node->rb_right);
+		} else
+			node = relaxed_load(&node->rb_left);
+	}
+	while (result_node && relaxed_erased(result_node))
+		result_node = relaxed_prev(result_node);
+	return result_node;
+}
+
+struct rdx_rb_node *
+rdx_rb_relaxed_leftmost_greater_equiv(struct rdx_rb_relaxed *tree,
+				      struct rdx_rb_node *elem)
+{
+	struct rdx_rb_root *root = tree->root;
+	struct rdx_rb_node *node = relaxed_load(&root->rb_node);
+	struct rdx_rb_node *result_node = NULL;
+
+	while (node) {
+		if (root->weak_compare(node, elem) >= 0) {
+			result_node = node;
+			node = relaxed_load(&node->rb_left);
+		} else
+			node = relaxed_load(&node->rb_right);
+	}
+	while (result_node && relaxed_erased(result_node))
+		result_node = relaxed_next(result_node);
+	return result_node;
+}
@@ -0,0 +1,120 @@
+/*
+  Red Black Trees - relaxed balance with concurrent writers
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_RELAXED_H
+#define _RDX_RBTREE_RELAXED_H
+
+#include <pthread.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * Writers run concurrently and do no rebalancing at all: an insertion links
+ * a red leaf with a single compare-and-swap on the empty child slot, an
+ * erasure merely marks the node as erased. Both leave the node in a
+ * per-writer log. Rebalancing is deferred to rdx_rb_relaxed_rebalance(),
+ * which runs alone and applies the usual local fixups to the logged nodes
+ * as one batch, so that every augmented payload gets recomputed once. A
+ * writer whose log fills up rebalances by itself.
+ *
+ * In between, the tree is a valid search tree but neither balanced nor
+ * augmented: payloads only account for what was there at the last
+ * rebalance. Lookups have to go through the functions below, which skip
+ * erased nodes; anything else must rebalance first. A filter or feed on
+ * the root only hears of changes as they are rebalanced.
+ *
+ * Rebalancing is not done by local relaxed-balance steps interleaved with
+ * the writers: it takes the lock exclusively, so every reader and writer
+ * waits while all logs are drained at once. That keeps it exact, since
+ * detaching the pending leaves restores the last balanced tree, but the
+ * pause grows with nr_writers * max_pending. Keep max_pending small where
+ * latency matters; bench shows the writers' throughput with 1024.
+ *
+ * Erased nodes stay allocated until the next rebalance, which hands them to
+ * @dispose. Readers bracket their lookups with rdx_rb_relaxed_read_lock()
+ * and must not insert or erase while holding it.
+ */
+
+struct rdx_rb_relaxed_writer {
+	int in_use;
+	size_t nr_pending, nr_erased;
+	struct rdx_rb_node **pending;
+	struct rdx_rb_node **erased;
+} __attribute__((aligned(64)));
+
+struct rdx_rb_relaxed {
+	pthread_rwlock_t lock;
+	struct rdx_rb_root *root;
+	void (*dispose)(struct rdx_rb_node *node, void *arg);
+	void *arg;
+	unsigned int nr_writers;
+	size_t max_pending;
+	struct rdx_rb_relaxed_writer *writers;
+	/* Rebalancing state, only touched under the exclusive lock */
+	struct rdx_rb_node **sorted;
+	struct rdx_rb_batch batch;
+};
+
+/*
+ * @augment may be NULL for a plain tree, and @dispose too if the caller
+ * keeps track of erased nodes itself. Returns false if out of memory.
+ */
+extern int
+rdx_rb_relaxed_init(struct rdx_rb_relaxed *tree, struct rdx_rb_root *root,
+		    const struct rdx_rb_augment_callbacks *augment,
+		    void (*dispose)(struct rdx_rb_node *node, void *arg),
+		    void *arg, unsigned int nr_writers, size_t max_pending);
+/* Rebalances one last time, leaving a regular tree behind */
+extern void rdx_rb_relaxed_destroy(struct rdx_rb_relaxed *tree);
+
+/* Returns a writer slot for the calling thread, or -1 if all are taken */
+extern int rdx_rb_relaxed_register(struct rdx_rb_relaxed *tree);
+extern void rdx_rb_relaxed_unregister(struct rdx_rb_relaxed *tree, int writer);
+
+/* Same result as rdx_rb_insert() */
+extern int
+rdx_rb_relaxed_insert(struct rdx_rb_relaxed *tree, int writer,
+		      struct rdx_rb_node *node);
+/* Returns false if @node was erased already */
+extern int
+rdx_rb_relaxed_erase(struct rdx_rb_relaxed *tree, int writer,
+		     struct rdx_rb_node *node);
+
+extern void rdx_rb_relaxed_rebalance(struct rdx_rb_relaxed *tree);
+
+static inline void rdx_rb_relaxed_read_lock(struct rdx_rb_relaxed *tree)
+{
+	pthread_rwlock_rdlock(&tree->lock);
+}
+
+static inline void rdx_rb_relaxed_read_unlock(struct rdx_rb_relaxed *tree)
+{
+	pthread_rwlock_unlock(&tree->lock);
+}
+
+/* Same as their rbtree.h counterparts, minus the erased nodes */
+extern struct rdx_rb_node *
+rdx_rb_relaxed_find(struct rdx_rb_relaxed *tree, struct rdx_rb_node *elem);
+extern struct rdx_rb_node *
+rdx_rb_relaxed_rightmost_less_equiv(struct rdx_rb_relaxed *tree,
+				    struct rdx_rb_node *elem);
+extern struct rdx_rb_node *
+rdx_rb_relaxed_leftmost_greater_equiv(struct rdx_rb_relaxed *tree,
+				      struct rdx_rb_node *elem);
+
+#endif	/* _RDX_RBTREE_RELAXED_H */
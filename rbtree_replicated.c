@@ -0,0 +1,438 @@
+/*
+  Red Black Trees - NUMA node replication
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "rbtree_replicated.h"
+
+/*
+ * Log entries are numbered from 0 on; entry n lives in slot n modulo the
+ * capacity. A slot gets reused only once every replica has replayed its
+ * entry and the writer that appended it has picked up its result, which
+ * all replicas agree on since they replay the same operations in the same
+ * order, none of which can fail there: insertions bring their nodes along.
+ */
+
+enum { OP_INSERT, OP_ERASE };
+
+/*
+ * Arenas
+ *
+ * Nodes come from chunks of whole huge pages, preferably on the node of
+ * the replica. Without huge pages reserved the kernel may still back the
+ * chunks transparently. Nodes freed by erasures are kept for reuse; chunks
+ * go back only with the whole tree.
+ */
+
+#define ARENA_HUGE_PAGE	(2ul << 20)
+#define ARENA_ALIGN	64
+/* The nodes an unsigned long mask for mbind() can name */
+#define NUMA_MAX_NODES	(8 * (int)sizeof(unsigned long))
+
+struct arena_chunk {
+	struct arena_chunk *next;
+};
+
+static void *arena_map(size_t size, int numa_node)
+{
+	unsigned long mask = 1ul << numa_node;
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (mem == MAP_FAILED) {
+		mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+			   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (mem == MAP_FAILED)
+			return NULL;
+		madvise(mem, size, MADV_HUGEPAGE);
+	}
+	/*
+	 * Only a preference: failing that, memory from anywhere will do. The
+	 * kernel takes one bit less of the mask than it is told.
+	 */
+	if (numa_node < NUMA_MAX_NODES)
+		syscall(SYS_mbind, mem, size, MPOL_PREFERRED, &mask,
+			NUMA_MAX_NODES + 1, 0);
+	return mem;
+}
+
+static void *arena_alloc(struct rdx_rb_arena *arena, size_t stride,
+			 int numa_node)
+{
+	void *mem;
+
+	pthread_mutex_lock(&arena->lock);
+	mem = arena->free_list;
+	if (mem) {
+		arena->free_list = *(void **)mem;
+		goto out;
+	}
+	if (!arena->chunk || arena->used + stride > arena->chunk_size) {
+		struct arena_chunk *chunk =
+			arena_map(arena->chunk_size, numa_node);
+		if (!chunk)
+			goto out;
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->chunk = (char *)chunk;
+		arena->used = ARENA_ALIGN;
+	}
+	mem = arena->chunk + arena->used;
+	arena->used += stride;
+out:
+	pthread_mutex_unlock(&arena->lock);
+	return mem;
+}
+
+static void arena_free(struct rdx_rb_arena *arena, void *mem)
+{
+	pthread_mutex_lock(&arena->lock);
+	*(void **)mem = arena->free_list;
+	arena->free_list = mem;
+	pthread_mutex_unlock(&arena->lock);
+}
+
+static void arena_destroy(struct rdx_rb_arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks, *next;
+
+	for (; chunk; chunk = next) {
+		next = chunk->next;
+		munmap(chunk, arena->chunk_size);
+	}
+	pthread_mutex_destroy(&arena->lock);
+}
+
+static size_t arena_stride(size_t size)
+{
+	return (size + 15) & ~(size_t)15;
+}
+
+/*
+ * NUMA topology
+ */
+
+/* The nodes online, from a list like "0-1,3"; node 0 if that fails */
+static unsigned int numa_nodes(int *nodes)
+{
+	FILE *file = fopen("/sys/devices/system/node/online", "r");
+	unsigned int count = 0, first, last;
+	char separator = ',';
+
+	while (file && separator == ',' && fscanf(file, "%u", &first) == 1) {
+		last = first;
+		if (fscanf(file, "%c", &separator) == 1 && separator == '-' &&
+		    fscanf(file, "%u%c", &last, &separator) < 1)
+			break;
+		for (; first <= last && first < NUMA_MAX_NODES; first++)
+			nodes[count++] = first;
+	}
+	if (file)
+		fclose(file);
+	if (!count)
+		nodes[count++] = 0;
+	return count;
+}
+
+/* The first replica on the node of the caller, if there is one there */
+static struct rdx_rb_replica *local_replica(struct rdx_rb_replicated *tree)
+{
+	unsigned int cpu, node, i;
+
+	if (getcpu(&cpu, &node))
+		node = 0;
+	for (i = 0; i < tree->nr_replicas; i++)
+		if (tree->replicas[i].numa_node == (int)node)
+			return &tree->replicas[i];
+	return &tree->replicas[node % tree->nr_replicas];
+}
+
+int rdx_rb_replicated_init(struct rdx_rb_replicated *tree,
+			   int (*strict_compare)(struct rdx_rb_node *left,
+						 struct rdx_rb_node *right),
+			   int (*weak_compare)(struct rdx_rb_node *left,
+					       struct rdx_rb_node *right),
+			   const struct rdx_rb_augment_callbacks *augment,
+			   size_t size, size_t offset,
+			   unsigned int nr_replicas, size_t log_capacity)
+{
+	int online[NUMA_MAX_NODES];
+	unsigned int nodes = numa_nodes(online), i;
+
+	if (!nr_replicas)
+		nr_replicas = nodes;
+	tree->size = size;
+	tree->offset = offset;
+	tree->log_capacity = log_capacity ? log_capacity : 1;
+	tree->tail = 0;
+	tree->nr_replicas = nr_replicas;
+	tree->log = calloc(tree->log_capacity, sizeof(*tree->log));
+	tree->log_data = malloc(tree->log_capacity * size);
+	tree->log_nodes = malloc(tree->log_capacity * nr_replicas *
+				 sizeof(*tree->log_nodes));
+	tree->replicas = __rdx_rb_calloc_lines(nr_replicas,
+					       sizeof(*tree->replicas));
+	if (!tree->log || !tree->log_data || !tree->log_nodes ||
+	    !tree->replicas)
+		goto fail;
+	if (pthread_mutex_init(&tree->log_lock, NULL))
+		goto fail;
+
+	for (i = 0; i < nr_replicas; i++) {
+		struct rdx_rb_replica *replica = &tree->replicas[i];
+
+		if (pthread_rwlock_init(&replica->lock, NULL))
+			break;
+		if (pthread_mutex_init(&replica->arena.lock, NULL)) {
+			pthread_rwlock_destroy(&replica->lock);
+			break;
+		}
+		replica->root = RDX_RB_ROOT(strict_compare, weak_compare);
+		replica->numa_node = online[i % nodes];
+		replica->arena.chunk_size = (arena_stride(size) + ARENA_ALIGN +
+					     ARENA_HUGE_PAGE - 1) &
+			~(ARENA_HUGE_PAGE - 1);
+		rdx_rb_batch_init(&replica->batch, &replica->root, augment);
+	}
+	if (i == nr_replicas)
+		return true;
+
+	while (i-- > 0) {
+		pthread_mutex_destroy(&tree->replicas[i].arena.lock);
+		pthread_rwlock_destroy(&tree->replicas[i].lock);
+	}
+	pthread_mutex_destroy(&tree->log_lock);
+fail:
+	free(tree->replicas);
+	free(tree->log_nodes);
+	free(tree->log_data);
+	free(tree->log);
+	return false;
+}
+
+void rdx_rb_replicated_destroy(struct rdx_rb_replicated *tree)
+{
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_replicas; i++) {
+		struct rdx_rb_replica *replica = &tree->replicas[i];
+
+		rdx_rb_batch_destroy(&replica->batch);
+		arena_destroy(&replica->arena);
+		pthread_rwlock_destroy(&replica->lock);
+	}
+	pthread_mutex_destroy(&tree->log_lock);
+	free(tree->replicas);
+	free(tree->log_nodes);
+	free(tree->log_data);
+	free(tree->log);
+}
+
+/*
+ * Replay
+ */
+
+static struct rdx_rb_node *replica_find(struct rdx_rb_root *root,
+					struct rdx_rb_node *elem)
+{
+	struct rdx_rb_node *node = root->rb_node;
+
+	while (node) {
+		int result = root->strict_compare(elem, node);
+		if (!result)
+			return node;
+		node = result < 0 ? node->rb_left : node->rb_right;
+	}
+	return NULL;
+}
+
+/* Called with the replica locked exclusively */
+static void replica_apply(struct rdx_rb_replicated *tree,
+			  struct rdx_rb_replica *replica, uint64_t upto)
+{
+	size_t index = replica - tree->replicas;
+	struct rdx_rb_node *erased = NULL, *node;
+	uint64_t seq;
+
+	rdx_rb_batch_begin(&replica->batch);
+	for (seq = replica->applied; seq < upto; seq++) {
+		size_t slot = seq % tree->log_capacity;
+		char *data = tree->log_data + slot * tree->size;
+		struct rdx_rb_node *elem = (void *)(data + tree->offset);
+		int result = false;
+
+		if (tree->log[slot].op == OP_ERASE) {
+			node = replica_find(&replica->root, elem);
+			if (node) {
+				rdx_rb_batch_erase(&replica->batch, node);
+				/* The batch still looks at it, free it after */
+				node->rb_left = erased;
+				erased = node;
+				result = true;
+			}
+		} else {
+			char *mem = tree->log_nodes[slot * tree->nr_replicas +
+						    index];
+
+			memcpy(mem, data, tree->size);
+			node = (void *)(mem + tree->offset);
+			result = rdx_rb_batch_insert(&replica->batch, node);
+			if (!result)
+				arena_free(&replica->arena, mem);
+		}
+		__atomic_store_n(&tree->log[slot].result, result,
+				 __ATOMIC_RELAXED);
+	}
+	rdx_rb_batch_end(&replica->batch);
+
+	for (; erased; erased = node) {
+		node = erased->rb_left;
+		arena_free(&replica->arena, (char *)erased - tree->offset);
+	}
+	__atomic_store_n(&replica->applied, upto, __ATOMIC_RELEASE);
+}
+
+static void replica_sync(struct rdx_rb_replicated *tree,
+			 struct rdx_rb_replica *replica, uint64_t upto)
+{
+	if (__atomic_load_n(&replica->applied, __ATOMIC_ACQUIRE) >= upto)
+		return;
+	pthread_rwlock_wrlock(&replica->lock);
+	if (replica->applied < upto)
+		replica_apply(tree, replica, upto);
+	pthread_rwlock_unlock(&replica->lock);
+}
+
+void rdx_rb_replicated_sync(struct rdx_rb_replicated *tree)
+{
+	uint64_t tail = __atomic_load_n(&tree->tail, __ATOMIC_ACQUIRE);
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_replicas; i++)
+		replica_sync(tree, &tree->replicas[i], tail);
+}
+
+struct rdx_rb_root *
+rdx_rb_replicated_read_lock(struct rdx_rb_replicated *tree)
+{
+	struct rdx_rb_replica *replica = local_replica(tree);
+
+	replica_sync(tree, replica,
+		     __atomic_load_n(&tree->tail, __ATOMIC_ACQUIRE));
+	pthread_rwlock_rdlock(&replica->lock);
+	return &replica->root;
+}
+
+/*
+ * Writers
+ */
+
+/* Called with the log locked */
+static int log_full(struct rdx_rb_replicated *tree)
+{
+	uint64_t oldest = tree->tail;
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_replicas; i++) {
+		uint64_t applied = __atomic_load_n(&tree->replicas[i].applied,
+						   __ATOMIC_ACQUIRE);
+		if (applied < oldest)
+			oldest = applied;
+	}
+	if (tree->tail - oldest == tree->log_capacity)
+		return true;
+	return __atomic_load_n(&tree->log[tree->tail % tree->log_capacity].busy,
+			       __ATOMIC_ACQUIRE);
+}
+
+/* A node on every replica for an insertion into @slot, or none at all */
+static int log_reserve(struct rdx_rb_replicated *tree, size_t slot)
+{
+	void **nodes = tree->log_nodes + slot * tree->nr_replicas;
+	size_t stride = arena_stride(tree->size);
+	unsigned int i;
+
+	for (i = 0; i < tree->nr_replicas; i++) {
+		struct rdx_rb_replica *replica = &tree->replicas[i];
+
+		nodes[i] = arena_alloc(&replica->arena, stride,
+				       replica->numa_node);
+		if (!nodes[i]) {
+			while (i-- > 0)
+				arena_free(&tree->replicas[i].arena, nodes[i]);
+			errno = ENOMEM;
+			return false;
+		}
+	}
+	return true;
+}
+
+static int log_submit(struct rdx_rb_replicated *tree, int op,
+		      struct rdx_rb_node *elem)
+{
+	struct rdx_rb_log_entry *entry;
+	uint64_t seq;
+	int result;
+
+	pthread_mutex_lock(&tree->log_lock);
+	while (log_full(tree)) {
+		pthread_mutex_unlock(&tree->log_lock);
+		rdx_rb_replicated_sync(tree);
+		/* For whoever still has to pick up a result from the slot */
+		sched_yield();
+		pthread_mutex_lock(&tree->log_lock);
+	}
+	seq = tree->tail;
+	if (op == OP_INSERT && !log_reserve(tree, seq % tree->log_capacity)) {
+		pthread_mutex_unlock(&tree->log_lock);
+		return false;
+	}
+	entry = &tree->log[seq % tree->log_capacity];
+	memcpy(tree->log_data + seq % tree->log_capacity * tree->size,
+	       (char *)elem - tree->offset, tree->size);
+	entry->op = op;
+	entry->busy = true;
+	__atomic_store_n(&tree->tail, seq + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&tree->log_lock);
+
+	replica_sync(tree, local_replica(tree), seq + 1);
+	result = __atomic_load_n(&entry->result, __ATOMIC_RELAXED);
+	__atomic_store_n(&entry->busy, false, __ATOMIC_RELEASE);
+	return result;
+}
+
+int rdx_rb_replicated_insert(struct rdx_rb_replicated *tree,
+			     struct rdx_rb_node *elem)
+{
+	return log_submit(tree, OP_INSERT, elem);
+}
+
+int rdx_rb_replicated_erase(struct rdx_rb_replicated *tree,
+			    struct rdx_rb_node *elem)
+{
+	return log_submit(tree, OP_ERASE, elem);
+}
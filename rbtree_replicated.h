@@ -0,0 +1,131 @@
+/*
+  Red Black Trees - NUMA node replication
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_REPLICATED_H
+#define _RDX_RBTREE_REPLICATED_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * One copy of the tree per NUMA node, so that readers never have to leave
+ * their own. Writers merely append to a shared operation log; every
+ * replica replays the log on its own, lazily, whenever somebody on its node
+ * is about to read it, and in batches, so that augmented payloads get
+ * recomputed once per batch.
+ *
+ * The tree owns its nodes: insertions copy the @size bytes of the caller's
+ * container, which has its rdx_rb_node @offset bytes in, into the log and
+ * from there into node-local arenas backed by huge pages where available.
+ * The copies are plain bytes, so containers must not point into
+ * themselves. Erasing goes by key.
+ *
+ * The log is a ring of @log_capacity entries. A writer that finds it full
+ * brings the replicas that lag behind up to date itself. An insertion
+ * takes its node on every replica before it is logged, so that replaying
+ * it cannot fail, and the replicas never differ.
+ */
+
+struct rdx_rb_arena {
+	/* Writers reserve nodes, replay frees them */
+	pthread_mutex_t lock;
+	char *chunk;
+	size_t used, chunk_size;
+	void *free_list;
+	void *chunks;
+};
+
+struct rdx_rb_replica {
+	pthread_rwlock_t lock;
+	struct rdx_rb_root root;
+	uint64_t applied;
+	int numa_node;
+	struct rdx_rb_arena arena;
+	/* Replay state, only touched under the exclusive lock */
+	struct rdx_rb_batch batch;
+} __attribute__((aligned(64)));
+
+struct rdx_rb_log_entry {
+	int op;
+	int result;
+	int busy;
+};
+
+struct rdx_rb_replicated {
+	pthread_mutex_t log_lock;
+	size_t size, offset;
+	size_t log_capacity;
+	struct rdx_rb_log_entry *log;
+	char *log_data;
+	/* For every slot, the node each replica inserts from it */
+	void **log_nodes;
+	uint64_t tail;
+	unsigned int nr_replicas;
+	struct rdx_rb_replica *replicas;
+};
+
+/*
+ * @augment may be NULL for a plain tree. An @nr_replicas of 0 means one
+ * per NUMA node. Returns false if out of memory.
+ */
+extern int
+rdx_rb_replicated_init(struct rdx_rb_replicated *tree,
+		       int (*strict_compare)(struct rdx_rb_node *left,
+					     struct rdx_rb_node *right),
+		       int (*weak_compare)(struct rdx_rb_node *left,
+					   struct rdx_rb_node *right),
+		       const struct rdx_rb_augment_callbacks *augment,
+		       size_t size, size_t offset, unsigned int nr_replicas,
+		       size_t log_capacity);
+/* Frees every node of every replica */
+extern void rdx_rb_replicated_destroy(struct rdx_rb_replicated *tree);
+
+/*
+ * Same results as rdx_rb_insert(), and false for erasing a missing key.
+ * Inserting also fails with errno set to ENOMEM when some replica is out
+ * of memory, leaving every replica as it was.
+ */
+extern int
+rdx_rb_replicated_insert(struct rdx_rb_replicated *tree,
+			 struct rdx_rb_node *elem);
+extern int
+rdx_rb_replicated_erase(struct rdx_rb_replicated *tree,
+			struct rdx_rb_node *elem);
+
+/* Brings every replica up to date */
+extern void rdx_rb_replicated_sync(struct rdx_rb_replicated *tree);
+
+/*
+ * The replica local to the calling thread, up to date and locked for
+ * reading with the plain lookup functions.
+ */
+extern struct rdx_rb_root *
+rdx_rb_replicated_read_lock(struct rdx_rb_replicated *tree);
+
+static inline void
+rdx_rb_replicated_read_unlock(struct rdx_rb_replicated *tree
+			      __attribute__((unused)),
+			      struct rdx_rb_root *root)
+{
+	pthread_rwlock_unlock(&container_of(root, struct rdx_rb_replica,
+					    root)->lock);
+}
+
+#endif	/* _RDX_RBTREE_REPLICATED_H */
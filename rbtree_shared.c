@@ -0,0 +1,271 @@
+/*
+  Red Black Trees - trees in shared memory
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+/* Ahead of <sys/stat.h>, whose <linux/stddef.h> would hide our own */
+#include "rbtree_shared.h"
+#include "stddef.h"
+#include "rbtree_io.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * Segment layout: the header, then the nodes, each a struct rdx_rb_onode
+ * followed by the record and padded to 8 bytes. Nodes come off a free list
+ * threaded through their left links, or else from the end of the used
+ * space. The magic goes in last, once the rest is set up.
+ */
+
+#define SHARED_MAGIC	"RDXRBSH1"
+
+struct rdx_rb_shared_header {
+	char magic[8];
+	uint64_t size, record_size, node_size, data_offset;
+	uint64_t root, free, end, count;
+	pthread_rwlock_t lock;
+};
+
+
+static inline void *record_of(struct rdx_rb_shared *shared, uint64_t node)
+{
+	return shared->base + node + sizeof(struct rdx_rb_onode);
+}
+
+static int compare_node(const void *key, const struct rdx_rb_onode *node,
+			void *arg)
+{
+	struct rdx_rb_shared *shared = arg;
+
+	return shared->compare(key, node + 1, shared->arg);
+}
+
+static int map(struct rdx_rb_shared *shared, int fd, size_t size,
+	       int (*compare)(const void *a, const void *b, void *arg),
+	       void *arg)
+{
+	shared->base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+			    fd, 0);
+	if (shared->base == MAP_FAILED)
+		return false;
+	shared->size = size;
+	shared->header = (struct rdx_rb_shared_header *)shared->base;
+	shared->tree.base = shared->base;
+	shared->tree.root = &shared->header->root;
+	shared->tree.touch = NULL;
+	shared->compare = compare;
+	shared->arg = arg;
+	return true;
+}
+
+int rdx_rb_shared_create(struct rdx_rb_shared *shared, int fd, size_t size,
+			 size_t record_size,
+			 int (*compare)(const void *a, const void *b, void *arg),
+			 void *arg)
+{
+	struct rdx_rb_shared_header *header;
+	pthread_rwlockattr_t attr;
+	int ok;
+
+	if (size < sizeof(*header) || ftruncate(fd, size) ||
+	    !map(shared, fd, size, compare, arg))
+		return false;
+
+	header = shared->header;
+	memset(header, 0, sizeof(*header));
+	header->size = size;
+	header->record_size = record_size;
+	header->node_size = ALIGN8(sizeof(struct rdx_rb_onode) + record_size);
+	header->data_offset = ALIGN8(sizeof(*header));
+	header->end = header->data_offset;
+
+	ok = !pthread_rwlockattr_init(&attr);
+	ok = ok &&
+	     !pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) &&
+	     !pthread_rwlockattr_setkind_np(&attr,
+			PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP) &&
+	     !pthread_rwlock_init(&header->lock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+	if (!ok) {
+		munmap(shared->base, size);
+		return false;
+	}
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(header->magic, SHARED_MAGIC, sizeof(header->magic));
+	return true;
+}
+
+int rdx_rb_shared_attach(struct rdx_rb_shared *shared, int fd,
+			 int (*compare)(const void *a, const void *b, void *arg),
+			 void *arg)
+{
+	struct rdx_rb_shared_header *header;
+	struct stat st;
+
+	if (fstat(fd, &st) || (size_t)st.st_size < sizeof(*header) ||
+	    !map(shared, fd, st.st_size, compare, arg))
+		return false;
+
+	header = shared->header;
+	if (!memcmp(header->magic, SHARED_MAGIC, sizeof(header->magic))) {
+		/* Pairs with the fence before the magic is written */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (header->size == (uint64_t)st.st_size &&
+		    header->data_offset >= sizeof(*header) &&
+		    header->end <= header->size)
+			return true;
+	}
+	munmap(shared->base, shared->size);
+	return false;
+}
+
+void rdx_rb_shared_detach(struct rdx_rb_shared *shared)
+{
+	munmap(shared->base, shared->size);
+}
+
+void rdx_rb_shared_destroy(struct rdx_rb_shared *shared)
+{
+	pthread_rwlock_destroy(&shared->header->lock);
+	rdx_rb_shared_detach(shared);
+}
+
+/*
+ * Allocation, with the lock held for writing
+ */
+
+static uint64_t alloc_node(struct rdx_rb_shared *shared)
+{
+	struct rdx_rb_shared_header *header = shared->header;
+	uint64_t node = header->free;
+
+	if (node) {
+		header->free = RDX_RB_ONODE(&shared->tree, node)->left;
+		return node;
+	}
+	if (header->end + header->node_size > shared->size)
+		return 0;
+	node = header->end;
+	header->end += header->node_size;
+	return node;
+}
+
+static void free_node(struct rdx_rb_shared *shared, uint64_t node)
+{
+	RDX_RB_ONODE(&shared->tree, node)->left = shared->header->free;
+	shared->header->free = node;
+}
+
+/*
+ * Changes and lookups
+ */
+
+int rdx_rb_shared_insert(struct rdx_rb_shared *shared, const void *record)
+{
+	struct rdx_rb_shared_header *header = shared->header;
+	uint64_t parent, node;
+	int right, ok = false;
+
+	pthread_rwlock_wrlock(&header->lock);
+	if (!rdx_rb_olookup(&shared->tree, record, compare_node, shared,
+			    &parent, &right) &&
+	    (node = alloc_node(shared))) {
+		memcpy(record_of(shared, node), record, header->record_size);
+		rdx_rb_oinsert(&shared->tree, node, parent, right);
+		header->count++;
+		ok = true;
+	}
+	pthread_rwlock_unlock(&header->lock);
+	return ok;
+}
+
+int rdx_rb_shared_erase(struct rdx_rb_shared *shared, const void *key)
+{
+	struct rdx_rb_shared_header *header = shared->header;
+	uint64_t parent, node;
+	int right;
+
+	pthread_rwlock_wrlock(&header->lock);
+	node = rdx_rb_olookup(&shared->tree, key, compare_node, shared,
+			      &parent, &right);
+	if (node) {
+		rdx_rb_oerase(&shared->tree, node);
+		free_node(shared, node);
+		header->count--;
+	}
+	pthread_rwlock_unlock(&header->lock);
+	return node != 0;
+}
+
+int rdx_rb_shared_update(struct rdx_rb_shared *shared, const void *record)
+{
+	struct rdx_rb_shared_header *header = shared->header;
+	uint64_t parent, node;
+	int right;
+
+	pthread_rwlock_wrlock(&header->lock);
+	node = rdx_rb_olookup(&shared->tree, record, compare_node, shared,
+			      &parent, &right);
+	if (node)
+		memcpy(record_of(shared, node), record, header->record_size);
+	pthread_rwlock_unlock(&header->lock);
+	return node != 0;
+}
+
+int rdx_rb_shared_find(struct rdx_rb_shared *shared, const void *key,
+		       void *record)
+{
+	struct rdx_rb_shared_header *header = shared->header;
+	uint64_t parent, node;
+	int right;
+
+	pthread_rwlock_rdlock(&header->lock);
+	node = rdx_rb_olookup(&shared->tree, key, compare_node, shared,
+			      &parent, &right);
+	if (node)
+		memcpy(record, record_of(shared, node), header->record_size);
+	pthread_rwlock_unlock(&header->lock);
+	return node != 0;
+}
+
+void rdx_rb_shared_for_each(struct rdx_rb_shared *shared,
+			    void (*fn)(const void *record, void *arg),
+			    void *arg)
+{
+	uint64_t node;
+
+	pthread_rwlock_rdlock(&shared->header->lock);
+	for (node = rdx_rb_ofirst(&shared->tree); node;
+	     node = rdx_rb_onext(&shared->tree, node))
+		fn(record_of(shared, node), arg);
+	pthread_rwlock_unlock(&shared->header->lock);
+}
+
+uint64_t rdx_rb_shared_count(struct rdx_rb_shared *shared)
+{
+	uint64_t count;
+
+	pthread_rwlock_rdlock(&shared->header->lock);
+	count = shared->header->count;
+	pthread_rwlock_unlock(&shared->header->lock);
+	return count;
+}
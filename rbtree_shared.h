@@ -0,0 +1,90 @@
+/*
+  Red Black Trees - trees in shared memory
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_SHARED_H
+#define _RDX_RBTREE_SHARED_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree_offset.h"
+
+/*
+ * A tree of fixed-size records in a segment of shared memory, so that one
+ * tree serves every process mapping it, wherever each maps it: the nodes
+ * link by offset, and are allocated from the segment itself, which holds
+ * everything the tree needs, a process-shared reader/writer lock included.
+ *
+ * The segment is whatever @fd refers to: shm_open(), memfd_create(), or a
+ * plain file. It does not grow, so insertions fail once it is full. Every
+ * call takes the lock itself; readers share it, writers have it to
+ * themselves and go first. A process dying with the lock held leaves it
+ * held.
+ *
+ * @compare orders records like memcmp(), and is per process, as code may
+ * not be at the same address everywhere.
+ */
+
+struct rdx_rb_shared_header;
+
+struct rdx_rb_shared {
+	unsigned char *base;
+	uint64_t size;
+	struct rdx_rb_shared_header *header;
+	struct rdx_rb_otree tree;
+	int (*compare)(const void *a, const void *b, void *arg);
+	void *arg;
+};
+
+/*
+ * Set up an empty tree in the first @size bytes of @fd and map it, or map
+ * the one another process set up, which must be complete by then.
+ * Returns false on failure, or if @fd holds no such tree.
+ */
+extern int
+rdx_rb_shared_create(struct rdx_rb_shared *shared, int fd, size_t size,
+		     size_t record_size,
+		     int (*compare)(const void *a, const void *b, void *arg),
+		     void *arg);
+extern int
+rdx_rb_shared_attach(struct rdx_rb_shared *shared, int fd,
+		     int (*compare)(const void *a, const void *b, void *arg),
+		     void *arg);
+/* Unmap, and for the last process out, destroy the lock first */
+extern void rdx_rb_shared_detach(struct rdx_rb_shared *shared);
+extern void rdx_rb_shared_destroy(struct rdx_rb_shared *shared);
+
+/*
+ * As in rbtree_file.h, except that lookups copy the record out to @record,
+ * since the tree may change as soon as the lock is released.
+ */
+extern int rdx_rb_shared_insert(struct rdx_rb_shared *shared,
+				const void *record);
+extern int rdx_rb_shared_erase(struct rdx_rb_shared *shared, const void *key);
+extern int rdx_rb_shared_update(struct rdx_rb_shared *shared,
+				const void *record);
+extern int rdx_rb_shared_find(struct rdx_rb_shared *shared, const void *key,
+			      void *record);
+
+/* Call @fn on every record in order, holding the lock as a reader */
+extern void
+rdx_rb_shared_for_each(struct rdx_rb_shared *shared,
+		       void (*fn)(const void *record, void *arg), void *arg);
+extern uint64_t rdx_rb_shared_count(struct rdx_rb_shared *shared);
+
+#endif	/* _RDX_RBTREE_SHARED_H */
@@ -0,0 +1,420 @@
+/*
+  Red Black Trees - small sets
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "rbtree_small.h"
+#include "rbtree_augmented.h"
+
+struct small_entry {
+	struct rdx_rb_node node;
+	uint64_t key;
+	/* The aggregate of the subtree, then the value */
+	unsigned char data[] __attribute__((aligned(16)));
+};
+
+#define ALIGN16(x)	(((x) + 15) & ~(size_t)15)
+
+/*
+ * The inline array
+ */
+
+static inline void *array_value(const struct rdx_rb_small *small, size_t i)
+{
+	return (void *)(small->values + i * small->ops->value_size);
+}
+
+/*
+ * How many keys are below @key, or not above it. Every slot is compared,
+ * used or not, so that the loop has no exit to take and vectorizes.
+ */
+static inline size_t array_rank(const struct rdx_rb_small *small, uint64_t key,
+				int equal)
+{
+	const uint64_t *keys = small->keys;
+	size_t i, rank = 0;
+
+	for (i = 0; i < RDX_RB_SMALL_MAX; i++)
+		rank += (i < small->count) &
+			((keys[i] < key) | (equal & (keys[i] == key)));
+	return rank;
+}
+
+/*
+ * The tree
+ */
+
+/* The map being worked on by this thread, for the callbacks below */
+static __thread const struct rdx_rb_small *small_current;
+
+static struct small_entry *entry_of(const struct rdx_rb_node *node)
+{
+	return node ? rdx_rb_entry(node, struct small_entry, node) : NULL;
+}
+
+static int small_compare(struct rdx_rb_node *left, struct rdx_rb_node *right)
+{
+	uint64_t a = entry_of(left)->key, b = entry_of(right)->key;
+
+	return a < b ? -1 : a > b;
+}
+
+static inline void *value_of(const struct rdx_rb_small *small,
+			     struct small_entry *entry)
+{
+	return entry->data + ALIGN16(small->ops->aggregate_size);
+}
+
+static void entry_compute(struct small_entry *entry)
+{
+	const struct rdx_rb_small_ops *ops = small_current->ops;
+	struct small_entry *left = entry_of(entry->node.rb_left);
+	struct small_entry *right = entry_of(entry->node.rb_right);
+	void *arg = small_current->arg;
+
+	if (!ops->aggregate_size)
+		return;
+	ops->init(entry->data, arg);
+	if (left)
+		ops->combine(entry->data, left->data, arg);
+	ops->accumulate(entry->data, entry->key,
+			value_of(small_current, entry), arg);
+	if (right)
+		ops->combine(entry->data, right->data, arg);
+}
+
+static void small_propagate(struct rdx_rb_node *node, struct rdx_rb_node *stop)
+{
+	for (; node != stop; node = rdx_rb_parent(node))
+		entry_compute(entry_of(node));
+}
+
+static void small_copy(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	memcpy(entry_of(new)->data, entry_of(old)->data,
+	       small_current->ops->aggregate_size);
+}
+
+static void small_rotate(struct rdx_rb_node *old, struct rdx_rb_node *new)
+{
+	entry_compute(entry_of(old));
+	entry_compute(entry_of(new));
+}
+
+static const struct rdx_rb_augment_callbacks small_callbacks = {
+	small_propagate, small_copy, small_rotate
+};
+
+static struct small_entry *new_entry(const struct rdx_rb_small *small,
+				     uint64_t key, const void *value)
+{
+	struct small_entry *entry =
+		malloc(sizeof(*entry) + ALIGN16(small->ops->aggregate_size) +
+		       small->ops->value_size);
+
+	if (entry) {
+		entry->key = key;
+		memcpy(value_of(small, entry), value, small->ops->value_size);
+	}
+	return entry;
+}
+
+static struct small_entry *tree_lower_bound(const struct rdx_rb_small *small,
+					    uint64_t key)
+{
+	struct small_entry probe = { .key = key };
+
+	return entry_of(rdx_rb_leftmost_greater_equiv(
+		&probe.node, (struct rdx_rb_root *)&small->root));
+}
+
+static struct small_entry *tree_upper_bound(const struct rdx_rb_small *small,
+					    uint64_t key)
+{
+	struct small_entry probe = { .key = key };
+
+	return entry_of(rdx_rb_rightmost_less_equiv(
+		&probe.node, (struct rdx_rb_root *)&small->root));
+}
+
+static struct small_entry *tree_find(const struct rdx_rb_small *small,
+				     uint64_t key)
+{
+	struct small_entry *entry = tree_lower_bound(small, key);
+
+	return entry && entry->key == key ? entry : NULL;
+}
+
+static void tree_link(struct rdx_rb_small *small, struct small_entry *entry)
+{
+	rdx_rb_insert(&entry->node, &small->root);
+	small_current = small;
+	rdx_rb_insert_augmented(&entry->node, &small->root, &small_callbacks);
+}
+
+/* All or nothing: false, with nothing moved, when out of memory */
+static int to_tree(struct rdx_rb_small *small)
+{
+	struct small_entry *entries[RDX_RB_SMALL_MAX];
+	size_t i;
+
+	for (i = 0; i < small->count; i++) {
+		entries[i] = new_entry(small, small->keys[i],
+				       array_value(small, i));
+		if (!entries[i]) {
+			while (i--)
+				free(entries[i]);
+			return false;
+		}
+	}
+	small->root = RDX_RB_ROOT(small_compare, small_compare);
+	small->is_tree = true;
+	for (i = 0; i < small->count; i++)
+		tree_link(small, entries[i]);
+	return true;
+}
+
+static void to_array(struct rdx_rb_small *small)
+{
+	struct small_entry *entries[RDX_RB_SMALL_MIN];
+	struct rdx_rb_node *node;
+	size_t i = 0;
+
+	/* The keys go where the root is, so take the entries out first */
+	for (node = rdx_rb_first(&small->root); node; node = rdx_rb_next(node))
+		entries[i++] = entry_of(node);
+	small->is_tree = false;
+	for (i = 0; i < small->count; i++) {
+		small->keys[i] = entries[i]->key;
+		memcpy(array_value(small, i), value_of(small, entries[i]),
+		       small->ops->value_size);
+		free(entries[i]);
+	}
+}
+
+void rdx_rb_small_init(struct rdx_rb_small *small,
+		       const struct rdx_rb_small_ops *ops, void *arg)
+{
+	small->ops = ops;
+	small->arg = arg;
+	small->count = 0;
+	small->is_tree = false;
+	memset(small->keys, 0, sizeof(small->keys));
+}
+
+void rdx_rb_small_destroy(struct rdx_rb_small *small)
+{
+	struct rdx_rb_node *node, *next;
+
+	if (small->is_tree)
+		for (node = rdx_rb_first_postorder(&small->root); node;
+		     node = next) {
+			next = rdx_rb_next_postorder(node);
+			free(entry_of(node));
+		}
+	rdx_rb_small_init(small, small->ops, small->arg);
+}
+
+int rdx_rb_small_insert(struct rdx_rb_small *small, uint64_t key,
+			const void *value)
+{
+	size_t size = small->ops->value_size, rank;
+	struct small_entry *entry;
+
+	if (!small->is_tree) {
+		rank = array_rank(small, key, false);
+		if (rank < small->count && small->keys[rank] == key)
+			return false;
+		if (small->count < RDX_RB_SMALL_MAX) {
+			memmove(small->keys + rank + 1, small->keys + rank,
+				(small->count - rank) * sizeof(uint64_t));
+			memmove(array_value(small, rank + 1),
+				array_value(small, rank),
+				(small->count - rank) * size);
+			small->keys[rank] = key;
+			memcpy(array_value(small, rank), value, size);
+			small->count++;
+			return true;
+		}
+		if (!to_tree(small))
+			return false;
+	}
+
+	if (tree_find(small, key) || !(entry = new_entry(small, key, value)))
+		return false;
+	tree_link(small, entry);
+	small->count++;
+	return true;
+}
+
+int rdx_rb_small_erase(struct rdx_rb_small *small, uint64_t key)
+{
+	size_t size = small->ops->value_size, rank;
+	struct small_entry *entry;
+
+	if (!small->is_tree) {
+		rank = array_rank(small, key, false);
+		if (rank == small->count || small->keys[rank] != key)
+			return false;
+		small->count--;
+		memmove(small->keys + rank, small->keys + rank + 1,
+			(small->count - rank) * sizeof(uint64_t));
+		memmove(array_value(small, rank), array_value(small, rank + 1),
+			(small->count - rank) * size);
+		return true;
+	}
+
+	entry = tree_find(small, key);
+	if (!entry)
+		return false;
+	small_current = small;
+	rdx_rb_erase_augmented(&entry->node, &small->root, &small_callbacks);
+	free(entry);
+	if (--small->count <= RDX_RB_SMALL_MIN)
+		to_array(small);
+	return true;
+}
+
+const void *rdx_rb_small_find(const struct rdx_rb_small *small, uint64_t key)
+{
+	struct small_entry *entry;
+	size_t rank;
+
+	if (!small->is_tree) {
+		rank = array_rank(small, key, false);
+		return rank < small->count && small->keys[rank] == key ?
+		       array_value(small, rank) : NULL;
+	}
+	entry = tree_find(small, key);
+	return entry ? value_of(small, entry) : NULL;
+}
+
+int rdx_rb_small_greater_equiv(const struct rdx_rb_small *small, uint64_t *key,
+			       const void **value)
+{
+	struct small_entry *entry;
+	size_t rank;
+
+	if (!small->is_tree) {
+		rank = array_rank(small, *key, false);
+		if (rank == small->count)
+			return false;
+		*key = small->keys[rank];
+		*value = array_value(small, rank);
+		return true;
+	}
+	entry = tree_lower_bound(small, *key);
+	if (!entry)
+		return false;
+	*key = entry->key;
+	*value = value_of(small, entry);
+	return true;
+}
+
+int rdx_rb_small_less_equiv(const struct rdx_rb_small *small, uint64_t *key,
+			    const void **value)
+{
+	struct small_entry *entry;
+	size_t rank;
+
+	if (!small->is_tree) {
+		rank = array_rank(small, *key, true);
+		if (!rank)
+			return false;
+		*key = small->keys[rank - 1];
+		*value = array_value(small, rank - 1);
+		return true;
+	}
+	entry = tree_upper_bound(small, *key);
+	if (!entry)
+		return false;
+	*key = entry->key;
+	*value = value_of(small, entry);
+	return true;
+}
+
+void rdx_rb_small_scan(const struct rdx_rb_small *small, uint64_t first,
+		       uint64_t last,
+		       void (*fn)(uint64_t key, const void *value, void *arg),
+		       void *arg)
+{
+	struct small_entry *entry;
+	struct rdx_rb_node *node;
+	size_t i;
+
+	if (!small->is_tree) {
+		for (i = array_rank(small, first, false);
+		     i < small->count && small->keys[i] <= last; i++)
+			fn(small->keys[i], array_value(small, i), arg);
+		return;
+	}
+	entry = tree_lower_bound(small, first);
+	for (node = entry ? &entry->node : NULL;
+	     node && entry_of(node)->key <= last; node = rdx_rb_next(node))
+		fn(entry_of(node)->key, value_of(small, entry_of(node)), arg);
+}
+
+/* As in rbtree_mvcc.c */
+static void aggregate_tree(const struct rdx_rb_small *small, void *acc,
+			   struct rdx_rb_node *node, uint64_t first,
+			   uint64_t last, int lower, int upper)
+{
+	const struct rdx_rb_small_ops *ops = small->ops;
+
+	while (node) {
+		struct small_entry *entry = entry_of(node);
+
+		if (!lower && !upper) {
+			ops->combine(acc, entry->data, small->arg);
+			return;
+		}
+		if (lower && entry->key < first) {
+			node = node->rb_right;
+		} else if (upper && entry->key > last) {
+			node = node->rb_left;
+		} else {
+			aggregate_tree(small, acc, node->rb_left, first, last,
+				       lower, false);
+			ops->accumulate(acc, entry->key,
+					value_of(small, entry), small->arg);
+			lower = false;
+			node = node->rb_right;
+		}
+	}
+}
+
+void rdx_rb_small_aggregate(const struct rdx_rb_small *small, uint64_t first,
+			    uint64_t last, void *result)
+{
+	const struct rdx_rb_small_ops *ops = small->ops;
+	size_t i;
+
+	if (!ops->aggregate_size)
+		return;
+	ops->init(result, small->arg);
+	if (small->is_tree) {
+		aggregate_tree(small, result, small->root.rb_node, first, last,
+			       true, true);
+		return;
+	}
+	for (i = array_rank(small, first, false);
+	     i < small->count && small->keys[i] <= last; i++)
+		ops->accumulate(result, small->keys[i], array_value(small, i),
+				small->arg);
+}
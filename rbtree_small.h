@@ -0,0 +1,107 @@
+/*
+  Red Black Trees - small sets
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_SMALL_H
+#define _RDX_RBTREE_SMALL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "rbtree.h"
+
+/*
+ * A map from 64-bit keys to values of @value_size bytes for when there are
+ * lots of maps and most of them hold a handful of keys. Up to
+ * RDX_RB_SMALL_MAX keys sit sorted in the map itself, with no allocation
+ * and no pointers to chase: a search compares against all of them without
+ * a branch, which unrolls fully, and vectorizes on targets with 64-bit
+ * vector compares (-mavx2 and up). One key more
+ * moves them all to an augmented tree of allocated entries, and erasing
+ * down to RDX_RB_SMALL_MIN moves them back, so a map sitting at the
+ * threshold does not go back and forth on every change.
+ *
+ * The map takes RDX_RB_SMALL_SIZE(value_size) bytes, of which the values
+ * are the tail end. Range aggregates are as in rbtree_lsm.h, under @init,
+ * @accumulate and @combine on accumulators of @aggregate_size bytes (0 for
+ * none), taking whole subtrees once it is a tree.
+ */
+
+#define RDX_RB_SMALL_MAX	8
+#define RDX_RB_SMALL_MIN	4
+
+struct rdx_rb_small_ops {
+	size_t value_size, aggregate_size;
+	void (*init)(void *acc, void *arg);
+	void (*accumulate)(void *acc, uint64_t key, const void *value,
+			   void *arg);
+	void (*combine)(void *acc, const void *other, void *arg);
+};
+
+struct rdx_rb_small {
+	const struct rdx_rb_small_ops *ops;
+	void *arg;
+	size_t count;
+	int is_tree;
+	union {
+		uint64_t keys[RDX_RB_SMALL_MAX];
+		struct rdx_rb_root root;
+	};
+	/* RDX_RB_SMALL_MAX of them while not a tree */
+	unsigned char values[];
+};
+
+#define RDX_RB_SMALL_SIZE(value_size)					\
+	(sizeof(struct rdx_rb_small) + RDX_RB_SMALL_MAX * (value_size))
+
+extern void rdx_rb_small_init(struct rdx_rb_small *small,
+			      const struct rdx_rb_small_ops *ops, void *arg);
+/* Free the tree, if any, and leave @small empty */
+extern void rdx_rb_small_destroy(struct rdx_rb_small *small);
+
+/* False if @key is there already, or out of memory */
+extern int rdx_rb_small_insert(struct rdx_rb_small *small, uint64_t key,
+			       const void *value);
+/* False if @key is not there */
+extern int rdx_rb_small_erase(struct rdx_rb_small *small, uint64_t key);
+/* The value of @key, or NULL */
+extern const void *rdx_rb_small_find(const struct rdx_rb_small *small,
+				     uint64_t key);
+
+/*
+ * Move @key to the first key at or above it, or the last at or below it,
+ * and set @value to its value. False, leaving both alone, if there is none.
+ */
+extern int
+rdx_rb_small_greater_equiv(const struct rdx_rb_small *small, uint64_t *key,
+			   const void **value);
+extern int
+rdx_rb_small_less_equiv(const struct rdx_rb_small *small, uint64_t *key,
+			const void **value);
+
+/* Call @fn on every key from @first to @last, in order */
+extern void
+rdx_rb_small_scan(const struct rdx_rb_small *small, uint64_t first,
+		  uint64_t last,
+		  void (*fn)(uint64_t key, const void *value, void *arg),
+		  void *arg);
+/* Set @result to the aggregate of every key from @first to @last */
+extern void
+rdx_rb_small_aggregate(const struct rdx_rb_small *small, uint64_t first,
+		       uint64_t last, void *result);
+
+#endif	/* _RDX_RBTREE_SMALL_H */
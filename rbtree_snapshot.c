@@ -0,0 +1,846 @@
+/*
+  Red Black Trees - compact snapshots
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#define _GNU_SOURCE
+
+/* Ahead of the system headers, which may drag in <linux/stddef.h> */
+#include "rbtree_snapshot.h"
+#include "rbtree_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+/* Our stddef.h shares its guard with <linux/stddef.h>, which defines this */
+#ifndef __DECLARE_FLEX_ARRAY
+#define __DECLARE_FLEX_ARRAY(TYPE, NAME)	\
+	struct {				\
+		struct { } __empty_ ## NAME;	\
+		TYPE NAME[];			\
+	}
+#endif
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <zlib.h>
+
+/*
+ * File layout: the header, the blocks one after another, then the index,
+ * an array of struct rdx_rb_snapshot_block. The header is written last,
+ * once the index is in place. All checksums are CRC32s.
+ */
+
+#define SNAPSHOT_MAGIC		"RDXRBSN1"
+#define SNAPSHOT_BLOCK		4096
+#define VARINT_MAX		10
+/* Asynchronous I/O goes in stages of this size, up to DEPTH of them in flight */
+#define SNAPSHOT_STAGE		(1 << 20)
+#define SNAPSHOT_DEPTH		4
+/* What O_DIRECT wants offsets, lengths and buffers aligned to */
+#define SNAPSHOT_ALIGN		4096
+
+struct snapshot_header {
+	char magic[8];
+	uint64_t value_size, count, nr_blocks, index_offset;
+	uint32_t index_crc, crc;
+};
+
+static size_t put_varint(unsigned char *p, uint64_t value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80) {
+		p[len++] = value | 0x80;
+		value >>= 7;
+	}
+	p[len++] = value;
+	return len;
+}
+
+/* Returns the length, or 0 if the varint runs past @end or is too long */
+static size_t get_varint(const unsigned char *p, const unsigned char *end,
+			 uint64_t *value)
+{
+	size_t len = 0;
+
+	*value = 0;
+	while (p + len < end && len < VARINT_MAX) {
+		*value |= (uint64_t)(p[len] & 0x7f) << (7 * len);
+		if (!(p[len++] & 0x80))
+			return len;
+	}
+	return 0;
+}
+
+/*
+ * Reads @len bytes if it can but is content with @need, @done of which are
+ * there already: a span widened to whole pages may run past the end of
+ * the file.
+ */
+static int read_span(int fd, unsigned char *data, size_t len, off_t offset,
+		     size_t need, size_t done)
+{
+	while (done < need) {
+		ssize_t n = pread(fd, data + done, len - done, offset + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return false;
+		done += n;
+	}
+	return true;
+}
+
+/*
+ * Turn O_DIRECT on for @fd, where the file system allows. Returns the file
+ * status flags to put back afterwards, or -1 if there is nothing to undo.
+ */
+static int enable_direct(int fd)
+{
+	int fl = fcntl(fd, F_GETFL);
+
+	if (fl < 0 || (fl & O_DIRECT) || fcntl(fd, F_SETFL, fl | O_DIRECT))
+		return -1;
+	return fl;
+}
+
+static int is_direct(int fd)
+{
+	int fl = fcntl(fd, F_GETFL);
+
+	return fl >= 0 && (fl & O_DIRECT);
+}
+
+/*
+ * Asynchronous I/O, on an io_uring set up by hand: a submission and a
+ * completion queue shared with the kernel, each a ring of entries between
+ * free-running head and tail counters. There is a single submitter and a
+ * single reaper, the calling thread, so only the counters the kernel also
+ * touches need ordering.
+ */
+
+struct io_ring {
+	int fd;
+	unsigned int *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_map, *cq_map;
+	size_t sq_len, cq_len, sqes_len;
+	/* Queued, but not handed to the kernel yet */
+	unsigned int queued;
+};
+
+static void ring_exit(struct io_ring *ring)
+{
+	if (ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_len);
+	if (ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map, ring->sq_len);
+	close(ring->fd);
+}
+
+/* Returns false where io_uring is missing or not allowed */
+static int ring_init(struct io_ring *ring, unsigned int entries)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ring->fd < 0)
+		return false;
+	ring->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_len = p.cq_off.cqes +
+		       p.cq_entries * sizeof(struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) &&
+	    ring->cq_len > ring->sq_len)
+		ring->sq_len = ring->cq_len;
+
+	ring->sq_map = mmap(NULL, ring->sq_len, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	ring->cq_map = ring->sq_map;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP) &&
+	    ring->sq_map != MAP_FAILED)
+		ring->cq_map = mmap(NULL, ring->cq_len, PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+	    ring->sqes == MAP_FAILED) {
+		ring_exit(ring);
+		return false;
+	}
+
+	sq = ring->sq_map;
+	cq = ring->cq_map;
+	ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+	ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ring->queued = 0;
+	return true;
+}
+
+/* Callers keep no more in flight than the ring has entries */
+static void ring_queue(struct io_ring *ring, int opcode, int fd, void *data,
+		       size_t len, off_t offset, uint64_t user_data)
+{
+	unsigned int tail = *ring->sq_tail, index = tail & *ring->sq_mask;
+	struct io_uring_sqe *sqe = &ring->sqes[index];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)data;
+	sqe->len = len;
+	sqe->off = offset;
+	sqe->user_data = user_data;
+	ring->sq_array[index] = index;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring->queued++;
+}
+
+/* Hand whatever is queued to the kernel, and wait for a completion if asked */
+static int ring_enter(struct io_ring *ring, int wait)
+{
+	for (;;) {
+		long done = syscall(__NR_io_uring_enter, ring->fd,
+				    ring->queued, wait,
+				    wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+		if (done >= 0) {
+			ring->queued -= done;
+			return true;
+		}
+		if (errno != EINTR)
+			return false;
+	}
+}
+
+static int ring_reap(struct io_ring *ring, uint64_t *user_data, int *res)
+{
+	for (;;) {
+		unsigned int head = *ring->cq_head;
+
+		if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe =
+				&ring->cqes[head & *ring->cq_mask];
+
+			*user_data = cqe->user_data;
+			*res = cqe->res;
+			__atomic_store_n(ring->cq_head, head + 1,
+					 __ATOMIC_RELEASE);
+			return true;
+		}
+		if (!ring_enter(ring, 1))
+			return false;
+	}
+}
+
+/*
+ * Writing
+ *
+ * Blocks are laid out one after another in staging buffers, each written
+ * out whole once full. With RDX_RB_SNAPSHOT_ASYNC up to SNAPSHOT_DEPTH of
+ * them are in flight while the next ones are filled; otherwise there is a
+ * single one, written synchronously. Stages start on page boundaries, and
+ * under O_DIRECT the last one is padded to whole pages and the file cut
+ * back afterwards.
+ */
+
+struct snapshot_writer {
+	int fd, flags;
+	const struct rdx_rb_snapshot_ops *ops;
+	void *arg;
+	off_t offset;
+	size_t block_records;
+	/* The block being filled: its keys as varints, then its values */
+	unsigned char *raw, *values, *packed;
+	size_t nr_keys, keys_len, packed_capacity;
+	uint64_t first_key, last_key;
+	struct rdx_rb_snapshot_block *blocks;
+	size_t nr_blocks, capacity;
+	/* Staging: the current stage has @fill bytes, from @stage_offset on */
+	unsigned char *stages, *first_page;
+	size_t nr_stages, stage, fill, pending[SNAPSHOT_DEPTH];
+	off_t stage_offset, offsets[SNAPSHOT_DEPTH];
+	struct io_ring ring;
+	int async, direct;
+};
+
+/* Reap one write, finishing it synchronously if it came up short */
+static int reap_stage(struct snapshot_writer *w)
+{
+	uint64_t slot;
+	int res;
+
+	if (!ring_reap(&w->ring, &slot, &res)) {
+		/* Nothing more will come back */
+		memset(w->pending, 0, sizeof(w->pending));
+		return false;
+	}
+	res = res >= 0 &&
+	      ((size_t)res == w->pending[slot] ||
+	       write_all(w->fd, w->stages + slot * SNAPSHOT_STAGE + res,
+			 w->pending[slot] - res, w->offsets[slot] + res));
+	w->pending[slot] = 0;
+	return res;
+}
+
+static int flush_stage(struct snapshot_writer *w, size_t len)
+{
+	unsigned char *stage = w->stages + w->stage * SNAPSHOT_STAGE;
+	int ok = true;
+
+	/* Under O_DIRECT the header goes in by rewriting the whole page */
+	if (w->direct && w->stage_offset == 0)
+		memcpy(w->first_page, stage, SNAPSHOT_ALIGN);
+	if (w->async) {
+		w->offsets[w->stage] = w->stage_offset;
+		w->pending[w->stage] = len;
+		ring_queue(&w->ring, IORING_OP_WRITE, w->fd, stage, len,
+			   w->stage_offset, w->stage);
+		ok = ring_enter(&w->ring, 0);
+	} else {
+		ok = write_all(w->fd, stage, len, w->stage_offset);
+	}
+	w->stage_offset += len;
+	w->fill = 0;
+	w->stage = (w->stage + 1) % w->nr_stages;
+	while (ok && w->pending[w->stage])
+		ok = reap_stage(w);
+	return ok;
+}
+
+static int emit(struct snapshot_writer *w, const void *data, size_t len)
+{
+	while (len) {
+		size_t chunk = SNAPSHOT_STAGE - w->fill;
+
+		if (chunk > len)
+			chunk = len;
+		memcpy(w->stages + w->stage * SNAPSHOT_STAGE + w->fill, data,
+		       chunk);
+		w->fill += chunk;
+		data = (const char *)data + chunk;
+		len -= chunk;
+		if (w->fill == SNAPSHOT_STAGE &&
+		    !flush_stage(w, SNAPSHOT_STAGE))
+			return false;
+	}
+	return true;
+}
+
+/* Write out the last stage and wait for every write, even after an error */
+static int finish_stages(struct snapshot_writer *w, int ok)
+{
+	size_t len = w->fill, slot;
+
+	if (w->direct)
+		len = (len + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+	memset(w->stages + w->stage * SNAPSHOT_STAGE + w->fill, 0,
+	       len - w->fill);
+	ok = ok && (!len || flush_stage(w, len));
+	for (slot = 0; w->async && slot < w->nr_stages; slot++)
+		while (w->pending[slot])
+			if (!reap_stage(w))
+				ok = false;
+	return ok;
+}
+
+static int flush_block(struct snapshot_writer *w)
+{
+	size_t values_len = w->nr_keys * w->ops->value_size;
+	size_t raw_size = w->keys_len + values_len;
+	uLongf stored_size = w->packed_capacity;
+	const unsigned char *stored = w->packed;
+	struct rdx_rb_snapshot_block *block;
+
+	if (w->nr_blocks == w->capacity) {
+		size_t capacity = 2 * w->capacity + 16;
+		block = realloc(w->blocks, capacity * sizeof(*block));
+		if (!block)
+			return false;
+		w->blocks = block;
+		w->capacity = capacity;
+	}
+	block = &w->blocks[w->nr_blocks++];
+
+	memcpy(w->raw + w->keys_len, w->values, values_len);
+	block->flags = 0;
+	if ((w->flags & RDX_RB_SNAPSHOT_COMPRESS) &&
+	    compress2(w->packed, &stored_size, w->raw, raw_size, 1) == Z_OK &&
+	    stored_size < raw_size) {
+		block->flags = RDX_RB_SNAPSHOT_COMPRESS;
+	} else {
+		stored = w->raw;
+		stored_size = raw_size;
+	}
+	block->offset = w->offset;
+	block->first_key = w->first_key;
+	block->count = w->nr_keys;
+	block->raw_size = raw_size;
+	block->stored_size = stored_size;
+	block->crc = checksum(stored, stored_size);
+	w->offset += stored_size;
+	w->nr_keys = 0;
+	w->keys_len = 0;
+	return emit(w, stored, stored_size);
+}
+
+static int add_node(struct snapshot_writer *w, struct rdx_rb_node *node)
+{
+	uint64_t key = w->ops->key(node, w->arg);
+
+	if ((w->nr_keys || w->nr_blocks) && key < w->last_key)
+		return false;
+	if (!w->nr_keys)
+		w->first_key = key;
+	w->keys_len += put_varint(w->raw + w->keys_len,
+				  w->nr_keys ? key - w->last_key : key);
+	w->ops->encode(node, w->values + w->nr_keys * w->ops->value_size,
+		       w->arg);
+	w->last_key = key;
+	return ++w->nr_keys < w->block_records || flush_block(w);
+}
+
+int rdx_rb_snapshot_write(struct rdx_rb_root *root, int fd,
+			  const struct rdx_rb_snapshot_ops *ops, void *arg,
+			  size_t block_records, int flags)
+{
+	struct snapshot_writer w = { fd, flags, ops, arg,
+				     sizeof(struct snapshot_header) };
+	struct snapshot_header header = { SNAPSHOT_MAGIC, ops->value_size };
+	int restore = -1;
+	struct rdx_rb_node *node;
+	size_t raw_capacity, end;
+	int ok;
+
+	w.block_records = block_records ? block_records : SNAPSHOT_BLOCK;
+	raw_capacity = w.block_records * (VARINT_MAX + ops->value_size);
+	/* Blocks must fit the 32-bit sizes of the index */
+	if (raw_capacity > UINT32_MAX)
+		return false;
+	w.packed_capacity = compressBound(raw_capacity);
+	w.raw = malloc(raw_capacity);
+	w.values = malloc(w.block_records * ops->value_size + 1);
+	w.packed = malloc(w.packed_capacity);
+	ok = w.raw && w.values && w.packed;
+
+	if (flags & RDX_RB_SNAPSHOT_DIRECT)
+		restore = enable_direct(fd);
+	w.direct = is_direct(fd);
+	w.async = (flags & RDX_RB_SNAPSHOT_ASYNC) &&
+		  ring_init(&w.ring, SNAPSHOT_DEPTH);
+	w.nr_stages = w.async ? SNAPSHOT_DEPTH : 1;
+	if (posix_memalign((void **)&w.stages, SNAPSHOT_ALIGN,
+			   w.nr_stages * SNAPSHOT_STAGE))
+		w.stages = NULL;
+	if (posix_memalign((void **)&w.first_page, SNAPSHOT_ALIGN,
+			   SNAPSHOT_ALIGN))
+		w.first_page = NULL;
+	ok = ok && w.stages && w.first_page;
+	/* Room for the header, which goes in last */
+	if (ok) {
+		memset(w.stages, 0, sizeof(header));
+		w.fill = sizeof(header);
+	}
+
+	for (node = rdx_rb_first(root); ok && node; node = rdx_rb_next(node)) {
+		ok = add_node(&w, node);
+		header.count++;
+	}
+	ok = ok && (!w.nr_keys || flush_block(&w));
+
+	header.nr_blocks = w.nr_blocks;
+	header.index_offset = w.offset;
+	header.index_crc = checksum(w.blocks, w.nr_blocks * sizeof(*w.blocks));
+	header.crc = checksum(&header, offsetof(struct snapshot_header, crc));
+	end = w.offset + w.nr_blocks * sizeof(*w.blocks);
+	ok = ok && emit(&w, w.blocks, w.nr_blocks * sizeof(*w.blocks));
+	if (w.stages)
+		ok = finish_stages(&w, ok);
+	if (ok && w.direct) {
+		memcpy(w.first_page, &header, sizeof(header));
+		ok = write_all(fd, w.first_page, SNAPSHOT_ALIGN, 0);
+	} else if (ok) {
+		ok = write_all(fd, &header, sizeof(header), 0);
+	}
+	ok = ok && !ftruncate(fd, end) && !fdatasync(fd);
+
+	if (w.async)
+		ring_exit(&w.ring);
+	if (restore >= 0)
+		fcntl(fd, F_SETFL, restore);
+	free(w.first_page);
+	free(w.stages);
+	free(w.blocks);
+	free(w.packed);
+	free(w.values);
+	free(w.raw);
+	return ok;
+}
+
+/*
+ * Reading
+ */
+
+int rdx_rb_snapshot_open(struct rdx_rb_snapshot *snapshot, int fd,
+			 const struct rdx_rb_snapshot_ops *ops, void *arg)
+{
+	struct snapshot_header header;
+	uint64_t count = 0;
+	size_t i, len;
+
+	snapshot->fd = fd;
+	snapshot->ops = ops;
+	snapshot->arg = arg;
+	snapshot->blocks = NULL;
+	if (!read_all(fd, &header, sizeof(header), 0) ||
+	    memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) ||
+	    header.crc != checksum(&header, offsetof(struct snapshot_header,
+						     crc)) ||
+	    header.value_size != ops->value_size ||
+	    header.nr_blocks > SIZE_MAX / sizeof(*snapshot->blocks))
+		return false;
+
+	len = header.nr_blocks * sizeof(*snapshot->blocks);
+	snapshot->nr_blocks = header.nr_blocks;
+	snapshot->count = header.count;
+	snapshot->blocks = malloc(len + 1);
+	if (!snapshot->blocks ||
+	    !read_all(fd, snapshot->blocks, len, header.index_offset) ||
+	    checksum(snapshot->blocks, len) != header.index_crc)
+		goto fail;
+	for (i = 0; i < snapshot->nr_blocks; i++) {
+		if (!snapshot->blocks[i].count)
+			goto fail;
+		count += snapshot->blocks[i].count;
+	}
+	if (count == header.count)
+		return true;
+fail:
+	free(snapshot->blocks);
+	snapshot->blocks = NULL;
+	return false;
+}
+
+void rdx_rb_snapshot_close(struct rdx_rb_snapshot *snapshot)
+{
+	free(snapshot->blocks);
+	snapshot->blocks = NULL;
+}
+
+size_t rdx_rb_snapshot_find(struct rdx_rb_snapshot *snapshot, uint64_t key)
+{
+	size_t lo = 1, hi = snapshot->nr_blocks;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (snapshot->blocks[mid].first_key <= key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+static int decode_block(struct rdx_rb_snapshot *snapshot,
+			struct rdx_rb_snapshot_block *block,
+			const unsigned char *raw, struct rdx_rb_node **nodes)
+{
+	const struct rdx_rb_snapshot_ops *ops = snapshot->ops;
+	const unsigned char *p = raw, *values, *end = raw + block->raw_size;
+	uint64_t i, key = 0;
+
+	/* Find where the values start, and that they all fit */
+	for (i = 0; i < block->count; i++) {
+		size_t len = get_varint(p, end, &key);
+		if (!len)
+			return false;
+		p += len;
+	}
+	if ((size_t)(end - p) != block->count * ops->value_size)
+		return false;
+
+	values = p;
+	for (p = raw, i = 0; i < block->count; i++) {
+		uint64_t delta;
+
+		p += get_varint(p, end, &delta);
+		key = i ? key + delta : delta;
+		nodes[i] = ops->decode(key, values + i * ops->value_size,
+				       snapshot->arg);
+		if (!nodes[i]) {
+			while (i--)
+				ops->dispose(nodes[i], snapshot->arg);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Check, uncompress and decode @block, read into @stored */
+static int decode_stored(struct rdx_rb_snapshot *snapshot,
+			 struct rdx_rb_snapshot_block *block,
+			 const unsigned char *stored,
+			 struct rdx_rb_node **nodes)
+{
+	unsigned char *raw = NULL;
+	uLongf raw_size = block->raw_size;
+	int ok = checksum(stored, block->stored_size) == block->crc;
+
+	if (ok && (block->flags & RDX_RB_SNAPSHOT_COMPRESS)) {
+		raw = malloc(block->raw_size + 1);
+		ok = raw && uncompress(raw, &raw_size, stored,
+				       block->stored_size) == Z_OK &&
+		     raw_size == block->raw_size;
+	} else if (ok) {
+		ok = block->stored_size == block->raw_size;
+	}
+	ok = ok && decode_block(snapshot, block, raw ? raw : stored, nodes);
+	free(raw);
+	return ok;
+}
+
+int rdx_rb_snapshot_read_block(struct rdx_rb_snapshot *snapshot, size_t index,
+			       struct rdx_rb_node **nodes)
+{
+	struct rdx_rb_snapshot_block *block = &snapshot->blocks[index];
+	unsigned char *stored = malloc(block->stored_size + 1);
+	int ok = stored && read_all(snapshot->fd, stored, block->stored_size,
+				    block->offset) &&
+		 decode_stored(snapshot, block, stored, nodes);
+
+	free(stored);
+	return ok;
+}
+
+/*
+ * Loading: every block is decoded and built into a subtree of its own, in
+ * parallel, each block but the first keeping its first node aside. The
+ * subtrees are then joined in order around those nodes, which costs
+ * O(log n) a block.
+ *
+ * With RDX_RB_SNAPSHOT_ASYNC or RDX_RB_SNAPSHOT_DIRECT each thread takes a
+ * run of consecutive blocks instead and reads them into page-aligned
+ * buffers, whole pages at a time, keeping up to SNAPSHOT_DEPTH reads in
+ * flight on a ring of its own while it decodes those already in.
+ */
+
+struct load_ctx {
+	struct rdx_rb_snapshot *snapshot;
+	const struct rdx_rb_augment_callbacks *augment;
+	int async;
+	size_t nr_runs;
+	struct rdx_rb_node **nodes;
+	size_t *starts;
+	struct rdx_rb_root *subtrees;
+	int *loaded;
+};
+
+/* Once the nodes of @block are in, build its subtree */
+static void build_block(struct load_ctx *ctx, size_t block)
+{
+	struct rdx_rb_node **nodes = ctx->nodes + ctx->starts[block];
+	size_t count = ctx->snapshot->blocks[block].count;
+
+	ctx->loaded[block] = true;
+	/* Keep the pivot out, except in front of the first subtree */
+	if (block > 0) {
+		nodes++;
+		count--;
+	}
+	if (ctx->augment)
+		rdx_rb_build_sorted_augmented(nodes, count,
+					      &ctx->subtrees[block], 1,
+					      ctx->augment);
+	else
+		rdx_rb_build_sorted(nodes, count, &ctx->subtrees[block], 1);
+}
+
+static void load_worker(void *arg, size_t block)
+{
+	struct load_ctx *ctx = arg;
+
+	if (rdx_rb_snapshot_read_block(ctx->snapshot, block,
+				       ctx->nodes + ctx->starts[block]))
+		build_block(ctx, block);
+}
+
+/* The file span holding @block, widened to whole pages */
+static off_t block_span(struct rdx_rb_snapshot_block *block, size_t *len,
+			size_t *need)
+{
+	off_t start = block->offset & ~(off_t)(SNAPSHOT_ALIGN - 1);
+
+	*need = block->offset + block->stored_size - start;
+	*len = (*need + SNAPSHOT_ALIGN - 1) & ~(size_t)(SNAPSHOT_ALIGN - 1);
+	return start;
+}
+
+static void decode_span(struct load_ctx *ctx, size_t block,
+			const unsigned char *span)
+{
+	struct rdx_rb_snapshot_block *b = &ctx->snapshot->blocks[block];
+
+	if (decode_stored(ctx->snapshot, b,
+			  span + (b->offset & (SNAPSHOT_ALIGN - 1)),
+			  ctx->nodes + ctx->starts[block]))
+		build_block(ctx, block);
+}
+
+static void load_run_worker(void *arg, size_t run)
+{
+	struct load_ctx *ctx = arg;
+	struct rdx_rb_snapshot *snapshot = ctx->snapshot;
+	size_t first = snapshot->nr_blocks * run / ctx->nr_runs;
+	size_t last = snapshot->nr_blocks * (run + 1) / ctx->nr_runs;
+	size_t slot_size = 0, in_flight = 0, next, len, need, i;
+	size_t slots[SNAPSHOT_DEPTH];
+	unsigned char *spans;
+	struct io_ring ring;
+	uint64_t slot;
+	int async, res;
+
+	for (i = first; i < last; i++) {
+		block_span(&snapshot->blocks[i], &len, &need);
+		if (len > slot_size)
+			slot_size = len;
+	}
+	if (posix_memalign((void **)&spans, SNAPSHOT_ALIGN,
+			   SNAPSHOT_DEPTH * slot_size))
+		return;
+	async = ctx->async && ring_init(&ring, SNAPSHOT_DEPTH);
+
+	for (next = first; !async && next < last; next++) {
+		off_t start = block_span(&snapshot->blocks[next], &len, &need);
+
+		if (read_span(snapshot->fd, spans, len, start, need, 0))
+			decode_span(ctx, next, spans);
+	}
+
+	for (i = 0; i < SNAPSHOT_DEPTH; i++)
+		slots[i] = SIZE_MAX;
+	while (async && (next < last || in_flight)) {
+		unsigned char *span;
+		off_t start;
+
+		/* Keep the ring full */
+		for (i = 0; i < SNAPSHOT_DEPTH && next < last; i++) {
+			if (slots[i] != SIZE_MAX)
+				continue;
+			start = block_span(&snapshot->blocks[next], &len,
+					   &need);
+			ring_queue(&ring, IORING_OP_READ, snapshot->fd,
+				   spans + i * slot_size, len, start, i);
+			slots[i] = next++;
+			in_flight++;
+		}
+		if ((ring.queued && !ring_enter(&ring, 0)) ||
+		    !ring_reap(&ring, &slot, &res))
+			break;
+		in_flight--;
+
+		span = spans + slot * slot_size;
+		start = block_span(&snapshot->blocks[slots[slot]], &len, &need);
+		if (res >= 0 && read_span(snapshot->fd, span, len, start, need,
+					  res))
+			decode_span(ctx, slots[slot], span);
+		slots[slot] = SIZE_MAX;
+	}
+
+	/* Buffers reads may still land in have to stay, whatever the cost */
+	while (async && in_flight && ring_reap(&ring, &slot, &res))
+		in_flight--;
+	if (async)
+		ring_exit(&ring);
+	if (!in_flight)
+		free(spans);
+}
+
+int rdx_rb_snapshot_load(struct rdx_rb_snapshot *snapshot,
+			 struct rdx_rb_root *root,
+			 const struct rdx_rb_augment_callbacks *augment,
+			 unsigned int nr_threads, int flags)
+{
+	size_t nr_blocks = snapshot->nr_blocks, i, j;
+	struct load_ctx ctx = { snapshot, augment,
+				flags & RDX_RB_SNAPSHOT_ASYNC };
+	int ok = true, restore = -1;
+
+	if (!nr_blocks)
+		return true;
+	ctx.nodes = malloc(snapshot->count * sizeof(*ctx.nodes));
+	ctx.starts = malloc(nr_blocks * sizeof(*ctx.starts));
+	ctx.subtrees = calloc(nr_blocks, sizeof(*ctx.subtrees));
+	ctx.loaded = calloc(nr_blocks, sizeof(*ctx.loaded));
+	if (!ctx.nodes || !ctx.starts || !ctx.subtrees || !ctx.loaded) {
+		ok = false;
+		goto out;
+	}
+	for (i = 0, j = 0; i < nr_blocks; j += snapshot->blocks[i++].count)
+		ctx.starts[i] = j;
+
+	if (flags & RDX_RB_SNAPSHOT_DIRECT)
+		restore = enable_direct(snapshot->fd);
+	if (ctx.async || is_direct(snapshot->fd)) {
+		ctx.nr_runs = nr_threads ? nr_threads : 1;
+		if (ctx.nr_runs > nr_blocks)
+			ctx.nr_runs = nr_blocks;
+		__rdx_rb_parallel_run(ctx.nr_runs, load_run_worker, &ctx,
+				      nr_threads);
+	} else {
+		__rdx_rb_parallel_run(nr_blocks, load_worker, &ctx,
+				      nr_threads);
+	}
+	if (restore >= 0)
+		fcntl(snapshot->fd, F_SETFL, restore);
+
+	for (i = 0; i < nr_blocks; i++)
+		ok &= ctx.loaded[i];
+	if (!ok) {
+		for (i = 0; i < nr_blocks; i++) {
+			if (!ctx.loaded[i])
+				continue;
+			for (j = 0; j < snapshot->blocks[i].count; j++)
+				snapshot->ops->dispose(ctx.nodes[ctx.starts[i] + j],
+						       snapshot->arg);
+		}
+		goto out;
+	}
+
+	root->rb_node = ctx.subtrees[0].rb_node;
+	for (i = 1; i < nr_blocks; i++)
+		rdx_rb_join_augmented(root, ctx.nodes[ctx.starts[i]],
+				      &ctx.subtrees[i], augment);
+out:
+	free(ctx.loaded);
+	free(ctx.subtrees);
+	free(ctx.starts);
+	free(ctx.nodes);
+	return ok;
+}
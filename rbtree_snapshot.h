@@ -0,0 +1,121 @@
+/*
+  Red Black Trees - compact snapshots
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#ifndef _RDX_RBTREE_SNAPSHOT_H
+#define _RDX_RBTREE_SNAPSHOT_H
+
+#include <stdint.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * A snapshot file holds the nodes of a tree in order, for trees whose
+ * order is that of a 64-bit key, each node carrying @value_size more bytes.
+ * Nodes go in blocks: within a block the first key is stored as is and
+ * every further one as the difference from its predecessor, all as
+ * varints, followed by the values. Blocks may be compressed one by one,
+ * and an index at the end of the file tells where each block is and which
+ * key it starts with, so that blocks can be found and decoded on their own.
+ *
+ * @key and @encode take a node apart, @decode allocates one from its key
+ * and value, and @dispose frees nodes decoded by a load that then failed.
+ */
+
+struct rdx_rb_snapshot_ops {
+	size_t value_size;
+	uint64_t (*key)(const struct rdx_rb_node *node, void *arg);
+	void (*encode)(const struct rdx_rb_node *node, void *value, void *arg);
+	struct rdx_rb_node *(*decode)(uint64_t key, const void *value,
+				      void *arg);
+	void (*dispose)(struct rdx_rb_node *node, void *arg);
+};
+
+/* Compress blocks with zlib, wherever that makes them smaller */
+#define RDX_RB_SNAPSHOT_COMPRESS	1
+/*
+ * Keep several large io_uring reads or writes in flight while encoding and
+ * decoding, falling back to plain pread/pwrite where io_uring is missing
+ */
+#define RDX_RB_SNAPSHOT_ASYNC		2
+/*
+ * Bypass the page cache with O_DIRECT, where the file system allows: @fd is
+ * switched to it for the duration of the write or load, so it should not be
+ * opened that way to begin with
+ */
+#define RDX_RB_SNAPSHOT_DIRECT		4
+
+struct rdx_rb_snapshot_block {
+	uint64_t offset, first_key, count;
+	uint32_t stored_size, raw_size;
+	uint32_t crc, flags;
+};
+
+struct rdx_rb_snapshot {
+	int fd;
+	const struct rdx_rb_snapshot_ops *ops;
+	void *arg;
+	uint64_t count;
+	size_t nr_blocks;
+	struct rdx_rb_snapshot_block *blocks;
+};
+
+/*
+ * Write the whole tree to @fd, from offset 0 on, in blocks of
+ * @block_records nodes (0 picks a default). Returns false on I/O errors,
+ * running out of memory, or keys out of order.
+ */
+extern int
+rdx_rb_snapshot_write(struct rdx_rb_root *root, int fd,
+		      const struct rdx_rb_snapshot_ops *ops, void *arg,
+		      size_t block_records, int flags);
+
+/*
+ * Read the index of the snapshot in @fd. Returns false if it is not one or
+ * is corrupt, or if out of memory. Closing leaves @fd open.
+ */
+extern int
+rdx_rb_snapshot_open(struct rdx_rb_snapshot *snapshot, int fd,
+		     const struct rdx_rb_snapshot_ops *ops, void *arg);
+extern void rdx_rb_snapshot_close(struct rdx_rb_snapshot *snapshot);
+
+/* The block @key would be in: the last one starting at or below it */
+extern size_t
+rdx_rb_snapshot_find(struct rdx_rb_snapshot *snapshot, uint64_t key);
+
+/*
+ * Decode the nodes of @block, in order, into @nodes. Safe to call for
+ * different blocks from several threads at once. Returns false on I/O
+ * errors, corruption or running out of memory, having disposed of
+ * whatever it decoded.
+ */
+extern int
+rdx_rb_snapshot_read_block(struct rdx_rb_snapshot *snapshot, size_t block,
+			   struct rdx_rb_node **nodes);
+
+/*
+ * Build the empty @root from the whole snapshot, on up to @nr_threads
+ * threads: blocks are decoded and built into subtrees in parallel, then
+ * joined. @augment may be NULL for a plain tree, and @flags may ask for
+ * RDX_RB_SNAPSHOT_ASYNC and RDX_RB_SNAPSHOT_DIRECT reads.
+ */
+extern int
+rdx_rb_snapshot_load(struct rdx_rb_snapshot *snapshot, struct rdx_rb_root *root,
+		     const struct rdx_rb_augment_callbacks *augment,
+		     unsigned int nr_threads, int flags);
+
+#endif	/* _RDX_RBTREE_SNAPSHOT_H */
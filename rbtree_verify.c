@@ -0,0 +1,278 @@
+/*
+  Red Black Trees - consistency checking
+
+  This program is free software; you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation; either version 2 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program; if not, write to the Free Software
+  Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+*/
+
+#include <stdint.h>
+#include <time.h>
+
+#include "rbtree_augmented.h"
+
+/*
+ * The walk is an explicit-stack postorder, so it needs no recursion and
+ * runs in bounded memory. 4) and 5) limit the depth of a valid tree to
+ * twice its black height, which cannot exceed the bits in a pointer, so
+ * anything deeper than VERIFY_MAX_DEPTH is broken anyway - possibly even
+ * cyclic, which the depth limit also catches.
+ *
+ * In parallel, the subtrees below the top few levels are verified first,
+ * each on its own. The top levels are then walked with the results of the
+ * subtrees standing in for them: their black heights must agree with
+ * their siblings, and their first and last nodes must fit between the cut
+ * nodes around them.
+ */
+
+#define VERIFY_MAX_DEPTH	(2 * 8 * sizeof(void *))
+
+struct verify_result {
+	int ok;
+	int height;
+	struct rdx_rb_node *first, *last;
+};
+
+struct verify_ctx {
+	struct rdx_rb_root *root;
+	int (*check)(struct rdx_rb_node *node, void *arg);
+	void *arg;
+	struct rdx_rb_node **subtrees;
+	struct verify_result *results;
+	unsigned int sample;
+	uint64_t seed;
+};
+
+struct verify_frame {
+	struct rdx_rb_node *node;
+	int stage;
+	int left_height;
+};
+
+struct verify_walk {
+	struct verify_ctx *ctx;
+	struct verify_result *result;
+	int levels;
+	size_t next_result;
+	int height;
+};
+
+/* Account for the in-order run [first, last] showing up next */
+static int verify_order(struct verify_walk *walk, struct rdx_rb_node *first,
+			struct rdx_rb_node *last)
+{
+	struct verify_result *result = walk->result;
+
+	if (result->last &&
+	    walk->ctx->root->strict_compare(result->last, first) >= 0)
+		return false;
+	if (!result->first)
+		result->first = first;
+	result->last = last;
+	return true;
+}
+
+/*
+ * Deal with the child slot @child of @parent at @depth: either take the
+ * result of the subtree there from the parallel pass, or tell the caller
+ * to descend. Leaves the black height of the slot in walk->height.
+ */
+enum { SLOT_BAD, SLOT_DONE, SLOT_DESCEND };
+
+static int verify_slot(struct verify_walk *walk, struct rdx_rb_node *parent,
+		       struct rdx_rb_node *child, int depth)
+{
+	/* Whoever walks the parent checks the links to the top itself */
+	if (child && depth > 0) {
+		if (rdx_rb_parent(child) != parent)
+			return SLOT_BAD;
+		if (rdx_rb_is_red(parent) && rdx_rb_is_red(child))
+			return SLOT_BAD;
+	}
+
+	if (walk->levels >= 0 && (!child || depth == walk->levels)) {
+		struct verify_result *sub =
+			&walk->ctx->results[walk->next_result++];
+		if (!sub->ok)
+			return SLOT_BAD;
+		if (sub->first && !verify_order(walk, sub->first, sub->last))
+			return SLOT_BAD;
+		walk->height = sub->height;
+		return SLOT_DONE;
+	}
+	if (!child) {
+		walk->height = 0;
+		return SLOT_DONE;
+	}
+	return SLOT_DESCEND;
+}
+
+/*
+ * Verify the tree below @top. A non-negative @levels stops the walk at that
+ * depth, where the results of the subtrees take over.
+ */
+static void verify_tree(struct verify_ctx *ctx, struct rdx_rb_node *top,
+			int levels, struct verify_result *result)
+{
+	struct verify_frame stack[VERIFY_MAX_DEPTH];
+	struct verify_walk walk = { ctx, result, levels, 0, 0 };
+	struct verify_frame *frame;
+	struct rdx_rb_node *node;
+	int sp = 0, slot;
+
+	*result = (struct verify_result){ false, 0, NULL, NULL };
+
+	slot = verify_slot(&walk, NULL, top, 0);
+	if (slot == SLOT_BAD)
+		return;
+	if (slot == SLOT_DESCEND)
+		stack[0] = (struct verify_frame){ top, 0, 0 };
+	else
+		sp = -1;
+
+	while (sp >= 0) {
+		frame = &stack[sp];
+		node = frame->node;
+
+		switch (frame->stage) {
+		case 0:
+			frame->stage = 1;
+			slot = verify_slot(&walk, node, node->rb_left, sp + 1);
+			if (slot == SLOT_BAD)
+				return;
+			if (slot == SLOT_DESCEND)
+				goto push_left;
+			/* fall through */
+		case 1:
+			frame->left_height = walk.height;
+			if (!verify_order(&walk, node, node))
+				return;
+			frame->stage = 2;
+			slot = verify_slot(&walk, node, node->rb_right, sp + 1);
+			if (slot == SLOT_BAD)
+				return;
+			if (slot == SLOT_DESCEND)
+				goto push_right;
+			/* fall through */
+		case 2:
+			if (walk.height != frame->left_height)
+				return;
+			if (ctx->check && !ctx->check(node, ctx->arg))
+				return;
+			walk.height += rdx_rb_is_black(node);
+			sp--;
+			continue;
+		}
+
+push_left:
+		node = node->rb_left;
+		goto push;
+push_right:
+		node = node->rb_right;
+push:
+		if (++sp == VERIFY_MAX_DEPTH)
+			return;
+		stack[sp] = (struct verify_frame){ node, 0, 0 };
+	}
+
+	result->height = walk.height;
+	result->ok = true;
+}
+
+/* The black height along the leftmost path, trusting the rest */
+static void verify_skip(struct rdx_rb_node *top, struct verify_result *result)
+{
+	struct rdx_rb_node *node;
+
+	*result = (struct verify_result){ true, 0, NULL, NULL };
+	if (!top)
+		return;
+	for (node = top; node; node = node->rb_left)
+		result->height += rdx_rb_is_black(node);
+	result->first = __rdx_rb_leftmost(top);
+	result->last = __rdx_rb_rightmost(top);
+}
+
+static int verify_sampled(struct verify_ctx *ctx, size_t i)
+{
+	uint64_t x = ctx->seed ^ (i * 0x9e3779b97f4a7c15ull);
+
+	if (ctx->sample <= 1)
+		return true;
+	x ^= x >> 31;
+	x *= 0xbf58476d1ce4e5b9ull;
+	x ^= x >> 29;
+	return x % ctx->sample == 0;
+}
+
+static void verify_worker(void *arg, size_t i)
+{
+	struct verify_ctx *ctx = arg;
+	struct rdx_rb_node *top = ctx->subtrees[i];
+
+	if (!verify_sampled(ctx, i)) {
+		verify_skip(top, &ctx->results[i]);
+		return;
+	}
+	verify_tree(ctx, top, -1, &ctx->results[i]);
+}
+
+int rdx_rb_verify(struct rdx_rb_root *root,
+		  int (*check)(struct rdx_rb_node *node, void *arg),
+		  void *arg, unsigned int nr_threads, unsigned int sample)
+{
+	struct verify_ctx ctx = { root, check, arg, NULL, NULL, sample, 0 };
+	struct rdx_rb_node **separators = NULL;
+	struct verify_result result;
+	int levels = __rdx_rb_split_levels(nr_threads);
+	size_t width, nr_subtrees;
+
+	if (root->rb_node && (rdx_rb_parent(root->rb_node) ||
+			      rdx_rb_is_red(root->rb_node)))
+		return false;
+
+	if (sample > 1) {
+		struct timespec now;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		ctx.seed = (uint64_t)now.tv_sec * 1000000000ull + now.tv_nsec;
+		/* Enough subtrees to sample from even on a single thread */
+		if (levels < 8)
+			levels = 8;
+	}
+
+	width = (size_t)1 << levels;
+	if (levels > 0) {
+		ctx.subtrees = malloc(width * sizeof(*ctx.subtrees));
+		separators = malloc(width * sizeof(*separators));
+		ctx.results = malloc(width * sizeof(*ctx.results));
+	}
+	if (!ctx.subtrees || !separators || !ctx.results) {
+		/* No memory to split, check everything right here */
+		free(ctx.results);
+		free(separators);
+		free(ctx.subtrees);
+		verify_tree(&ctx, root->rb_node, -1, &result);
+		return result.ok;
+	}
+
+	nr_subtrees = __rdx_rb_split_top(root->rb_node, levels,
+					 ctx.subtrees, separators, 0);
+	__rdx_rb_parallel_run(nr_subtrees, verify_worker, &ctx, nr_threads);
+	verify_tree(&ctx, root->rb_node, levels, &result);
+
+	free(ctx.results);
+	free(separators);
+	free(ctx.subtrees);
+	return result.ok;
+}
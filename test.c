@@ -1,7 +1,30 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "rbtree_augmented.h"
+#include "rbtree_combining.h"
+#include "rbtree_relaxed.h"
+#include "rbtree_buffered.h"
+#include "rbtree_replicated.h"
+#include "rbtree_mvcc.h"
+#include "rbtree_journal.h"
+#include "rbtree_snapshot.h"
+#include "rbtree_file.h"
+#include "rbtree_shared.h"
+#include "rbtree_lsm.h"
+#include "rbtree_frozen.h"
+#include "rbtree_learned.h"
+#include "rbtree_filter.h"
+#include "rbtree_small.h"
+#include "rbtree_merkle.h"
+#include "rbtree_feed.h"
 
 int verbose = false;
 
@@ -156,6 +179,25 @@ int is_consistent_tree(struct rdx_rb_root *root) {
 	return result;
 }
 
+int is_consistent_payload(struct rdx_rb_node *node, void *arg)
+{
+	struct my_node *data = rdx_rb_entry(node, struct my_node, node);
+	struct avg_payload needed_payload = compute_payload(data);
+	return payloads_equal(&data->payload, &needed_payload);
+}
+
+int is_valid_tree(struct rdx_rb_root *root)
+{
+	return rdx_rb_verify(root, is_consistent_payload, NULL, 1, 0);
+}
+
+size_t tree_size(struct rdx_rb_root *root)
+{
+	if (!root->rb_node)
+		return 0;
+	return rdx_rb_entry(root->rb_node, struct my_node, node)->payload.count;
+}
+
 struct rdx_rb_node *random_node(struct rdx_rb_root *root, size_t nodes_count) {
 	if (nodes_count == 0) {
 		return (struct rdx_rb_node *)NULL;
@@ -225,54 +267,2540 @@ int test_leftmost_ge(struct my_node *node, struct rdx_rb_root *tree,
 	       expected_result;
 }
 
-#define DECLARE_NODE(strict_key, weak_key)			\
-	struct my_node *n_ ## strict_key ## _ ## weak_key =	\
-		construct_node(strict_key, weak_key)		\
+void free_tree(struct rdx_rb_root *tree)
+{
+	while (!RDX_RB_EMPTY_ROOT(tree)) {
+		struct my_node *data =
+			rdx_rb_entry(tree->rb_node, struct my_node, node);
+		my_node_mmap_erase(data, tree);
+		free_node(data);
+	}
+}
 
-#define TRY(expr) if (!(expr)) {	\
-		printf("Fail\n\n");	\
-		return 1;		\
-	} else {			\
-		printf("OK\n\n");		\
+int keep_not_third(struct rdx_rb_node *node, void *arg)
+{
+	return rdx_rb_entry(node, struct my_node, node)->strict_key % 3 != 0;
+}
+
+void dispose_node(struct rdx_rb_node *node, void *arg)
+{
+	(*(size_t *)arg)++;
+	free_node(rdx_rb_entry(node, struct my_node, node));
+}
+
+int test_retain(size_t count, unsigned int nr_threads)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	size_t disposed = 0;
+	struct rdx_rb_node *it;
+	long long expected = 1;
+
+	printf("Retain %zu nodes on %u threads\n", count, nr_threads);
+
+	for (size_t i = 0; i < count; i++)
+		my_node_mmap_insert(construct_node(i, i / 4), &tree);
+	if (!my_node_mmap_retain(&tree, keep_not_third, dispose_node,
+				 &disposed, nr_threads))
+		return false;
+
+	if (disposed != (count + 2) / 3 || tree_size(&tree) != count - disposed ||
+	    !is_valid_tree(&tree))
+		return false;
+	for (it = rdx_rb_first(&tree); it; it = rdx_rb_next(it)) {
+		struct my_node *data = rdx_rb_entry(it, struct my_node, node);
+		if (data->strict_key != expected)
+			return false;
+		expected += expected % 3 == 1 ? 1 : 2;
 	}
 
-int main()
+	/* Nothing left to drop, the tree must stay as it is */
+	it = tree.rb_node;
+	if (!my_node_mmap_retain(&tree, keep_not_third, dispose_node,
+				 &disposed, 1) || tree.rb_node != it)
+		return false;
+	free_tree(&tree);
+	return true;
+}
+
+int test_join(size_t left_count, size_t right_count)
+{
+	struct rdx_rb_root left =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct rdx_rb_root right =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct my_node *pivot = construct_node(left_count, 0);
+	struct rdx_rb_node *it;
+	long long expected = 0;
+
+	printf("Join %zu and %zu nodes\n", left_count, right_count);
+
+	/* Scattered insertions, so that the colors are not all alike */
+	for (size_t i = 0; i < left_count; i++)
+		my_node_mmap_insert(construct_node(i * 7919 % left_count, 0),
+				    &left);
+	for (size_t i = 0; i < right_count; i++)
+		my_node_mmap_insert(construct_node(left_count + 1 +
+						   i * 7919 % right_count, 0),
+				    &right);
+
+	my_node_mmap_join(&left, &pivot->node, &right);
+	if (right.rb_node || !is_valid_tree(&left) ||
+	    tree_size(&left) != left_count + right_count + 1)
+		return false;
+	for (it = rdx_rb_first(&left); it; it = rdx_rb_next(it)) {
+		struct my_node *data = rdx_rb_entry(it, struct my_node, node);
+		if (data->strict_key != expected++)
+			return false;
+	}
+	free_tree(&left);
+	return true;
+}
+
+void rescale_node(struct rdx_rb_node *node, void *arg)
+{
+	struct my_node *data = rdx_rb_entry(node, struct my_node, node);
+	data->weak_key *= *(long long *)arg;
+	/* Stale on purpose, remap has to recompute it */
+	data->payload.count = 0;
+}
+
+int test_remap(size_t count, unsigned int nr_threads)
 {
 	struct rdx_rb_root tree =
 		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	long long factor = 3;
+	struct rdx_rb_node *it;
+	size_t i = 0;
 
-	struct my_node *null = (struct my_node *)NULL;
+	printf("Remap %zu nodes on %u threads\n", count, nr_threads);
 
-	DECLARE_NODE(0, 2);
-	DECLARE_NODE(1, 1);
-	DECLARE_NODE(2, 3);
-	DECLARE_NODE(3, 1);
-	DECLARE_NODE(4, 3);
-	DECLARE_NODE(5, 4);
-	DECLARE_NODE(6, 0);
+	for (i = 0; i < count; i++)
+		my_node_mmap_insert(construct_node(i, i / 4), &tree);
+	my_node_mmap_remap(&tree, rescale_node, &factor, nr_threads);
 
-	TRY(test_insert(n_0_2, &tree, true));
-	TRY(test_insert(n_1_1, &tree, true));
-	TRY(test_insert(n_2_3, &tree, true));
-	TRY(test_insert(n_3_1, &tree, true));
-	TRY(test_insert(n_4_3, &tree, true));
-	TRY(test_insert(n_5_4, &tree, true));
-	TRY(test_insert(n_6_0, &tree, true));
+	if (tree_size(&tree) != count || !is_valid_tree(&tree))
+		return false;
+	i = 0;
+	for (it = rdx_rb_first(&tree); it; it = rdx_rb_next(it), i++) {
+		struct my_node *data = rdx_rb_entry(it, struct my_node, node);
+		if (data->weak_key != (long long)(i / 4) * factor)
+			return false;
+	}
 
-	TRY(test_erase(n_0_2, &tree));
-	TRY(test_erase(n_6_0, &tree));
+	free_tree(&tree);
+	return i == count;
+}
 
-	TRY(test_rightmost_le(n_2_3, &tree, n_4_3));
-	TRY(test_rightmost_le(n_4_3, &tree, n_4_3));
-	TRY(test_rightmost_le(n_6_0, &tree, null));
-	TRY(test_rightmost_le(n_0_2, &tree, n_3_1));
+void count_node(struct rdx_rb_node *node, void *arg)
+{
+	__atomic_fetch_add((size_t *)arg, 1, __ATOMIC_RELAXED);
+}
 
-	TRY(test_erase(n_5_4, &tree));
+/* Only comes out sorted if partial results are combined in key order */
+struct order_acc {
+	size_t count;
+	long long first, last;
+	int sorted;
+};
 
-	TRY(test_leftmost_ge(n_1_1, &tree, n_1_1));
-	TRY(test_leftmost_ge(n_3_1, &tree, n_1_1));
-	TRY(test_leftmost_ge(n_5_4, &tree, null));
-	TRY(test_leftmost_ge(n_0_2, &tree, n_2_3));
+void order_init(void *acc, void *arg)
+{
+	*(struct order_acc *)acc = (struct order_acc){ 0, 0, 0, true };
+}
+
+void order_accumulate(void *acc, struct rdx_rb_node *node, void *arg)
+{
+	struct order_acc *order = acc;
+	long long key = rdx_rb_entry(node, struct my_node, node)->strict_key;
+
+	if (order->count++ == 0)
+		order->first = key;
+	else if (order->last >= key)
+		order->sorted = false;
+	order->last = key;
+}
+
+void order_combine(void *acc, const void *right, void *arg)
+{
+	struct order_acc *order = acc;
+	const struct order_acc *next = right;
+
+	if (!next->count)
+		return;
+	if (!order->count)
+		order->first = next->first;
+	else if (order->last >= next->first)
+		order->sorted = false;
+	order->sorted = order->sorted && next->sorted;
+	order->count += next->count;
+	order->last = next->last;
+}
+
+static const struct rdx_rb_reducer order_reducer = {
+	sizeof(struct order_acc), order_init, order_accumulate, order_combine
+};
+
+int test_traverse(size_t count, unsigned int nr_threads)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct order_acc order;
+	size_t visited = 0;
+	int result;
+
+	printf("Traverse %zu nodes on %u threads\n", count, nr_threads);
+
+	for (size_t i = 0; i < count; i++)
+		my_node_mmap_insert(construct_node(i, i / 4), &tree);
+	rdx_rb_for_each(&tree, count_node, &visited, nr_threads);
+	rdx_rb_reduce(&tree, &order_reducer, &order, NULL, nr_threads);
+
+	result = visited == count && order.count == count && order.sorted &&
+		(!count || (order.first == 0 && order.last == count - 1));
+	free_tree(&tree);
+	return result;
+}
+
+void dispose_duplicate(struct rdx_rb_node *node, void *arg)
+{
+	struct my_node *data = rdx_rb_entry(node, struct my_node, node);
+
+	/* Duplicates are made with an empty payload, originals are not */
+	if (data->payload.count == 0)
+		(*(size_t *)arg)++;
+	free_node(data);
+}
+
+int test_build(size_t count, unsigned int nr_threads)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	size_t nr_duplicates = count / 10, duplicates = 0, i;
+	struct rdx_rb_node **nodes;
+	struct rdx_rb_node *it;
+	int result;
+
+	printf("Build %zu nodes on %u threads\n", count, nr_threads);
+
+	nodes = malloc((count + nr_duplicates + 1) * sizeof(*nodes));
+	if (!nodes)
+		return false;
+	/* Keys in scrambled order, duplicates of some of them at the end */
+	for (i = 0; i < count; i++) {
+		long long key = (i * 7919) % count;
+		nodes[i] = &construct_node(key, key / 4)->node;
+	}
+	for (i = 0; i < nr_duplicates; i++) {
+		struct my_node *data =
+			rdx_rb_entry(nodes[i * 3], struct my_node, node);
+		data = construct_node(data->strict_key, data->weak_key);
+		data->payload.count = 0;
+		nodes[count + i] = &data->node;
+	}
+	if (!my_node_mmap_build(nodes, count + nr_duplicates, &tree,
+				dispose_duplicate, &duplicates, nr_threads)) {
+		free(nodes);
+		return false;
+	}
+	free(nodes);
+
+	result = duplicates == nr_duplicates && tree_size(&tree) == count &&
+		is_valid_tree(&tree);
+	i = 0;
+	for (it = rdx_rb_first(&tree); it; it = rdx_rb_next(it), i++)
+		if (rdx_rb_entry(it, struct my_node, node)->strict_key != i)
+			result = false;
+	free_tree(&tree);
+	return result && i == count;
+}
+
+int test_verify(size_t count, unsigned int nr_threads)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct rdx_rb_node *node;
+	struct my_node *data;
+	long long key;
+	int result = true;
+
+	printf("Verify %zu nodes on %u threads\n", count, nr_threads);
+
+	for (size_t i = 0; i < count; i++)
+		my_node_mmap_insert(construct_node(i, i / 4), &tree);
+	if (!rdx_rb_verify(&tree, is_consistent_payload, NULL, nr_threads, 0) ||
+	    !rdx_rb_verify(&tree, is_consistent_payload, NULL, nr_threads, 16))
+		result = false;
+
+	/* Break things deep down, one at a time */
+	node = rdx_rb_last(&tree);
+	data = rdx_rb_entry(node, struct my_node, node);
+	data->payload.count++;
+	if (rdx_rb_verify(&tree, is_consistent_payload, NULL, nr_threads, 0))
+		result = false;
+	data->payload.count--;
+
+	key = data->strict_key;
+	data->strict_key = -1;
+	if (rdx_rb_verify(&tree, NULL, NULL, nr_threads, 0))
+		result = false;
+	data->strict_key = key;
+
+	node->__rb_parent_color ^= RDX_RB_BLACK;
+	if (rdx_rb_verify(&tree, NULL, NULL, nr_threads, 0))
+		result = false;
+	node->__rb_parent_color ^= RDX_RB_BLACK;
+
+	if (!rdx_rb_verify(&tree, is_consistent_payload, NULL, nr_threads, 0))
+		result = false;
+	free_tree(&tree);
+	return result;
+}
+
+struct fc_worker {
+	struct rdx_rb_fc *fc;
+	pthread_t thread;
+	long long first, stride, count;
+	int ok;
+};
+
+/* Insert a range of keys, then erase every other one */
+void *fc_worker(void *arg)
+{
+	struct fc_worker *worker = arg;
+	struct my_node **nodes = malloc(worker->count * sizeof(*nodes));
+	int slot = rdx_rb_fc_register(worker->fc);
+
+	worker->ok = nodes && slot >= 0;
+	if (!worker->ok)
+		goto out;
+	for (long long i = 0; i < worker->count; i++) {
+		long long key = worker->first + i * worker->stride;
+		nodes[i] = construct_node(key, key / 4);
+		if (!rdx_rb_fc_insert(worker->fc, slot, &nodes[i]->node))
+			worker->ok = false;
+	}
+	/* Every key exists already, nothing may go in twice */
+	if (rdx_rb_fc_insert(worker->fc, slot, &nodes[0]->node))
+		worker->ok = false;
+	for (long long i = 0; i < worker->count; i += 2) {
+		rdx_rb_fc_erase(worker->fc, slot, &nodes[i]->node);
+		free_node(nodes[i]);
+	}
+	rdx_rb_fc_unregister(worker->fc, slot);
+out:
+	free(nodes);
+	return NULL;
+}
+
+int test_combining(unsigned int nr_threads, long long count)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct fc_worker workers[nr_threads];
+	struct rdx_rb_fc fc;
+	int result = true;
+
+	printf("Flat combining on %u threads\n", nr_threads);
+
+	if (!rdx_rb_fc_init(&fc, &tree, &payload_callbacks, nr_threads))
+		return false;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		/* Interleaved keys, so that batches mix everybody */
+		workers[i] = (struct fc_worker){ &fc, 0, i, nr_threads,
+						 count, 0 };
+		pthread_create(&workers[i].thread, NULL, fc_worker, &workers[i]);
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		result = result && workers[i].ok;
+	}
+	rdx_rb_fc_destroy(&fc);
+
+	result = result && tree_size(&tree) == nr_threads * (count / 2) &&
+		is_valid_tree(&tree);
+	free_tree(&tree);
+	return result;
+}
+
+struct relaxed_worker {
+	struct rdx_rb_relaxed *tree;
+	pthread_t thread;
+	long long first, stride, count;
+	int ok;
+};
+
+/*
+ * Insert a range of keys, erase every other one, then put a fresh node back
+ * in for every fourth key, right behind its erased twin
+ */
+void *relaxed_worker(void *arg)
+{
+	struct relaxed_worker *worker = arg;
+	struct rdx_rb_relaxed *tree = worker->tree;
+	struct my_node **nodes = malloc(worker->count * sizeof(*nodes));
+	int writer = rdx_rb_relaxed_register(tree);
+
+	worker->ok = nodes && writer >= 0;
+	if (!worker->ok)
+		goto out;
+	for (long long i = 0; i < worker->count; i++) {
+		long long key = worker->first + i * worker->stride;
+		nodes[i] = construct_node(key, key / 4);
+		if (!rdx_rb_relaxed_insert(tree, writer, &nodes[i]->node))
+			worker->ok = false;
+	}
+	if (rdx_rb_relaxed_insert(tree, writer, &nodes[0]->node))
+		worker->ok = false;
+	/* Erased nodes may be gone from here on */
+	for (long long i = 0; i < worker->count; i += 2)
+		if (!rdx_rb_relaxed_erase(tree, writer, &nodes[i]->node))
+			worker->ok = false;
+
+	rdx_rb_relaxed_read_lock(tree);
+	for (long long i = 0; i < worker->count; i++) {
+		long long key = worker->first + i * worker->stride;
+		struct my_node probe = { key / 4, key };
+		struct rdx_rb_node *found =
+			rdx_rb_relaxed_find(tree, &probe.node);
+		if (found != (i % 2 ? &nodes[i]->node : NULL))
+			worker->ok = false;
+		/* Our keys erased for good must be skipped for a neighbour */
+		found = rdx_rb_relaxed_rightmost_less_equiv(tree, &probe.node);
+		if (found) {
+			key = rdx_rb_entry(found, struct my_node,
+					   node)->strict_key - worker->first;
+			if (key % worker->stride == 0 &&
+			    key / worker->stride % 4 == 2)
+				worker->ok = false;
+		}
+	}
+	rdx_rb_relaxed_read_unlock(tree);
+
+	for (long long i = 0; i < worker->count; i += 4) {
+		long long key = worker->first + i * worker->stride;
+		if (!rdx_rb_relaxed_insert(tree, writer,
+					   &construct_node(key, key / 4)->node))
+			worker->ok = false;
+	}
+	rdx_rb_relaxed_unregister(tree, writer);
+out:
+	free(nodes);
+	return NULL;
+}
+
+int test_relaxed(unsigned int nr_threads, long long count, size_t max_pending)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct relaxed_worker workers[nr_threads];
+	struct rdx_rb_relaxed relaxed;
+	size_t disposed = 0;
+	int result = true;
+
+	printf("Relaxed balance on %u threads, rebalancing every %zu\n",
+	       nr_threads, max_pending);
+
+	if (!rdx_rb_relaxed_init(&relaxed, &tree, &payload_callbacks,
+				 dispose_node, &disposed, nr_threads,
+				 max_pending))
+		return false;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		/* Keys from one to count past the end, everybody a share */
+		workers[i] = (struct relaxed_worker){ &relaxed, 0, i + 1,
+						      nr_threads, count, 0 };
+		pthread_create(&workers[i].thread, NULL, relaxed_worker,
+			       &workers[i]);
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		result = result && workers[i].ok;
+	}
+	rdx_rb_relaxed_destroy(&relaxed);
+
+	result = result && disposed == nr_threads * ((count + 1) / 2) &&
+		tree_size(&tree) == nr_threads * (count / 2 + (count + 3) / 4) &&
+		is_valid_tree(&tree);
+	free_tree(&tree);
+	return result;
+}
+
+struct buffered_worker {
+	struct rdx_rb_buffered *tree;
+	pthread_t thread;
+	long long first, stride, count;
+	size_t rejected;
+	int ok;
+};
+
+/* Insert a range of keys, every eighth one twice, looking each one up */
+void *buffered_worker(void *arg)
+{
+	struct buffered_worker *worker = arg;
+	struct rdx_rb_buffered *tree = worker->tree;
+
+	worker->ok = true;
+	for (long long i = 0; i < worker->count; i++) {
+		long long key = worker->first + i * worker->stride;
+		struct my_node *data = construct_node(key, key / 4);
+		struct rdx_rb_node *found;
+
+		if (!rdx_rb_buffered_insert(tree, &data->node))
+			worker->ok = false;
+		if (rdx_rb_buffered_find(tree, &data->node) != &data->node)
+			worker->ok = false;
+		found = rdx_rb_buffered_leftmost_greater_equiv(tree,
+							       &data->node);
+		if (!found || weak_compare_rb(found, &data->node) != 0)
+			worker->ok = false;
+		found = rdx_rb_buffered_rightmost_less_equiv(tree, &data->node);
+		if (!found || weak_compare_rb(found, &data->node) != 0)
+			worker->ok = false;
+
+		if (i % 8)
+			continue;
+		data = construct_node(key, key / 4);
+		if (!rdx_rb_buffered_insert(tree, &data->node)) {
+			free_node(data);
+			worker->rejected++;
+		}
+	}
+	return NULL;
+}
+
+int test_buffered(unsigned int nr_threads, long long count, size_t capacity)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct buffered_worker workers[nr_threads];
+	struct rdx_rb_buffered buffered;
+	size_t duplicates = 0;
+	int result = true;
+
+	printf("Insert buffers on %u threads, %zu nodes each\n",
+	       nr_threads, capacity);
+
+	if (!rdx_rb_buffered_init(&buffered, &tree, &payload_callbacks,
+				  dispose_node, &duplicates, 0, capacity))
+		return false;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		workers[i] = (struct buffered_worker){ &buffered, 0, i,
+						       nr_threads, count, 0, 0 };
+		pthread_create(&workers[i].thread, NULL, buffered_worker,
+			       &workers[i]);
+	}
+	for (unsigned int i = 0; i < nr_threads; i++)
+		pthread_join(workers[i].thread, NULL);
+	/* Merges report duplicates until the very last worker is done */
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		result = result && workers[i].ok;
+		duplicates += workers[i].rejected;
+	}
+
+	/* The plain API works in between, on everything inserted so far */
+	rdx_rb_buffered_write_lock(&buffered);
+	result = result && tree_size(&tree) == nr_threads * count &&
+		is_valid_tree(&tree);
+	rdx_rb_buffered_write_unlock(&buffered);
+	rdx_rb_buffered_destroy(&buffered);
+
+	result = result && duplicates == nr_threads * ((count + 7) / 8);
+	free_tree(&tree);
+	return result;
+}
+
+struct replicated_worker {
+	struct rdx_rb_replicated *tree;
+	pthread_t thread;
+	long long first, stride, count;
+	int ok;
+};
+
+/* Insert a range of keys, then erase every other one, reading in between */
+void *replicated_worker(void *arg)
+{
+	struct replicated_worker *worker = arg;
+	struct rdx_rb_replicated *tree = worker->tree;
+
+	worker->ok = true;
+	for (long long i = 0; i < worker->count; i++) {
+		long long key = worker->first + i * worker->stride;
+		struct my_node data = { key / 4, key };
+		struct rdx_rb_root *replica;
+		struct rdx_rb_node *found;
+
+		if (!rdx_rb_replicated_insert(tree, &data.node))
+			worker->ok = false;
+		if (rdx_rb_replicated_insert(tree, &data.node))
+			worker->ok = false;
+
+		/* Our own writes are visible right away */
+		replica = rdx_rb_replicated_read_lock(tree);
+		found = rdx_rb_leftmost_greater_equiv(&data.node, replica);
+		if (!found || weak_compare_rb(found, &data.node))
+			worker->ok = false;
+		rdx_rb_replicated_read_unlock(tree, replica);
+	}
+	for (long long i = 0; i < worker->count; i += 2) {
+		long long key = worker->first + i * worker->stride;
+		struct my_node data = { key / 4, key };
+
+		if (!rdx_rb_replicated_erase(tree, &data.node))
+			worker->ok = false;
+		if (rdx_rb_replicated_erase(tree, &data.node))
+			worker->ok = false;
+	}
+	return NULL;
+}
+
+int test_replicated(unsigned int nr_threads, unsigned int nr_replicas,
+		    long long count, size_t log_capacity)
+{
+	struct replicated_worker workers[nr_threads];
+	struct rdx_rb_replicated tree;
+	int result = true;
+
+	if (!rdx_rb_replicated_init(&tree, strict_compare_rb, weak_compare_rb,
+				    &payload_callbacks, sizeof(struct my_node),
+				    offsetof(struct my_node, node),
+				    nr_replicas, log_capacity))
+		return false;
+	printf("%u replicas on %u threads, log of %zu\n",
+	       tree.nr_replicas, nr_threads, log_capacity);
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		workers[i] = (struct replicated_worker){ &tree, 0, i,
+							 nr_threads, count, 0 };
+		pthread_create(&workers[i].thread, NULL, replicated_worker,
+			       &workers[i]);
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		result = result && workers[i].ok;
+	}
+
+	rdx_rb_replicated_sync(&tree);
+	for (unsigned int i = 0; i < tree.nr_replicas; i++) {
+		struct rdx_rb_root *replica = &tree.replicas[i].root;
+		result = result &&
+			tree_size(replica) == nr_threads * (count / 2) &&
+			is_valid_tree(replica);
+	}
+	rdx_rb_replicated_destroy(&tree);
+	return result;
+}
+
+struct account {
+	struct rdx_rb_version version;
+	long long key, balance;
+};
+
+static int account_compare(const struct rdx_rb_version *left,
+			   const struct rdx_rb_version *right)
+{
+	long long l = container_of(left, struct account, version)->key;
+	long long r = container_of(right, struct account, version)->key;
+	return l < r ? -1 : l > r;
+}
+
+static void balance_init(void *acc, void *arg)
+{
+	*(long long *)acc = 0;
+}
+
+static void balance_accumulate(void *acc, const struct rdx_rb_version *version,
+			       void *arg)
+{
+	*(long long *)acc += container_of(version, struct account,
+					  version)->balance;
+}
+
+static void balance_combine(void *acc, const void *right, void *arg)
+{
+	*(long long *)acc += *(const long long *)right;
+}
+
+static void dispose_account(struct rdx_rb_version *version, void *arg)
+{
+	__atomic_add_fetch((size_t *)arg, 1, __ATOMIC_RELAXED);
+	free(container_of(version, struct account, version));
+}
+
+static const struct rdx_rb_mvcc_ops account_ops = {
+	account_compare, sizeof(long long),
+	balance_init, balance_accumulate, balance_combine, dispose_account
+};
+
+static struct account *new_account(long long key, long long balance)
+{
+	struct account *account = malloc(sizeof(*account));
+	account->key = key;
+	account->balance = balance;
+	return account;
+}
+
+static long long balance_at(struct rdx_rb_mvcc *tree, uint64_t ts,
+			    long long first, long long last)
+{
+	struct account lo = { .key = first }, hi = { .key = last };
+	long long sum;
+
+	rdx_rb_mvcc_aggregate(tree, ts, first < 0 ? NULL : &lo.version,
+			      last < 0 ? NULL : &hi.version, &sum);
+	return sum;
+}
+
+static size_t count_nodes(struct rdx_rb_root *root)
+{
+	struct rdx_rb_node *node;
+	size_t nodes = 0;
+
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node))
+		nodes++;
+	return nodes;
+}
+
+struct mvcc_reader {
+	pthread_t thread;
+	struct rdx_rb_mvcc *tree;
+	long long count;
+	int *stop;
+	int ok;
+};
+
+static void *mvcc_reader(void *data)
+{
+	struct mvcc_reader *reader = data;
+	struct rdx_rb_mvcc_snapshot snap;
+
+	while (!__atomic_load_n(reader->stop, __ATOMIC_RELAXED)) {
+		if (!rdx_rb_mvcc_snapshot(reader->tree, &snap))
+			continue;
+		/* Twice, so that the writer gets to move on in between */
+		for (int i = 0; i < 2; i++)
+			if (balance_at(reader->tree, snap.ts, -1, -1) !=
+			    100 * reader->count)
+				reader->ok = false;
+		rdx_rb_mvcc_release(reader->tree, &snap);
+	}
+	return NULL;
+}
+
+/*
+ * Sets up @count accounts of 100, then checks two snapshots against each
+ * other and against brute force, and moves money around with @nr_readers
+ * checking the total meanwhile.
+ */
+int test_mvcc(unsigned int nr_readers, long long count)
+{
+	struct mvcc_reader readers[nr_readers ? nr_readers : 1];
+	struct rdx_rb_mvcc_snapshot s1, s2;
+	struct rdx_rb_mvcc tree;
+	size_t allocated = 0, disposed = 0, live;
+	int stop = false;
+	long long expect = 0, key, lo = count / 4, hi = count / 2;
+	int result = true;
+
+	if (!rdx_rb_mvcc_init(&tree, &account_ops, &disposed, nr_readers + 2))
+		return false;
+	printf("mvcc with %lld accounts, %u readers\n", count, nr_readers);
+
+	rdx_rb_mvcc_begin(&tree);
+	for (key = 0; key < count; key++, allocated++)
+		rdx_rb_mvcc_put(&tree, &new_account(key, 100)->version);
+	rdx_rb_mvcc_commit(&tree);
+	rdx_rb_mvcc_snapshot(&tree, &s1);
+
+	rdx_rb_mvcc_begin(&tree);
+	for (key = 0; key < count; key += 2, allocated++)
+		rdx_rb_mvcc_put(&tree, &new_account(key, 1)->version);
+	for (key = 0; key < count; key += 3) {
+		struct account probe = { .key = key };
+		rdx_rb_mvcc_erase(&tree, &probe.version);
+	}
+	rdx_rb_mvcc_commit(&tree);
+	rdx_rb_mvcc_snapshot(&tree, &s2);
+
+	for (key = lo; key <= hi; key++)
+		if (key % 3)
+			expect += key % 2 ? 100 : 1;
+	live = count - (count + 2) / 3;
+
+	for (int pass = 0; pass < 2; pass++) {
+		struct account probe = { .key = 4 };
+		struct rdx_rb_version *v1 = rdx_rb_mvcc_find(&tree, s1.ts,
+							     &probe.version);
+		struct rdx_rb_version *v2 = rdx_rb_mvcc_find(&tree, s2.ts,
+							     &probe.version);
+		result = result &&
+			balance_at(&tree, s1.ts, -1, -1) == 100 * count &&
+			balance_at(&tree, s1.ts, lo, hi) == 100 * (hi - lo + 1) &&
+			balance_at(&tree, s2.ts, lo, hi) == expect &&
+			balance_at(&tree, s2.ts, lo, lo) ==
+				(lo % 3 ? (lo % 2 ? 100 : 1) : 0) &&
+			v1 && container_of(v1, struct account,
+					   version)->balance == 100 &&
+			v2 && container_of(v2, struct account,
+					   version)->balance == 1;
+		probe.key = 3;
+		result = result &&
+			rdx_rb_mvcc_find(&tree, s1.ts, &probe.version) &&
+			!rdx_rb_mvcc_find(&tree, s2.ts, &probe.version);
+		/* s1 keeps everything alive through the first collection */
+		rdx_rb_mvcc_gc(&tree);
+		result = result && disposed == 0;
+	}
+	rdx_rb_mvcc_release(&tree, &s1);
+	rdx_rb_mvcc_release(&tree, &s2);
+	rdx_rb_mvcc_gc(&tree);
+	result = result && disposed == allocated - live &&
+		 balance_at(&tree, s2.ts, lo, hi) == expect &&
+		 count_nodes(&tree.root) == live &&
+		 rdx_rb_verify(&tree.root, NULL, NULL, 1, 0);
+
+	/* Refill, then transfer between accounts under the readers' noses */
+	rdx_rb_mvcc_begin(&tree);
+	for (key = 0; key < count; key++, allocated++)
+		rdx_rb_mvcc_put(&tree, &new_account(key, 100)->version);
+	rdx_rb_mvcc_commit(&tree);
+	for (unsigned int i = 0; i < nr_readers; i++) {
+		readers[i] = (struct mvcc_reader){ 0, &tree, count, &stop,
+						   true };
+		pthread_create(&readers[i].thread, NULL, mvcc_reader,
+			       &readers[i]);
+	}
+	for (long long i = 0; i < 4 * count; i++) {
+		long long from = i * 7 % count, to = i * 13 % count;
+		struct account probe = { .key = from };
+		struct account *a, *b;
+
+		rdx_rb_mvcc_begin(&tree);
+		a = container_of(rdx_rb_mvcc_find(&tree, tree.txn - 1,
+						  &probe.version),
+				 struct account, version);
+		probe.key = to;
+		b = container_of(rdx_rb_mvcc_find(&tree, tree.txn - 1,
+						  &probe.version),
+				 struct account, version);
+		if (from != to) {
+			rdx_rb_mvcc_put(&tree, &new_account(from,
+						a->balance - 10)->version);
+			rdx_rb_mvcc_put(&tree, &new_account(to,
+						b->balance + 10)->version);
+			allocated += 2;
+		}
+		rdx_rb_mvcc_commit(&tree);
+		if (i % 64 == 0)
+			rdx_rb_mvcc_gc(&tree);
+	}
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < nr_readers; i++) {
+		pthread_join(readers[i].thread, NULL);
+		result = result && readers[i].ok;
+	}
+	rdx_rb_mvcc_gc(&tree);
+	result = result && disposed == allocated - count &&
+		 balance_at(&tree, tree.clock, -1, -1) == 100 * count;
+	rdx_rb_mvcc_destroy(&tree);
+	return result && disposed == allocated;
+}
+
+struct journal_record {
+	long long strict_key, weak_key;
+};
+
+static void encode_node(const struct rdx_rb_node *node, void *record,
+			void *arg)
+{
+	const struct my_node *data = container_of(node, struct my_node, node);
+	struct journal_record *out = record;
+
+	out->strict_key = data->strict_key;
+	out->weak_key = data->weak_key;
+}
+
+static struct rdx_rb_node *decode_node(const void *record, void *arg)
+{
+	const struct journal_record *in = record;
+
+	return &construct_node(in->strict_key, in->weak_key)->node;
+}
+
+static void free_rb_node(struct rdx_rb_node *node, void *arg)
+{
+	free_node(container_of(node, struct my_node, node));
+}
+
+static const struct rdx_rb_journal_ops journal_ops = {
+	sizeof(struct journal_record), encode_node, decode_node, free_rb_node
+};
+
+struct journal_worker {
+	pthread_t thread;
+	struct rdx_rb_journal *journal;
+	pthread_mutex_t *lock;
+	unsigned int id, nr_threads;
+	long long count;
+	int ok;
+};
+
+/* Every worker inserts its share of the keys, committing each one alone */
+static void *journal_worker(void *data)
+{
+	struct journal_worker *worker = data;
+
+	for (long long i = worker->id; i < worker->count;
+	     i += worker->nr_threads) {
+		struct my_node *node = construct_node(i * 7919 % worker->count,
+						      0);
+		pthread_mutex_lock(worker->lock);
+		rdx_rb_journal_insert(worker->journal, &node->node);
+		pthread_mutex_unlock(worker->lock);
+		worker->ok = rdx_rb_journal_commit(worker->journal) &&
+			     worker->ok;
+	}
+	return NULL;
+}
+
+/* Keys divisible by 3 are gone, the others are all there */
+static int journal_tree_ok(struct rdx_rb_root *root, long long count)
+{
+	long long key = 0;
+	struct rdx_rb_node *node;
+
+	for (node = rdx_rb_first(root); node; node = rdx_rb_next(node)) {
+		while (key % 3 == 0)
+			key++;
+		if (container_of(node, struct my_node, node)->strict_key != key++)
+			return false;
+	}
+	while (key < count && key % 3 == 0)
+		key++;
+	return key >= count &&
+	       tree_size(root) == (size_t)(count - (count + 2) / 3) &&
+	       is_valid_tree(root);
+}
+
+static int reopen(struct rdx_rb_journal *journal, const char *path,
+		  struct rdx_rb_root *root)
+{
+	rdx_rb_journal_close(journal);
+	free_tree(root);
+	return rdx_rb_journal_open(journal, path, root, &payload_callbacks,
+				   &journal_ops, NULL, 64);
+}
+
+/* Count the files in @dir, removing them too if @remove */
+static size_t files_in(const char *dir, int remove)
+{
+	DIR *d = opendir(dir);
+	struct dirent *entry;
+	size_t count = 0;
+
+	while (d && (entry = readdir(d))) {
+		if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+			continue;
+		count++;
+		if (remove)
+			unlinkat(dirfd(d), entry->d_name, 0);
+	}
+	if (d)
+		closedir(d);
+	return count;
+}
+
+/*
+ * Fill a journal from @nr_threads threads, erase and update some keys with
+ * or without a checkpoint in between, then recover, also from a torn tail.
+ * With checkpoints, also see that a checkpoint after changing a single key
+ * rewrites a single segment.
+ */
+int test_journal(unsigned int nr_threads, long long count, int checkpoint)
+{
+	struct journal_worker workers[nr_threads];
+	struct rdx_rb_root root =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	struct rdx_rb_journal journal;
+	char dir[] = "/tmp/rdx_journal_XXXXXX", path[64];
+	int result = true, fd;
+
+	if (!mkdtemp(dir))
+		return false;
+	snprintf(path, sizeof(path), "%s/log", dir);
+	printf("journal of %lld on %u threads%s\n", count, nr_threads,
+	       checkpoint ? ", checkpointed" : "");
+
+	result = rdx_rb_journal_open(&journal, path, &root, &payload_callbacks,
+				     &journal_ops, NULL, 64) && !root.rb_node;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		workers[i] = (struct journal_worker){ 0, &journal, &lock, i,
+						      nr_threads, count, true };
+		pthread_create(&workers[i].thread, NULL, journal_worker,
+			       &workers[i]);
+	}
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		result = result && workers[i].ok;
+	}
+	if (checkpoint)
+		result = result && rdx_rb_journal_checkpoint(&journal);
+
+	for (struct rdx_rb_node *node = rdx_rb_first(&root), *next; node;
+	     node = next) {
+		struct my_node *data = container_of(node, struct my_node, node);
+
+		next = rdx_rb_next(node);
+		if (data->strict_key % 3 == 0) {
+			rdx_rb_journal_erase(&journal, node);
+			free_node(data);
+		} else if (data->strict_key % 5 == 0) {
+			rdx_rb_journal_update(&journal, node);
+		}
+	}
+	/* Erased, put back and erased again, all within the log */
+	for (long long key = 0; key < count; key += 6) {
+		struct my_node *node = construct_node(key, 0);
+		rdx_rb_journal_insert(&journal, &node->node);
+		rdx_rb_journal_erase(&journal, &node->node);
+		free_node(node);
+	}
+	result = result && rdx_rb_journal_commit(&journal) &&
+		 journal_tree_ok(&root, count);
+
+	result = result && reopen(&journal, path, &root) &&
+		 journal_tree_ok(&root, count);
+
+	/* A record torn halfway through gets cut off */
+	fd = open(path, O_WRONLY | O_APPEND);
+	result = result && fd >= 0 && write(fd, "torn", 4) == 4 && !close(fd);
+	result = result && reopen(&journal, path, &root) &&
+		 journal_tree_ok(&root, count);
+	if (checkpoint) {
+		struct rdx_rb_node *node;
+		uint64_t first_id;
+		size_t rewritten = 0;
+		char orphan[96];
+
+		result = result && rdx_rb_journal_checkpoint(&journal) &&
+			 reopen(&journal, path, &root) &&
+			 journal_tree_ok(&root, count);
+
+		node = rdx_rb_first(&root);
+		while (node && container_of(node, struct my_node,
+					    node)->strict_key < count / 2)
+			node = rdx_rb_next(node);
+		first_id = journal.next_id;
+		rdx_rb_journal_update(&journal, node);
+		result = result && rdx_rb_journal_checkpoint(&journal);
+		for (size_t i = 0; i < journal.nr_segments; i++)
+			rewritten += journal.segments[i].id >= first_id;
+		/* The log and the manifest besides the segments */
+		result = result && rewritten == 1 &&
+			 files_in(dir, false) == journal.nr_segments + 2;
+
+		/* A commit that fails stops the checkpoint before it starts */
+		rdx_rb_journal_update(&journal, node);
+		pthread_mutex_lock(&journal.lock);
+		journal.error = true;
+		pthread_mutex_unlock(&journal.lock);
+		result = result && !rdx_rb_journal_checkpoint(&journal) &&
+			 files_in(dir, false) == journal.nr_segments + 2;
+		journal.error = false;
+
+		/* As if a checkpoint had crashed before its manifest */
+		snprintf(orphan, sizeof(orphan), "%s.%llu.seg", path,
+			 (unsigned long long)journal.next_id);
+		fd = open(orphan, O_WRONLY | O_CREAT, 0644);
+		result = result && fd >= 0 && !close(fd) &&
+			 reopen(&journal, path, &root) &&
+			 journal_tree_ok(&root, count) &&
+			 files_in(dir, false) == journal.nr_segments + 2;
+	}
+
+	rdx_rb_journal_close(&journal);
+	free_tree(&root);
+	files_in(dir, true);
+	rmdir(dir);
+	return result;
+}
+
+static uint64_t snapshot_key(const struct rdx_rb_node *node, void *arg)
+{
+	return container_of(node, struct my_node, node)->strict_key;
+}
+
+static void snapshot_encode(const struct rdx_rb_node *node, void *value,
+			    void *arg)
+{
+	memcpy(value, &container_of(node, struct my_node, node)->weak_key,
+	       sizeof(long long));
+}
+
+static struct rdx_rb_node *snapshot_decode(uint64_t key, const void *value,
+					   void *arg)
+{
+	long long weak_key;
+
+	memcpy(&weak_key, value, sizeof(weak_key));
+	return &construct_node(key, weak_key)->node;
+}
+
+static const struct rdx_rb_snapshot_ops snapshot_ops = {
+	sizeof(long long), snapshot_key, snapshot_encode, snapshot_decode,
+	free_rb_node
+};
+
+static int same_keys(struct rdx_rb_root *a, struct rdx_rb_root *b)
+{
+	struct rdx_rb_node *x = rdx_rb_first(a), *y = rdx_rb_first(b);
+
+	for (; x && y; x = rdx_rb_next(x), y = rdx_rb_next(y))
+		if (strict_compare_rb(x, y))
+			return false;
+	return !x && !y;
+}
+
+/*
+ * Round trip a tree of @count keys a few apart through a snapshot with
+ * blocks of @block nodes, loading one block alone and then all of them,
+ * and see that a flipped bit fails the load.
+ */
+int test_snapshot(long long count, size_t block, int flags,
+		  unsigned int nr_threads)
+{
+	struct rdx_rb_root tree = RDX_RB_ROOT(strict_compare_rb,
+					      weak_compare_rb);
+	struct rdx_rb_root copy = RDX_RB_ROOT(strict_compare_rb,
+					      weak_compare_rb);
+	struct rdx_rb_node **nodes = malloc((count + 1) * sizeof(*nodes));
+	char name[] = "/tmp/rdx_snapshot_XXXXXX";
+	struct rdx_rb_snapshot snapshot;
+	int fd = mkstemp(name), result;
+	size_t per_block = block ? block : 4096;
+	size_t expect_blocks = (count + per_block - 1) / per_block;
+	long long key = count / 2 * 3;
+	unsigned char byte;
+	off_t size;
+
+	printf("snapshot of %lld in blocks of %zu%s%s%s on %u threads\n",
+	       count, block,
+	       flags & RDX_RB_SNAPSHOT_COMPRESS ? ", compressed" : "",
+	       flags & RDX_RB_SNAPSHOT_ASYNC ? ", async" : "",
+	       flags & RDX_RB_SNAPSHOT_DIRECT ? ", direct" : "", nr_threads);
+	for (long long i = 0; i < count; i++)
+		nodes[i] = &construct_node(i * 3 + i % 2, 0)->node;
+	rdx_rb_build_sorted_augmented(nodes, count, &tree, 1,
+				      &payload_callbacks);
+
+	result = fd >= 0 &&
+		 rdx_rb_snapshot_write(&tree, fd, &snapshot_ops, NULL, block,
+				       flags) &&
+		 rdx_rb_snapshot_open(&snapshot, fd, &snapshot_ops, NULL) &&
+		 snapshot.count == (uint64_t)count &&
+		 snapshot.nr_blocks == expect_blocks;
+	size = lseek(fd, 0, SEEK_END);
+	/* Well under the 16 bytes a node would take as it is */
+	result = result && size < (flags & RDX_RB_SNAPSHOT_COMPRESS ?
+				   2 : 11) * count + 4096;
+
+	if (result && count) {
+		size_t b = rdx_rb_snapshot_find(&snapshot, key);
+		size_t n = snapshot.blocks[b].count, found = 0;
+
+		result = rdx_rb_snapshot_read_block(&snapshot, b, nodes);
+		for (size_t i = 0; result && i < n; i++) {
+			found += container_of(nodes[i], struct my_node,
+					      node)->strict_key == key;
+			free_rb_node(nodes[i], NULL);
+		}
+		result = result && found == 1;
+	}
+	result = result && rdx_rb_snapshot_load(&snapshot, &copy,
+						&payload_callbacks,
+						nr_threads, flags) &&
+		 same_keys(&tree, &copy) && is_valid_tree(&copy) &&
+		 (!count || tree_size(&copy) == (size_t)count);
+	free_tree(&copy);
+	rdx_rb_snapshot_close(&snapshot);
+
+	if (result && count) {
+		/* Somewhere in the middle of the first block */
+		result = pread(fd, &byte, 1, 60) == 1;
+		byte ^= 0x10;
+		result = result && pwrite(fd, &byte, 1, 60) == 1 &&
+			 rdx_rb_snapshot_open(&snapshot, fd, &snapshot_ops,
+					      NULL) &&
+			 !rdx_rb_snapshot_load(&snapshot, &copy,
+					       &payload_callbacks,
+					       nr_threads, flags) &&
+			 !copy.rb_node;
+		rdx_rb_snapshot_close(&snapshot);
+	}
+
+	free_tree(&tree);
+	free(nodes);
+	if (fd >= 0)
+		close(fd);
+	unlink(name);
+	return result;
+}
+
+#define DECLARE_NODE(strict_key, weak_key)			\
+	struct my_node *n_ ## strict_key ## _ ## weak_key =	\
+		construct_node(strict_key, weak_key)		\
+
+#define TRY(expr) if (!(expr)) {	\
+		printf("Fail\n\n");	\
+		return 1;		\
+	} else {			\
+		printf("OK\n\n");		\
+	}
+
+struct file_record {
+	long long key, value;
+};
+
+int compare_file_records(const void *a, const void *b, void *arg)
+{
+	long long x = ((const struct file_record *)a)->key;
+	long long y = ((const struct file_record *)b)->key;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Every key below @count, but every third, erased if @erased */
+int check_file(struct rdx_rb_file *file, long long count, int erased)
+{
+	const struct file_record *record = rdx_rb_file_first(file);
+	long long key = 0, n = 0;
+
+	for (; record; record = rdx_rb_file_next(file, record), n++) {
+		if (erased && key % 3 == 0)
+			key++;
+		if (record->key != key ||
+		    record->value != (erased ? -key : key))
+			return false;
+		key++;
+	}
+	return n == (long long)rdx_rb_file_count(file) &&
+	       n == (erased ? count - (count + 2) / 3 : count) &&
+	       rdx_rb_overify(&file->tree, file->size) == n;
+}
+
+int test_file(long long count, size_t log_size)
+{
+	char path[] = "/tmp/rdx_file_XXXXXX";
+	struct file_record record;
+	struct rdx_rb_file file;
+	int fd = mkstemp(path), result;
+	off_t offset;
+
+	printf("file-backed tree of %lld with a log of %zu\n", count,
+	       log_size);
+	if (fd < 0)
+		return false;
+	close(fd);
+
+	/* Scattered keys, so that the file grows and the log fills */
+	result = rdx_rb_file_open(&file, path, sizeof(record),
+				  compare_file_records, NULL, log_size);
+	for (long long i = 0; result && i < count; i++) {
+		record.key = record.value = i * 7919 % count;
+		result = rdx_rb_file_insert(&file, &record);
+	}
+	result = result && !rdx_rb_file_insert(&file, &record) &&
+		 check_file(&file, count, false) && rdx_rb_file_close(&file);
+
+	/* Erase and update, then reopen */
+	result = result && rdx_rb_file_open(&file, path, sizeof(record),
+					    compare_file_records, NULL, 0) &&
+		 check_file(&file, count, false);
+	for (long long i = 0; result && i < count; i++) {
+		record.key = i;
+		record.value = -i;
+		result = i % 3 ? rdx_rb_file_update(&file, &record) :
+				 rdx_rb_file_erase(&file, &record);
+	}
+	record.key = count;
+	result = result && !rdx_rb_file_erase(&file, &record) &&
+		 check_file(&file, count, true) && rdx_rb_file_close(&file) &&
+		 rdx_rb_file_open(&file, path, sizeof(record),
+				  compare_file_records, NULL, 0) &&
+		 check_file(&file, count, true);
+
+	/*
+	 * Crash with changes not committed, too few to fill the log: they
+	 * must be gone
+	 */
+	for (long long i = 0; result && i < count && i < 90; i += 3) {
+		record.key = i;
+		record.value = 1;
+		result = rdx_rb_file_insert(&file, &record);
+	}
+	if (result) {
+		munmap(file.base, file.size);
+		close(file.fd);
+		free(file.dirty);
+	}
+	result = result && rdx_rb_file_open(&file, path, sizeof(record),
+					    compare_file_records, NULL, 0) &&
+		 check_file(&file, count, true);
+
+	/*
+	 * Damage a node the last commit wrote, as if the crash had come
+	 * before it got there: the log brings it back.
+	 */
+	record.key = 1;
+	record.value = -1;
+	result = result && count > 1 && rdx_rb_file_update(&file, &record) &&
+		 rdx_rb_file_commit(&file);
+	offset = result ? (const unsigned char *)rdx_rb_file_find(&file,
+								  &record) -
+			  file.base : 0;
+	result = result && rdx_rb_file_close(&file);
+	fd = open(path, O_RDWR);
+	record.value = 12345;
+	result = result && fd >= 0 &&
+		 pwrite(fd, &record, sizeof(record), offset) == sizeof(record);
+	if (fd >= 0)
+		close(fd);
+	result = result && rdx_rb_file_open(&file, path, sizeof(record),
+					    compare_file_records, NULL, 0) &&
+		 check_file(&file, count, true) && rdx_rb_file_close(&file);
+
+	/* Not a tree of these records */
+	result = result && !rdx_rb_file_open(&file, path, 2 * sizeof(record),
+					     compare_file_records, NULL, 0);
+	unlink(path);
+	return result;
+}
+
+void check_shared_record(const void *record, void *arg)
+{
+	const struct file_record *r = record;
+	long long *expected = arg;
+
+	if (r->key != *expected || r->value != -r->key)
+		*expected = -1;
+	else
+		++*expected;
+}
+
+/* One of @nr_procs processes, inserting its share of the keys */
+int shared_worker(int fd, long long count, int proc, int nr_procs)
+{
+	struct rdx_rb_shared shared;
+	struct file_record record;
+	int result = rdx_rb_shared_attach(&shared, fd, compare_file_records,
+					  NULL);
+
+	for (long long i = proc; result && i < count; i += nr_procs) {
+		record.key = i;
+		record.value = -i;
+		result = rdx_rb_shared_insert(&shared, &record);
+		/* What other processes put in is there to find */
+		record.key = i / 2;
+		if (result && rdx_rb_shared_find(&shared, &record, &record))
+			result = record.value == -record.key;
+	}
+	if (result)
+		rdx_rb_shared_detach(&shared);
+	return result;
+}
+
+int test_shared(long long count, int nr_procs)
+{
+	char path[] = "/tmp/rdx_shared_XXXXXX";
+	struct rdx_rb_shared shared, other;
+	struct file_record record;
+	/* Room for the nodes, and a page for the header */
+	size_t size = count * 48 + 4096;
+	int fd = mkstemp(path), result, status;
+	long long expected = 0;
+
+	printf("shared tree of %lld across %d processes\n", count, nr_procs);
+	if (fd < 0)
+		return false;
+	unlink(path);
+	result = rdx_rb_shared_create(&shared, fd, size, sizeof(record),
+				      compare_file_records, NULL);
+
+	for (int proc = 0; result && proc < nr_procs; proc++) {
+		pid_t pid = fork();
+
+		if (pid == 0)
+			_exit(!shared_worker(fd, count, proc, nr_procs));
+		result = pid > 0;
+	}
+	while (wait(&status) > 0)
+		result = result && WIFEXITED(status) && !WEXITSTATUS(status);
+
+	result = result && rdx_rb_shared_count(&shared) == (uint64_t)count &&
+		 rdx_rb_overify(&shared.tree, shared.size) == count;
+	if (result)
+		rdx_rb_shared_for_each(&shared, check_shared_record, &expected);
+	result = result && expected == count;
+
+	/* A second mapping, elsewhere, sees the same tree */
+	result = result && rdx_rb_shared_attach(&other, fd,
+						compare_file_records, NULL);
+	record.key = count / 2;
+	result = result && other.base != shared.base &&
+		 rdx_rb_shared_erase(&other, &record) &&
+		 !rdx_rb_shared_find(&shared, &record, &record) &&
+		 rdx_rb_shared_insert(&shared, &record) &&
+		 !rdx_rb_shared_insert(&other, &record);
+	record.value = 7;
+	result = result && rdx_rb_shared_update(&other, &record) &&
+		 rdx_rb_shared_find(&shared, &record, &record) &&
+		 record.value == 7;
+	if (result)
+		rdx_rb_shared_detach(&other);
+
+	/* Full: the erased node comes back, then nothing more fits */
+	for (long long i = count; result; i++) {
+		record.key = i;
+		if (!rdx_rb_shared_insert(&shared, &record))
+			break;
+		/* Nodes take at least their links */
+		result = (size_t)(i - count + 1) * 24 < size;
+	}
+	result = result && rdx_rb_overify(&shared.tree, shared.size) >= count;
+
+	if (result)
+		rdx_rb_shared_destroy(&shared);
+	close(fd);
+	return result;
+}
+
+struct lsm_sum {
+	long long count, sum;
+};
+
+static void lsm_sum_init(void *acc, void *arg)
+{
+	memset(acc, 0, sizeof(struct lsm_sum));
+}
+
+static void lsm_sum_accumulate(void *acc, uint64_t key, const void *value,
+			       void *arg)
+{
+	struct lsm_sum *sum = acc;
+
+	sum->count++;
+	sum->sum += *(const long long *)value;
+}
+
+static void lsm_sum_combine(void *acc, const void *other, void *arg)
+{
+	struct lsm_sum *sum = acc;
+	const struct lsm_sum *right = other;
+
+	sum->count += right->count;
+	sum->sum += right->sum;
+}
+
+static const struct rdx_rb_lsm_ops lsm_ops = {
+	sizeof(long long), sizeof(struct lsm_sum),
+	lsm_sum_init, lsm_sum_accumulate, lsm_sum_combine
+};
+
+/* What the tree should hold below nr_keys */
+struct lsm_model {
+	long long nr_keys;
+	long long *values;
+	char *present;
+	long long next;
+	int ok;
+};
+
+static void check_lsm_key(uint64_t key, const void *value, void *arg)
+{
+	struct lsm_model *model = arg;
+
+	/* In order, and nothing skipped */
+	for (; model->next < (long long)key; model->next++)
+		if (model->present[model->next])
+			model->ok = false;
+	if ((long long)key >= model->nr_keys || !model->present[key] ||
+	    model->values[key] != *(const long long *)value)
+		model->ok = false;
+	model->next = key + 1;
+}
+
+static int check_lsm(struct rdx_rb_lsm *lsm, struct lsm_model *model)
+{
+	struct lsm_sum sum;
+	long long value, first, last, count, total;
+
+	for (long long key = 0; key < model->nr_keys; key++)
+		if (rdx_rb_lsm_get(lsm, key, &value) != model->present[key] ||
+		    (model->present[key] && value != model->values[key]))
+			return false;
+
+	model->next = 0;
+	model->ok = true;
+	rdx_rb_lsm_scan(lsm, 0, model->nr_keys - 1, check_lsm_key, model);
+	for (; model->next < model->nr_keys; model->next++)
+		if (model->present[model->next])
+			model->ok = false;
+	if (!model->ok)
+		return false;
+
+	for (int i = 0; i < 100; i++) {
+		first = rand() % model->nr_keys;
+		last = first + rand() % (i < 50 ? 100 : model->nr_keys);
+		if (last >= model->nr_keys)
+			last = model->nr_keys - 1;
+		count = total = 0;
+		for (long long key = first; key <= last; key++)
+			if (model->present[key]) {
+				count++;
+				total += model->values[key];
+			}
+		rdx_rb_lsm_aggregate(lsm, first, last, &sum);
+		if (sum.count != count || sum.sum != total)
+			return false;
+	}
+	return true;
+}
+
+struct lsm_reader {
+	pthread_t thread;
+	struct rdx_rb_lsm *lsm;
+	long long base, count;
+	int *stop;
+	int ok;
+};
+
+/* Keys from base on never change: value the key, count of them in all */
+static void *lsm_reader(void *data)
+{
+	struct lsm_reader *reader = data;
+	unsigned int seed = reader->base;
+	struct lsm_sum sum;
+	long long key, value;
+
+	while (!__atomic_load_n(reader->stop, __ATOMIC_RELAXED)) {
+		key = reader->base + rand_r(&seed) % reader->count;
+		if (!rdx_rb_lsm_get(reader->lsm, key, &value) || value != key)
+			reader->ok = false;
+		rdx_rb_lsm_aggregate(reader->lsm, reader->base, UINT64_MAX,
+				     &sum);
+		if (sum.count != reader->count)
+			reader->ok = false;
+	}
+	return NULL;
+}
+
+/*
+ * Make @count random changes through memtables of @memtable_limit keys,
+ * with @nr_readers reading meanwhile, then check everything against a
+ * model, before and after reopening.
+ */
+int test_lsm(long long count, size_t memtable_limit, unsigned int nr_readers)
+{
+	struct lsm_reader readers[nr_readers ? nr_readers : 1];
+	struct lsm_model model = { count / 2 + 1 };
+	char dir[] = "/tmp/rdx_lsm_XXXXXX", orphan[64];
+	long long key, value, nr_fixed = 1000;
+	struct rdx_rb_lsm lsm;
+	int result, stop = false, fd;
+
+	if (!mkdtemp(dir))
+		return false;
+	printf("lsm tree of %lld changes, memtable of %zu, %u readers\n",
+	       count, memtable_limit, nr_readers);
+	model.values = calloc(model.nr_keys, sizeof(*model.values));
+	model.present = calloc(model.nr_keys, 1);
+	result = model.values && model.present &&
+		 rdx_rb_lsm_open(&lsm, dir, &lsm_ops, NULL, memtable_limit);
+	if (!result)
+		goto out;
+
+	for (long long i = 0; result && i < nr_fixed; i++) {
+		key = model.nr_keys + i;
+		result = rdx_rb_lsm_put(&lsm, key, &key);
+	}
+	for (unsigned int i = 0; i < nr_readers; i++) {
+		readers[i] = (struct lsm_reader){ 0, &lsm, model.nr_keys,
+						  nr_fixed, &stop, true };
+		pthread_create(&readers[i].thread, NULL, lsm_reader,
+			       &readers[i]);
+	}
+
+	srand(1);
+	for (long long i = 0; result && i < count; i++) {
+		key = rand() % model.nr_keys;
+		model.present[key] = rand() % 4 != 0;
+		if (model.present[key]) {
+			model.values[key] = value = rand() - RAND_MAX / 2;
+			result = rdx_rb_lsm_put(&lsm, key, &value);
+		} else {
+			result = rdx_rb_lsm_erase(&lsm, key);
+		}
+		key = rand() % model.nr_keys;
+		result = result &&
+			 rdx_rb_lsm_get(&lsm, key, &value) ==
+			 model.present[key] &&
+			 (!model.present[key] || value == model.values[key]);
+	}
+
+	__atomic_store_n(&stop, true, __ATOMIC_RELAXED);
+	for (unsigned int i = 0; i < nr_readers; i++) {
+		pthread_join(readers[i].thread, NULL);
+		result = result && readers[i].ok;
+	}
+	result = result && check_lsm(&lsm, &model);
+	result = rdx_rb_lsm_close(&lsm) && result;
+
+	/* Everything is in runs now; a run no manifest names goes */
+	snprintf(orphan, sizeof(orphan), "%s/999999.run", dir);
+	fd = open(orphan, O_WRONLY | O_CREAT, 0644);
+	result = result && fd >= 0 && !close(fd) &&
+		 rdx_rb_lsm_open(&lsm, dir, &lsm_ops, NULL, memtable_limit);
+	if (result) {
+		size_t before = lsm.memtable_count;
+
+		result = access(orphan, F_OK) && check_lsm(&lsm, &model);
+		/* Once background work fails, changes are turned away */
+		pthread_mutex_lock(&lsm.work_lock);
+		lsm.error = true;
+		pthread_mutex_unlock(&lsm.work_lock);
+		result = result && !rdx_rb_lsm_put(&lsm, 0, &key) &&
+			 !rdx_rb_lsm_erase(&lsm, 0) &&
+			 lsm.memtable_count == before;
+		lsm.error = false;
+		result = rdx_rb_lsm_close(&lsm) && result;
+	}
+out:
+	free(model.values);
+	free(model.present);
+	files_in(dir, true);
+	rmdir(dir);
+	return result;
+}
+
+static uint64_t frozen_key(const struct rdx_rb_node *node, void *arg)
+{
+	return rdx_rb_entry(node, struct my_node, node)->weak_key;
+}
+
+static void frozen_payload(const struct rdx_rb_node *node, void *payload,
+			   void *arg)
+{
+	*(long long *)payload =
+		rdx_rb_entry(node, struct my_node, node)->strict_key;
+}
+
+static void frozen_accumulate(void *acc, uint64_t key, const void *payload,
+			      void *arg)
+{
+	*(long long *)acc += *(const long long *)payload;
+}
+
+static const struct rdx_rb_frozen_ops frozen_ops = {
+	sizeof(long long), sizeof(long long), frozen_key, frozen_payload,
+	balance_init, frozen_accumulate, balance_combine
+};
+
+/*
+ * Freeze @count nodes, three to a key with a gap after each, and check
+ * walks, searches for every key and the gaps, and range sums against the
+ * tree.
+ */
+int test_frozen(size_t count)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	long long max_key = 2 * (long long)(count / 3) + 2, sum, expected;
+	struct my_node probe;
+	struct rdx_rb_frozen frozen;
+	struct rdx_rb_node *it;
+	int result = true;
+	size_t i;
+
+	printf("Freeze %zu nodes\n", count);
+	for (i = 0; i < count; i++) {
+		size_t j = i * 7919 % count;
+		my_node_mmap_insert(construct_node(j, 2 * (j / 3)), &tree);
+	}
+	if (!rdx_rb_freeze(&frozen, &tree, &frozen_ops, NULL))
+		return false;
+
+	for (it = rdx_rb_first(&tree), i = rdx_rb_frozen_first(&frozen);
+	     it; it = rdx_rb_next(it), i = rdx_rb_frozen_next(&frozen, i))
+		result = result && rdx_rb_frozen_node(&frozen, i) == it;
+	result = result && !i;
+	for (it = rdx_rb_last(&tree), i = rdx_rb_frozen_last(&frozen);
+	     it; it = rdx_rb_prev(it), i = rdx_rb_frozen_prev(&frozen, i))
+		result = result && rdx_rb_frozen_node(&frozen, i) == it;
+	result = result && !i;
+
+	for (long long key = 0; result && key <= max_key; key++) {
+		probe.weak_key = key;
+		result = rdx_rb_frozen_node(&frozen,
+				rdx_rb_frozen_greater_equiv(&frozen, key)) ==
+			 rdx_rb_leftmost_greater_equiv(&probe.node, &tree) &&
+			 rdx_rb_frozen_node(&frozen,
+				rdx_rb_frozen_less_equiv(&frozen, key)) ==
+			 rdx_rb_rightmost_less_equiv(&probe.node, &tree);
+	}
+
+	for (int n = 0; result && n < 200; n++) {
+		long long first = rand() % max_key;
+		long long last = first + rand() % (n < 100 ? 20 : max_key);
+
+		expected = 0;
+		for (it = rdx_rb_first(&tree); it; it = rdx_rb_next(it)) {
+			struct my_node *data =
+				rdx_rb_entry(it, struct my_node, node);
+			if (data->weak_key >= first && data->weak_key <= last)
+				expected += data->strict_key;
+		}
+		rdx_rb_frozen_aggregate(&frozen, first, last, &sum);
+		result = sum == expected;
+	}
+
+	rdx_rb_frozen_destroy(&frozen);
+	free_tree(&tree);
+	return result;
+}
+
+/*
+ * Index @count nodes with keys growing quadratically, three to a key, and
+ * check that every key, the ones next to them and random ones all give
+ * what the frozen copy gives.
+ */
+int test_learned(size_t count, size_t epsilon)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	uint64_t range = (count / 3 + 2) * (count / 3 + 2), key;
+	struct rdx_rb_learned learned;
+	struct rdx_rb_frozen frozen;
+	int result = true;
+	size_t i;
+
+	printf("Learned index of %zu nodes, epsilon %zu\n", count, epsilon);
+	for (i = 0; i < count; i++) {
+		size_t j = i * 7919 % count;
+		my_node_mmap_insert(construct_node(j, (j / 3) * (j / 3)),
+				    &tree);
+	}
+	if (!rdx_rb_freeze(&frozen, &tree, &frozen_ops, NULL))
+		return false;
+	if (!rdx_rb_learned_build(&learned, &frozen, epsilon)) {
+		rdx_rb_frozen_destroy(&frozen);
+		return false;
+	}
+
+	for (i = 0; result && i < count + 1000; i++) {
+		key = (i / 3) * (i / 3) + i % 3 - 1;
+		if (i >= count)
+			key = (uint64_t)rand() * rand() % range;
+		result = rdx_rb_learned_greater_equiv(&learned, key) ==
+			 rdx_rb_frozen_greater_equiv(&frozen, key) &&
+			 rdx_rb_learned_less_equiv(&learned, key) ==
+			 rdx_rb_frozen_less_equiv(&frozen, key);
+	}
+	result = result && rdx_rb_learned_less_equiv(&learned, -1) ==
+			   rdx_rb_frozen_last(&frozen);
+	/* Far fewer pieces than keys, or there is no point */
+	result = result && (count < 1000 || !epsilon ||
+			   learned.nr_segments < count / 10);
+
+	rdx_rb_learned_destroy(&learned);
+	rdx_rb_frozen_destroy(&frozen);
+	free_tree(&tree);
+	return result;
+}
+
+uint64_t filter_hash(const struct rdx_rb_node *node)
+{
+	const struct my_node *data = rdx_rb_entry(node, struct my_node, node);
+
+	return data->strict_key * 0x9e3779b97f4a7c15ULL ^ data->weak_key;
+}
+
+/* Present keys are even, absent ones odd */
+int check_filter(struct rdx_rb_root *tree, size_t count, size_t step)
+{
+	size_t i, passed = 0;
+	struct my_node probe;
+
+	for (i = 0; i < 2 * count; i++) {
+		probe.strict_key = i;
+		probe.weak_key = i / 8;
+		if (i % 2 && rdx_rb_filter_may_contain(tree->filter,
+						       &probe.node))
+			passed++;
+		if (!!my_node_mmap_find(&probe, tree) !=
+		    (i % 2 == 0 && (i / 2) % step == 0))
+			return false;
+	}
+	/* Not a hard bound, only far above the expected 1 in 500 */
+	return passed <= count / 50 + 1;
+}
+
+int test_filter(size_t count)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct my_node probe, *node, *old;
+	struct rdx_rb_filter filter;
+	int result;
+	size_t i;
+
+	printf("Filter over %zu nodes\n", count);
+	for (i = 0; i < count / 2; i++)
+		my_node_mmap_insert(construct_node(2 * i, 2 * i / 8), &tree);
+	if (!rdx_rb_filter_attach(&filter, &tree, filter_hash))
+		return false;
+	for (; i < count; i++)
+		my_node_mmap_insert(construct_node(2 * i, 2 * i / 8), &tree);
+	result = check_filter(&tree, count, 1);
+
+	/* Enough stale keys to build it again */
+	for (i = 0; result && i < count; i++) {
+		if (i % 4 == 0)
+			continue;
+		probe.strict_key = 2 * i;
+		probe.weak_key = 2 * i / 8;
+		node = my_node_mmap_find(&probe, &tree);
+		result = node != NULL;
+		if (node) {
+			my_node_mmap_erase(node, &tree);
+			free_node(node);
+		}
+	}
+	/* Built again on the way, bar trees too small to bother */
+	result = result && check_filter(&tree, count, 4) &&
+		 (count < 1000 || filter.stale <= filter.count);
+
+	node = construct_node(0, 0);
+	old = my_node_mmap_upsert(node, &tree);
+	result = result && old && old != node && is_valid_tree(&tree) &&
+		 my_node_mmap_find(old, &tree) == node;
+	free_node(old ? old : node);
+	node = construct_node(1, 0);
+	result = result && !my_node_mmap_upsert(node, &tree) &&
+		 my_node_mmap_find(node, &tree) == node &&
+		 is_valid_tree(&tree);
+
+	rdx_rb_filter_detach(&tree);
+	free_tree(&tree);
+	return result;
+}
+
+/* The same through a front end that applies batches, with a feed too */
+int test_filter_batch(size_t count)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	size_t bytes = RDX_RB_FEED_BYTES(2 * count, sizeof(struct my_node));
+	struct rdx_rb_feed *feed = malloc(bytes);
+	struct rdx_rb_filter filter;
+	struct my_node probe, *node;
+	size_t i, erased = 0;
+	struct rdx_rb_fc fc;
+	int result, slot;
+
+	printf("Filter and feed behind combining over %zu nodes\n", count);
+	if (!feed || !rdx_rb_filter_attach(&filter, &tree, filter_hash)) {
+		free(feed);
+		return false;
+	}
+	if (!rdx_rb_fc_init(&fc, &tree, &payload_callbacks, 1)) {
+		rdx_rb_filter_detach(&tree);
+		free(feed);
+		return false;
+	}
+	rdx_rb_feed_init(feed, 2 * count, sizeof(struct my_node),
+			 offsetof(struct my_node, node));
+	tree.feed = feed;
+	slot = rdx_rb_fc_register(&fc);
+	result = true;
+	for (i = 0; i < count; i++)
+		result = result && rdx_rb_fc_insert(
+			&fc, slot, &construct_node(2 * i, 2 * i / 8)->node);
+	result = result && check_filter(&tree, count, 1) &&
+		 feed->head == count;
+
+	for (i = 0; result && i < count; i++) {
+		if (i % 4 == 0)
+			continue;
+		probe.strict_key = 2 * i;
+		probe.weak_key = 2 * i / 8;
+		node = my_node_mmap_find(&probe, &tree);
+		result = node != NULL;
+		if (node) {
+			rdx_rb_fc_erase(&fc, slot, &node->node);
+			free_node(node);
+			erased++;
+		}
+	}
+	result = result && check_filter(&tree, count, 4) &&
+		 feed->head == count + erased && is_valid_tree(&tree);
+
+	rdx_rb_fc_unregister(&fc, slot);
+	rdx_rb_fc_destroy(&fc);
+	tree.feed = NULL;
+	rdx_rb_filter_detach(&tree);
+	free_tree(&tree);
+	free(feed);
+	return result;
+}
+
+static const struct rdx_rb_small_ops small_ops = {
+	sizeof(long long), sizeof(struct lsm_sum),
+	lsm_sum_init, lsm_sum_accumulate, lsm_sum_combine
+};
+
+struct small_scan {
+	long long nr_keys, *values;
+	char *present;
+	long long next;
+	int result;
+};
+
+static void small_scan_key(uint64_t key, const void *value, void *arg)
+{
+	struct small_scan *scan = arg;
+
+	while (scan->next < scan->nr_keys && !scan->present[scan->next])
+		scan->next++;
+	scan->result = scan->result && key == scan->next * 3 &&
+		       *(const long long *)value == scan->values[scan->next];
+	scan->next++;
+}
+
+/* Compare @small with the model at a random key and over everything */
+int check_small(struct rdx_rb_small *small, struct small_scan *model,
+		size_t count)
+{
+	long long k = rand() % model->nr_keys, i;
+	struct lsm_sum sum, expected = { 0, 0 };
+	uint64_t key;
+	const void *value;
+	const long long *found = rdx_rb_small_find(small, k * 3);
+	int result;
+
+	result = small->count == count &&
+		 (count <= RDX_RB_SMALL_MAX || small->is_tree) &&
+		 (count > RDX_RB_SMALL_MIN || !small->is_tree) &&
+		 (model->present[k] ? found && *found == model->values[k] :
+		  !found);
+
+	for (i = k; i < model->nr_keys && !model->present[i]; i++)
+		;
+	key = k ? k * 3 - 1 : 0;
+	result = result && (i == model->nr_keys ?
+		 !rdx_rb_small_greater_equiv(small, &key, &value) :
+		 rdx_rb_small_greater_equiv(small, &key, &value) &&
+		 key == i * 3 && *(const long long *)value == model->values[i]);
+	for (i = k; i >= 0 && !model->present[i]; i--)
+		;
+	key = k * 3 + 1;
+	result = result && (i < 0 ?
+		 !rdx_rb_small_less_equiv(small, &key, &value) :
+		 rdx_rb_small_less_equiv(small, &key, &value) &&
+		 key == i * 3 && *(const long long *)value == model->values[i]);
+
+	for (i = k / 2; i <= k; i++)
+		if (model->present[i]) {
+			expected.count++;
+			expected.sum += model->values[i];
+		}
+	rdx_rb_small_aggregate(small, k / 2 * 3, k * 3, &sum);
+	result = result && sum.count == expected.count &&
+		 sum.sum == expected.sum;
+
+	model->next = 0;
+	model->result = true;
+	rdx_rb_small_scan(small, 0, -1, small_scan_key, model);
+	for (; model->next < model->nr_keys; model->next++)
+		model->result = model->result && !model->present[model->next];
+	return result && model->result;
+}
+
+/*
+ * Insert and erase at random among @nr_keys keys, with erases a little
+ * ahead, so that the map fills up and drains through both thresholds.
+ */
+int test_small(long long nr_keys, size_t rounds)
+{
+	struct rdx_rb_small *small =
+		malloc(RDX_RB_SMALL_SIZE(small_ops.value_size));
+	struct small_scan model = { nr_keys };
+	int result = small != NULL, inserting = true;
+	size_t count = 0, i;
+	long long k, value;
+
+	printf("Small map of up to %lld keys, %zu rounds\n", nr_keys, rounds);
+	model.values = calloc(nr_keys, sizeof(*model.values));
+	model.present = calloc(nr_keys, 1);
+	result = result && model.values && model.present;
+	if (small)
+		rdx_rb_small_init(small, &small_ops, NULL);
+
+	for (i = 0; result && i < rounds; i++) {
+		if (!count || count == (size_t)nr_keys || rand() % 64 == 0)
+			inserting = count < (size_t)nr_keys &&
+				    (!count || rand() % 2);
+		k = rand() % nr_keys;
+		value = rand();
+		if (inserting && rand() % 8) {
+			result = rdx_rb_small_insert(small, k * 3, &value) ==
+				 !model.present[k];
+			if (!model.present[k]) {
+				model.present[k] = true;
+				model.values[k] = value;
+				count++;
+			}
+		} else {
+			result = rdx_rb_small_erase(small, k * 3) ==
+				 model.present[k];
+			if (model.present[k]) {
+				model.present[k] = false;
+				count--;
+			}
+		}
+		result = result && check_small(small, &model, count);
+	}
+
+	if (small)
+		rdx_rb_small_destroy(small);
+	free(small);
+	free(model.values);
+	free(model.present);
+	return result;
+}
+
+struct clone_budget {
+	size_t copies, limit, disposed;
+};
+
+/* Keys only: the payload is for the clone itself to copy */
+static struct rdx_rb_node *clone_copy(const struct rdx_rb_node *node,
+				      void *arg)
+{
+	const struct my_node *data = rdx_rb_entry(node, struct my_node, node);
+	struct clone_budget *budget = arg;
+	struct my_node *copy;
+
+	if (__atomic_add_fetch(&budget->copies, 1, __ATOMIC_RELAXED) >
+	    budget->limit)
+		return NULL;
+	copy = construct_node(data->strict_key, data->weak_key);
+	return copy ? &copy->node : NULL;
+}
+
+static void clone_dispose(struct rdx_rb_node *node, void *arg)
+{
+	((struct clone_budget *)arg)->disposed++;
+	free_node(rdx_rb_entry(node, struct my_node, node));
+}
+
+/* Same shape, keys and colors, none of the same nodes */
+int same_shape(struct rdx_rb_node *a, struct rdx_rb_node *b)
+{
+	if (!a || !b)
+		return a == b;
+	return a != b &&
+	       rdx_rb_entry(a, struct my_node, node)->strict_key ==
+	       rdx_rb_entry(b, struct my_node, node)->strict_key &&
+	       rdx_rb_color(a) == rdx_rb_color(b) &&
+	       same_shape(a->rb_left, b->rb_left) &&
+	       same_shape(a->rb_right, b->rb_right);
+}
+
+/* Clone, then clone again with memory running out after @limit copies */
+int test_clone(size_t count, size_t limit, unsigned int nr_threads)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct clone_budget budget = { 0, -1, 0 };
+	struct rdx_rb_root copy;
+	int result;
+	size_t i;
+
+	printf("Clone %zu nodes with %u threads, failing after %zu\n",
+	       count, nr_threads, limit);
+	for (i = 0; i < count; i++)
+		my_node_mmap_insert(construct_node(i * 7919 % count, i % 97),
+				    &tree);
+
+	result = my_node_mmap_clone(&copy, &tree, clone_copy, clone_dispose,
+				    &budget, nr_threads) &&
+		 budget.copies == count && same_shape(tree.rb_node,
+						      copy.rb_node) &&
+		 is_valid_tree(&copy);
+	/* Independent of the original from now on */
+	if (result && count) {
+		struct my_node *first = rdx_rb_entry(rdx_rb_first(&copy),
+						     struct my_node, node);
+
+		my_node_mmap_erase(first, &copy);
+		free_node(first);
+		result = tree_size(&copy) == count - 1 &&
+			 tree_size(&tree) == count && is_valid_tree(&tree);
+	}
+	free_tree(&copy);
+
+	budget = (struct clone_budget){ 0, limit, 0 };
+	if (limit < count)
+		result = result &&
+			 !my_node_mmap_clone(&copy, &tree, clone_copy,
+					     clone_dispose, &budget,
+					     nr_threads) &&
+			 RDX_RB_EMPTY_ROOT(&copy) &&
+			 budget.disposed == limit;
+	free_tree(&tree);
+	return result;
+}
+
+struct merkle_item {
+	long long key, value;
+	struct rdx_rb_merkle_node merkle;
+};
+
+#define merkle_item_of(node)						\
+	container_of(rdx_rb_merkle_entry(node), struct merkle_item, merkle)
+
+static int merkle_compare(struct rdx_rb_node *left, struct rdx_rb_node *right)
+{
+	long long l = merkle_item_of(left)->key, r = merkle_item_of(right)->key;
+
+	return l < r ? -1 : l > r;
+}
+
+static uint64_t merkle_item_hash(struct merkle_item *item)
+{
+	return item->key * 0x9e3779b97f4a7c15ULL + item->value;
+}
+
+static void merkle_put(struct rdx_rb_root *root, long long key,
+		       long long value)
+{
+	struct merkle_item *item = malloc(sizeof(*item));
+
+	item->key = key;
+	item->value = value;
+	rdx_rb_merkle_set(&item->merkle, merkle_item_hash(item));
+	rdx_rb_merkle_insert(&item->merkle, root);
+}
+
+static int merkle_check(struct rdx_rb_node *node, void *arg)
+{
+	struct rdx_rb_merkle_node *merkle = rdx_rb_merkle_entry(node);
+	uint64_t hash = merkle->self;
+
+	if (node->rb_left)
+		hash += rdx_rb_merkle_entry(node->rb_left)->hash;
+	if (node->rb_right)
+		hash += rdx_rb_merkle_entry(node->rb_right)->hash;
+	return merkle->hash == hash;
+}
+
+static void free_merkle(struct rdx_rb_root *root)
+{
+	struct rdx_rb_node *node, *next;
+
+	for (node = rdx_rb_first_postorder(root); node; node = next) {
+		next = rdx_rb_next_postorder(node);
+		free(merkle_item_of(node));
+	}
+	root->rb_node = NULL;
+}
+
+/* Differences as keys, and which side has them: 1 for a, 2 for b, 3 both */
+struct merkle_diff {
+	long long *keys;
+	int *sides;
+	size_t count;
+};
+
+static void merkle_record(struct merkle_diff *diff, struct rdx_rb_node *a,
+			  struct rdx_rb_node *b)
+{
+	diff->keys[diff->count] = merkle_item_of(a ? a : b)->key;
+	diff->sides[diff->count++] = (a != NULL) | (b != NULL) << 1;
+}
+
+static void merkle_collect(struct rdx_rb_node *a, struct rdx_rb_node *b,
+			   void *arg)
+{
+	merkle_record(arg, a, b);
+}
+
+/* The same, the slow way, merging both in order */
+static void merkle_walk(struct rdx_rb_root *a, struct rdx_rb_root *b,
+			struct merkle_diff *diff)
+{
+	struct rdx_rb_node *x = rdx_rb_first(a), *y = rdx_rb_first(b);
+	int order;
+
+	while (x || y) {
+		order = !x ? 1 : !y ? -1 : merkle_compare(x, y);
+		if (order < 0) {
+			merkle_record(diff, x, NULL);
+			x = rdx_rb_next(x);
+		} else if (order > 0) {
+			merkle_record(diff, NULL, y);
+			y = rdx_rb_next(y);
+		} else {
+			if (merkle_item_of(x)->value != merkle_item_of(y)->value)
+				merkle_record(diff, x, y);
+			x = rdx_rb_next(x);
+			y = rdx_rb_next(y);
+		}
+	}
+}
+
+/*
+ * Build the same keys into two trees in different orders, so in different
+ * shapes, then change @nr_changes keys of one and see the diff find them.
+ */
+int test_merkle(long long count, size_t nr_changes)
+{
+	struct rdx_rb_root a = RDX_RB_ROOT(merkle_compare, merkle_compare);
+	struct rdx_rb_root b = RDX_RB_ROOT(merkle_compare, merkle_compare);
+	struct merkle_diff found = { 0 }, expected = { 0 };
+	struct merkle_item probe, *item, first, last;
+	struct rdx_rb_node *node;
+	uint64_t sum = 0;
+	long long i;
+	int result;
+
+	printf("Merkle diff of %lld nodes, %zu changes\n", count, nr_changes);
+	for (i = 0; i < count; i++) {
+		merkle_put(&a, i, i);
+		merkle_put(&b, i * 7919 % count, i * 7919 % count);
+	}
+	found.keys = malloc(3 * count * sizeof(*found.keys) + 1);
+	found.sides = malloc(3 * count * sizeof(*found.sides) + 1);
+	expected.keys = malloc(3 * count * sizeof(*expected.keys) + 1);
+	expected.sides = malloc(3 * count * sizeof(*expected.sides) + 1);
+	rdx_rb_merkle_diff(&a, &b, merkle_collect, &found);
+	result = rdx_rb_merkle_root_hash(&a) == rdx_rb_merkle_root_hash(&b) &&
+		 found.count == 0;
+
+	for (i = 0; i < (long long)nr_changes; i++) {
+		probe.key = rand() % (2 * count);
+		node = rdx_rb_find(&probe.merkle.node, &b);
+		item = node ? merkle_item_of(node) : NULL;
+		if (!item) {
+			merkle_put(&b, probe.key, rand());
+		} else if (rand() % 2) {
+			rdx_rb_merkle_erase(&item->merkle, &b);
+			free(item);
+		} else {
+			item->value = rand();
+			rdx_rb_merkle_update(&item->merkle,
+					     merkle_item_hash(item));
+		}
+	}
+	rdx_rb_merkle_diff(&a, &b, merkle_collect, &found);
+	merkle_walk(&a, &b, &expected);
+	result = result && found.count == expected.count &&
+		 !memcmp(found.keys, expected.keys,
+			 found.count * sizeof(*found.keys)) &&
+		 !memcmp(found.sides, expected.sides,
+			 found.count * sizeof(*found.sides)) &&
+		 (found.count > 0) ==
+		 (rdx_rb_merkle_root_hash(&a) != rdx_rb_merkle_root_hash(&b));
+
+	/* A range hash against the sum over the same range */
+	first.key = count / 4;
+	last.key = count / 2;
+	for (node = rdx_rb_first(&b); node; node = rdx_rb_next(node))
+		if (merkle_item_of(node)->key >= first.key &&
+		    merkle_item_of(node)->key <= last.key)
+			sum += rdx_rb_merkle_entry(node)->self;
+	result = result &&
+		 rdx_rb_merkle_range_hash(&b, &first.merkle.node,
+					  &last.merkle.node) == sum &&
+		 rdx_rb_merkle_range_hash(&b, NULL, NULL) ==
+		 rdx_rb_merkle_root_hash(&b) &&
+		 rdx_rb_verify(&a, merkle_check, NULL, 1, 0) &&
+		 rdx_rb_verify(&b, merkle_check, NULL, 1, 0);
+
+	free(found.keys);
+	free(found.sides);
+	free(expected.keys);
+	free(expected.sides);
+	free_merkle(&a);
+	free_merkle(&b);
+	return result;
+}
+
+/* One change at random, an insert, an erase or an update */
+static void feed_change(struct rdx_rb_root *tree, long long range)
+{
+	long long k = rand() % range;
+	struct my_node probe = { .strict_key = k, .weak_key = k / 4 }, *node;
+
+	node = my_node_mmap_find(&probe, tree);
+	if (!node)
+		my_node_mmap_insert(construct_node(k, k / 4), tree);
+	else if (rand() % 3)
+		my_node_mmap_erase(node, tree);
+	else
+		node = my_node_mmap_upsert(construct_node(k, k / 4), tree);
+	if (node)
+		free_node(node);
+}
+
+/*
+ * Make @count changes among @range keys and have a follower keep up,
+ * through a pipe in this process or with the feed in memory shared with
+ * a child process that makes the changes.
+ */
+int test_feed(size_t count, long long range, size_t capacity,
+	      size_t max_batch, int shared)
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	struct rdx_rb_root copy =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+	size_t bytes = RDX_RB_FEED_BYTES(capacity, sizeof(struct my_node));
+	struct rdx_rb_follower follower;
+	struct rdx_rb_feed *feed;
+	unsigned int seed = rand();
+	int result, fds[2], status;
+	size_t i;
+	pid_t pid;
+
+	printf("Feed of %zu changes over %s, batches of %zu\n", count,
+	       shared ? "shared memory" : "a pipe", max_batch);
+	feed = shared ? mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_ANONYMOUS, -1, 0) :
+			malloc(bytes);
+	if (!feed || feed == MAP_FAILED)
+		return false;
+	rdx_rb_feed_init(feed, capacity, sizeof(struct my_node),
+			 offsetof(struct my_node, node));
+	result = rdx_rb_follower_init(&follower, &copy, &payload_callbacks,
+				      sizeof(struct my_node),
+				      offsetof(struct my_node, node),
+				      max_batch);
+
+	if (result && !shared && !pipe(fds)) {
+		tree.feed = feed;
+		/* No more than the ring holds between sends */
+		for (i = 0; result && i < count; i++) {
+			feed_change(&tree, range);
+			if ((i + 1) % capacity && i + 1 < count)
+				continue;
+			result = rdx_rb_feed_send(feed, fds[1]);
+			/* A batch that fails is kept to try again */
+			if (i + 1 == capacity) {
+				follower.next_seq = 1;
+				result = !rdx_rb_follower_receive(&follower,
+								  fds[0]) &&
+					 follower.error == EILSEQ &&
+					 follower.filled;
+				follower.next_seq = 0;
+				follower.error = 0;
+			}
+			while (result && follower.next_seq < feed->head)
+				result = rdx_rb_follower_receive(&follower,
+								 fds[0]);
+		}
+		close(fds[1]);
+		result = result && same_keys(&tree, &copy) &&
+			 !rdx_rb_follower_receive(&follower, fds[0]) &&
+			 !follower.error;
+		close(fds[0]);
+		tree.feed = NULL;
+	} else if (result && shared && (pid = fork()) >= 0) {
+		if (pid == 0) {
+			srand(seed);
+			tree.feed = feed;
+			for (i = 0; i < count; i++)
+				feed_change(&tree, range);
+			_exit(0);
+		}
+		/* A batch that fails stays on the ring for the next try */
+		while (!__atomic_load_n(&feed->head, __ATOMIC_ACQUIRE))
+			sched_yield();
+		follower.next_seq = 1;
+		result = !rdx_rb_follower_poll(&follower, feed) &&
+			 follower.error == EILSEQ && !feed->tail;
+		follower.next_seq = 0;
+		follower.error = 0;
+
+		while (result && follower.next_seq < count)
+			if (!(result = rdx_rb_follower_poll(&follower, feed)))
+				break;
+			else if (follower.next_seq == feed->tail &&
+				 follower.next_seq < count)
+				sched_yield();
+		result = waitpid(pid, &status, 0) == pid && result &&
+			 WIFEXITED(status) && !WEXITSTATUS(status);
+
+		/* The same changes over again make the tree to compare with */
+		srand(seed);
+		for (i = 0; i < count; i++)
+			feed_change(&tree, range);
+		result = result && same_keys(&tree, &copy);
+	} else {
+		result = false;
+	}
+	result = result && is_valid_tree(&copy);
+
+	rdx_rb_follower_destroy(&follower);
+	if (shared)
+		munmap(feed, bytes);
+	else
+		free(feed);
+	free_tree(&copy);
+	free_tree(&tree);
+	return result;
+}
+
+int main()
+{
+	struct rdx_rb_root tree =
+		RDX_RB_ROOT(strict_compare_rb, weak_compare_rb);
+
+	struct my_node *null = (struct my_node *)NULL;
+
+	DECLARE_NODE(0, 2);
+	DECLARE_NODE(1, 1);
+	DECLARE_NODE(2, 3);
+	DECLARE_NODE(3, 1);
+	DECLARE_NODE(4, 3);
+	DECLARE_NODE(5, 4);
+	DECLARE_NODE(6, 0);
+
+	TRY(test_insert(n_0_2, &tree, true));
+	TRY(test_insert(n_1_1, &tree, true));
+	TRY(test_insert(n_2_3, &tree, true));
+	TRY(test_insert(n_3_1, &tree, true));
+	TRY(test_insert(n_4_3, &tree, true));
+	TRY(test_insert(n_5_4, &tree, true));
+	TRY(test_insert(n_6_0, &tree, true));
+
+	TRY(test_erase(n_0_2, &tree));
+	TRY(test_erase(n_6_0, &tree));
+
+	TRY(test_rightmost_le(n_2_3, &tree, n_4_3));
+	TRY(test_rightmost_le(n_4_3, &tree, n_4_3));
+	TRY(test_rightmost_le(n_6_0, &tree, null));
+	TRY(test_rightmost_le(n_0_2, &tree, n_3_1));
+
+	TRY(test_erase(n_5_4, &tree));
+
+	TRY(test_leftmost_ge(n_1_1, &tree, n_1_1));
+	TRY(test_leftmost_ge(n_3_1, &tree, n_1_1));
+	TRY(test_leftmost_ge(n_5_4, &tree, null));
+	TRY(test_leftmost_ge(n_0_2, &tree, n_2_3));
+
+	TRY(test_retain(1, 1));
+	TRY(test_retain(1000, 1));
+	TRY(test_retain(1000, 4));
+	TRY(test_retain(100000, 8));
+
+	TRY(test_join(0, 0));
+	TRY(test_join(0, 1000));
+	TRY(test_join(1000, 0));
+	TRY(test_join(1, 100000));
+	TRY(test_join(100000, 3));
+	TRY(test_join(5000, 7000));
+
+	TRY(test_remap(1000, 1));
+	TRY(test_remap(100000, 8));
+
+	TRY(test_traverse(0, 4));
+	TRY(test_traverse(1000, 1));
+	TRY(test_traverse(100000, 8));
+	TRY(test_traverse(100000, 64));
+
+	TRY(test_build(0, 1));
+	TRY(test_build(31, 1));
+	TRY(test_build(1000, 1));
+	TRY(test_build(1000, 3));
+	TRY(test_build(100000, 8));
+
+	TRY(test_verify(1000, 1));
+	TRY(test_verify(100000, 8));
+
+	TRY(test_combining(1, 1000));
+	TRY(test_combining(8, 2000));
+
+	TRY(test_relaxed(1, 1000, 1));
+	TRY(test_relaxed(1, 1000, 64));
+	TRY(test_relaxed(8, 2000, 16));
+	TRY(test_relaxed(16, 5000, 256));
+
+	TRY(test_buffered(1, 1000, 1));
+	TRY(test_buffered(1, 1000, 64));
+	TRY(test_buffered(8, 2000, 32));
+
+	TRY(test_replicated(1, 0, 1000, 1));
+	TRY(test_replicated(1, 2, 1000, 16));
+	TRY(test_replicated(8, 3, 2000, 64));
+
+	TRY(test_mvcc(0, 1000));
+	TRY(test_mvcc(4, 2000));
+
+	TRY(test_journal(1, 1000, false));
+	TRY(test_journal(8, 2000, true));
+
+	TRY(test_snapshot(0, 64, 0, 1));
+	TRY(test_snapshot(1000, 64, 0, 1));
+	TRY(test_snapshot(1000, 7, 0, 4));
+	TRY(test_snapshot(100000, 0, RDX_RB_SNAPSHOT_COMPRESS, 1));
+	TRY(test_snapshot(100000, 1000, RDX_RB_SNAPSHOT_COMPRESS, 8));
+	TRY(test_snapshot(1000, 64, RDX_RB_SNAPSHOT_ASYNC, 1));
+	TRY(test_snapshot(300000, 0, RDX_RB_SNAPSHOT_ASYNC, 4));
+	TRY(test_snapshot(100000, 100, RDX_RB_SNAPSHOT_DIRECT, 2));
+	TRY(test_snapshot(300000, 1000, RDX_RB_SNAPSHOT_ASYNC |
+			  RDX_RB_SNAPSHOT_DIRECT | RDX_RB_SNAPSHOT_COMPRESS, 4));
+
+	TRY(test_file(2, 0));
+	TRY(test_file(1000, 0));
+	TRY(test_file(50000, 64 << 10));
+
+	TRY(test_shared(1, 1));
+	TRY(test_shared(20000, 4));
+
+	TRY(test_lsm(10, 0, 0));
+	TRY(test_lsm(200000, 1000, 2));
+
+	TRY(test_frozen(0));
+	TRY(test_frozen(1));
+	TRY(test_frozen(1000));
+	TRY(test_frozen(100000));
+
+	TRY(test_learned(0, 16));
+	TRY(test_learned(1, 16));
+	TRY(test_learned(1000, 0));
+	TRY(test_learned(100000, 4));
+	TRY(test_learned(100000, 64));
+	TRY(test_filter(10));
+	TRY(test_filter(100000));
+	TRY(test_filter_batch(10));
+	TRY(test_filter_batch(100000));
+	TRY(test_small(1, 100));
+	TRY(test_small(24, 100000));
+	TRY(test_small(1000, 100000));
+	TRY(test_clone(0, 0, 1));
+	TRY(test_clone(1000, 0, 1));
+	TRY(test_clone(1000, 500, 1));
+	TRY(test_clone(100000, 50000, 4));
+	TRY(test_clone(100000, 100000, 8));
+	TRY(test_merkle(1, 1));
+	TRY(test_merkle(1000, 0));
+	TRY(test_merkle(1000, 10));
+	TRY(test_merkle(100000, 100));
+	TRY(test_merkle(1000, 2000));
+	TRY(test_feed(1, 10, 4, 4, false));
+	TRY(test_feed(10000, 64, 256, 100, false));
+	TRY(test_feed(100000, 1000, 1000, 37, false));
+	TRY(test_feed(100000, 64, 256, 100, true));
 
 	printf("All tests OK\n");
 